@@ -0,0 +1,413 @@
+// acquire-driver-bench: microbenchmarks of the per-frame and per-request hot paths.
+//
+// Every benchmark reports, next to Google Benchmark's own timings:
+//   frames_per_second / bytes_per_second  throughput
+//   allocs_per_iter                       global operator new calls per iteration
+//   p50_us / p99_us                       per iteration latency
+//
+// JSON for the baseline comparison: --benchmark_out=bench.json --benchmark_out_format=json,
+// then bench/compare_baseline.py bench/baseline.json bench.json (or just `make bench-compare`).
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "chunked_buffer.h"
+#include "frame_diff.h"
+#include "hls.h"
+#include "pixel_convert.h"
+#include "webm.h"
+#include "xor_texture.h"
+
+namespace
+{
+    std::atomic<uint64_t> allocations{0};
+}
+
+// Counts every allocation in the process, the array and sized forms all end up here
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+namespace
+{
+    // Times each iteration and counts the allocations made inside the benchmark loop.
+    // Samples go into a ring allocated up front, so recording them doesn't count as an allocation,
+    // fast benchmarks keep their most recent MAX_SAMPLES iterations.
+    class IterationStats
+    {
+    public:
+        static constexpr size_t MAX_SAMPLES = 1 << 16;
+
+        explicit IterationStats(benchmark::State &state) : state_(state), samples_(MAX_SAMPLES)
+        {
+            allocations_start_ = allocations.load(std::memory_order_relaxed);
+        }
+
+        void start() { iteration_start_ = std::chrono::steady_clock::now(); }
+
+        void stop()
+        {
+            samples_[count_ % MAX_SAMPLES] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - iteration_start_).count();
+            count_++;
+        }
+
+        // Call once after the benchmark loop
+        void report(int64_t frames_per_iteration = 0)
+        {
+            const uint64_t allocated = allocations.load(std::memory_order_relaxed) - allocations_start_;
+            state_.counters["allocs_per_iter"] = benchmark::Counter(static_cast<double>(allocated), benchmark::Counter::kAvgIterations);
+            if (frames_per_iteration > 0)
+            {
+                state_.counters["frames_per_second"] = benchmark::Counter(static_cast<double>(frames_per_iteration), benchmark::Counter::kIsIterationInvariantRate);
+            }
+
+            const size_t n = std::min<size_t>(count_, MAX_SAMPLES);
+            if (n == 0)
+            {
+                return;
+            }
+            state_.counters["p50_us"] = percentile(n, 0.50);
+            state_.counters["p99_us"] = percentile(n, 0.99);
+        }
+
+    private:
+        double percentile(size_t n, double p)
+        {
+            const size_t k = std::min(n - 1, static_cast<size_t>(p * n));
+            std::nth_element(samples_.begin(), samples_.begin() + k, samples_.begin() + n);
+            return samples_[k];
+        }
+
+        benchmark::State &state_;
+        std::vector<double> samples_;
+        size_t count_ = 0;
+        uint64_t allocations_start_ = 0;
+        std::chrono::steady_clock::time_point iteration_start_;
+    };
+
+    void resolutions(benchmark::internal::Benchmark *b)
+    {
+        b->Args({426, 240})->Args({1280, 720})->Args({1920, 1080});
+    }
+
+    int64_t frameBytes(int width, int height)
+    {
+        return int64_t(width) * height * 3 / 2; // I420
+    }
+}
+
+static void BM_GenXorTexture(benchmark::State &state)
+{
+    const int width = state.range(0);
+    const int height = state.range(1);
+    IterationStats stats(state);
+    int time = 0;
+    for (auto _ : state)
+    {
+        stats.start();
+        PooledFrame frame = genXorTexture(width, height, time++);
+        benchmark::DoNotOptimize(frame.plane(0));
+        stats.stop();
+    }
+    stats.report(1);
+    state.SetBytesProcessed(state.iterations() * frameBytes(width, height));
+}
+BENCHMARK(BM_GenXorTexture)->Apply(resolutions);
+
+static void BM_GenerateXorTexture(benchmark::State &state)
+{
+    const int width = state.range(0);
+    const int height = state.range(1);
+    IterationStats stats(state);
+    x264_picture_t pic;
+    int time = 0;
+    for (auto _ : state)
+    {
+        stats.start();
+        PooledFrame frame = generateXorTexture(&pic, width, height, time++);
+        benchmark::DoNotOptimize(pic.img.plane[0]);
+        stats.stop();
+    }
+    stats.report(1);
+    state.SetBytesProcessed(state.iterations() * frameBytes(width, height));
+}
+BENCHMARK(BM_GenerateXorTexture)->Apply(resolutions);
+
+// A 12 bit camera frame windowed into I420 with percentile auto-levels, range(2) picks gray16, gray16 with a gamma
+// curve or an RGGB mosaic
+static void BM_PixelConvert(benchmark::State &state)
+{
+    const int width = state.range(0);
+    const int height = state.range(1);
+    const int mode = state.range(2);
+    std::vector<uint16_t> samples(size_t(width) * height);
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> values(1000, 3000);
+    for (uint16_t &sample : samples)
+    {
+        sample = static_cast<uint16_t>(values(rng));
+    }
+    PixelWindowConfig window;
+    window.gamma = mode == 1 ? 0.5 : 1.0;
+    PixelConverter converter(window, 12);
+    PooledFrame frame = FramePool::shared().acquire(FrameFormat::I420, width, height);
+
+    IterationStats stats(state);
+    for (auto _ : state)
+    {
+        stats.start();
+        if (mode == 2)
+        {
+            converter.convertBayer16(samples.data(), width * sizeof(uint16_t), BayerPattern::RGGB, frame);
+        }
+        else
+        {
+            converter.convertGray16(samples.data(), width * sizeof(uint16_t), frame);
+        }
+        benchmark::DoNotOptimize(frame.plane(0));
+        stats.stop();
+    }
+    stats.report(1);
+    state.counters["pixels_per_second"] = benchmark::Counter(static_cast<double>(width) * height, benchmark::Counter::kIsIterationInvariantRate);
+}
+BENCHMARK(BM_PixelConvert)->ArgsProduct({{1920}, {1080}, {0, 1, 2}})->ArgsProduct({{3840}, {2160}, {0, 1, 2}});
+
+// Finding the changed macroblocks of an I420 frame, range(2) 0 compares against an identical frame, 1 against a
+// completely different one, which also copies every macroblock into the reference
+static void BM_FrameDiff(benchmark::State &state)
+{
+    const int width = state.range(0);
+    const int height = state.range(1);
+    const bool changing = state.range(2) != 0;
+    PooledFrame frames[2] = {FramePool::shared().acquire(FrameFormat::I420, width, height),
+                             FramePool::shared().acquire(FrameFormat::I420, width, height)};
+    for (int i = 0; i < 2; i++)
+    {
+        fillXorPlanes(frames[i].plane(0), frames[i].stride(0), frames[i].plane(1), frames[i].stride(1),
+                      frames[i].plane(2), frames[i].stride(2), width, height, i * 64);
+    }
+    FrameDiff diff;
+    diff.update(frames[0]);
+
+    IterationStats stats(state);
+    int64_t index = 0;
+    for (auto _ : state)
+    {
+        stats.start();
+        const DirtyMap &map = diff.update(frames[changing ? ++index % 2 : 0]);
+        benchmark::DoNotOptimize(map.dirty_count);
+        stats.stop();
+    }
+    stats.report(1);
+    state.counters["pixels_per_second"] = benchmark::Counter(static_cast<double>(width) * height, benchmark::Counter::kIsIterationInvariantRate);
+}
+BENCHMARK(BM_FrameDiff)->ArgsProduct({{1920}, {1080}, {0, 1}})->ArgsProduct({{3840}, {2160}, {0, 1}});
+
+// One VP9 frame into a webm segment, with the settings the live stream uses (realtime, cpu-used 8)
+static void BM_EncodeFrame(benchmark::State &state)
+{
+    const int width = state.range(0);
+    const int height = state.range(1);
+
+    vpx_codec_ctx_t codec;
+    vpx_codec_enc_cfg_t cfg;
+    vpx_codec_enc_config_default(vpx_codec_vp9_cx(), &cfg, 0);
+    cfg.g_w = width;
+    cfg.g_h = height;
+    cfg.g_timebase.num = 1;
+    cfg.g_timebase.den = 30;
+    cfg.g_lag_in_frames = 0;
+    configureVp9Threads(cfg, 0);
+    if (vpx_codec_enc_init(&codec, vpx_codec_vp9_cx(), &cfg, 0) != VPX_CODEC_OK)
+    {
+        state.SkipWithError("Failed to initialize encoder");
+        return;
+    }
+    applyVp9Threading(&codec, cfg);
+    vpx_codec_control(&codec, VP8E_SET_CPUUSED, 8);
+
+    std::vector<uint8_t> data;
+    MemoryBufferMkvWriter writer(data);
+    mkvmuxer::Segment segment;
+    const uint64_t track = segment.AddVideoTrack(width, height, 0);
+    if (!track || !segment.Init(&writer))
+    {
+        vpx_codec_destroy(&codec);
+        state.SkipWithError("Failed to initialize muxer segment");
+        return;
+    }
+
+    // Sources made up front so only the encode and mux are measured
+    std::vector<PooledFrame> sources;
+    for (int i = 0; i < 30; i++)
+    {
+        sources.push_back(genXorTexture(width, height, i));
+    }
+
+    IterationStats stats(state);
+    int frame = 0;
+    for (auto _ : state)
+    {
+        vpx_image_t img;
+        stats.start();
+        encode_frame(&codec, wrapVpxImage(sources[frame % sources.size()], &img), frame, frame % 30 == 0 ? VPX_EFLAG_FORCE_KF : 0,
+                     &writer, segment, track, VPX_DL_REALTIME);
+        stats.stop();
+        frame++;
+    }
+    stats.report(1);
+    state.SetBytesProcessed(state.iterations() * frameBytes(width, height));
+
+    vpx_codec_destroy(&codec);
+}
+BENCHMARK(BM_EncodeFrame)->Apply(resolutions)->Unit(benchmark::kMillisecond);
+
+static void BM_MemoryBufferMkvWriterWrite(benchmark::State &state)
+{
+    const size_t len = state.range(0);
+    const size_t limit = 64 * 1024 * 1024;
+    std::vector<uint8_t> payload(len, 0x5A);
+    std::vector<uint8_t> data;
+    MemoryBufferMkvWriter writer(data);
+
+    IterationStats stats(state);
+    for (auto _ : state)
+    {
+        // Rewinding keeps the buffer from growing forever, writes past the first pass overwrite in place
+        if (static_cast<size_t>(writer.Position()) + len > limit)
+        {
+            writer.Position(0);
+        }
+        stats.start();
+        writer.Write(payload.data(), len);
+        stats.stop();
+    }
+    stats.report();
+    state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(BM_MemoryBufferMkvWriterWrite)->Arg(64)->Arg(4096)->Arg(64 * 1024);
+
+// Same writes into pooled chunks, what encodeXorWebm muxes into
+static void BM_ChunkedMkvWriterWrite(benchmark::State &state)
+{
+    const size_t len = state.range(0);
+    const size_t limit = 64 * 1024 * 1024;
+    std::vector<uint8_t> payload(len, 0x5A);
+    ChunkedMkvWriter writer;
+
+    IterationStats stats(state);
+    for (auto _ : state)
+    {
+        if (static_cast<size_t>(writer.Position()) + len > limit)
+        {
+            writer.Position(0);
+        }
+        stats.start();
+        writer.Write(payload.data(), len);
+        stats.stop();
+    }
+    stats.report();
+    state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(BM_ChunkedMkvWriterWrite)->Arg(64)->Arg(4096)->Arg(64 * 1024);
+
+static void BM_GenerateHLSSegment(benchmark::State &state)
+{
+    const int width = state.range(0);
+    const int height = state.range(1);
+    IterationStats stats(state);
+    int64_t index = 0;
+    size_t segment_bytes = 0;
+    for (auto _ : state)
+    {
+        stats.start();
+        ChunkedBufferPtr segment = generateHLSSegment(width, height, index++ * FRAMES_PER_SEGMENT);
+        stats.stop();
+        if (!segment)
+        {
+            state.SkipWithError("Failed to generate segment");
+            break;
+        }
+        segment_bytes = segment->size();
+    }
+    stats.report(FRAMES_PER_SEGMENT);
+    state.counters["segment_bytes"] = static_cast<double>(segment_bytes);
+    state.SetBytesProcessed(state.iterations() * FRAMES_PER_SEGMENT * frameBytes(width, height));
+}
+BENCHMARK(BM_GenerateHLSSegment)->Apply(resolutions)->Unit(benchmark::kMillisecond)->Iterations(3);
+
+// What a Range request against a cached segment costs: walking the chunks covering the range and copying them out,
+// as setChunkedContent does into httplib's sink
+static void BM_RangeSlice(benchmark::State &state)
+{
+    const size_t length = state.range(0);
+    const size_t size = 8 * 1024 * 1024;
+
+    std::vector<uint8_t> source(size);
+    for (size_t i = 0; i < size; i++)
+    {
+        source[i] = static_cast<uint8_t>(i * 31);
+    }
+    ChunkedBuffer buffer;
+    buffer.append(source.data(), source.size());
+
+    std::vector<uint8_t> out(length);
+    std::mt19937_64 rng(42);
+    std::uniform_int_distribution<size_t> offsets(0, size - length);
+
+    IterationStats stats(state);
+    for (auto _ : state)
+    {
+        const size_t offset = offsets(rng);
+        size_t written = 0;
+        stats.start();
+        buffer.forEach(offset, length, [&](const uint8_t *data, size_t n)
+                       {
+                           std::memcpy(out.data() + written, data, n);
+                           written += n;
+                           return true; });
+        stats.stop();
+        benchmark::DoNotOptimize(out.data());
+    }
+    stats.report();
+    state.SetBytesProcessed(state.iterations() * length);
+}
+BENCHMARK(BM_RangeSlice)->Arg(1024)->Arg(64 * 1024)->Arg(1024 * 1024);
+
+int main(int argc, char **argv)
+{
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    {
+        return 1;
+    }
+
+    // Per frame logging is at trace level, below the default, so it stays out of the report and the timings
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
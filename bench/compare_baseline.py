@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+"""Compares an acquire-driver-bench JSON report against a stored baseline.
+
+    compare_baseline.py baseline.json current.json [--threshold 0.10] [--update]
+
+A benchmark regresses when its CPU time per iteration or its allocations per iteration grow by more than
+the threshold. Exits 1 if any benchmark regressed, and 2 if there is nothing to compare against: no baseline, or
+one that has none of the current benchmarks. --update replaces the baseline with the current report, do that on
+the reference machine after an intended change in performance (`make bench-baseline` does both steps).
+"""
+
+import argparse
+import json
+import os
+import shutil
+import sys
+
+TO_NANOSECONDS = {"ns": 1.0, "us": 1e3, "ms": 1e6, "s": 1e9}
+
+
+def load(path):
+    with open(path) as f:
+        report = json.load(f)
+    results = {}
+    for bench in report.get("benchmarks", []):
+        # With --benchmark_repetitions only the median is compared, it shrugs off the odd slow run
+        if bench.get("run_type") == "aggregate" and bench.get("aggregate_name") != "median":
+            continue
+        if bench.get("error_occurred"):
+            continue
+        name = bench.get("run_name", bench["name"])
+        results[name] = {
+            "cpu_ns": bench["cpu_time"] * TO_NANOSECONDS[bench.get("time_unit", "ns")],
+            "allocs": bench.get("allocs_per_iter"),
+            "p99_us": bench.get("p99_us"),
+        }
+    return results
+
+
+def change(old, new):
+    if old is None or new is None:
+        return None
+    if old == 0:
+        return 0.0 if new == 0 else float("inf")
+    return (new - old) / old
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    parser.add_argument("--threshold", type=float, default=0.10, help="allowed relative growth (default 0.10)")
+    parser.add_argument("--update", action="store_true", help="store current as the new baseline")
+    args = parser.parse_args()
+
+    if args.update:
+        shutil.copyfile(args.current, args.baseline)
+        print(f"Baseline updated: {args.baseline}")
+        return 0
+    # Without a baseline nothing is checked, that must not pass for "no regressions"
+    if not os.path.exists(args.baseline):
+        print(f"No baseline at {args.baseline}, record one on the reference machine with --update "
+              f"(make bench-baseline)", file=sys.stderr)
+        return 2
+
+    baseline = load(args.baseline)
+    current = load(args.current)
+    if not set(baseline) & set(current):
+        print(f"{args.baseline} has none of the benchmarks in {args.current}, record a new baseline with --update",
+              file=sys.stderr)
+        return 2
+
+    regressions = []
+    print(f"{'benchmark':<50} {'cpu':>9} {'allocs':>9} {'p99':>9}")
+    for name, now in sorted(current.items()):
+        before = baseline.get(name)
+        if before is None:
+            print(f"{name:<50} {'new':>9}")
+            continue
+        cpu = change(before["cpu_ns"], now["cpu_ns"])
+        allocs = change(before["allocs"], now["allocs"])
+        p99 = change(before["p99_us"], now["p99_us"])
+        cells = [f"{c:+9.1%}" if c is not None else f"{'-':>9}" for c in (cpu, allocs, p99)]
+        print(f"{name:<50} {' '.join(cells)}")
+        if cpu is not None and cpu > args.threshold:
+            regressions.append(f"{name}: cpu time {cpu:+.1%}")
+        if allocs is not None and allocs > args.threshold:
+            regressions.append(f"{name}: allocations {allocs:+.1%}")
+
+    for name in sorted(set(baseline) - set(current)):
+        print(f"{name:<50} {'missing':>9}")
+
+    if regressions:
+        print(f"\n{len(regressions)} regression(s) over {args.threshold:.0%}:")
+        for regression in regressions:
+            print(f"  {regression}")
+        return 1
+    print("\nNo regressions")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
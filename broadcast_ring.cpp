@@ -0,0 +1,80 @@
+#include "broadcast_ring.h"
+
+BroadcastRing::BroadcastRing(size_t capacity) : slots_(capacity) {}
+
+void BroadcastRing::publish(bool keyframe, std::vector<uint8_t> data)
+{
+    const uint64_t sequence = head_.load(std::memory_order_relaxed);
+
+    auto piece = std::make_shared<BroadcastPiece>();
+    piece->sequence = sequence;
+    piece->keyframe = keyframe;
+    piece->data = std::move(data);
+
+    std::atomic_store_explicit(&slots_[sequence % slots_.size()], BroadcastPiecePtr(std::move(piece)), std::memory_order_release);
+    if (keyframe)
+    {
+        latest_keyframe_.store(sequence, std::memory_order_release);
+    }
+    head_.store(sequence + 1, std::memory_order_release);
+
+    {
+        std::lock_guard<std::mutex> lock(wait_mutex_);
+    }
+    wait_cv_.notify_all();
+}
+
+void BroadcastRing::close()
+{
+    closed_.store(true, std::memory_order_release);
+    {
+        std::lock_guard<std::mutex> lock(wait_mutex_);
+    }
+    wait_cv_.notify_all();
+}
+
+BroadcastPiecePtr BroadcastRing::load(uint64_t sequence) const
+{
+    BroadcastPiecePtr piece = std::atomic_load_explicit(&slots_[sequence % slots_.size()], std::memory_order_acquire);
+    return piece && piece->sequence == sequence ? piece : nullptr;
+}
+
+BroadcastPiecePtr BroadcastRing::read(uint64_t &cursor, std::chrono::milliseconds timeout) const
+{
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (;;)
+    {
+        if (cursor == NO_SEQUENCE)
+        {
+            cursor = latest_keyframe_.load(std::memory_order_acquire);
+        }
+
+        if (cursor != NO_SEQUENCE && cursor < head())
+        {
+            if (BroadcastPiecePtr piece = load(cursor))
+            {
+                cursor++;
+                return piece;
+            }
+            // Overwritten while this reader was busy elsewhere, pick the stream back up at the newest keyframe
+            skips_.fetch_add(1, std::memory_order_relaxed);
+            cursor = NO_SEQUENCE;
+            continue;
+        }
+
+        if (closed_.load(std::memory_order_acquire))
+        {
+            return nullptr;
+        }
+
+        std::unique_lock<std::mutex> lock(wait_mutex_);
+        const bool published = wait_cv_.wait_until(lock, deadline, [&]
+                                                    { return closed_.load(std::memory_order_acquire) ||
+                                                             (cursor == NO_SEQUENCE ? latest_keyframe_.load(std::memory_order_acquire) != NO_SEQUENCE
+                                                                                    : cursor < head()); });
+        if (!published)
+        {
+            return nullptr;
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// One published piece of a live stream, immutable once it is in the ring
+struct BroadcastPiece
+{
+    uint64_t sequence = 0;
+    bool keyframe = false; // a reader can start here
+    std::vector<uint8_t> data;
+};
+
+using BroadcastPiecePtr = std::shared_ptr<const BroadcastPiece>;
+
+// Fixed size ring with a single writer and any number of readers, each following along with its own cursor.
+// The writer never waits on a reader: it overwrites the oldest slot, and a reader that falls that far behind
+// notices the slot now holds a newer sequence and skips forward to the latest keyframe instead.
+// The capacity has to cover more than one keyframe interval so the latest keyframe is always still in the ring.
+class BroadcastRing
+{
+public:
+    static constexpr uint64_t NO_SEQUENCE = UINT64_MAX;
+
+    explicit BroadcastRing(size_t capacity);
+
+    BroadcastRing(const BroadcastRing &) = delete;
+    BroadcastRing &operator=(const BroadcastRing &) = delete;
+
+    // Only ever called from the writer thread
+    void publish(bool keyframe, std::vector<uint8_t> data);
+
+    // Wakes up every waiting reader for good, read() returns nullptr from then on once it runs out of pieces
+    void close();
+
+    // Returns the piece at cursor and moves the cursor past it, waiting up to timeout for it to be published.
+    // A cursor of NO_SEQUENCE (a new reader) or one that has been overwritten jumps to the latest keyframe.
+    // nullptr on timeout or once the ring is closed.
+    BroadcastPiecePtr read(uint64_t &cursor, std::chrono::milliseconds timeout) const;
+
+    // Sequence the next published piece gets
+    uint64_t head() const { return head_.load(std::memory_order_acquire); }
+
+    uint64_t skips() const { return skips_.load(std::memory_order_relaxed); }
+
+private:
+    BroadcastPiecePtr load(uint64_t sequence) const;
+
+    std::vector<BroadcastPiecePtr> slots_; // only accessed through std::atomic_load/atomic_store
+    std::atomic<uint64_t> head_{0};
+    std::atomic<uint64_t> latest_keyframe_{NO_SEQUENCE};
+    std::atomic<bool> closed_{false};
+    mutable std::atomic<uint64_t> skips_{0};
+
+    // Only used to put readers to sleep, the writer holds it just long enough to notify
+    mutable std::mutex wait_mutex_;
+    mutable std::condition_variable wait_cv_;
+};
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "chunked_buffer.h"
+
+// Thread-safe LRU cache of immutable encoded buffers (segments, webm files, etc.)
+// Concurrent requests for a key that is still being built wait on the one in-flight build
+// ("single-flight") instead of each running their own encode.
+// Value only needs a size() member so the cache can account for the memory it holds.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class BufferCache
+{
+public:
+    using ValuePtr = std::shared_ptr<const Value>;
+    using Builder = std::function<ValuePtr()>;
+
+    struct Stats
+    {
+        uint64_t hits = 0;      // served straight from the cache
+        uint64_t misses = 0;    // not in the cache: had to run the builder, or find() came back empty
+        uint64_t coalesced = 0; // waited on someone else's in-flight build
+        uint64_t evictions = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+
+    explicit BufferCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+    // Returns the cached value for key, building it with builder if needed.
+    // Only one builder runs per key at a time, everyone else asking for that key blocks until it finishes.
+    // A null result from the builder is handed to the waiters but never cached, so the next request retries.
+    ValuePtr getOrBuild(const Key &key, const Builder &builder)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        auto it = entries_.find(key);
+        if (it != entries_.end())
+        {
+            lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+            hits_++;
+            return it->second.value;
+        }
+
+        auto flight = in_flight_.find(key);
+        if (flight != in_flight_.end())
+        {
+            std::shared_future<ValuePtr> pending = flight->second;
+            coalesced_++;
+            lock.unlock();
+            return pending.get();
+        }
+
+        misses_++;
+        std::promise<ValuePtr> promise;
+        in_flight_.emplace(key, promise.get_future().share());
+        lock.unlock();
+
+        ValuePtr value;
+        try
+        {
+            value = builder();
+        }
+        catch (...)
+        {
+            lock.lock();
+            in_flight_.erase(key);
+            lock.unlock();
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+
+        lock.lock();
+        in_flight_.erase(key);
+        if (value)
+        {
+            insertLocked(key, value);
+        }
+        lock.unlock();
+
+        promise.set_value(value);
+        return value;
+    }
+
+    // Returns the cached value or nullptr, never builds. Counts as a hit or a miss like getOrBuild does.
+    ValuePtr find(const Key &key)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        if (it == entries_.end())
+        {
+            misses_++;
+            return nullptr;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second.lru_it);
+        hits_++;
+        return it->second.value;
+    }
+
+    // Inserts (or replaces) a value that was built elsewhere
+    void put(const Key &key, ValuePtr value)
+    {
+        if (!value)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        insertLocked(key, std::move(value));
+    }
+
+    Stats stats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Stats stats;
+        stats.hits = hits_;
+        stats.misses = misses_;
+        stats.coalesced = coalesced_;
+        stats.evictions = evictions_;
+        stats.entries = entries_.size();
+        stats.bytes = bytes_;
+        return stats;
+    }
+
+private:
+    struct Entry
+    {
+        ValuePtr value;
+        size_t size;
+        typename std::list<Key>::iterator lru_it;
+    };
+
+    void insertLocked(const Key &key, ValuePtr value)
+    {
+        auto existing = entries_.find(key);
+        if (existing != entries_.end())
+        {
+            bytes_ -= existing->second.size;
+            lru_.erase(existing->second.lru_it);
+            entries_.erase(existing);
+        }
+
+        const size_t size = value->size();
+        lru_.push_front(key);
+        entries_.emplace(key, Entry{std::move(value), size, lru_.begin()});
+        bytes_ += size;
+
+        // Always keep the newest entry even if it is bigger than the budget on its own.
+        // Readers hold their own reference, so evicting never pulls data out from under a response.
+        while (bytes_ > max_bytes_ && lru_.size() > 1)
+        {
+            auto victim = entries_.find(lru_.back());
+            bytes_ -= victim->second.size;
+            entries_.erase(victim);
+            lru_.pop_back();
+            evictions_++;
+        }
+    }
+
+    const size_t max_bytes_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<Key, Entry, Hash> entries_;
+    std::unordered_map<Key, std::shared_future<ValuePtr>, Hash> in_flight_;
+    std::list<Key> lru_; // most recently used at the front
+    size_t bytes_ = 0;
+
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t coalesced_ = 0;
+    uint64_t evictions_ = 0;
+};
+
+// Identifies one HLS segment of one stream at one resolution
+struct SegmentKey
+{
+    std::string stream;
+    int width;
+    int height;
+    int64_t index;
+
+    bool operator==(const SegmentKey &other) const
+    {
+        return index == other.index && width == other.width && height == other.height && stream == other.stream;
+    }
+};
+
+struct SegmentKeyHash
+{
+    size_t operator()(const SegmentKey &key) const
+    {
+        size_t h = std::hash<std::string>()(key.stream);
+        h = h * 31 + std::hash<int>()(key.width);
+        h = h * 31 + std::hash<int>()(key.height);
+        h = h * 31 + std::hash<int64_t>()(key.index);
+        return h;
+    }
+};
+
+using SegmentCache = BufferCache<SegmentKey, ChunkedBuffer, SegmentKeyHash>;
@@ -0,0 +1,159 @@
+#include "chunked_buffer.h"
+
+#include <cstring>
+
+ChunkPool::ChunkPool(size_t max_free_chunks) : max_free_chunks_(max_free_chunks) {}
+
+ChunkPool::~ChunkPool()
+{
+    for (BufferChunk *chunk : free_)
+    {
+        delete chunk;
+    }
+}
+
+ChunkPool &ChunkPool::shared()
+{
+    // Up to 256MB of idle chunks. Never destroyed: globals built before its first use (caches, producers) still
+    // hand chunks back to it while they are destroyed at exit.
+    static ChunkPool *pool = new ChunkPool(4096);
+    return *pool;
+}
+
+ChunkPtr ChunkPool::acquire()
+{
+    BufferChunk *chunk = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!free_.empty())
+        {
+            chunk = free_.back();
+            free_.pop_back();
+        }
+    }
+    if (!chunk)
+    {
+        chunk = new BufferChunk;
+    }
+    chunk->size = 0;
+    return ChunkPtr(chunk, [this](BufferChunk *released)
+                    { release(released); });
+}
+
+size_t ChunkPool::freeChunks() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return free_.size();
+}
+
+void ChunkPool::release(BufferChunk *chunk)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_.size() < max_free_chunks_)
+        {
+            free_.push_back(chunk);
+            return;
+        }
+    }
+    delete chunk;
+}
+
+void ChunkedBuffer::append(const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        if (chunks_.empty() || tail_shared_ || chunks_.back()->size == BufferChunk::CAPACITY)
+        {
+            chunks_.push_back(pool_->acquire());
+            starts_.push_back(size_);
+            tail_shared_ = false;
+        }
+        BufferChunk &chunk = *chunks_.back();
+        const size_t n = std::min(len, BufferChunk::CAPACITY - chunk.size);
+        std::memcpy(chunk.data + chunk.size, data, n);
+        chunk.size += n;
+        size_ += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void ChunkedBuffer::appendChunks(const ChunkedBuffer &other)
+{
+    for (const ChunkPtr &chunk : other.chunks_)
+    {
+        chunks_.push_back(chunk);
+        starts_.push_back(size_);
+        size_ += chunk->size;
+    }
+    tail_shared_ = tail_shared_ || !other.chunks_.empty();
+}
+
+void ChunkedBuffer::appendChunk(ChunkPtr chunk)
+{
+    starts_.push_back(size_);
+    size_ += chunk->size;
+    chunks_.push_back(std::move(chunk));
+    tail_shared_ = true;
+}
+
+void LiveBuffer::append(ChunkedBufferPtr piece)
+{
+    if (!piece || piece->empty())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        starts_.push_back(size_);
+        size_ += piece->size();
+        pieces_.push_back(std::move(piece));
+    }
+    cv_.notify_all();
+}
+
+void LiveBuffer::finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (finished_)
+        {
+            return;
+        }
+        auto whole = std::make_shared<ChunkedBuffer>();
+        for (const ChunkedBufferPtr &piece : pieces_)
+        {
+            whole->appendChunks(*piece);
+        }
+        whole_ = std::move(whole);
+        finished_ = true;
+    }
+    cv_.notify_all();
+}
+
+bool LiveBuffer::finished() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return finished_;
+}
+
+ChunkedBufferPtr LiveBuffer::whole() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return whole_;
+}
+
+ChunkedBufferPtr LiveBuffer::next(size_t offset, size_t &piece_offset, std::chrono::milliseconds timeout) const
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait_for(lock, timeout, [&]
+                 { return offset < size_ || finished_; });
+    if (offset >= size_)
+    {
+        return nullptr;
+    }
+    const size_t index = std::upper_bound(starts_.begin(), starts_.end(), offset) - starts_.begin() - 1;
+    piece_offset = offset - starts_[index];
+    return pieces_[index];
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Fixed-size block of bytes handed out by a ChunkPool
+struct BufferChunk
+{
+    static constexpr size_t CAPACITY = 64 * 1024;
+
+    size_t size = 0;
+    uint8_t data[CAPACITY];
+};
+
+// Reference counted, when the last reference goes away the chunk goes back to its pool
+using ChunkPtr = std::shared_ptr<BufferChunk>;
+
+// Recycles chunks so muxing a segment doesn't go back to the heap for every few kilobytes of output.
+// At most max_free_chunks idle chunks are kept, anything beyond that is freed.
+class ChunkPool
+{
+public:
+    explicit ChunkPool(size_t max_free_chunks);
+    ~ChunkPool();
+
+    ChunkPool(const ChunkPool &) = delete;
+    ChunkPool &operator=(const ChunkPool &) = delete;
+
+    // Shared by every muxer in the process
+    static ChunkPool &shared();
+
+    ChunkPtr acquire();
+
+    size_t freeChunks() const;
+
+private:
+    void release(BufferChunk *chunk);
+
+    const size_t max_free_chunks_;
+    mutable std::mutex mutex_;
+    std::vector<BufferChunk *> free_;
+};
+
+// A rope of pooled chunks. A muxer appends to it while writing, afterwards it is shared read-only
+// (as a ChunkedBufferPtr) between the cache, HTTP responses and the disk writer without ever being flattened.
+class ChunkedBuffer
+{
+public:
+    explicit ChunkedBuffer(ChunkPool &pool = ChunkPool::shared()) : pool_(&pool) {}
+
+    void append(const uint8_t *data, size_t len);
+
+    // Appends other's bytes by taking references to its chunks, nothing is copied.
+    // Those chunks are never written to again, later appends start a fresh chunk.
+    void appendChunks(const ChunkedBuffer &other);
+
+    // Appends a chunk filled elsewhere (its size bytes of it) by reference, same as appendChunks for a single chunk
+    void appendChunk(ChunkPtr chunk);
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const std::vector<ChunkPtr> &chunks() const { return chunks_; }
+
+    // Calls fn(data, size) with the contiguous pieces covering [offset, offset + length).
+    // Stops and returns false as soon as fn does.
+    template <typename Fn>
+    bool forEach(size_t offset, size_t length, Fn &&fn) const
+    {
+        if (offset >= size_)
+        {
+            return true;
+        }
+        const size_t end = std::min(offset + length, size_);
+        size_t index = std::upper_bound(starts_.begin(), starts_.end(), offset) - starts_.begin() - 1;
+        size_t chunk_offset = offset - starts_[index];
+        while (offset < end && index < chunks_.size())
+        {
+            const BufferChunk &chunk = *chunks_[index];
+            const size_t n = std::min(chunk.size - chunk_offset, end - offset);
+            if (!fn(chunk.data + chunk_offset, n))
+            {
+                return false;
+            }
+            offset += n;
+            chunk_offset = 0;
+            index++;
+        }
+        return true;
+    }
+
+private:
+    ChunkPool *pool_;
+    std::vector<ChunkPtr> chunks_;
+    std::vector<size_t> starts_; // offset of the first byte of each chunk
+    size_t size_ = 0;
+    bool tail_shared_ = false;
+};
+
+using ChunkedBufferPtr = std::shared_ptr<const ChunkedBuffer>;
+
+// A buffer that is still being written. The writer appends whole pieces (fMP4 fragments), readers follow along
+// and block until the next piece exists, so a response can start before the writer is done.
+class LiveBuffer
+{
+public:
+    void append(ChunkedBufferPtr piece);
+
+    // No more pieces will come, wakes up every waiting reader
+    void finish();
+
+    bool finished() const;
+
+    // All the pieces as one buffer once finished, nullptr before that
+    ChunkedBufferPtr whole() const;
+
+    // Returns the piece holding byte `offset` and sets piece_offset to where that byte is inside it.
+    // Waits up to timeout for the piece to be written, returns nullptr if the buffer ends before offset or it times out.
+    ChunkedBufferPtr next(size_t offset, size_t &piece_offset, std::chrono::milliseconds timeout) const;
+
+private:
+    mutable std::mutex mutex_;
+    mutable std::condition_variable cv_;
+    std::vector<ChunkedBufferPtr> pieces_;
+    std::vector<size_t> starts_; // offset of the first byte of each piece
+    size_t size_ = 0;
+    ChunkedBufferPtr whole_;
+    bool finished_ = false;
+};
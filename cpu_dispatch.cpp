@@ -0,0 +1,38 @@
+#include "cpu_dispatch.h"
+
+namespace
+{
+    struct Features
+    {
+        bool sse2 = false;
+        bool avx2 = false;
+        bool avx512bw = false;
+
+        Features()
+        {
+#ifdef CPU_DISPATCH_X86
+            __builtin_cpu_init();
+            sse2 = __builtin_cpu_supports("sse2");
+            avx2 = __builtin_cpu_supports("avx2");
+            avx512bw = __builtin_cpu_supports("avx512bw");
+#endif
+        }
+    };
+}
+
+bool cpuSupports(CpuFeature feature)
+{
+    static const Features features;
+    switch (feature)
+    {
+    case CpuFeature::None:
+        return true;
+    case CpuFeature::Sse2:
+        return features.sse2;
+    case CpuFeature::Avx2:
+        return features.avx2;
+    case CpuFeature::Avx512bw:
+        return features.avx512bw;
+    }
+    return false;
+}
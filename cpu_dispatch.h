@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Runtime CPU dispatch for the SIMD kernels. Each module keeps a table of its kernel sets, best first and ending with
+// plain C++, each tagged with the instruction set it needs; the first one the CPU supports is used.
+//
+//   struct Kernel { CpuFeature feature; const char *name; void (*row)(uint8_t *, int); };
+//   constexpr Kernel KERNELS[] = {{CpuFeature::Avx2, "avx2", rowAvx2}, {CpuFeature::None, "scalar", rowScalar}};
+//   const Kernel &kernel = bestKernel(KERNELS);
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_DISPATCH_X86 1
+#endif
+
+enum class CpuFeature
+{
+    None, // plain C++, runs everywhere
+    Sse2,
+    Avx2,
+    Avx512bw,
+};
+
+// Whether this CPU can run code built for feature, detected once
+bool cpuSupports(CpuFeature feature);
+
+// The first kernel of table this CPU supports. Cache it in a function local static: that is safe to use from other
+// static initializers, a namespace scope one isn't.
+template <typename Kernel, size_t N>
+const Kernel &bestKernel(const Kernel (&table)[N])
+{
+    for (const Kernel &kernel : table)
+    {
+        if (cpuSupports(kernel.feature))
+        {
+            return kernel;
+        }
+    }
+    return table[N - 1];
+}
+
+// Every kernel of table this CPU supports, best first, so tests can check each of them against the last one
+template <typename Kernel, size_t N>
+std::vector<Kernel> supportedKernels(const Kernel (&table)[N])
+{
+    std::vector<Kernel> kernels;
+    for (const Kernel &kernel : table)
+    {
+        if (cpuSupports(kernel.feature))
+        {
+            kernels.push_back(kernel);
+        }
+    }
+    return kernels;
+}
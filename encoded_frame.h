@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// A compressed frame kept around after encoding so it can be muxed again (see LoopHlsStream and LiveWebmConfig::loop).
+// pts and dts are in frames.
+struct EncodedFrame
+{
+    std::vector<uint8_t> data;
+    int64_t pts = 0;
+    int64_t dts = 0;
+    bool keyframe = false;
+};
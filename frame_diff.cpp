@@ -0,0 +1,207 @@
+#include "frame_diff.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef CPU_DISPATCH_X86
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    // Adds each sample's absolute difference of one row to the sum of its block, blocks are 1 << shift samples wide
+    // (16 for luma, 8 for chroma)
+    void sadRowScalar(const uint8_t *a, const uint8_t *b, int width, int shift, uint32_t *sums)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            sums[x >> shift] += a[x] > b[x] ? a[x] - b[x] : b[x] - a[x];
+        }
+    }
+
+#ifdef CPU_DISPATCH_X86
+    // psadbw sums every 8 bytes into its own quadword, 8 wide blocks take one each and 16 wide blocks two
+    __attribute__((target("sse2"))) void sadRowSse2(const uint8_t *a, const uint8_t *b, int width, int shift, uint32_t *sums)
+    {
+        int x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            const __m128i sad = _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + x)),
+                                             _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + x)));
+            sums[x >> shift] += _mm_cvtsi128_si32(sad);
+            sums[(x + 8) >> shift] += _mm_cvtsi128_si32(_mm_srli_si128(sad, 8));
+        }
+        sadRowScalar(a + x, b + x, width - x, shift, sums + (x >> shift));
+    }
+
+    __attribute__((target("avx2"))) void sadRowAvx2(const uint8_t *a, const uint8_t *b, int width, int shift, uint32_t *sums)
+    {
+        int x = 0;
+        for (; x + 32 <= width; x += 32)
+        {
+            const __m256i sad = _mm256_sad_epu8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + x)),
+                                                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + x)));
+            const __m128i low = _mm256_castsi256_si128(sad);
+            const __m128i high = _mm256_extracti128_si256(sad, 1);
+            sums[x >> shift] += _mm_cvtsi128_si32(low);
+            sums[(x + 8) >> shift] += _mm_cvtsi128_si32(_mm_srli_si128(low, 8));
+            sums[(x + 16) >> shift] += _mm_cvtsi128_si32(high);
+            sums[(x + 24) >> shift] += _mm_cvtsi128_si32(_mm_srli_si128(high, 8));
+        }
+        sadRowSse2(a + x, b + x, width - x, shift, sums + (x >> shift));
+    }
+#endif
+
+    constexpr FrameDiffKernel KERNELS[] = {
+#ifdef CPU_DISPATCH_X86
+        {CpuFeature::Avx2, "avx2", sadRowAvx2},
+        {CpuFeature::Sse2, "sse2", sadRowSse2},
+#endif
+        {CpuFeature::None, "scalar", sadRowScalar},
+    };
+
+    const FrameDiffKernel &activeKernel()
+    {
+        static const FrameDiffKernel &kernel = bestKernel(KERNELS);
+        return kernel;
+    }
+
+    int planeWidth(int plane, int width) { return plane == 0 ? width : (width + 1) / 2; }
+    int planeHeight(int plane, int height) { return plane == 0 ? height : (height + 1) / 2; }
+
+    // Samples per macroblock side in a plane, as a shift
+    int blockShift(int plane) { return plane == 0 ? 4 : 3; }
+}
+
+void DirtyMap::scaleTo(int width, int height, DirtyMap &out) const
+{
+    out.mb_width = (width + MACROBLOCK_SIZE - 1) / MACROBLOCK_SIZE;
+    out.mb_height = (height + MACROBLOCK_SIZE - 1) / MACROBLOCK_SIZE;
+    if (out.mb_width == mb_width && out.mb_height == mb_height)
+    {
+        out.dirty = dirty;
+        out.dirty_count = dirty_count;
+        return;
+    }
+
+    out.dirty.assign(static_cast<size_t>(out.mb_width) * out.mb_height, 0);
+    out.dirty_count = 0;
+    if (dirty_count == 0)
+    {
+        return;
+    }
+    for (int y = 0; y < out.mb_height; y++)
+    {
+        const int top = std::max(y * mb_height / out.mb_height - 1, 0);
+        const int bottom = std::min(((y + 1) * mb_height + out.mb_height - 1) / out.mb_height + 1, mb_height);
+        for (int x = 0; x < out.mb_width; x++)
+        {
+            const int left = std::max(x * mb_width / out.mb_width - 1, 0);
+            const int right = std::min(((x + 1) * mb_width + out.mb_width - 1) / out.mb_width + 1, mb_width);
+            bool changed = false;
+            for (int sy = top; sy < bottom && !changed; sy++)
+            {
+                for (int sx = left; sx < right && !changed; sx++)
+                {
+                    changed = at(sx, sy);
+                }
+            }
+            if (changed)
+            {
+                out.dirty[static_cast<size_t>(y) * out.mb_width + x] = 1;
+                out.dirty_count++;
+            }
+        }
+    }
+}
+
+FrameDiff::FrameDiff(uint32_t threshold)
+    : threshold_(threshold)
+{
+}
+
+const DirtyMap &FrameDiff::update(const PooledFrame &frame)
+{
+    const int width = frame.width();
+    const int height = frame.height();
+
+    if (width != width_ || height != height_)
+    {
+        width_ = width;
+        height_ = height;
+        map_.mb_width = (width + MACROBLOCK_SIZE - 1) / MACROBLOCK_SIZE;
+        map_.mb_height = (height + MACROBLOCK_SIZE - 1) / MACROBLOCK_SIZE;
+        map_.dirty.assign(static_cast<size_t>(map_.mb_width) * map_.mb_height, 1);
+        map_.dirty_count = map_.mb_width * map_.mb_height;
+        sad_.resize(map_.dirty.size());
+        for (int i = 0; i < 3; i++)
+        {
+            const int plane_width = planeWidth(i, width);
+            const int plane_height = planeHeight(i, height);
+            reference_[i].resize(static_cast<size_t>(plane_width) * plane_height);
+            for (int y = 0; y < plane_height; y++)
+            {
+                std::memcpy(reference_[i].data() + static_cast<size_t>(y) * plane_width,
+                            frame.plane(i) + static_cast<size_t>(y) * frame.stride(i), plane_width);
+            }
+        }
+        return map_;
+    }
+
+    const FrameDiffKernel &kernel = activeKernel();
+    std::fill(sad_.begin(), sad_.end(), 0);
+    for (int i = 0; i < 3; i++)
+    {
+        const int plane_width = planeWidth(i, width);
+        const int plane_height = planeHeight(i, height);
+        const int shift = blockShift(i);
+        for (int y = 0; y < plane_height; y++)
+        {
+            kernel.sad_row(frame.plane(i) + static_cast<size_t>(y) * frame.stride(i),
+                           reference_[i].data() + static_cast<size_t>(y) * plane_width,
+                           plane_width, shift, sad_.data() + static_cast<size_t>(y >> shift) * map_.mb_width);
+        }
+    }
+
+    map_.dirty_count = 0;
+    for (size_t mb = 0; mb < map_.dirty.size(); mb++)
+    {
+        map_.dirty[mb] = sad_[mb] > threshold_;
+        map_.dirty_count += map_.dirty[mb];
+    }
+    if (map_.dirty_count == 0)
+    {
+        return map_;
+    }
+
+    for (int mb_y = 0; mb_y < map_.mb_height; mb_y++)
+    {
+        for (int mb_x = 0; mb_x < map_.mb_width; mb_x++)
+        {
+            if (!map_.at(mb_x, mb_y))
+            {
+                continue;
+            }
+            for (int i = 0; i < 3; i++)
+            {
+                const int plane_width = planeWidth(i, width);
+                const int plane_height = planeHeight(i, height);
+                const int shift = blockShift(i);
+                const int x0 = mb_x << shift;
+                const int columns = std::min(1 << shift, plane_width - x0);
+                const int rows_end = std::min((mb_y + 1) << shift, plane_height);
+                for (int y = mb_y << shift; y < rows_end; y++)
+                {
+                    std::memcpy(reference_[i].data() + static_cast<size_t>(y) * plane_width + x0,
+                                frame.plane(i) + static_cast<size_t>(y) * frame.stride(i) + x0, columns);
+                }
+            }
+        }
+    }
+    return map_;
+}
+
+std::vector<FrameDiffKernel> frameDiffKernels()
+{
+    return supportedKernels(KERNELS);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "cpu_dispatch.h"
+#include "frame_pool.h"
+
+// Finds the 16x16 macroblocks of a frame that changed since the frames before it, so the encoders can skip the rest
+// of a mostly idle camera picture instead of searching it for motion every frame. A macroblock's change is the sum of
+// absolute differences of its 256 luma and 2x64 chroma samples against a reference, summed with the best kernel the
+// CPU supports (AVX2, SSE2 or plain C++).
+
+const int MACROBLOCK_SIZE = 16;
+
+// One flag per macroblock, row by row
+struct DirtyMap
+{
+    int mb_width = 0;
+    int mb_height = 0;
+    std::vector<uint8_t> dirty;
+    int dirty_count = 0;
+
+    bool unchanged() const { return dirty_count == 0; }
+    bool at(int mb_x, int mb_y) const { return dirty[static_cast<size_t>(mb_y) * mb_width + mb_x] != 0; }
+
+    // The map for this frame scaled to width x height. A macroblock there is dirty if any source macroblock it
+    // samples from is, widened by one macroblock for the scaler's filter taps.
+    void scaleTo(int width, int height, DirtyMap &out) const;
+};
+
+class FrameDiff
+{
+public:
+    // threshold is the SAD a macroblock has to exceed to count as changed, above the camera's noise but below the
+    // smallest change worth showing. 128 is half a level per luma sample on average.
+    explicit FrameDiff(uint32_t threshold = 128);
+
+    // Compares frame against the reference and copies the macroblocks that changed into it. Macroblocks under the
+    // threshold are left alone, so a slow drift still adds up until it crosses it.
+    // The first frame, and the first of a new size, is dirty everywhere.
+    const DirtyMap &update(const PooledFrame &frame);
+
+    const DirtyMap &map() const { return map_; }
+
+private:
+    const uint32_t threshold_;
+    int width_ = 0;
+    int height_ = 0;
+    std::vector<uint8_t> reference_[3]; // planes packed at their width
+    std::vector<uint32_t> sad_;
+    DirtyMap map_;
+};
+
+struct FrameDiffKernel
+{
+    CpuFeature feature;
+    const char *name;
+    // Adds the absolute difference of a[x] and b[x] to sums[x >> shift], for blocks 1 << shift samples wide
+    void (*sad_row)(const uint8_t *a, const uint8_t *b, int width, int shift, uint32_t *sums);
+};
+
+// The kernels this CPU can run, best first: FrameDiff uses the first, the last is plain C++
+std::vector<FrameDiffKernel> frameDiffKernels();
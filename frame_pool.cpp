@@ -0,0 +1,193 @@
+#include "frame_pool.h"
+
+#include <cstdlib>
+
+#include "logger.h"
+
+namespace
+{
+    const size_t FRAME_ALIGNMENT = 64;
+
+    size_t alignUp(size_t value)
+    {
+        return (value + FRAME_ALIGNMENT - 1) & ~(FRAME_ALIGNMENT - 1);
+    }
+
+    uint8_t *allocateSlab(size_t size)
+    {
+        return static_cast<uint8_t *>(std::aligned_alloc(FRAME_ALIGNMENT, alignUp(size)));
+    }
+}
+
+FrameLayout FrameLayout::make(FrameFormat format, int width, int height)
+{
+    FrameLayout layout{};
+    layout.format = format;
+    layout.width = width;
+    layout.height = height;
+
+    switch (format)
+    {
+    case FrameFormat::I420:
+    {
+        const int chroma_width = (width + 1) / 2;
+        const int chroma_height = (height + 1) / 2;
+        layout.planes = 3;
+        layout.stride[0] = static_cast<int>(alignUp(width));
+        layout.stride[1] = static_cast<int>(alignUp(chroma_width));
+        layout.stride[2] = layout.stride[1];
+        layout.offset[0] = 0;
+        layout.offset[1] = alignUp(static_cast<size_t>(layout.stride[0]) * height);
+        layout.offset[2] = layout.offset[1] + alignUp(static_cast<size_t>(layout.stride[1]) * chroma_height);
+        layout.size = layout.offset[2] + alignUp(static_cast<size_t>(layout.stride[2]) * chroma_height);
+        break;
+    }
+    }
+
+    return layout;
+}
+
+PooledFrame &PooledFrame::operator=(PooledFrame &&other) noexcept
+{
+    if (this != &other)
+    {
+        reset();
+        owner_ = other.owner_;
+        lender_ = other.lender_;
+        index_ = other.index_;
+        data_ = other.data_;
+        std::copy(other.planes_, other.planes_ + 3, planes_);
+        layout_ = other.layout_;
+        other.owner_ = nullptr;
+        other.lender_ = nullptr;
+        other.data_ = nullptr;
+        other.layout_ = nullptr;
+    }
+    return *this;
+}
+
+void PooledFrame::reset()
+{
+    if (owner_ && data_)
+    {
+        owner_->release(index_, data_);
+    }
+    else if (lender_ && data_)
+    {
+        lender_->release(index_);
+    }
+    owner_ = nullptr;
+    lender_ = nullptr;
+    data_ = nullptr;
+}
+
+FrameSlabs::FrameSlabs(const FrameLayout &layout, uint32_t max_slabs)
+    : layout_(layout),
+      max_slabs_(max_slabs),
+      head_(NONE),
+      next_(new std::atomic<uint32_t>[max_slabs]),
+      slabs_(new std::atomic<uint8_t *>[max_slabs])
+{
+    for (uint32_t i = 0; i < max_slabs_; i++)
+    {
+        next_[i].store(NONE, std::memory_order_relaxed);
+        slabs_[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+FrameSlabs::~FrameSlabs()
+{
+    for (uint32_t i = 0; i < max_slabs_; i++)
+    {
+        std::free(slabs_[i].load(std::memory_order_relaxed));
+    }
+}
+
+PooledFrame FrameSlabs::acquire()
+{
+    // Pop the first free slab
+    uint64_t head = head_.load(std::memory_order_acquire);
+    while (static_cast<uint32_t>(head) != NONE)
+    {
+        const uint32_t index = static_cast<uint32_t>(head);
+        const uint32_t next = next_[index].load(std::memory_order_relaxed);
+        const uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+        if (head_.compare_exchange_weak(head, new_head, std::memory_order_acq_rel, std::memory_order_acquire))
+        {
+            return PooledFrame(this, index, slabs_[index].load(std::memory_order_acquire), &layout_);
+        }
+    }
+
+    // Nothing free, grow by one slab. The index is only claimed once the slab is there, a failed allocation must not
+    // use one of max_slabs_ up.
+    uint8_t *data = nullptr;
+    if (allocated_.load(std::memory_order_relaxed) < max_slabs_)
+    {
+        data = allocateSlab(layout_.size);
+        if (!data)
+        {
+            logError("Failed to allocate a {}x{} frame slab", layout_.width, layout_.height);
+            return PooledFrame();
+        }
+        uint32_t index = allocated_.load(std::memory_order_relaxed);
+        while (index < max_slabs_)
+        {
+            if (allocated_.compare_exchange_weak(index, index + 1, std::memory_order_relaxed))
+            {
+                slabs_[index].store(data, std::memory_order_release);
+                return PooledFrame(this, index, data, &layout_);
+            }
+        }
+        // Another thread took the last slab in the meantime, what was allocated goes out as an overflow frame
+    }
+
+    // Every slab is in flight, something is holding on to frames. Keep streaming rather than stall the encoder.
+    if (overflows_.fetch_add(1, std::memory_order_relaxed) == 0)
+    {
+        logWarn("Frame pool exhausted for {}x{}, falling back to the heap", layout_.width, layout_.height);
+    }
+    if (!data)
+    {
+        data = allocateSlab(layout_.size);
+    }
+    if (!data)
+    {
+        return PooledFrame();
+    }
+    return PooledFrame(this, OVERFLOW_INDEX, data, &layout_);
+}
+
+void FrameSlabs::release(uint32_t index, uint8_t *data)
+{
+    if (index == OVERFLOW_INDEX)
+    {
+        std::free(data);
+        return;
+    }
+
+    // Push the slab back on the free list
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    uint64_t new_head;
+    do
+    {
+        next_[index].store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+        new_head = (((head >> 32) + 1) << 32) | index;
+    } while (!head_.compare_exchange_weak(head, new_head, std::memory_order_release, std::memory_order_relaxed));
+}
+
+FramePool &FramePool::shared()
+{
+    static FramePool pool;
+    return pool;
+}
+
+FrameSlabs &FramePool::slabs(FrameFormat format, int width, int height)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto &slabs = slabs_[std::make_tuple(format, width, height)];
+    if (!slabs)
+    {
+        slabs = std::make_unique<FrameSlabs>(FrameLayout::make(format, width, height), max_slabs_per_size_);
+    }
+    return *slabs;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+
+enum class FrameFormat
+{
+    I420,
+};
+
+// Where the planes of a frame live inside its slab. Every stride and plane offset is 64 byte aligned.
+struct FrameLayout
+{
+    FrameFormat format;
+    int width;
+    int height;
+    int planes;
+    int stride[3];
+    size_t offset[3];
+    size_t size;
+
+    static FrameLayout make(FrameFormat format, int width, int height);
+};
+
+class FrameSlabs;
+
+// Lends out frames that live somewhere other than a FrameSlabs, e.g. in the shared memory ingest ring.
+// release is called with the index the frame was lent out under once its PooledFrame is done with it.
+class FrameLender
+{
+public:
+    virtual void release(uint32_t index) = 0;
+
+protected:
+    ~FrameLender() = default;
+};
+
+// A frame borrowed from the pool (or a lender), goes back when destroyed.
+// Encoders are handed its planes directly (see wrapX264Picture/wrapVpxImage), nothing is copied.
+class PooledFrame
+{
+public:
+    // A lent frame: planes point into the lender's memory, layout gives the size and strides (its offsets are unused)
+    PooledFrame(FrameLender *lender, uint32_t index, uint8_t *const planes[3], const FrameLayout *layout)
+        : lender_(lender), index_(index), data_(planes[0]), planes_{planes[0], planes[1], planes[2]}, layout_(layout) {}
+
+    PooledFrame() = default;
+    ~PooledFrame() { reset(); }
+
+    PooledFrame(PooledFrame &&other) noexcept { *this = std::move(other); }
+    PooledFrame &operator=(PooledFrame &&other) noexcept;
+    PooledFrame(const PooledFrame &) = delete;
+    PooledFrame &operator=(const PooledFrame &) = delete;
+
+    explicit operator bool() const { return data_ != nullptr; }
+
+    const FrameLayout &layout() const { return *layout_; }
+    int width() const { return layout_->width; }
+    int height() const { return layout_->height; }
+    uint8_t *plane(int i) const { return planes_[i]; }
+    int stride(int i) const { return layout_->stride[i]; }
+
+    void reset();
+
+private:
+    friend class FrameSlabs;
+    PooledFrame(FrameSlabs *owner, uint32_t index, uint8_t *data, const FrameLayout *layout)
+        : owner_(owner), index_(index), data_(data),
+          planes_{data + layout->offset[0], data + layout->offset[1], data + layout->offset[2]}, layout_(layout) {}
+
+    FrameSlabs *owner_ = nullptr;
+    FrameLender *lender_ = nullptr;
+    uint32_t index_ = 0;
+    uint8_t *data_ = nullptr;
+    uint8_t *planes_[3] = {};
+    const FrameLayout *layout_ = nullptr;
+};
+
+// Fixed-size slabs for one (format, width, height), recycled through a lock-free (Treiber) free list.
+// Slabs are allocated the first time they are needed and then live as long as the pool does,
+// so once a stream reaches steady state acquire/release never touch the heap.
+class FrameSlabs
+{
+public:
+    FrameSlabs(const FrameLayout &layout, uint32_t max_slabs);
+    ~FrameSlabs();
+
+    FrameSlabs(const FrameSlabs &) = delete;
+    FrameSlabs &operator=(const FrameSlabs &) = delete;
+
+    PooledFrame acquire();
+
+    const FrameLayout &layout() const { return layout_; }
+    uint32_t allocated() const { return allocated_.load(std::memory_order_relaxed); }
+    uint64_t overflows() const { return overflows_.load(std::memory_order_relaxed); }
+
+private:
+    friend class PooledFrame;
+    void release(uint32_t index, uint8_t *data);
+
+    static constexpr uint32_t NONE = 0xFFFFFFFF;
+    static constexpr uint32_t OVERFLOW_INDEX = 0xFFFFFFFE; // frame came straight from the heap because every slab was in use
+
+    const FrameLayout layout_;
+    const uint32_t max_slabs_;
+
+    // Low 32 bits are the index of the first free slab, high 32 bits a tag bumped on every change to avoid ABA
+    std::atomic<uint64_t> head_;
+    std::unique_ptr<std::atomic<uint32_t>[]> next_;
+    std::unique_ptr<std::atomic<uint8_t *>[]> slabs_;
+    std::atomic<uint32_t> allocated_{0};
+    std::atomic<uint64_t> overflows_{0};
+};
+
+class FramePool
+{
+public:
+    explicit FramePool(uint32_t max_slabs_per_size = 64) : max_slabs_per_size_(max_slabs_per_size) {}
+
+    // Shared by every encoder in the process
+    static FramePool &shared();
+
+    // Looking up the slabs takes a lock, so look them up once per stream and acquire from them per frame
+    FrameSlabs &slabs(FrameFormat format, int width, int height);
+
+    PooledFrame acquire(FrameFormat format, int width, int height) { return slabs(format, width, height).acquire(); }
+
+private:
+    const uint32_t max_slabs_per_size_;
+    std::mutex mutex_;
+    std::map<std::tuple<FrameFormat, int, int>, std::unique_ptr<FrameSlabs>> slabs_;
+};
@@ -0,0 +1,269 @@
+#include "frame_scale.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#ifdef CPU_DISPATCH_X86
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    // Blends are 8 bit fixed point: out = (a * (256 - f) + b * f + 128) >> 8, identical in every kernel
+
+    void blendRowScalar(uint8_t *dst, const uint8_t *a, const uint8_t *b, int width, int f)
+    {
+        const int g = 256 - f;
+        for (int x = 0; x < width; x++)
+        {
+            dst[x] = static_cast<uint8_t>((a[x] * g + b[x] * f + 128) >> 8);
+        }
+    }
+
+    // Halving is a 2x2 box: dst[x] = (top[2x] + top[2x + 1] + bottom[2x] + bottom[2x + 1] + 2) >> 2, an odd last
+    // column averages with itself
+    void halveRowScalar(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, int width)
+    {
+        int x = 0;
+        for (; x + 1 < width; x += 2)
+        {
+            dst[x / 2] = static_cast<uint8_t>((top[x] + top[x + 1] + bottom[x] + bottom[x + 1] + 2) >> 2);
+        }
+        if (x < width)
+        {
+            dst[x / 2] = static_cast<uint8_t>((top[x] + bottom[x] + 1) >> 1);
+        }
+    }
+
+#ifdef CPU_DISPATCH_X86
+    __attribute__((target("sse2"))) void blendRowSse2(uint8_t *dst, const uint8_t *a, const uint8_t *b, int width, int f)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i wa = _mm_set1_epi16(static_cast<short>(256 - f));
+        const __m128i wb = _mm_set1_epi16(static_cast<short>(f));
+        const __m128i round = _mm_set1_epi16(128);
+        int x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + x));
+            const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + x));
+            __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa), _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+            __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa), _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_packus_epi16(lo, hi));
+        }
+        blendRowScalar(dst + x, a + x, b + x, width - x, f);
+    }
+
+    __attribute__((target("avx2"))) void blendRowAvx2(uint8_t *dst, const uint8_t *a, const uint8_t *b, int width, int f)
+    {
+        const __m256i wa = _mm256_set1_epi16(static_cast<short>(256 - f));
+        const __m256i wb = _mm256_set1_epi16(static_cast<short>(f));
+        const __m256i round = _mm256_set1_epi16(128);
+        int x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            // Widen 16 pixels to 16 bit lanes, no cross-lane shuffles needed on the way back
+            const __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + x)));
+            const __m256i vb = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + x)));
+            __m256i sum = _mm256_add_epi16(_mm256_mullo_epi16(va, wa), _mm256_mullo_epi16(vb, wb));
+            sum = _mm256_srli_epi16(_mm256_add_epi16(sum, round), 8);
+            const __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), packed);
+        }
+        blendRowScalar(dst + x, a + x, b + x, width - x, f);
+    }
+
+    // Each 16 bit lane adds its even and odd byte, which is the horizontal pair of one output
+    __attribute__((target("sse2"))) __m128i pairSums(__m128i top, __m128i bottom)
+    {
+        const __m128i mask = _mm_set1_epi16(0x00FF);
+        return _mm_add_epi16(_mm_add_epi16(_mm_and_si128(top, mask), _mm_srli_epi16(top, 8)),
+                             _mm_add_epi16(_mm_and_si128(bottom, mask), _mm_srli_epi16(bottom, 8)));
+    }
+
+    __attribute__((target("sse2"))) void halveRowSse2(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, int width)
+    {
+        const __m128i two = _mm_set1_epi16(2);
+        int x = 0;
+        for (; x + 32 <= width; x += 32)
+        {
+            __m128i lo = pairSums(_mm_loadu_si128(reinterpret_cast<const __m128i *>(top + x)),
+                                  _mm_loadu_si128(reinterpret_cast<const __m128i *>(bottom + x)));
+            __m128i hi = pairSums(_mm_loadu_si128(reinterpret_cast<const __m128i *>(top + x + 16)),
+                                  _mm_loadu_si128(reinterpret_cast<const __m128i *>(bottom + x + 16)));
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x / 2), _mm_packus_epi16(lo, hi));
+        }
+        halveRowScalar(dst + x / 2, top + x, bottom + x, width - x);
+    }
+
+    __attribute__((target("avx2"))) __m256i pairSums(__m256i top, __m256i bottom)
+    {
+        const __m256i mask = _mm256_set1_epi16(0x00FF);
+        return _mm256_add_epi16(_mm256_add_epi16(_mm256_and_si256(top, mask), _mm256_srli_epi16(top, 8)),
+                                _mm256_add_epi16(_mm256_and_si256(bottom, mask), _mm256_srli_epi16(bottom, 8)));
+    }
+
+    __attribute__((target("avx2"))) void halveRowAvx2(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, int width)
+    {
+        const __m256i two = _mm256_set1_epi16(2);
+        int x = 0;
+        for (; x + 64 <= width; x += 64)
+        {
+            __m256i lo = pairSums(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(top + x)),
+                                  _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bottom + x)));
+            __m256i hi = pairSums(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(top + x + 32)),
+                                  _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bottom + x + 32)));
+            lo = _mm256_srli_epi16(_mm256_add_epi16(lo, two), 2);
+            hi = _mm256_srli_epi16(_mm256_add_epi16(hi, two), 2);
+            // packus works within 128 bit lanes, the permute puts the quarters back in order
+            const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xD8);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x / 2), packed);
+        }
+        halveRowSse2(dst + x / 2, top + x, bottom + x, width - x);
+    }
+#endif
+
+    constexpr FrameScaleKernel KERNELS[] = {
+#ifdef CPU_DISPATCH_X86
+        {CpuFeature::Avx2, "avx2", blendRowAvx2, halveRowAvx2},
+        {CpuFeature::Sse2, "sse2", blendRowSse2, halveRowSse2},
+#endif
+        {CpuFeature::None, "scalar", blendRowScalar, halveRowScalar},
+    };
+
+    const FrameScaleKernel &activeKernel()
+    {
+        static const FrameScaleKernel &kernel = bestKernel(KERNELS);
+        return kernel;
+    }
+
+    // Maps output position i to the source sample left of (or above) its centre and the 8 bit weight of the next one
+    void samplePosition(int i, int src_size, int dst_size, int &index, int &weight)
+    {
+        const int64_t position = ((2 * static_cast<int64_t>(i) + 1) * src_size * 256) / (2 * dst_size) - 128;
+        if (position <= 0)
+        {
+            index = 0;
+            weight = 0;
+            return;
+        }
+        index = static_cast<int>(position >> 8);
+        weight = static_cast<int>(position & 0xFF);
+        if (index >= src_size - 1)
+        {
+            index = src_size - 1;
+            weight = 0;
+        }
+    }
+}
+
+void scalePlane(const uint8_t *src, int src_stride, int src_width, int src_height,
+                uint8_t *dst, int dst_stride, int dst_width, int dst_height)
+{
+    // Scalers run on several encode threads at once, each keeps its own scratch space
+    thread_local std::vector<uint8_t> halved[2];
+    thread_local std::vector<uint8_t> row;
+    thread_local std::vector<int> x_index;
+    thread_local std::vector<uint16_t> x_weight;
+
+    // Two taps only see every source sample down to 2:1, anything smaller is halved by 2x2 boxes until it is within
+    // 2:1 of the output, so fine detail averages out instead of aliasing
+    const FrameScaleKernel &kernel = activeKernel();
+    int next = 0;
+    while (src_width > 2 * dst_width || src_height > 2 * dst_height)
+    {
+        const bool halve_x = src_width > 2 * dst_width;
+        const bool halve_y = src_height > 2 * dst_height;
+        const int width = halve_x ? (src_width + 1) / 2 : src_width;
+        const int height = halve_y ? (src_height + 1) / 2 : src_height;
+        std::vector<uint8_t> &out = halved[next];
+        out.resize(static_cast<size_t>(width) * height);
+        for (int y = 0; y < height; y++)
+        {
+            const int sy = halve_y ? 2 * y : y;
+            const uint8_t *top = src + static_cast<size_t>(sy) * src_stride;
+            const uint8_t *bottom = halve_y ? src + static_cast<size_t>(std::min(sy + 1, src_height - 1)) * src_stride : top;
+            if (halve_x)
+            {
+                kernel.halve(out.data() + static_cast<size_t>(y) * width, top, bottom, src_width);
+            }
+            else
+            {
+                kernel.blend(out.data() + static_cast<size_t>(y) * width, top, bottom, src_width, 128);
+            }
+        }
+        src = out.data();
+        src_stride = width;
+        src_width = width;
+        src_height = height;
+        next ^= 1;
+    }
+
+    if (src_width == dst_width && src_height == dst_height)
+    {
+        for (int y = 0; y < dst_height; y++)
+        {
+            std::memcpy(dst + static_cast<size_t>(y) * dst_stride, src + static_cast<size_t>(y) * src_stride, dst_width);
+        }
+        return;
+    }
+
+    row.resize(src_width + 1);
+    x_index.resize(dst_width);
+    x_weight.resize(dst_width);
+
+    for (int x = 0; x < dst_width; x++)
+    {
+        int index;
+        int weight;
+        samplePosition(x, src_width, dst_width, index, weight);
+        x_index[x] = index;
+        x_weight[x] = weight;
+    }
+
+    for (int y = 0; y < dst_height; y++)
+    {
+        int sy;
+        int fy;
+        samplePosition(y, src_height, dst_height, sy, fy);
+        const uint8_t *a = src + static_cast<size_t>(sy) * src_stride;
+        if (fy == 0)
+        {
+            std::memcpy(row.data(), a, src_width);
+        }
+        else
+        {
+            kernel.blend(row.data(), a, a + src_stride, src_width, fy);
+        }
+        row[src_width] = row[src_width - 1]; // the last column blends with itself
+
+        uint8_t *out = dst + static_cast<size_t>(y) * dst_stride;
+        for (int x = 0; x < dst_width; x++)
+        {
+            const int sx = x_index[x];
+            const int fx = x_weight[x];
+            out[x] = static_cast<uint8_t>((row[sx] * (256 - fx) + row[sx + 1] * fx + 128) >> 8);
+        }
+    }
+}
+
+void scaleFrame(const PooledFrame &src, const PooledFrame &dst)
+{
+    scalePlane(src.plane(0), src.stride(0), src.width(), src.height(),
+               dst.plane(0), dst.stride(0), dst.width(), dst.height());
+    for (int i = 1; i < 3; i++)
+    {
+        scalePlane(src.plane(i), src.stride(i), (src.width() + 1) / 2, (src.height() + 1) / 2,
+                   dst.plane(i), dst.stride(i), (dst.width() + 1) / 2, (dst.height() + 1) / 2);
+    }
+}
+
+std::vector<FrameScaleKernel> frameScaleKernels()
+{
+    return supportedKernels(KERNELS);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "cpu_dispatch.h"
+#include "frame_pool.h"
+
+// Downscaling for the ABR ladder, every rendition is scaled from the one generated source frame.
+// Planes more than 2:1 larger than the output are first halved by 2x2 box averages, then scaled the rest of the way
+// bilinearly: each output row is a vertical blend of two source rows followed by a horizontal blend of that row.
+// Halving and the vertical blend do most of the work and use the best kernels the CPU supports (AVX2, SSE2 or plain
+// C++).
+
+void scalePlane(const uint8_t *src, int src_stride, int src_width, int src_height,
+                uint8_t *dst, int dst_stride, int dst_width, int dst_height);
+
+// Scales all three planes of an I420 frame into dst, which is already sized for the output
+void scaleFrame(const PooledFrame &src, const PooledFrame &dst);
+
+struct FrameScaleKernel
+{
+    CpuFeature feature;
+    const char *name;
+    // dst[x] = (a[x] * (256 - f) + b[x] * f + 128) >> 8
+    void (*blend)(uint8_t *dst, const uint8_t *a, const uint8_t *b, int width, int f);
+    // dst[x] = (top[2x] + top[2x + 1] + bottom[2x] + bottom[2x + 1] + 2) >> 2 for the (width + 1) / 2 outputs
+    void (*halve)(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, int width);
+};
+
+// The kernels this CPU can run, best first: scalePlane uses the first, the last is plain C++
+std::vector<FrameScaleKernel> frameScaleKernels();
@@ -0,0 +1,436 @@
+#include "hls.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include "logger.h"
+#include "xor_texture.h"
+
+void wrapX264Picture(const PooledFrame &frame, x264_picture_t *pic)
+{
+    x264_picture_init(pic);
+    pic->img.i_csp = X264_CSP_I420;
+    pic->img.i_plane = 3;
+    for (int i = 0; i < 3; i++)
+    {
+        pic->img.plane[i] = frame.plane(i);
+        pic->img.i_stride[i] = frame.stride(i);
+    }
+}
+
+void fillXorTexture(x264_picture_t *pic, int width, int height, int time)
+{
+    fillXorPlanes(pic->img.plane[0], pic->img.i_stride[0],
+                  pic->img.plane[1], pic->img.i_stride[1],
+                  pic->img.plane[2], pic->img.i_stride[2],
+                  width, height, time);
+}
+
+PooledFrame generateXorTexture(x264_picture_t *pic, int width, int height, int time)
+{
+    PooledFrame frame = FramePool::shared().acquire(FrameFormat::I420, width, height);
+    if (!frame)
+    {
+        std::cerr << "Failed to allocate picture" << std::endl;
+        return frame;
+    }
+
+    wrapX264Picture(frame, pic);
+    fillXorTexture(pic, width, height, time);
+    logTrace("XOR texture for time {} in picture {}", time, pic);
+    return frame;
+}
+
+x264_t *openHLSEncoder(int width, int height, int bitrate, int threads, const char *preset, bool mb_info)
+{
+    x264_param_t param;
+    x264_param_default_preset(&param, preset, "zerolatency");
+    if (threads > 0)
+    {
+        param.i_threads = threads;
+    }
+    param.i_csp = X264_CSP_I420;
+    param.i_width = width;
+    param.i_height = height;
+    param.i_fps_num = FRAME_RATE;
+    param.i_fps_den = 1;
+    param.b_vfr_input = 0;
+    param.b_repeat_headers = 1; // SPS/PPS in front of every IDR so each segment decodes on its own
+    param.b_annexb = 1;
+    param.i_keyint_max = FRAMES_PER_SEGMENT;
+    param.i_scenecut_threshold = 0; // no extra keyframes in the middle of a segment
+    param.analyse.b_mb_info = mb_info;
+    if (bitrate > 0)
+    {
+        // Capped so a rendition never needs more than the bandwidth the master playlist advertises for it
+        param.rc.i_rc_method = X264_RC_ABR;
+        param.rc.i_bitrate = bitrate;
+        param.rc.i_vbv_max_bitrate = bitrate;
+        param.rc.i_vbv_buffer_size = bitrate;
+    }
+    if (x264_param_apply_profile(&param, "high") < 0)
+    {
+        std::cerr << "Failed to apply profile restrictions" << std::endl;
+    }
+
+    return x264_encoder_open(&param);
+}
+
+bool reconfigureHLSEncoder(x264_t *encoder, const char *preset)
+{
+    x264_param_t target;
+    if (x264_param_default_preset(&target, preset, "zerolatency") < 0)
+    {
+        std::cerr << "Unknown x264 preset " << preset << std::endl;
+        return false;
+    }
+    x264_param_t param;
+    x264_encoder_parameters(encoder, &param);
+    param.i_frame_reference = target.i_frame_reference;
+    param.b_deblocking_filter = target.b_deblocking_filter;
+    param.analyse.intra = target.analyse.intra;
+    param.analyse.inter = target.analyse.inter;
+    param.analyse.b_transform_8x8 = target.analyse.b_transform_8x8;
+    param.analyse.i_me_method = target.analyse.i_me_method;
+    param.analyse.i_me_range = target.analyse.i_me_range;
+    param.analyse.i_subpel_refine = target.analyse.i_subpel_refine;
+    param.analyse.b_mixed_references = target.analyse.b_mixed_references;
+    param.analyse.i_trellis = target.analyse.i_trellis;
+    param.analyse.b_fast_pskip = target.analyse.b_fast_pskip;
+    param.analyse.b_dct_decimate = target.analyse.b_dct_decimate;
+    param.rc.i_aq_mode = target.rc.i_aq_mode;
+    if (x264_encoder_reconfig(encoder, &param) < 0)
+    {
+        std::cerr << "Failed to switch encoder to preset " << preset << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::vector<uint8_t> encoderHeaders(x264_t *encoder)
+{
+    std::vector<uint8_t> headers;
+    x264_nal_t *nals;
+    int i_nals;
+    if (x264_encoder_headers(encoder, &nals, &i_nals) < 0)
+    {
+        std::cerr << "Failed to get encoder headers" << std::endl;
+        return headers;
+    }
+    for (int i = 0; i < i_nals; i++)
+    {
+        headers.insert(headers.end(), nals[i].p_payload, nals[i].p_payload + nals[i].i_payload);
+    }
+    return headers;
+}
+
+// Size of the scratch buffer the muxer fills before handing data to writePacket, a whole number of 188 byte TS packets
+const int TS_AVIO_BUFFER_SIZE = 188 * 174;
+
+SegmentMuxer::SegmentMuxer(Container container, int width, int height, const std::vector<uint8_t> &extradata)
+    : container_(container), output_(std::make_shared<ChunkedBuffer>())
+{
+    const char *format = container == Container::Fmp4 ? "mp4" : "mpegts";
+    avformat_alloc_output_context2(&outctx_, nullptr, format, nullptr);
+    if (!outctx_)
+    {
+        std::cerr << "Failed to allocate " << format << " context" << std::endl;
+        return;
+    }
+
+    stream_ = avformat_new_stream(outctx_, nullptr);
+    stream_->time_base.num = 1;
+    stream_->time_base.den = FRAME_RATE;
+
+    stream_->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    stream_->codecpar->codec_id = AV_CODEC_ID_H264;
+    stream_->codecpar->width = width;
+    stream_->codecpar->height = height;
+
+    if (container == Container::Fmp4)
+    {
+        // The moov (and its avcC) is written up front, the muxer turns the Annex B SPS/PPS into avcC itself
+        stream_->codecpar->extradata = static_cast<uint8_t *>(av_mallocz(extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+        if (!stream_->codecpar->extradata)
+        {
+            std::cerr << "Failed to allocate extradata" << std::endl;
+            close();
+            return;
+        }
+        std::copy(extradata.begin(), extradata.end(), stream_->codecpar->extradata);
+        stream_->codecpar->extradata_size = extradata.size();
+    }
+
+    uint8_t *avio_buffer = static_cast<uint8_t *>(av_malloc(TS_AVIO_BUFFER_SIZE));
+    avio_ = avio_alloc_context(avio_buffer, TS_AVIO_BUFFER_SIZE, 1, this, nullptr, &SegmentMuxer::writePacket, nullptr);
+    if (!avio_)
+    {
+        std::cerr << "Failed to allocate " << format << " io context" << std::endl;
+        av_free(avio_buffer);
+        close();
+        return;
+    }
+    outctx_->pb = avio_;
+    outctx_->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    AVDictionary *options = nullptr;
+    if (container == Container::Fmp4)
+    {
+        // empty_moov: the header is a self contained init segment, nothing is ever seeked back to.
+        // frag_custom: fragments are only cut when we flush, which cutPart does after every frame.
+        av_dict_set(&options, "movflags", "empty_moov+default_base_moof+frag_custom+cmaf", 0);
+    }
+    if (avformat_write_header(outctx_, &options) < 0)
+    {
+        std::cerr << "Failed to write " << format << " header" << std::endl;
+        close();
+    }
+    av_dict_free(&options);
+}
+
+SegmentMuxer::~SegmentMuxer()
+{
+    close();
+}
+
+int SegmentMuxer::writePacket(void *opaque, AvioWriteBuffer buf, int buf_size)
+{
+    static_cast<SegmentMuxer *>(opaque)->output_->append(buf, buf_size);
+    return buf_size;
+}
+
+void SegmentMuxer::close()
+{
+    if (avio_)
+    {
+        av_freep(&avio_->buffer);
+        avio_context_free(&avio_);
+    }
+    if (outctx_)
+    {
+        avformat_free_context(outctx_);
+        outctx_ = nullptr;
+    }
+}
+
+bool SegmentMuxer::writeFrame(x264_nal_t *nals, int i_nals, int64_t pts, int64_t dts, bool keyframe)
+{
+    if (i_nals <= 0)
+    {
+        return false;
+    }
+    int size = 0;
+    for (int j = 0; j < i_nals; j++)
+    {
+        size += nals[j].i_payload;
+    }
+    return writeData(nals[0].p_payload, size, pts, dts, keyframe);
+}
+
+bool SegmentMuxer::writeData(const uint8_t *data, int size, int64_t pts, int64_t dts, bool keyframe)
+{
+    if (!outctx_ || size <= 0)
+    {
+        return false;
+    }
+
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    pkt.data = const_cast<uint8_t *>(data); // only read by the muxer
+    pkt.size = size;
+    pkt.stream_index = stream_->index;
+    if (keyframe)
+    {
+        pkt.flags |= AV_PKT_FLAG_KEY;
+    }
+
+    // Both muxers pick their own stream time base in avformat_write_header (90kHz for mpegts)
+    pkt.pts = av_rescale_q(pts, (AVRational){1, FRAME_RATE}, stream_->time_base);
+    pkt.dts = av_rescale_q(dts, (AVRational){1, FRAME_RATE}, stream_->time_base);
+    logTrace("pkt dts: {} pts: {}", pkt.dts, pkt.pts);
+    // fMP4 needs every sample's duration up front since each fragment is written as soon as the frame is in
+    pkt.duration = av_rescale_q(1, (AVRational){1, FRAME_RATE}, stream_->time_base);
+
+    if (av_interleaved_write_frame(outctx_, &pkt) != 0)
+    {
+        std::cerr << "Failed to write frame" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+ChunkedBufferPtr SegmentMuxer::cutPart()
+{
+    if (!outctx_)
+    {
+        return nullptr;
+    }
+
+    // Push out anything still buffered in the muxer and the AVIO scratch buffer so the part ends on a whole TS packet.
+    // For fMP4 the null packet writes out the pending fragment (moof + mdat).
+    av_write_frame(outctx_, nullptr);
+    avio_flush(avio_);
+
+    if (output_->empty())
+    {
+        return nullptr;
+    }
+    ChunkedBufferPtr part = std::move(output_);
+    output_ = std::make_shared<ChunkedBuffer>();
+    if (container_ == Container::MpegTs)
+    {
+        parts_.push_back(part); // an fMP4 stream is never finished into one segment, don't hold on to its fragments
+    }
+    return part;
+}
+
+ChunkedBufferPtr SegmentMuxer::finish(ChunkedBufferPtr *last_part)
+{
+    if (!outctx_)
+    {
+        return nullptr;
+    }
+
+    av_write_trailer(outctx_);
+    avio_flush(avio_);
+    close();
+
+    if (!output_->empty())
+    {
+        parts_.push_back(output_);
+        if (last_part)
+        {
+            *last_part = output_;
+        }
+    }
+    output_.reset();
+
+    auto segment = std::make_shared<ChunkedBuffer>();
+    for (const ChunkedBufferPtr &part : parts_)
+    {
+        segment->appendChunks(*part);
+    }
+    parts_.clear();
+    return segment->empty() ? nullptr : segment;
+}
+
+// TODO: instead of using x264 codec use the avformat codec for the frames
+ChunkedBufferPtr encodeHLSSegment(x264_t *encoder, int width, int height, int64_t pts_offset, int64_t &encoder_pts, bool *drained)
+{
+    logDebug("Generating HLS segment at frame {}", pts_offset);
+
+    SegmentMuxer muxer(Container::MpegTs, width, height);
+    if (!muxer.ok())
+    {
+        return nullptr;
+    }
+
+    x264_picture_t in_pic;
+    x264_picture_t out_pic;
+
+    // The encoder counts in its own pts, shift them back to the segment's place in the stream when muxing
+    const int64_t pts_shift = pts_offset - encoder_pts;
+
+    int64_t num_frames = FRAMES_PER_SEGMENT; // The number of frames in a segment
+    logTrace("Encoding {} frames", num_frames);
+    for (int64_t i = pts_offset; i < pts_offset + num_frames; i++)
+    {
+        PooledFrame frame = generateXorTexture(&in_pic, width, height, i);
+        if (!frame)
+        {
+            break;
+        }
+
+        in_pic.i_pts = i - pts_shift;
+        in_pic.i_type = i == pts_offset ? X264_TYPE_IDR : X264_TYPE_AUTO; // every segment decodes on its own
+        logTrace("Encoding frame {} pts {}", i, in_pic.i_pts);
+
+        x264_nal_t *nals; // Network abstraction layer, essentially these are groups of packets
+        int i_nals;
+
+        int frame_size = x264_encoder_encode(encoder, &nals, &i_nals, &in_pic, &out_pic); // Encode the frame
+        if (frame_size < 0)
+        {
+            std::cerr << "Failed to encode frame" << std::endl;
+        }
+        else if (frame_size > 0) // 0 means the frame was buffered
+        {
+            // Mux the encoded frame into the stream
+            if (muxer.writeFrame(nals, i_nals, out_pic.i_pts + pts_shift, out_pic.i_dts + pts_shift, out_pic.b_keyframe))
+            {
+                logTrace("Wrote frame {}", i);
+            }
+        }
+    }
+    encoder_pts += num_frames;
+
+    // Flush the encoder. With the zerolatency tune nothing is ever held back, so this normally has nothing to do
+    // and the encoder can go straight on with another segment.
+    logTrace("Flushing encoder");
+    if (drained)
+    {
+        *drained = x264_encoder_delayed_frames(encoder) > 0;
+    }
+    while (x264_encoder_delayed_frames(encoder))
+    {
+        x264_nal_t *nals;
+        int i_nals;
+
+        int frame_size = x264_encoder_encode(encoder, &nals, &i_nals, NULL, &out_pic);
+        if (frame_size < 0)
+        {
+            std::cerr << "Encoder failed while flushing" << std::endl;
+            break;
+        }
+        else if (frame_size > 0)
+        { // Mux the remaining encoded frames into the stream
+            muxer.writeFrame(nals, i_nals, out_pic.i_pts + pts_shift, out_pic.i_dts + pts_shift, out_pic.b_keyframe);
+        }
+    }
+    logTrace("Flushing complete");
+
+    return muxer.finish();
+}
+
+ChunkedBufferPtr generateHLSSegment(int width, int height, int64_t pts_offset)
+{
+    // Initialize the encoder
+    x264_t *encoder = openHLSEncoder(width, height);
+    if (!encoder)
+    {
+        std::cerr << "Failed to open encoder" << std::endl;
+        return nullptr;
+    }
+
+    int64_t encoder_pts = pts_offset;
+    ChunkedBufferPtr segment = encodeHLSSegment(encoder, width, height, pts_offset, encoder_pts);
+
+    x264_encoder_close(encoder);
+    logTrace("Encoder closed");
+
+    return segment;
+}
+
+bool saveSegmentToFile(const ChunkedBuffer &segment, const std::string &filename)
+{
+    std::ofstream outfile(filename, std::ios::out | std::ios::binary);
+    if (!outfile)
+    {
+        std::cerr << "Could not open file for writing: " << filename << std::endl;
+        return false;
+    }
+
+    // Written chunk by chunk, the segment is never flattened into one buffer
+    for (const ChunkPtr &chunk : segment.chunks())
+    {
+        outfile.write(reinterpret_cast<const char *>(chunk->data), chunk->size);
+    }
+    outfile.close();
+    if (!outfile)
+    {
+        std::cerr << "Could not write " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <x264.h>
+
+#include "chunked_buffer.h"
+#include "frame_pool.h"
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+const int FRAME_RATE = 30;       // fps
+const int SEGMENT_DURATION = 10; // in seconds
+const int FRAMES_PER_SEGMENT = FRAME_RATE * SEGMENT_DURATION;
+
+// Point an x264 picture at the planes of a pooled frame, x264 copies the input during encode so the frame can go back afterwards
+void wrapX264Picture(const PooledFrame &frame, x264_picture_t *pic);
+
+// Fill an already allocated I420 picture with a XOR texture
+void fillXorTexture(x264_picture_t *pic, int width, int height, int time);
+// Take a frame from the shared pool, fill it with a XOR texture and point pic at it.
+// pic is only valid while the returned frame is alive.
+PooledFrame generateXorTexture(x264_picture_t *pic, int width, int height, int time);
+
+// x264 presets from best quality to fastest, the speed levels adaptive encoders step through (see speed_controller.h)
+const char *const HLS_SPEED_PRESETS[] = {"medium", "fast", "faster", "veryfast", "superfast", "ultrafast"};
+const int HLS_SPEED_LEVELS = sizeof(HLS_SPEED_PRESETS) / sizeof(HLS_SPEED_PRESETS[0]);
+const int HLS_DEFAULT_SPEED = 1; // "fast"
+
+// Opens an x264 encoder set up for HLS: IDR frames only every FRAMES_PER_SEGMENT frames so segments can be cut on them.
+// bitrate (kbit/s) switches from constant quality to VBV constrained ABR, threads 0 lets x264 pick.
+// mb_info has x264 read the pictures' prop.mb_info, so macroblocks flagged X264_MBINFO_CONSTANT are skipped cheaply.
+x264_t *openHLSEncoder(int width, int height, int bitrate = 0, int threads = 0, const char *preset = HLS_SPEED_PRESETS[HLS_DEFAULT_SPEED], bool mb_info = false);
+
+// Switches an open encoder to the analysis settings of another preset, between frames.
+// Only what x264_encoder_reconfig can change goes across: motion search, partitions, subpel refinement, trellis,
+// reference count (never above what the encoder was opened with), deblocking and AQ. Open with the slowest preset
+// that will be used so the slower levels have something to go back to.
+bool reconfigureHLSEncoder(x264_t *encoder, const char *preset);
+
+// Encodes the self contained segment starting at frame pts_offset with an encoder that is already open, starting on a forced IDR.
+// encoder_pts is the encoder's own clock, which has to keep going up from one call to the next, it is advanced past the segment.
+// drained is set if the encoder had frames held back that had to be flushed, it can't be fed any more frames after that.
+// Returns nullptr if the segment couldn't be made.
+ChunkedBufferPtr encodeHLSSegment(x264_t *encoder, int width, int height, int64_t pts_offset, int64_t &encoder_pts, bool *drained = nullptr);
+
+// Same with an encoder of its own, returns nullptr if the segment couldn't be made
+ChunkedBufferPtr generateHLSSegment(int width, int height, int64_t pts_offset = 0);
+
+// False (and says why on stderr) if the file couldn't be opened or written in full
+bool saveSegmentToFile(const ChunkedBuffer &segment, const std::string &filename);
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+using AvioWriteBuffer = const uint8_t *;
+#else
+using AvioWriteBuffer = uint8_t *;
+#endif
+
+enum class Container
+{
+    MpegTs, // one self contained .ts file per segment
+    Fmp4,   // CMAF: an init segment (ftyp + moov) followed by one moof/mdat fragment per frame
+};
+
+// Collects the SPS/PPS the encoder will use, fMP4 needs them in the moov before the first frame is written
+std::vector<uint8_t> encoderHeaders(x264_t *encoder);
+
+// Muxes encoded H.264 frames into in memory segments.
+// The muxer writes through a custom AVIOContext straight into pooled chunks, which become the finished segment as is.
+// An mpegts muxer makes one segment, an fMP4 muxer runs for the whole stream: the first cut is the init segment
+// and every frame written after that is flushed as its own fragment.
+class SegmentMuxer
+{
+public:
+    // extradata is only used (and required) for Container::Fmp4
+    SegmentMuxer(Container container, int width, int height, const std::vector<uint8_t> &extradata = {});
+    ~SegmentMuxer();
+
+    SegmentMuxer(const SegmentMuxer &) = delete;
+    SegmentMuxer &operator=(const SegmentMuxer &) = delete;
+
+    bool ok() const { return outctx_ != nullptr; }
+
+    // pts and dts are in frames (1/FRAME_RATE). x264 guarantees the NAL payloads of a frame are contiguous,
+    // so the whole frame is written as one packet.
+    bool writeFrame(x264_nal_t *nals, int i_nals, int64_t pts, int64_t dts, bool keyframe);
+
+    // Same for a frame that was encoded earlier and kept as one Annex B buffer
+    bool writeData(const uint8_t *data, int size, int64_t pts, int64_t dts, bool keyframe);
+
+    // Ends the current partial segment and returns the bytes written since the previous cut (nullptr if there are none).
+    // The parts of a segment are plain byte ranges of it, played back to back they are the segment.
+    ChunkedBufferPtr cutPart();
+
+    // Writes the trailer and returns the finished segment (nullptr on failure), the muxer can't be used afterwards.
+    // The segment shares its chunks with the parts already cut, last_part gets whatever came after the last cut.
+    ChunkedBufferPtr finish(ChunkedBufferPtr *last_part = nullptr);
+
+private:
+    static int writePacket(void *opaque, AvioWriteBuffer buf, int buf_size);
+    void close();
+
+    const Container container_;
+    AVFormatContext *outctx_ = nullptr;
+    AVIOContext *avio_ = nullptr;
+    AVStream *stream_ = nullptr;
+    std::shared_ptr<ChunkedBuffer> output_; // bytes since the last cut
+    std::vector<ChunkedBufferPtr> parts_;
+};
@@ -0,0 +1,142 @@
+#include "hls_batch.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "work_stealing_pool.h"
+
+int64_t encodeHLSBatch(const HlsBatchConfig &config, const SegmentWriter &write)
+{
+    const size_t threads = config.threads > 0 ? config.threads : std::max(1u, std::thread::hardware_concurrency());
+    const int64_t max_in_flight = config.max_in_flight > 0 ? config.max_in_flight : 2 * threads;
+    const int64_t first = config.first_segment;
+    const int64_t last = config.first_segment + config.segment_count;
+
+    // One encoder per worker, opened the first time the worker needs it and reused for every segment it picks up.
+    // Parallelism comes from running whole segments side by side, so each encoder gets a single thread.
+    struct WorkerEncoder
+    {
+        x264_t *encoder = nullptr;
+        int64_t pts = 0;
+    };
+    std::vector<WorkerEncoder> encoders(threads);
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::map<int64_t, ChunkedBufferPtr> finished; // done but not written yet, a null segment failed
+
+    WorkStealingPool pool(threads);
+    auto encode = [&](int64_t index, size_t worker)
+    {
+        WorkerEncoder &slot = encoders[worker];
+        if (!slot.encoder)
+        {
+            slot.encoder = openHLSEncoder(config.width, config.height, 0, 1);
+            slot.pts = 0;
+        }
+
+        ChunkedBufferPtr segment;
+        if (slot.encoder)
+        {
+            bool drained = false;
+            segment = encodeHLSSegment(slot.encoder, config.width, config.height, index * FRAMES_PER_SEGMENT, slot.pts, &drained);
+            if (drained)
+            {
+                x264_encoder_close(slot.encoder);
+                slot.encoder = nullptr;
+            }
+        }
+        else
+        {
+            std::cerr << "Failed to open encoder" << std::endl;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished[index] = std::move(segment);
+        }
+        cv.notify_all();
+    };
+
+    int64_t next_submit = first;
+    int64_t next_write = first;
+    while (next_write < last)
+    {
+        while (next_submit < last && next_submit - next_write < max_in_flight)
+        {
+            const int64_t index = next_submit++;
+            pool.submit([&encode, index](size_t worker)
+                        { encode(index, worker); });
+        }
+
+        ChunkedBufferPtr segment;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]
+                    { return finished.count(next_write) > 0; });
+            segment = std::move(finished[next_write]);
+            finished.erase(next_write);
+        }
+
+        if (!segment)
+        {
+            std::cerr << "Failed to encode segment " << next_write << std::endl;
+            break;
+        }
+        if (!write(next_write, *segment))
+        {
+            break;
+        }
+        next_write++;
+    }
+
+    pool.wait();
+    for (WorkerEncoder &slot : encoders)
+    {
+        if (slot.encoder)
+        {
+            x264_encoder_close(slot.encoder);
+        }
+    }
+    return next_write - first;
+}
+
+bool writeHLSBatch(const HlsBatchConfig &config, const std::string &dir)
+{
+    const int64_t written = encodeHLSBatch(config, [&](int64_t index, const ChunkedBuffer &segment)
+    { return saveSegmentToFile(segment, dir + "/segment_" + std::to_string(index) + ".ts"); });
+
+    const std::string filename = dir + "/playlist_vod.m3u8";
+    std::ofstream playlist(filename);
+    if (!playlist)
+    {
+        std::cerr << "Could not open file for writing: " << filename << std::endl;
+        return false;
+    }
+    playlist << "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:" << SEGMENT_DURATION << "\n";
+    playlist << "#EXT-X-PLAYLIST-TYPE:VOD\n#EXT-X-MEDIA-SEQUENCE:" << config.first_segment << "\n";
+    for (int64_t index = config.first_segment; index < config.first_segment + written; index++)
+    {
+        playlist << "#EXTINF:" << SEGMENT_DURATION << ".0,\nsegment_" << index << ".ts\n";
+    }
+    playlist << "#EXT-X-ENDLIST\n";
+    playlist.close();
+    if (!playlist)
+    {
+        std::cerr << "Could not write " << filename << std::endl;
+        return false;
+    }
+
+    if (written != config.segment_count)
+    {
+        std::cerr << "Only " << written << " of " << config.segment_count << " segments were written" << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "hls.h"
+
+struct HlsBatchConfig
+{
+    int width = 1280;
+    int height = 720;
+    int64_t first_segment = 0;
+    int64_t segment_count = 360; // an hour
+    int threads = 0;             // encode workers, 0 for one per core
+    int max_in_flight = 0;       // segments encoded or being encoded but not written yet, 0 for twice the workers
+};
+
+// Gets each finished segment in index order, returning false stops the batch
+using SegmentWriter = std::function<bool(int64_t index, const ChunkedBuffer &segment)>;
+
+// Offline (VOD/backfill) encoding: every segment is a closed GOP starting at index * FRAMES_PER_SEGMENT,
+// so a range of them is encoded concurrently on a work-stealing pool, each worker reusing one single threaded encoder.
+// Segments finish in any order but are handed to write in order, at most max_in_flight of them are held in memory.
+// Returns the number of segments written, the batch stops at the first one that fails.
+int64_t encodeHLSBatch(const HlsBatchConfig &config, const SegmentWriter &write);
+
+// Encodes the batch into segment_N.ts files in dir, plus a VOD playlist (playlist_vod.m3u8) listing them.
+// Stops at the first segment that fails to encode or write, the playlist then lists the ones before it and this
+// returns false.
+bool writeHLSBatch(const HlsBatchConfig &config, const std::string &dir);
@@ -0,0 +1,957 @@
+#include "hls_producer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <iostream>
+#include <memory>
+
+#include "frame_scale.h"
+#include "logger.h"
+#include "metrics.h"
+#include "speed_controller.h"
+#include "thread_pool.h"
+#include "xor_texture.h"
+
+namespace
+{
+    // Only the most recent segments keep their partial segments in the low latency playlist
+    const int LL_PART_SEGMENTS = 2;
+
+    // Added to the QP of macroblocks that didn't change, whatever x264 doesn't skip of them isn't worth many bits
+    const float STATIC_QP_OFFSET = 4.0f;
+
+    std::string formatDuration(double seconds)
+    {
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.5f", seconds);
+        return buffer;
+    }
+
+    std::string partName(int64_t index, int part)
+    {
+        return "segment_" + std::to_string(index) + ".part_" + std::to_string(part) + ".ts";
+    }
+
+    // fMP4 segments are cached next to the mpegts ones under their own stream name
+    std::string cmafStream(const std::string &stream)
+    {
+        return stream + ".m4s";
+    }
+}
+
+std::vector<RenditionConfig> defaultLadder()
+{
+    std::vector<RenditionConfig> ladder;
+    if (std::thread::hardware_concurrency() >= 8)
+    {
+        ladder.push_back({"1080p", 1920, 1080, 6000});
+    }
+    ladder.push_back({"720p", 1280, 720, 3000});
+    ladder.push_back({"480p", 854, 480, 1500});
+    ladder.push_back({"240p", 426, 240, 400});
+    return ladder;
+}
+
+std::vector<RenditionConfig> ingestLadder(int width, int height)
+{
+    // Same bits per pixel as the 1080p rung
+    const int bitrate = static_cast<int>(6000.0 * width * height / (1920 * 1080));
+    std::vector<RenditionConfig> ladder = {{"source", width, height, std::max(bitrate, 400)}};
+    for (const RenditionConfig &rung : defaultLadder())
+    {
+        if (rung.height < height)
+        {
+            ladder.push_back(rung);
+        }
+    }
+    return ladder;
+}
+
+struct HlsProducer::Encoder
+{
+    size_t rendition = 0;
+    int width = 0;
+    int height = 0;
+    x264_t *x264 = nullptr;
+    FrameSlabs *slabs = nullptr; // frames the source is scaled into
+    x264_picture_t in_pic;
+    x264_picture_t out_pic;
+
+    int64_t idr_index = -1; // segment the last forced IDR started
+
+    std::unique_ptr<SpeedController> speed; // with adaptive_speed
+
+    // With skip_static, which macroblocks changed at this rendition's size and the hints x264 gets from it.
+    // The same buffers go out with every frame, which holds because zerolatency x264 is done with them when encode returns.
+    DirtyMap changes;
+    std::vector<uint8_t> mb_info;
+    std::vector<float> quant_offsets;
+
+    std::unique_ptr<SegmentMuxer> muxer;
+    int64_t muxer_index = -1;
+
+    std::unique_ptr<SegmentMuxer> cmaf_muxer;
+    std::shared_ptr<LiveBuffer> cmaf_segment;
+    int64_t cmaf_index = -1;
+
+    ~Encoder()
+    {
+        if (x264)
+        {
+            x264_encoder_close(x264);
+        }
+    }
+};
+
+HlsProducer::HlsProducer(const HlsProducerConfig &config, SegmentCache &cache, SegmentStore *store)
+    : config_(config), cache_(cache), store_(store)
+{
+    for (const RenditionConfig &rendition : config_.renditions)
+    {
+        Rendition r;
+        r.config = rendition;
+        renditions_.push_back(std::move(r));
+    }
+}
+
+HlsProducer::~HlsProducer()
+{
+    stop();
+}
+
+void HlsProducer::start()
+{
+    if (running_.exchange(true))
+    {
+        return;
+    }
+    // A thread that gave up on its own has cleared running_ but still has to be joined
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+    thread_ = std::thread(&HlsProducer::run, this);
+}
+
+void HlsProducer::stop()
+{
+    // Joins even when running_ is already false, run() clears it itself when the encoder fails to open
+    if (running_.exchange(false))
+    {
+        cv_.notify_all();
+    }
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+}
+
+size_t HlsProducer::findRendition(const std::string &name) const
+{
+    if (name.empty())
+    {
+        return renditions_.empty() ? NO_RENDITION : 0;
+    }
+    for (size_t i = 0; i < renditions_.size(); i++)
+    {
+        if (renditions_[i].config.name == name)
+        {
+            return i;
+        }
+    }
+    return NO_RENDITION;
+}
+
+std::string HlsProducer::masterPlaylist(const std::string &media_playlist) const
+{
+    std::string content = "#EXTM3U\n#EXT-X-INDEPENDENT-SEGMENTS\n";
+    for (const Rendition &rendition : renditions_)
+    {
+        const RenditionConfig &rc = rendition.config;
+        // A little over the encoder's cap to leave room for the container
+        content += "#EXT-X-STREAM-INF:BANDWIDTH=" + std::to_string(rc.bitrate * 1100) +
+                   ",RESOLUTION=" + std::to_string(rc.width) + "x" + std::to_string(rc.height) +
+                   ",FRAME-RATE=" + std::to_string(FRAME_RATE) + ".000\n";
+        content += rc.name + "/" + media_playlist + "\n";
+    }
+    return content;
+}
+
+PlaylistSnapshotPtr HlsProducer::playlist(size_t r)
+{
+    const Rendition &rendition = renditions_[r];
+    if (PlaylistSnapshotPtr playlist = std::atomic_load(&rendition.live_playlist))
+    {
+        return playlist;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    // Give the producer time to finish the very first segment instead of handing out an empty playlist
+    cv_.wait_for(lock, std::chrono::seconds(SEGMENT_DURATION), [&]
+                 { return !rendition.window.empty() || !running_; });
+    if (PlaylistSnapshotPtr playlist = std::atomic_load(&rendition.live_playlist))
+    {
+        return playlist;
+    }
+    return PlaylistSnapshot::make(renderLiveLocked(rendition));
+}
+
+bool HlsProducer::lowLatencyPlaylist(size_t r, int64_t msn, int part, PlaylistSnapshotPtr &playlist)
+{
+    const Rendition &rendition = renditions_[r];
+    // Blocking reloads ask for a part that usually doesn't exist yet, only plain reloads can skip the lock
+    if (msn < 0 && (playlist = std::atomic_load(&rendition.low_latency_playlist)))
+    {
+        return true;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (msn >= 0)
+    {
+        // https://datatracker.ietf.org/doc/html/draft-pantos-hls-rfc8216bis#section-6.2.5.2
+        if (msn > newestIndexLocked(rendition) + 2)
+        {
+            return false;
+        }
+        // Hold the request until the part exists, but never longer than three target durations
+        cv_.wait_for(lock, std::chrono::seconds(3 * SEGMENT_DURATION), [&]
+                     { return partReadyLocked(rendition, msn, part) || !running_; });
+    }
+    else
+    {
+        cv_.wait_for(lock, std::chrono::seconds(SEGMENT_DURATION), [&]
+                     { return !rendition.window.empty() || !rendition.pending.parts.empty() || !running_; });
+    }
+
+    playlist = std::atomic_load(&rendition.low_latency_playlist);
+    if (!playlist)
+    {
+        playlist = PlaylistSnapshot::make(renderLowLatencyLocked(rendition));
+    }
+    return true;
+}
+
+SegmentCache::ValuePtr HlsProducer::segment(size_t r, int64_t index)
+{
+    // Every published segment goes into the cache, which also keeps the ones that just slid out of the window for a
+    // while. Looking there first makes each request count towards the cache's hit rate and keeps its LRU order honest.
+    if (SegmentCache::ValuePtr cached = cache_.find(segmentKey(r, config_.stream, index)))
+    {
+        return cached;
+    }
+
+    // The window still has it if the cache had to evict it early
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &entry : renditions_[r].window)
+    {
+        if (entry.index == index)
+        {
+            return entry.data;
+        }
+    }
+    return nullptr;
+}
+
+std::string HlsProducer::dvrPlaylist(size_t r)
+{
+    if (!store_)
+    {
+        return "";
+    }
+    const std::string &name = renditions_[r].config.name;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait_for(lock, std::chrono::seconds(SEGMENT_DURATION), [&]
+                     { return !renditions_[r].window.empty() || !running_; });
+    }
+
+    const std::vector<int64_t> indices = store_->indices(name);
+    std::string content = "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:" + std::to_string(SEGMENT_DURATION) + "\n";
+    // An event playlist may only ever grow. Once retention deletes segments this is a long sliding window instead.
+    if (!store_->evicted(name))
+    {
+        content += "#EXT-X-PLAYLIST-TYPE:EVENT\n";
+    }
+    content += "#EXT-X-MEDIA-SEQUENCE:" + std::to_string(indices.empty() ? 0 : indices.front()) + "\n";
+    for (size_t i = 0; i < indices.size(); i++)
+    {
+        if (i > 0 && indices[i] != indices[i - 1] + 1)
+        {
+            content += "#EXT-X-DISCONTINUITY\n"; // the store dropped segments, the timestamps jump
+        }
+        content += "#EXTINF:" + std::to_string(SEGMENT_DURATION) + ".0,\nsegment_" + std::to_string(indices[i]) + ".ts\n";
+    }
+    return content;
+}
+
+MappedFilePtr HlsProducer::storedSegment(size_t r, int64_t index) const
+{
+    return store_ ? store_->map(renditions_[r].config.name, index) : nullptr;
+}
+
+ChunkedBufferPtr HlsProducer::part(size_t r, int64_t index, int part)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    const Rendition &rendition = renditions_[r];
+
+    // A client following the preload hint asks for the next part before it exists, hold it until the part is published.
+    // Anything that isn't about to be made is answered straight away.
+    cv_.wait_for(lock, std::chrono::seconds(SEGMENT_DURATION), [&]
+                 {
+                     const int64_t newest = newestIndexLocked(rendition);
+                     return partReadyLocked(rendition, index, part) || index < newest || index > newest + 1 || !running_; });
+
+    if (rendition.pending.index == index && part < static_cast<int>(rendition.pending.parts.size()))
+    {
+        return rendition.pending.parts[part];
+    }
+    for (const auto &entry : rendition.window)
+    {
+        if (entry.index == index && part < static_cast<int>(entry.parts.size()))
+        {
+            return entry.parts[part];
+        }
+    }
+    return nullptr;
+}
+
+PlaylistSnapshotPtr HlsProducer::cmafPlaylist(size_t r)
+{
+    const Rendition &rendition = renditions_[r];
+    if (PlaylistSnapshotPtr playlist = std::atomic_load(&rendition.cmaf_playlist))
+    {
+        return playlist;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait_for(lock, std::chrono::seconds(SEGMENT_DURATION), [&]
+                 { return !rendition.cmaf_window.empty() || !config_.cmaf || !running_; });
+    if (PlaylistSnapshotPtr playlist = std::atomic_load(&rendition.cmaf_playlist))
+    {
+        return playlist;
+    }
+    return PlaylistSnapshot::make(renderCmafLocked(rendition));
+}
+
+ChunkedBufferPtr HlsProducer::cmafInit(size_t r)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    const Rendition &rendition = renditions_[r];
+    cv_.wait_for(lock, std::chrono::seconds(SEGMENT_DURATION), [&]
+                 { return rendition.cmaf_init || !config_.cmaf || !running_; });
+    return rendition.cmaf_init;
+}
+
+std::shared_ptr<const LiveBuffer> HlsProducer::cmafSegment(size_t r, int64_t index)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        const Rendition &rendition = renditions_[r];
+        // A player that has caught up asks for the next segment before it is started, hold it until it is
+        cv_.wait_for(lock, std::chrono::seconds(SEGMENT_DURATION), [&]
+                     {
+                         const int64_t newest = rendition.cmaf_window.empty() ? -1 : rendition.cmaf_window.back().index;
+                         return index <= newest || index > newest + 1 || !config_.cmaf || !running_; });
+        for (const auto &entry : rendition.cmaf_window)
+        {
+            if (entry.index == index)
+            {
+                return entry.data;
+            }
+        }
+    }
+
+    SegmentCache::ValuePtr cached = cache_.find(segmentKey(r, cmafStream(config_.stream), index));
+    if (!cached)
+    {
+        return nullptr;
+    }
+    auto segment = std::make_shared<LiveBuffer>();
+    segment->append(std::move(cached));
+    segment->finish();
+    return segment;
+}
+
+SegmentKey HlsProducer::segmentKey(size_t r, const std::string &stream, int64_t index) const
+{
+    const RenditionConfig &rc = renditions_[r].config;
+    return SegmentKey{stream, rc.width, rc.height, index};
+}
+
+// A whole segment counts as every one of its parts being ready
+bool HlsProducer::partReadyLocked(const Rendition &rendition, int64_t msn, int part) const
+{
+    if (!rendition.window.empty() && rendition.window.back().index >= msn)
+    {
+        return true;
+    }
+    return part >= 0 && rendition.pending.index == msn && part < static_cast<int>(rendition.pending.parts.size());
+}
+
+int64_t HlsProducer::newestIndexLocked(const Rendition &rendition) const
+{
+    if (rendition.pending.index >= 0)
+    {
+        return rendition.pending.index;
+    }
+    return rendition.window.empty() ? -1 : rendition.window.back().index;
+}
+
+double HlsProducer::partDuration(int part) const
+{
+    const int frames = std::min(config_.part_frames, FRAMES_PER_SEGMENT - part * config_.part_frames);
+    return static_cast<double>(frames) / FRAME_RATE;
+}
+
+std::string HlsProducer::renderLiveLocked(const Rendition &rendition) const
+{
+    std::string content = "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:" + std::to_string(SEGMENT_DURATION) + "\n";
+    content += "#EXT-X-MEDIA-SEQUENCE:" + std::to_string(rendition.media_sequence) + "\n";
+    for (const auto &entry : rendition.window)
+    {
+        content += "#EXTINF:" + std::to_string(SEGMENT_DURATION) + ".0,\nsegment_" + std::to_string(entry.index) + ".ts\n";
+    }
+    return content;
+}
+
+std::string HlsProducer::renderLowLatencyLocked(const Rendition &rendition) const
+{
+    const double part_target = static_cast<double>(config_.part_frames) / FRAME_RATE;
+
+    std::string content = "#EXTM3U\n#EXT-X-VERSION:6\n#EXT-X-TARGETDURATION:" + std::to_string(SEGMENT_DURATION) + "\n";
+    content += "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=" + formatDuration(3 * part_target) + "\n";
+    content += "#EXT-X-PART-INF:PART-TARGET=" + formatDuration(part_target) + "\n";
+    content += "#EXT-X-MEDIA-SEQUENCE:" + std::to_string(rendition.media_sequence) + "\n";
+
+    auto addParts = [&](const SegmentEntry &entry)
+    {
+        for (size_t i = 0; i < entry.parts.size(); i++)
+        {
+            content += "#EXT-X-PART:DURATION=" + formatDuration(partDuration(i)) + ",URI=\"" + partName(entry.index, i) + "\"";
+            content += i == 0 ? ",INDEPENDENT=YES\n" : "\n"; // every segment starts on an IDR
+        }
+    };
+
+    const int64_t newest = newestIndexLocked(rendition);
+    for (const auto &entry : rendition.window)
+    {
+        if (entry.index > newest - LL_PART_SEGMENTS)
+        {
+            addParts(entry);
+        }
+        content += "#EXTINF:" + std::to_string(SEGMENT_DURATION) + ".0,\nsegment_" + std::to_string(entry.index) + ".ts\n";
+    }
+
+    int64_t hint_index = 0;
+    int hint_part = 0;
+    if (rendition.pending.index >= 0)
+    {
+        addParts(rendition.pending);
+        hint_index = rendition.pending.index;
+        hint_part = rendition.pending.parts.size();
+    }
+    else if (!rendition.window.empty())
+    {
+        hint_index = rendition.window.back().index + 1;
+    }
+    content += "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"" + partName(hint_index, hint_part) + "\"\n";
+    return content;
+}
+
+std::string HlsProducer::renderCmafLocked(const Rendition &rendition) const
+{
+    const int64_t sequence = rendition.cmaf_window.empty() ? 0 : rendition.cmaf_window.front().index;
+    std::string content = "#EXTM3U\n#EXT-X-VERSION:7\n#EXT-X-TARGETDURATION:" + std::to_string(SEGMENT_DURATION) + "\n";
+    content += "#EXT-X-MEDIA-SEQUENCE:" + std::to_string(sequence) + "\n";
+    content += "#EXT-X-MAP:URI=\"init.mp4\"\n";
+    for (const auto &entry : rendition.cmaf_window)
+    {
+        content += "#EXTINF:" + std::to_string(SEGMENT_DURATION) + ".0,\nsegment_" + std::to_string(entry.index) + ".m4s\n";
+    }
+    return content;
+}
+
+void HlsProducer::publishPart(size_t r, int64_t index, ChunkedBufferPtr part)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Rendition &rendition = renditions_[r];
+        SegmentEntry &pending = rendition.pending;
+        if (pending.index != index)
+        {
+            pending = SegmentEntry();
+            pending.index = index;
+        }
+        pending.parts.push_back(std::move(part));
+        std::atomic_store(&rendition.low_latency_playlist, PlaylistSnapshot::make(renderLowLatencyLocked(rendition)));
+    }
+    cv_.notify_all();
+}
+
+void HlsProducer::publishSegment(size_t r, int64_t index, ChunkedBufferPtr data, ChunkedBufferPtr last_part)
+{
+    const std::string &name = renditions_[r].config.name;
+    if (store_)
+    {
+        store_->store(name, index, data);
+    }
+    pipelineMetrics().segment_bytes.observe(data->size());
+    cache_.put(segmentKey(r, config_.stream, index), data);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Rendition &rendition = renditions_[r];
+        SegmentEntry entry;
+        if (rendition.pending.index == index)
+        {
+            entry = std::move(rendition.pending);
+        }
+        entry.index = index;
+        entry.data = std::move(data);
+        if (config_.part_frames > 0 && last_part)
+        {
+            entry.parts.push_back(std::move(last_part));
+        }
+        rendition.pending = SegmentEntry();
+
+        rendition.window.push_back(std::move(entry));
+        while (rendition.window.size() > static_cast<size_t>(config_.window_size))
+        {
+            rendition.window.pop_front();
+        }
+        rendition.media_sequence = rendition.window.front().index;
+        std::atomic_store(&rendition.live_playlist, PlaylistSnapshot::make(renderLiveLocked(rendition)));
+        std::atomic_store(&rendition.low_latency_playlist, PlaylistSnapshot::make(renderLowLatencyLocked(rendition)));
+    }
+    cv_.notify_all();
+
+    logDebug("Published {} segment {}", name, index);
+}
+
+std::shared_ptr<LiveBuffer> HlsProducer::startCmafSegment(size_t r, int64_t index)
+{
+    auto segment = std::make_shared<LiveBuffer>();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Rendition &rendition = renditions_[r];
+        std::deque<CmafEntry> &cmaf_window = rendition.cmaf_window;
+        cmaf_window.push_back(CmafEntry{index, segment});
+        // window_size finished segments plus the one being encoded
+        while (cmaf_window.size() > static_cast<size_t>(config_.window_size) + 1)
+        {
+            cmaf_window.pop_front();
+        }
+        std::atomic_store(&rendition.cmaf_playlist, PlaylistSnapshot::make(renderCmafLocked(rendition)));
+    }
+    cv_.notify_all();
+    return segment;
+}
+
+void HlsProducer::finishCmafSegment(size_t r, int64_t index, LiveBuffer &segment)
+{
+    segment.finish();
+    if (ChunkedBufferPtr whole = segment.whole())
+    {
+        cache_.put(segmentKey(r, cmafStream(config_.stream), index), whole);
+    }
+}
+
+bool HlsProducer::openEncoder(size_t r, Encoder &encoder, int threads)
+{
+    const RenditionConfig &rc = renditions_[r].config;
+    encoder.rendition = r;
+    encoder.width = rc.width;
+    encoder.height = rc.height;
+    encoder.slabs = &FramePool::shared().slabs(FrameFormat::I420, rc.width, rc.height);
+
+    // Adaptive encoders open on the slowest preset, so stepping back to it later has everything it needs
+    encoder.x264 = openHLSEncoder(rc.width, rc.height, rc.bitrate, threads, config_.adaptive_speed ? HLS_SPEED_PRESETS[0] : HLS_SPEED_PRESETS[HLS_DEFAULT_SPEED],
+                                  config_.skip_static && !config_.ingest.empty());
+    if (!encoder.x264)
+    {
+        std::cerr << "Failed to open encoder for " << rc.name << std::endl;
+        return false;
+    }
+    if (config_.adaptive_speed)
+    {
+        SpeedControllerConfig speed;
+        speed.frame_budget = 1.0 / FRAME_RATE;
+        speed.min_level = 0;
+        speed.max_level = HLS_SPEED_LEVELS - 1;
+        speed.start_level = HLS_DEFAULT_SPEED;
+        encoder.speed = std::make_unique<SpeedController>(speed, "h264_" + rc.name);
+        reconfigureHLSEncoder(encoder.x264, HLS_SPEED_PRESETS[encoder.speed->level()]);
+    }
+
+    if (config_.cmaf)
+    {
+        encoder.cmaf_muxer = std::make_unique<SegmentMuxer>(Container::Fmp4, rc.width, rc.height, encoderHeaders(encoder.x264));
+        ChunkedBufferPtr init = encoder.cmaf_muxer->ok() ? encoder.cmaf_muxer->cutPart() : nullptr;
+        if (init)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            renditions_[r].cmaf_init = std::move(init);
+        }
+        else
+        {
+            std::cerr << "Failed to start the fMP4 stream for " << rc.name << std::endl;
+            encoder.cmaf_muxer.reset();
+        }
+    }
+    return true;
+}
+
+void HlsProducer::encodeFrame(Encoder &encoder, const PooledFrame &source, int64_t frame, const DirtyMap *changes)
+{
+    // Scaling and muxing count against the frame budget too, only the encoder can make up for them
+    const auto start = std::chrono::steady_clock::now();
+    PooledFrame scaled;
+    const PooledFrame *input = &source;
+    if (source.width() != encoder.width || source.height() != encoder.height)
+    {
+        scaled = encoder.slabs->acquire();
+        if (!scaled)
+        {
+            std::cerr << "Failed to allocate scaled frame" << std::endl;
+            return;
+        }
+        scaleFrame(source, scaled);
+        input = &scaled;
+    }
+
+    wrapX264Picture(*input, &encoder.in_pic);
+    encoder.in_pic.i_pts = frame;
+    // Every rendition gets its IDRs on the same frames, so their segments line up.
+    // That is the first frame of each segment, which for ingested frames isn't always the one on the boundary.
+    const int64_t index = frame / FRAMES_PER_SEGMENT;
+    encoder.in_pic.i_type = index != encoder.idr_index ? X264_TYPE_IDR : X264_TYPE_AUTO;
+    encoder.idr_index = index;
+
+    if (changes)
+    {
+        // Unchanged macroblocks are flagged constant, x264 skips them without a motion search, and lose quality
+        // where they aren't skipped. A frame where nothing changed comes out as a P frame of nothing but skips.
+        changes->scaleTo(encoder.width, encoder.height, encoder.changes);
+        const size_t macroblocks = encoder.changes.dirty.size();
+        encoder.mb_info.resize(macroblocks);
+        encoder.quant_offsets.resize(macroblocks);
+        for (size_t mb = 0; mb < macroblocks; mb++)
+        {
+            const bool dirty = encoder.changes.dirty[mb] != 0;
+            encoder.mb_info[mb] = dirty ? 0 : X264_MBINFO_CONSTANT;
+            encoder.quant_offsets[mb] = dirty ? 0.0f : STATIC_QP_OFFSET;
+        }
+        encoder.in_pic.prop.mb_info = encoder.mb_info.data();
+        encoder.in_pic.prop.quant_offsets = encoder.quant_offsets.data();
+    }
+
+    x264_nal_t *nals;
+    int i_nals;
+    int frame_size;
+    {
+        ScopedTimer timer(pipelineMetrics().h264_encode_seconds);
+        frame_size = x264_encoder_encode(encoder.x264, &nals, &i_nals, &encoder.in_pic, &encoder.out_pic);
+    }
+    if (frame_size < 0)
+    {
+        std::cerr << "Failed to encode frame" << std::endl;
+    }
+    else if (frame_size > 0)
+    {
+        ScopedTimer timer(pipelineMetrics().mux_seconds);
+        mux(encoder, nals, i_nals);
+    }
+
+    if (encoder.speed && encoder.speed->record(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()))
+    {
+        logInfo("{} encoder now on preset {}", renditions_[encoder.rendition].config.name, HLS_SPEED_PRESETS[encoder.speed->level()]);
+        reconfigureHLSEncoder(encoder.x264, HLS_SPEED_PRESETS[encoder.speed->level()]);
+    }
+}
+
+// Frames come out of the encoder in the same order they went in, but possibly later.
+// A new segment starts on the forced IDR at each segment boundary and ends after its last frame,
+// or when the next one starts if that frame never came (ingested frames can leave gaps).
+// Partial segments are cut every part_frames frames in between.
+// The fMP4 stream is cut the same way, except that every frame is flushed into the live segment as its own fragment.
+void HlsProducer::mux(Encoder &encoder, x264_nal_t *nals, int i_nals)
+{
+    const x264_picture_t &out_pic = encoder.out_pic;
+    const size_t r = encoder.rendition;
+    const int64_t index = out_pic.i_pts / FRAMES_PER_SEGMENT;
+    const int position = out_pic.i_pts % FRAMES_PER_SEGMENT + 1;
+    const bool segment_start = out_pic.b_keyframe && index != encoder.muxer_index;
+
+    if (encoder.cmaf_muxer)
+    {
+        if (encoder.cmaf_segment && encoder.cmaf_index != index)
+        {
+            finishCmafSegment(r, encoder.cmaf_index, *encoder.cmaf_segment);
+            encoder.cmaf_segment.reset();
+        }
+        if (segment_start)
+        {
+            encoder.cmaf_segment = startCmafSegment(r, index);
+            encoder.cmaf_index = index;
+        }
+        if (encoder.cmaf_segment && encoder.cmaf_index == index)
+        {
+            encoder.cmaf_muxer->writeFrame(nals, i_nals, out_pic.i_pts, out_pic.i_dts, out_pic.b_keyframe);
+            encoder.cmaf_segment->append(encoder.cmaf_muxer->cutPart());
+            if (position == FRAMES_PER_SEGMENT)
+            {
+                finishCmafSegment(r, index, *encoder.cmaf_segment);
+                encoder.cmaf_segment.reset();
+            }
+        }
+    }
+
+    if (encoder.muxer && encoder.muxer_index != index)
+    {
+        finishSegment(encoder);
+    }
+    if (segment_start)
+    {
+        encoder.muxer = std::make_unique<SegmentMuxer>(Container::MpegTs, encoder.width, encoder.height);
+        encoder.muxer_index = index;
+    }
+    if (!encoder.muxer || encoder.muxer_index != index)
+    {
+        return;
+    }
+
+    encoder.muxer->writeFrame(nals, i_nals, out_pic.i_pts, out_pic.i_dts, out_pic.b_keyframe);
+
+    if (position == FRAMES_PER_SEGMENT)
+    {
+        finishSegment(encoder);
+    }
+    else if (config_.part_frames > 0 && position % config_.part_frames == 0)
+    {
+        ChunkedBufferPtr part = encoder.muxer->cutPart();
+        if (part)
+        {
+            publishPart(r, index, std::move(part));
+        }
+    }
+}
+
+void HlsProducer::finishSegment(Encoder &encoder)
+{
+    ChunkedBufferPtr last_part;
+    ChunkedBufferPtr data = encoder.muxer->finish(&last_part);
+    encoder.muxer.reset();
+    if (data)
+    {
+        publishSegment(encoder.rendition, encoder.muxer_index, std::move(data), std::move(last_part));
+    }
+}
+
+struct HlsProducer::IngestSource
+{
+    std::unique_ptr<IngestReader> reader;
+    bool rebase = true;          // the next frame sets first_timestamp
+    uint64_t first_timestamp = 0; // camera time of output frame 0
+    int64_t last_frame = -1;
+    std::chrono::steady_clock::time_point last_arrival;
+};
+
+bool HlsProducer::nextIngestFrame(IngestSource &ingest, PooledFrame &source, int64_t &frame)
+{
+    static Counter &skipped = MetricsRegistry::shared().counter("acquire_ingest_skipped_frames_total",
+                                                                "Camera frames not encoded, dropped in the ring or landing on an output frame already taken");
+    while (running_)
+    {
+        if (!ingest.reader)
+        {
+            ingest.reader = IngestReader::open(config_.ingest, config_.ingest_policy, config_.ingest_backlog, config_.ingest_window);
+            if (!ingest.reader)
+            {
+                // The camera isn't up (yet), keep looking for its ring
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait_for(lock, std::chrono::seconds(1), [this]
+                             { return !running_; });
+                continue;
+            }
+            logInfo("Ingesting from {}", config_.ingest);
+            ingest.rebase = true;
+            ingest.last_arrival = std::chrono::steady_clock::now();
+        }
+
+        IngestFrame in;
+        const uint64_t dropped = ingest.reader->dropped();
+        const bool got = ingest.reader->next(in, std::chrono::milliseconds(100));
+        skipped.add(ingest.reader->dropped() - dropped);
+        if (!got)
+        {
+            // A camera that restarted made a new ring, this one will never get another frame
+            if (std::chrono::steady_clock::now() - ingest.last_arrival > std::chrono::seconds(SEGMENT_DURATION))
+            {
+                logWarn("No frames from {}, reopening it", config_.ingest);
+                ingest.reader.reset();
+            }
+            continue;
+        }
+        ingest.last_arrival = std::chrono::steady_clock::now();
+
+        if (ingest.rebase)
+        {
+            // Output frame numbers carry on from before, whatever the new camera clock starts at
+            const uint64_t offset = static_cast<uint64_t>(ingest.last_frame + 1) * 1000000000 / FRAME_RATE;
+            ingest.first_timestamp = in.timestamp_ns >= offset ? in.timestamp_ns - offset : 0;
+            ingest.rebase = false;
+        }
+        if (in.timestamp_ns < ingest.first_timestamp)
+        {
+            skipped.add(1);
+            continue;
+        }
+        // Nearest output frame to the camera timestamp
+        const int64_t number = ((in.timestamp_ns - ingest.first_timestamp) * FRAME_RATE + 500000000) / 1000000000;
+        if (number <= ingest.last_frame)
+        {
+            skipped.add(1); // the camera runs faster than FRAME_RATE (or its clock went back)
+            continue;
+        }
+        ingest.last_frame = number;
+        source = std::move(in.frame);
+        frame = number;
+        return true;
+    }
+    return false;
+}
+
+void HlsProducer::run()
+{
+    const size_t count = renditions_.size();
+    const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    const size_t threads = config_.encode_threads > 0 ? config_.encode_threads : std::min(count, cores);
+    // x264's own threads share out the cores between the renditions
+    const int x264_threads = std::max<int>(1, cores / std::max<size_t>(count, 1));
+
+    std::vector<std::unique_ptr<Encoder>> encoders;
+    for (size_t r = 0; r < count; r++)
+    {
+        encoders.push_back(std::make_unique<Encoder>());
+        if (!openEncoder(r, *encoders.back(), x264_threads))
+        {
+            encoders.clear();
+            break;
+        }
+    }
+    if (encoders.empty())
+    {
+        running_ = false;
+        cv_.notify_all();
+        return;
+    }
+
+    const RenditionConfig &source_config = renditions_.front().config;
+    FrameSlabs &source_slabs = FramePool::shared().slabs(FrameFormat::I420, source_config.width, source_config.height);
+    ThreadPool pool(threads);
+    std::vector<std::future<void>> jobs;
+
+    PipelineMetrics &metrics = pipelineMetrics();
+    const auto start_time = std::chrono::steady_clock::now();
+    // Real time pacing happens once per segment, or once per part in low latency mode
+    const int pace_frames = config_.part_frames > 0 ? config_.part_frames : FRAMES_PER_SEGMENT;
+
+    std::unique_ptr<IngestSource> ingest;
+    std::unique_ptr<FrameDiff> diff;
+    if (!config_.ingest.empty())
+    {
+        ingest = std::make_unique<IngestSource>();
+        if (config_.skip_static)
+        {
+            diff = std::make_unique<FrameDiff>(config_.static_threshold);
+            logInfo("Skipping unchanged macroblocks of ingested frames, {} kernel", frameDiffKernels().front().name);
+        }
+    }
+
+    for (int64_t frame = 0; running_; frame++)
+    {
+        PooledFrame source;
+        if (ingest)
+        {
+            // The camera sets the pace, its frames are encoded straight out of the ring
+            if (!nextIngestFrame(*ingest, source, frame))
+            {
+                break;
+            }
+        }
+        else
+        {
+            if (frame % pace_frames == 0)
+            {
+                // Stay lead_segments ahead of real time instead of encoding as fast as possible
+                const auto due = start_time + std::chrono::microseconds(frame * 1000000 / FRAME_RATE) - std::chrono::seconds(config_.lead_segments * SEGMENT_DURATION);
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait_until(lock, due, [this]
+                               { return !running_; });
+                if (!running_)
+                {
+                    break;
+                }
+            }
+
+            // Generated once at the largest size, every rendition scales it down for itself
+            source = source_slabs.acquire();
+            if (!source)
+            {
+                break;
+            }
+            ScopedTimer timer(metrics.frame_synthesis_seconds);
+            fillXorPlanes(source.plane(0), source.stride(0),
+                          source.plane(1), source.stride(1),
+                          source.plane(2), source.stride(2),
+                          source.width(), source.height(), frame);
+        }
+
+        // Diffed once at the source size, every rendition maps it onto its own macroblocks
+        const DirtyMap *changes = nullptr;
+        if (diff)
+        {
+            changes = &diff->update(source);
+            const int macroblocks = changes->mb_width * changes->mb_height;
+            metrics.hls_static_macroblocks.add(macroblocks - changes->dirty_count);
+            if (changes->unchanged())
+            {
+                metrics.hls_static_frames.add(1);
+            }
+        }
+
+        jobs.clear();
+        for (auto &encoder : encoders)
+        {
+            Encoder *job_encoder = encoder.get();
+            jobs.push_back(pool.submit([this, job_encoder, &source, frame, changes]
+                                       { encodeFrame(*job_encoder, source, frame, changes); }));
+        }
+        for (auto &job : jobs)
+        {
+            job.get();
+        }
+        if (ingest)
+        {
+            // How long the frame took from arriving to being encoded everywhere
+            metrics.hls_lag_seconds.set(std::chrono::duration<double>(std::chrono::steady_clock::now() - ingest->last_arrival).count());
+        }
+        else
+        {
+            const auto frame_due = start_time + std::chrono::microseconds(frame * 1000000 / FRAME_RATE) - std::chrono::seconds(config_.lead_segments * SEGMENT_DURATION);
+            metrics.hls_lag_seconds.set(std::chrono::duration<double>(std::chrono::steady_clock::now() - frame_due).count());
+        }
+    }
+
+    for (auto &encoder : encoders)
+    {
+        if (encoder->cmaf_segment)
+        {
+            encoder->cmaf_segment->finish(); // let anyone still reading the unfinished segment go
+        }
+    }
+    encoders.clear();
+    cv_.notify_all();
+}
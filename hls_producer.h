@@ -0,0 +1,192 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "buffer_cache.h"
+#include "hls.h"
+#include "frame_diff.h"
+#include "ingest_ring.h"
+#include "playlist_snapshot.h"
+#include "segment_store.h"
+
+// One rung of the ABR ladder
+struct RenditionConfig
+{
+    std::string name; // path prefix of its playlists and segments, e.g. "720p"
+    int width;
+    int height;
+    int bitrate; // kbit/s
+};
+
+// 720p/480p/240p, with 1080p on top when there are enough cores to encode it in real time next to the others
+std::vector<RenditionConfig> defaultLadder();
+
+// For a camera: a "source" rendition at its own size, which the encoder reads straight out of the ingest ring,
+// then every rung of the default ladder below it
+std::vector<RenditionConfig> ingestLadder(int width, int height);
+
+struct HlsProducerConfig
+{
+    std::string stream = "xor";
+    std::vector<RenditionConfig> renditions = defaultLadder(); // largest first, source frames are generated at its size
+    int window_size = 6;    // segments listed in the live playlist
+    int lead_segments = 1;  // how many segments to have encoded ahead of real time
+    int part_frames = 10;   // frames per LL-HLS partial segment (333ms at 30fps), 0 disables partial segments
+    bool cmaf = true;       // also mux the same encode into fragmented MP4 (CMAF) segments
+    int encode_threads = 0; // threads encoding renditions in parallel, 0 for one per rendition (at most one per core)
+    bool adaptive_speed = true; // step each encoder's x264 preset with its encode time (see speed_controller.h), or stay on "fast"
+
+    // Shared memory ring (see ingest_ring.h) to take frames from instead of generating the XOR texture.
+    // Frames are placed on the FRAME_RATE grid by their camera timestamps, not by arrival.
+    std::string ingest;
+    IngestPolicy ingest_policy = IngestPolicy::DropOldest;
+    uint32_t ingest_backlog = 2; // frames DropOldest lets queue up before skipping ahead
+    PixelWindowConfig ingest_window; // 16 bit and Bayer frames down to 8 bits
+    // Diff every ingested frame against the frames before it (see frame_diff.h) and tell x264 which macroblocks
+    // didn't change, so an idle camera costs next to nothing to encode. Generated frames change everywhere, they aren't diffed.
+    bool skip_static = true;
+    uint32_t static_threshold = 128; // SAD a macroblock has to exceed to count as changed
+};
+
+// Runs one long lived x264 encoder per rendition and cuts the continuous encodes into HLS segments
+// on the IDR frames forced at every SEGMENT_DURATION boundary.
+// Every source frame is generated once, scaled down for each rendition and handed to all the encoders in parallel,
+// IDRs are forced on the same frames everywhere so segment N covers the same time in every rendition.
+// Finished segments are published into a sliding window (and the shared segment cache) before anyone asks for them,
+// and handed to the segment store if there is one, which keeps a much longer window on disk for time-shifted playback.
+// With part_frames set, every segment is also published piece by piece as LL-HLS partial segments while it is encoded.
+// With cmaf set, the same frames also go into an fMP4 stream with one fragment per frame,
+// its segments can be read while they are encoded.
+// With skip_static, ingested frames are diffed once at the source size and every encoder is told which of its
+// macroblocks didn't change, so a still scene comes out as P frames of skipped macroblocks.
+class HlsProducer
+{
+public:
+    static constexpr size_t NO_RENDITION = static_cast<size_t>(-1);
+
+    HlsProducer(const HlsProducerConfig &config, SegmentCache &cache, SegmentStore *store = nullptr);
+    ~HlsProducer();
+
+    void start();
+    void stop();
+
+    // Index of the rendition with this name, an empty name is the first (largest) one. NO_RENDITION if there is none.
+    size_t findRendition(const std::string &name) const;
+
+    // Lists every rendition, pointing at its media playlist of the given name (playlist.m3u8, playlist_ll.m3u8, ...)
+    std::string masterPlaylist(const std::string &media_playlist) const;
+
+    // The live playlist for the current window, waits for the first segment if none exist yet.
+    // Media playlists are rendered by the producer whenever their window changes, once it has published one
+    // this is a single atomic load.
+    PlaylistSnapshotPtr playlist(size_t rendition);
+
+    // The low latency playlist (partial segments, preload hint, blocking reload).
+    // With msn >= 0 this blocks until segment msn (or part `part` of it) is available, as asked for by _HLS_msn/_HLS_part.
+    // Returns false if the request is too far in the future to ever be answered in time.
+    bool lowLatencyPlaylist(size_t rendition, int64_t msn, int part, PlaylistSnapshotPtr &playlist);
+
+    // Returns the segment if it is still in the window (or the cache), nullptr otherwise
+    SegmentCache::ValuePtr segment(size_t rendition, int64_t index);
+
+    // Renders the DVR playlist: every segment the store holds, so players can seek back past the live window.
+    // Empty without a store.
+    std::string dvrPlaylist(size_t rendition);
+
+    // A segment from the store, for requests that are too old for segment(). nullptr if the store doesn't have it.
+    MappedFilePtr storedSegment(size_t rendition, int64_t index) const;
+
+    // Returns a partial segment, waiting for it if it is the next one to be made (a preload hint)
+    ChunkedBufferPtr part(size_t rendition, int64_t index, int part);
+
+    // The CMAF playlist, which lists the segment currently being encoded as its last entry
+    PlaylistSnapshotPtr cmafPlaylist(size_t rendition);
+
+    // The fMP4 init segment (ftyp + moov), nullptr if there is none (yet)
+    ChunkedBufferPtr cmafInit(size_t rendition);
+
+    // Returns an fMP4 segment, finished or still being written. Waits for it if it is the next one to be started.
+    // nullptr if it isn't in the window (or the cache).
+    std::shared_ptr<const LiveBuffer> cmafSegment(size_t rendition, int64_t index);
+
+    const HlsProducerConfig &config() const { return config_; }
+
+private:
+    struct SegmentEntry
+    {
+        int64_t index = -1;
+        ChunkedBufferPtr data; // null until the whole segment is done
+        std::vector<ChunkedBufferPtr> parts;
+    };
+
+    struct CmafEntry
+    {
+        int64_t index = -1;
+        std::shared_ptr<LiveBuffer> data;
+    };
+
+    // What gets published for one rendition, guarded by mutex_
+    struct Rendition
+    {
+        RenditionConfig config;
+        std::deque<SegmentEntry> window; // finished segments
+        SegmentEntry pending;            // segment currently being encoded
+        int64_t media_sequence = 0;
+
+        ChunkedBufferPtr cmaf_init;
+        std::deque<CmafEntry> cmaf_window; // the last entry is the segment being encoded until it is finished
+
+        // Rendered under mutex_ whenever the windows change, read without it.
+        // Only accessed through std::atomic_load/atomic_store, null until there is something to list.
+        PlaylistSnapshotPtr live_playlist;
+        PlaylistSnapshotPtr low_latency_playlist;
+        PlaylistSnapshotPtr cmaf_playlist;
+    };
+
+    // Encoder and muxer state of one rendition, only touched by whichever encode thread runs it
+    struct Encoder;
+
+    // The ingest ring and where its timestamps start, only touched by the producer thread
+    struct IngestSource;
+
+    void run();
+    // Next frame from the ingest ring and its number on the output frame grid, false once stopped
+    bool nextIngestFrame(IngestSource &ingest, PooledFrame &source, int64_t &frame);
+    bool openEncoder(size_t rendition, Encoder &encoder, int threads);
+    // changes is which of the source's macroblocks changed since the last frame, nullptr if not known
+    void encodeFrame(Encoder &encoder, const PooledFrame &source, int64_t frame, const DirtyMap *changes);
+    void mux(Encoder &encoder, x264_nal_t *nals, int i_nals);
+    void finishSegment(Encoder &encoder);
+
+    void publishPart(size_t rendition, int64_t index, ChunkedBufferPtr part);
+    void publishSegment(size_t rendition, int64_t index, ChunkedBufferPtr data, ChunkedBufferPtr last_part);
+    std::shared_ptr<LiveBuffer> startCmafSegment(size_t rendition, int64_t index);
+    void finishCmafSegment(size_t rendition, int64_t index, LiveBuffer &segment);
+
+    SegmentKey segmentKey(size_t rendition, const std::string &stream, int64_t index) const;
+    bool partReadyLocked(const Rendition &rendition, int64_t msn, int part) const;
+    int64_t newestIndexLocked(const Rendition &rendition) const;
+    double partDuration(int part) const;
+    std::string renderLiveLocked(const Rendition &rendition) const;
+    std::string renderLowLatencyLocked(const Rendition &rendition) const;
+    std::string renderCmafLocked(const Rendition &rendition) const;
+
+    const HlsProducerConfig config_;
+    SegmentCache &cache_;
+    SegmentStore *const store_;
+
+    std::thread thread_;
+    std::atomic<bool> running_{false};
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<Rendition> renditions_;
+};
@@ -0,0 +1,325 @@
+#include "http_range.h"
+
+#include <strings.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+namespace
+{
+    bool isSpace(char c)
+    {
+        return c == ' ' || c == '\t';
+    }
+
+    // The elements of a comma separated header list with the whitespace around them trimmed, empty ones included
+    template <typename F>
+    bool forEachListElement(const std::string &list, size_t pos, F &&f)
+    {
+        while (pos <= list.size())
+        {
+            size_t end = list.find(',', pos);
+            if (end == std::string::npos)
+            {
+                end = list.size();
+            }
+            size_t begin = pos;
+            while (begin < end && isSpace(list[begin]))
+            {
+                begin++;
+            }
+            size_t last = end;
+            while (last > begin && isSpace(list[last - 1]))
+            {
+                last--;
+            }
+            if (f(begin, last))
+            {
+                return true;
+            }
+            pos = end + 1;
+        }
+        return false;
+    }
+
+    // Digits from begin to end into value, saturating instead of overflowing. False if there are none or anything else.
+    bool parseDigits(const std::string &text, size_t begin, size_t end, uint64_t &value)
+    {
+        if (begin == end)
+        {
+            return false;
+        }
+        value = 0;
+        for (size_t i = begin; i < end; i++)
+        {
+            if (text[i] < '0' || text[i] > '9')
+            {
+                return false;
+            }
+            const uint64_t digit = text[i] - '0';
+            value = value > (UINT64_MAX - digit) / 10 ? UINT64_MAX : value * 10 + digit;
+        }
+        return true;
+    }
+
+    bool etagEquals(const std::string &text, size_t begin, size_t end, const std::string &etag)
+    {
+        return end - begin == etag.size() && text.compare(begin, end - begin, etag) == 0;
+    }
+
+    // If-Range needs a strong match (RFC 7233 section 3.2): a weak tag never matches, a date only the exact Last-Modified
+    bool ifRangeMatches(const std::string &if_range, const HttpValidators &validators)
+    {
+        if (if_range.compare(0, 2, "W/") == 0)
+        {
+            return false;
+        }
+        if (!if_range.empty() && if_range.front() == '"')
+        {
+            return !validators.etag.empty() && if_range == validators.etag;
+        }
+        std::time_t date;
+        return validators.modified != 0 && parseHttpDate(if_range, date) && date == validators.modified;
+    }
+
+    std::string boundary()
+    {
+        thread_local std::mt19937_64 rng(std::random_device{}());
+        char text[32];
+        std::snprintf(text, sizeof(text), "acquire-%016llx", static_cast<unsigned long long>(rng()));
+        return text;
+    }
+}
+
+RangePlan planRangeResponse(const RangeRequest &request, uint64_t size, const HttpValidators &validators)
+{
+    RangePlan plan;
+
+    // RFC 7232 section 6: If-Modified-Since only counts without If-None-Match
+    if (!request.if_none_match.empty())
+    {
+        if (!validators.etag.empty() && etagMatches(request.if_none_match, validators.etag))
+        {
+            plan.status = 304;
+            return plan;
+        }
+    }
+    else if (!request.if_modified_since.empty() && validators.modified != 0)
+    {
+        std::time_t since;
+        if (parseHttpDate(request.if_modified_since, since) && validators.modified <= since)
+        {
+            plan.status = 304;
+            return plan;
+        }
+    }
+
+    if (request.range.empty() || (!request.if_range.empty() && !ifRangeMatches(request.if_range, validators)))
+    {
+        return plan;
+    }
+    std::vector<ByteRange> ranges;
+    if (!parseByteRanges(request.range, size, ranges) || ranges.size() > MAX_BYTE_RANGES)
+    {
+        return plan;
+    }
+    if (ranges.empty())
+    {
+        plan.status = 416;
+        return plan;
+    }
+
+    std::vector<ByteRange> sorted = ranges;
+    std::sort(sorted.begin(), sorted.end(), [](const ByteRange &a, const ByteRange &b)
+              { return a.offset < b.offset; });
+    bool overlap = false;
+    for (size_t i = 1; i < sorted.size() && !overlap; i++)
+    {
+        overlap = sorted[i].offset < sorted[i - 1].offset + sorted[i - 1].length;
+    }
+    if (overlap)
+    {
+        ranges.clear();
+        for (const ByteRange &range : sorted)
+        {
+            if (!ranges.empty() && range.offset <= ranges.back().offset + ranges.back().length)
+            {
+                ranges.back().length = std::max(ranges.back().offset + ranges.back().length, range.offset + range.length) - ranges.back().offset;
+            }
+            else
+            {
+                ranges.push_back(range);
+            }
+        }
+    }
+
+    plan.status = 206;
+    plan.ranges = std::move(ranges);
+    return plan;
+}
+
+bool parseByteRanges(const std::string &header, uint64_t size, std::vector<ByteRange> &ranges)
+{
+    ranges.clear();
+    const size_t equals = header.find('=');
+    if (equals == std::string::npos || equals != 5 || strncasecmp(header.c_str(), "bytes", 5) != 0)
+    {
+        return false;
+    }
+
+    bool malformed = false;
+    size_t specs = 0;
+    forEachListElement(header, equals + 1, [&](size_t begin, size_t end)
+                       {
+                           if (begin == end)
+                           {
+                               return false; // empty list elements are allowed
+                           }
+                           specs++;
+                           const size_t dash = header.find('-', begin);
+                           if (dash == std::string::npos || dash >= end)
+                           {
+                               malformed = true;
+                               return true;
+                           }
+                           uint64_t first = 0;
+                           uint64_t last = 0;
+                           if (dash == begin)
+                           {
+                               // The last `last` bytes
+                               if (!parseDigits(header, dash + 1, end, last))
+                               {
+                                   malformed = true;
+                                   return true;
+                               }
+                               if (last > 0 && size > 0)
+                               {
+                                   const uint64_t length = std::min(last, size);
+                                   ranges.push_back({size - length, length});
+                               }
+                               return false;
+                           }
+                           if (!parseDigits(header, begin, dash, first))
+                           {
+                               malformed = true;
+                               return true;
+                           }
+                           if (dash + 1 == end)
+                           {
+                               last = UINT64_MAX;
+                           }
+                           else if (!parseDigits(header, dash + 1, end, last) || last < first)
+                           {
+                               malformed = true;
+                               return true;
+                           }
+                           if (first < size)
+                           {
+                               ranges.push_back({first, std::min(last, size - 1) - first + 1});
+                           }
+                           return false; });
+    if (malformed || specs == 0)
+    {
+        ranges.clear();
+        return false;
+    }
+    return true;
+}
+
+bool etagMatches(const std::string &if_none_match, const std::string &etag)
+{
+    return forEachListElement(if_none_match, 0, [&](size_t begin, size_t end)
+                              {
+                                  if (end - begin >= 2 && if_none_match.compare(begin, 2, "W/") == 0)
+                                  {
+                                      begin += 2;
+                                  }
+                                  return (end - begin == 1 && if_none_match[begin] == '*') || etagEquals(if_none_match, begin, end, etag); });
+}
+
+uint64_t hashBytes(const void *data, size_t size, uint64_t hash)
+{
+    // FNV-1a, only has to change when the bytes do
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+std::string formatEtag(uint64_t hash)
+{
+    char etag[24];
+    std::snprintf(etag, sizeof(etag), "\"%016llx\"", static_cast<unsigned long long>(hash));
+    return etag;
+}
+
+std::string fileEtag(uint64_t size, std::time_t modified)
+{
+    char etag[48];
+    std::snprintf(etag, sizeof(etag), "\"%llx-%llx\"", static_cast<unsigned long long>(modified), static_cast<unsigned long long>(size));
+    return etag;
+}
+
+std::string formatHttpDate(std::time_t time)
+{
+    std::tm tm;
+    gmtime_r(&time, &tm);
+    char text[32];
+    std::strftime(text, sizeof(text), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return text;
+}
+
+bool parseHttpDate(const std::string &text, std::time_t &time)
+{
+    static const char *const MONTHS[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    char weekday[4];
+    char month[4];
+    std::tm tm = {};
+    int consumed = 0;
+    if (std::sscanf(text.c_str(), "%3[A-Za-z], %2d %3s %4d %2d:%2d:%2d GMT%n", weekday, &tm.tm_mday, month, &tm.tm_year,
+                    &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &consumed) != 7 ||
+        static_cast<size_t>(consumed) != text.size())
+    {
+        return false;
+    }
+    tm.tm_mon = -1;
+    for (int i = 0; i < 12; i++)
+    {
+        if (std::strcmp(month, MONTHS[i]) == 0)
+        {
+            tm.tm_mon = i;
+        }
+    }
+    if (tm.tm_mon < 0)
+    {
+        return false;
+    }
+    tm.tm_year -= 1900;
+    time = timegm(&tm);
+    return true;
+}
+
+MultipartByteRanges multipartByteRanges(const std::vector<ByteRange> &ranges, uint64_t size, const std::string &content_type)
+{
+    MultipartByteRanges body;
+    const std::string separator = boundary();
+    body.content_type = "multipart/byteranges; boundary=" + separator;
+    for (size_t i = 0; i < ranges.size(); i++)
+    {
+        body.part_headers.push_back((i > 0 ? "\r\n--" : "--") + separator + "\r\nContent-Type: " + content_type +
+                                    "\r\nContent-Range: " + contentRange(ranges[i], size) + "\r\n\r\n");
+        body.length += body.part_headers.back().size() + ranges[i].length;
+    }
+    body.closing = "\r\n--" + separator + "--\r\n";
+    body.length += body.closing.size();
+    return body;
+}
+
+std::string contentRange(const ByteRange &range, uint64_t size)
+{
+    return "bytes " + std::to_string(range.offset) + "-" + std::to_string(range.offset + range.length - 1) + "/" + std::to_string(size);
+}
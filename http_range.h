@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+// Conditional and range requests (RFC 7232 and RFC 7233), independent of the HTTP server: works out which status and
+// which bytes a GET of a representation gets. Sending them is up to the caller, straight out of wherever the bytes
+// already live.
+
+// More ranges than this in one request are ignored and answered with the whole representation, as RFC 7233 section 6.1
+// allows, a header of thousands of tiny ranges would cost more to answer than the file
+const size_t MAX_BYTE_RANGES = 64;
+
+struct ByteRange
+{
+    uint64_t offset;
+    uint64_t length;
+};
+
+// What the representation can be validated with, either may be missing
+struct HttpValidators
+{
+    std::string etag;         // quoted strong ETag, empty if none
+    std::time_t modified = 0; // Last-Modified, 0 if unknown
+};
+
+// The request headers that decide the answer, empty if absent
+struct RangeRequest
+{
+    std::string range;
+    std::string if_range;
+    std::string if_none_match;
+    std::string if_modified_since;
+};
+
+struct RangePlan
+{
+    int status = 200; // 200, 206, 304 or 416
+    std::vector<ByteRange> ranges; // for a 206, one range or the parts of a multipart/byteranges body
+};
+
+// If-None-Match (or If-Modified-Since without it) first, then Range if If-Range lets it through.
+// A Range header that doesn't parse is ignored. One whose ranges all start past the end is a 416. Overlapping ranges
+// are merged in order of offset, otherwise they are answered in the order asked for.
+RangePlan planRangeResponse(const RangeRequest &request, uint64_t size, const HttpValidators &validators);
+
+// Parses a "bytes=" Range header against a representation of size bytes: suffix ("-500"), open ended ("100-") and
+// closed ranges, clipped to the end. Unsatisfiable ranges are left out. False if the header is malformed or not in bytes.
+bool parseByteRanges(const std::string &header, uint64_t size, std::vector<ByteRange> &ranges);
+
+// Whether an If-None-Match header lists etag, or is "*". Weak comparison (RFC 7232 section 2.3.2): W/ prefixes are ignored.
+bool etagMatches(const std::string &if_none_match, const std::string &etag);
+
+// Quoted strong ETag from a hash of the bytes, the same bytes get the same tag from any server.
+// Hashes can be chained over pieces by passing the previous hash back in.
+const uint64_t HASH_BYTES_SEED = 14695981039346656037ull;
+uint64_t hashBytes(const void *data, size_t size, uint64_t hash = HASH_BYTES_SEED);
+std::string formatEtag(uint64_t hash);
+
+// ETag of a file from its size and modification time, without reading it
+std::string fileEtag(uint64_t size, std::time_t modified);
+
+// IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"), the only format parseHttpDate accepts as well
+std::string formatHttpDate(std::time_t time);
+bool parseHttpDate(const std::string &text, std::time_t &time);
+
+// A multipart/byteranges body: the part headers go before each range's bytes, closing after the last one
+struct MultipartByteRanges
+{
+    std::string content_type; // multipart/byteranges with the boundary
+    std::vector<std::string> part_headers;
+    std::string closing;
+    uint64_t length = 0; // of the whole body
+};
+
+MultipartByteRanges multipartByteRanges(const std::vector<ByteRange> &ranges, uint64_t size, const std::string &content_type);
+
+// "bytes first-last/size" for Content-Range
+std::string contentRange(const ByteRange &range, uint64_t size);
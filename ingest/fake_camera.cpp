@@ -0,0 +1,298 @@
+// acquire-driver-fake-camera: stands in for the acquisition process, writing XOR texture frames into the
+// shared memory ingest ring that acquire-driver-web reads with ACQUIRE_INGEST set.
+//
+//   acquire-driver-fake-camera [--name /acquire-ingest] [--width 3840] [--height 2160] [--fps 30]
+//                              [--format gray8|i420|gray16|bayer16] [--bits 12] [--slots 8] [--duration 0] [--jitter 0]
+//                              [--still 0]
+//
+// Frames are drawn straight into their slot, the way a camera would DMA into it, and stamped with the steady clock.
+// The 16 bit formats squeeze the texture into part of a --bits deep range for auto-levels to find, bayer16 is an
+// RGGB mosaic with the red sites dimmed so there is some colour to see.
+// --jitter shifts each frame's timestamp by up to that many milliseconds either way, to exercise the timestamp
+// handling on the other side. --still 1 freezes the picture apart from a square in the middle, like a mostly idle
+// scene, for the static macroblock skipping on the other side. Every second it prints the frame rate and how many frames found no free slot.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ingest_ring.h"
+#include "xor_texture.h"
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct CameraConfig
+    {
+        std::string name = "/acquire-ingest";
+        int width = 3840;
+        int height = 2160;
+        double fps = 30;
+        IngestPixelType format = IngestPixelType::Gray8;
+        int bits = 12; // of the 16 bit formats
+        int slots = 8;
+        int duration = 0; // seconds, 0 runs until interrupted
+        int jitter = 0;   // milliseconds
+        bool still = false;
+    };
+
+    // Side of the square that keeps moving with --still
+    const int STILL_MOVING_SIZE = 256;
+
+    std::atomic<bool> running{true};
+
+    void stop(int)
+    {
+        running = false;
+    }
+
+    bool parseArgs(int argc, char *argv[], CameraConfig &config)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            const std::string arg = argv[i];
+            if (i + 1 >= argc)
+            {
+                std::cerr << "Missing value for " << arg << std::endl;
+                return false;
+            }
+            const std::string value = argv[++i];
+            if (arg == "--name")
+            {
+                config.name = value;
+            }
+            else if (arg == "--width")
+            {
+                config.width = std::atoi(value.c_str());
+            }
+            else if (arg == "--height")
+            {
+                config.height = std::atoi(value.c_str());
+            }
+            else if (arg == "--fps")
+            {
+                config.fps = std::atof(value.c_str());
+            }
+            else if (arg == "--format" && value == "gray8")
+            {
+                config.format = IngestPixelType::Gray8;
+            }
+            else if (arg == "--format" && value == "i420")
+            {
+                config.format = IngestPixelType::I420;
+            }
+            else if (arg == "--format" && value == "gray16")
+            {
+                config.format = IngestPixelType::Gray16;
+            }
+            else if (arg == "--format" && value == "bayer16")
+            {
+                config.format = IngestPixelType::BayerRGGB16;
+            }
+            else if (arg == "--bits")
+            {
+                config.bits = std::atoi(value.c_str());
+            }
+            else if (arg == "--slots")
+            {
+                config.slots = std::atoi(value.c_str());
+            }
+            else if (arg == "--duration")
+            {
+                config.duration = std::atoi(value.c_str());
+            }
+            else if (arg == "--jitter")
+            {
+                config.jitter = std::atoi(value.c_str());
+            }
+            else if (arg == "--still")
+            {
+                config.still = std::atoi(value.c_str()) != 0;
+            }
+            else
+            {
+                std::cerr << "Unknown argument: " << arg << " " << value << std::endl;
+                return false;
+            }
+        }
+        return config.width > 0 && config.height > 0 && config.fps > 0 && config.slots >= 2 && config.bits >= 8 && config.bits <= 16;
+    }
+
+    // Planes packed one after the other, rows padded to 64 bytes
+    IngestFrameInfo frameInfo(const CameraConfig &config)
+    {
+        IngestFrameInfo info{};
+        info.width = config.width;
+        info.height = config.height;
+        info.pixel_type = config.format;
+        const bool wide = config.format != IngestPixelType::Gray8 && config.format != IngestPixelType::I420;
+        info.stride[0] = ((wide ? 2 * config.width : config.width) + 63) & ~63;
+        info.offset[0] = 0;
+        if (config.format == IngestPixelType::I420)
+        {
+            const uint32_t chroma_stride = ((config.width + 1) / 2 + 63) & ~63;
+            const uint64_t chroma_size = uint64_t(chroma_stride) * ((config.height + 1) / 2);
+            info.stride[1] = info.stride[2] = chroma_stride;
+            info.offset[1] = uint64_t(info.stride[0]) * config.height;
+            info.offset[2] = info.offset[1] + chroma_size;
+        }
+        return info;
+    }
+
+    // One row of the texture, with --still only the middle square moves
+    void textureRow(uint8_t *dst, std::vector<uint8_t> &moving, const CameraConfig &config, int y, int64_t frame)
+    {
+        if (!config.still)
+        {
+            xorTextureRow(dst, config.width, y, frame);
+            return;
+        }
+        xorTextureRow(dst, config.width, y, 0);
+        const int left = std::max(config.width - STILL_MOVING_SIZE, 0) / 2;
+        const int top = std::max(config.height - STILL_MOVING_SIZE, 0) / 2;
+        if (y >= top && y < top + STILL_MOVING_SIZE)
+        {
+            xorTextureRow(moving.data(), config.width, y, frame);
+            const int columns = std::min(STILL_MOVING_SIZE, config.width - left);
+            std::copy(moving.begin() + left, moving.begin() + left + columns, dst + left);
+        }
+    }
+
+    // The texture in the middle half of the range, red sites of the RGGB mosaic at three quarters
+    void fillWideRow(uint16_t *dst, const uint8_t *texture, const CameraConfig &config, int y)
+    {
+        const int max_value = (1 << config.bits) - 1;
+        const int base = max_value / 4;
+        const bool bayer = config.format == IngestPixelType::BayerRGGB16;
+        for (int x = 0; x < config.width; x++)
+        {
+            int value = base + texture[x] * (max_value / 2) / 255;
+            if (bayer && y % 2 == 0 && x % 2 == 0)
+            {
+                value = value * 3 / 4;
+            }
+            dst[x] = static_cast<uint16_t>(value);
+        }
+    }
+
+    const char *formatName(IngestPixelType format)
+    {
+        switch (format)
+        {
+        case IngestPixelType::I420:
+            return "i420";
+        case IngestPixelType::Gray16:
+            return "gray16";
+        case IngestPixelType::BayerRGGB16:
+            return "bayer16";
+        default:
+            return "gray8";
+        }
+    }
+
+    size_t frameBytes(const IngestFrameInfo &info)
+    {
+        if (info.pixel_type == IngestPixelType::I420)
+        {
+            return info.offset[2] + uint64_t(info.stride[2]) * ((info.height + 1) / 2);
+        }
+        return uint64_t(info.stride[0]) * info.height;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    CameraConfig config;
+    if (!parseArgs(argc, argv, config))
+    {
+        std::cerr << "Usage: " << argv[0] << " [--name /acquire-ingest] [--width 3840] [--height 2160] [--fps 30]"
+                  << " [--format gray8|i420|gray16|bayer16] [--bits 12] [--slots 8] [--duration 0] [--jitter 0] [--still 0]" << std::endl;
+        return 1;
+    }
+
+    IngestFrameInfo info = frameInfo(config);
+    std::unique_ptr<IngestWriter> ring = IngestWriter::create(config.name, config.slots, frameBytes(info), config.format, config.width, config.height, config.bits);
+    if (!ring)
+    {
+        return 1;
+    }
+    std::signal(SIGINT, stop);
+    std::signal(SIGTERM, stop);
+
+    std::cout << "Writing " << config.width << "x" << config.height << " " << formatName(config.format)
+              << " at " << config.fps << " fps into " << config.name << std::endl;
+
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int64_t> jitter(-int64_t(config.jitter) * 1000000, int64_t(config.jitter) * 1000000);
+    const Clock::time_point start = Clock::now();
+    const auto interval = std::chrono::duration<double>(1.0 / config.fps);
+    Clock::time_point report = start + std::chrono::seconds(1);
+    uint64_t written = 0;
+    uint64_t no_slot = 0;
+    std::vector<uint8_t> texture(config.width);
+    std::vector<uint8_t> moving(config.width);
+
+    for (int64_t frame = 0; running; frame++)
+    {
+        const Clock::time_point due = start + std::chrono::duration_cast<Clock::duration>(interval * frame);
+        if (config.duration > 0 && due >= start + std::chrono::seconds(config.duration))
+        {
+            break;
+        }
+        std::this_thread::sleep_until(due);
+
+        // Half a frame interval to get a slot, a real camera would have to drop the frame as well
+        uint8_t *payload = ring->begin(std::chrono::milliseconds(int64_t(500 / config.fps)));
+        if (!payload)
+        {
+            no_slot++;
+            continue;
+        }
+        if (config.format == IngestPixelType::I420)
+        {
+            // With --still the chroma stays put and only the luma square moves
+            fillXorPlanes(payload + info.offset[0], info.stride[0], payload + info.offset[1], info.stride[1],
+                          payload + info.offset[2], info.stride[2], config.width, config.height, config.still ? 0 : frame);
+            for (int y = 0; config.still && y < config.height; y++)
+            {
+                textureRow(payload + info.offset[0] + uint64_t(y) * info.stride[0], moving, config, y, frame);
+            }
+        }
+        else if (config.format == IngestPixelType::Gray8)
+        {
+            for (int y = 0; y < config.height; y++)
+            {
+                textureRow(payload + uint64_t(y) * info.stride[0], moving, config, y, frame);
+            }
+        }
+        else
+        {
+            for (int y = 0; y < config.height; y++)
+            {
+                textureRow(texture.data(), moving, config, y, frame);
+                fillWideRow(reinterpret_cast<uint16_t *>(payload + uint64_t(y) * info.stride[0]), texture.data(), config, y);
+            }
+        }
+        const int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+        info.timestamp_ns = config.jitter > 0 ? std::max<int64_t>(0, now + jitter(rng)) : now;
+        ring->commit(info);
+        written++;
+
+        if (Clock::now() >= report)
+        {
+            std::cout << written << " fps, " << no_slot << " without a free slot" << std::endl;
+            written = 0;
+            no_slot = 0;
+            report += std::chrono::seconds(1);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,400 @@
+#include "ingest_ring.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <new>
+#include <thread>
+
+namespace
+{
+    const size_t PAGE = 4096;
+
+    // Neither side has anything to wake the other with across processes, so waiting is polling at a fraction of
+    // a frame interval
+    const auto POLL_INTERVAL = std::chrono::microseconds(250);
+
+    size_t pageAlign(size_t value)
+    {
+        return (value + PAGE - 1) & ~(PAGE - 1);
+    }
+
+    uint64_t writing(uint64_t seq)
+    {
+        return 2 * seq + 1;
+    }
+
+    uint64_t complete(uint64_t seq)
+    {
+        return 2 * seq + 2;
+    }
+
+    bool isConverted(IngestPixelType pixel_type)
+    {
+        switch (pixel_type)
+        {
+        case IngestPixelType::Gray16:
+        case IngestPixelType::BayerRGGB16:
+        case IngestPixelType::BayerBGGR16:
+        case IngestPixelType::BayerGRBG16:
+        case IngestPixelType::BayerGBRG16:
+            return true;
+        default:
+            return false;
+        }
+    }
+}
+
+IngestRing::IngestRing(uint8_t *base, size_t size, const std::string &unlink_name)
+    : base_(base), size_(size), unlink_name_(unlink_name),
+      header_(reinterpret_cast<IngestRingHeader *>(base)),
+      slots_(reinterpret_cast<IngestSlotHeader *>(base + sizeof(IngestRingHeader)))
+{
+}
+
+IngestRing::~IngestRing()
+{
+    munmap(base_, size_);
+    if (!unlink_name_.empty())
+    {
+        shm_unlink(unlink_name_.c_str());
+    }
+}
+
+std::unique_ptr<IngestWriter> IngestWriter::create(const std::string &name, uint32_t slot_count, size_t slot_bytes,
+                                                   IngestPixelType pixel_type, uint32_t width, uint32_t height,
+                                                   uint32_t bit_depth)
+{
+    if (slot_count < 2 || slot_bytes == 0)
+    {
+        std::cerr << "Ingest ring needs at least 2 slots" << std::endl;
+        return nullptr;
+    }
+    slot_bytes = pageAlign(slot_bytes);
+    const size_t payload_offset = pageAlign(sizeof(IngestRingHeader) + slot_count * sizeof(IngestSlotHeader));
+    const size_t size = payload_offset + slot_count * slot_bytes;
+
+    shm_unlink(name.c_str()); // a ring left behind by a crashed run
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+    {
+        std::cerr << "Could not create shared memory " << name << std::endl;
+        return nullptr;
+    }
+    if (ftruncate(fd, size) != 0)
+    {
+        std::cerr << "Could not size shared memory " << name << std::endl;
+        close(fd);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+    void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        std::cerr << "Could not map shared memory " << name << std::endl;
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+
+    // Fresh shared memory is zeroed, the atomics are constructed in place before the magic says the ring is ready
+    uint8_t *bytes = static_cast<uint8_t *>(base);
+    IngestRingHeader *header = new (bytes) IngestRingHeader();
+    header->version = INGEST_RING_VERSION;
+    header->slot_count = slot_count;
+    header->pixel_type = static_cast<uint32_t>(pixel_type);
+    header->width = width;
+    header->height = height;
+    header->bit_depth = bit_depth;
+    header->slot_bytes = slot_bytes;
+    header->payload_offset = payload_offset;
+    header->policy.store(static_cast<uint32_t>(IngestPolicy::DropOldest));
+    header->write_seq.store(0);
+    header->read_seq.store(0);
+    header->held_seq.store(INGEST_NONE);
+    for (uint32_t i = 0; i < slot_count; i++)
+    {
+        new (bytes + sizeof(IngestRingHeader) + i * sizeof(IngestSlotHeader)) IngestSlotHeader();
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = INGEST_RING_MAGIC;
+
+    return std::unique_ptr<IngestWriter>(new IngestWriter(bytes, size, name));
+}
+
+uint8_t *IngestWriter::begin(std::chrono::milliseconds timeout)
+{
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    const uint64_t slots = header_->slot_count;
+    IngestSlotHeader &slot = this->slot(seq_);
+
+    // Block: never more than a ring ahead of what the reader has finished with
+    while (header_->policy.load() == static_cast<uint32_t>(IngestPolicy::Block) && seq_ >= header_->read_seq.load() + slots)
+    {
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            return nullptr;
+        }
+        std::this_thread::sleep_for(POLL_INTERVAL);
+    }
+
+    const uint64_t previous = slot.state.load();
+    slot.state.store(writing(seq_));
+    // Either way round, the frame the reader holds has to stay intact until it lets go
+    for (;;)
+    {
+        const uint64_t held = header_->held_seq.load();
+        if (held == INGEST_NONE || held % slots != seq_ % slots)
+        {
+            break;
+        }
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            slot.state.store(previous);
+            return nullptr;
+        }
+        std::this_thread::sleep_for(POLL_INTERVAL);
+    }
+    return payload(seq_);
+}
+
+void IngestWriter::commit(const IngestFrameInfo &info)
+{
+    IngestSlotHeader &slot = this->slot(seq_);
+    slot.width = info.width;
+    slot.height = info.height;
+    slot.pixel_type = static_cast<uint32_t>(info.pixel_type);
+    for (int i = 0; i < 3; i++)
+    {
+        slot.stride[i] = info.stride[i];
+        slot.offset[i] = info.offset[i];
+    }
+    slot.timestamp_ns = info.timestamp_ns;
+    slot.state.store(complete(seq_), std::memory_order_release);
+    seq_++;
+    header_->write_seq.store(seq_, std::memory_order_release);
+}
+
+std::unique_ptr<IngestReader> IngestReader::open(const std::string &name, IngestPolicy policy, uint32_t max_backlog,
+                                                 const PixelWindowConfig &window)
+{
+    const int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(IngestRingHeader))
+    {
+        close(fd);
+        return nullptr;
+    }
+    const size_t size = st.st_size;
+    void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        std::cerr << "Could not map shared memory " << name << std::endl;
+        return nullptr;
+    }
+
+    std::unique_ptr<IngestReader> reader(new IngestReader(static_cast<uint8_t *>(base), size, ""));
+    const IngestRingHeader &header = reader->header();
+    if (header.magic != INGEST_RING_MAGIC || header.version != INGEST_RING_VERSION ||
+        header.payload_offset + header.slot_count * header.slot_bytes > size)
+    {
+        std::cerr << "Shared memory " << name << " is not an ingest ring" << std::endl;
+        return nullptr;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    reader->policy_ = policy;
+    reader->max_backlog_ = max_backlog;
+    reader->converter_ = std::make_unique<PixelConverter>(window, header.bit_depth);
+    reader->next_ = header.write_seq.load(); // start live, whatever is already in the ring is stale
+    reader->header_->read_seq.store(reader->next_);
+    reader->header_->held_seq.store(INGEST_NONE);
+    reader->header_->policy.store(static_cast<uint32_t>(policy));
+    return reader;
+}
+
+bool IngestReader::next(IngestFrame &frame, std::chrono::milliseconds timeout)
+{
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    const uint64_t slots = header_->slot_count;
+    for (;;)
+    {
+        const uint64_t written = header_->write_seq.load(std::memory_order_acquire);
+        if (next_ >= written)
+        {
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                return false;
+            }
+            std::this_thread::sleep_for(POLL_INTERVAL);
+            continue;
+        }
+
+        // Under DropOldest the slot of written - slots may already be getting the next frame, under Block the writer
+        // waits for it to be read first
+        uint64_t oldest = written >= slots ? written - slots : 0;
+        if (policy_ == IngestPolicy::DropOldest)
+        {
+            oldest = written >= slots ? oldest + 1 : 0;
+            if (max_backlog_ > 0 && written > max_backlog_)
+            {
+                oldest = std::max(oldest, written - max_backlog_);
+            }
+        }
+        if (next_ < oldest)
+        {
+            dropped_ += oldest - next_;
+            next_ = oldest;
+        }
+
+        const uint64_t seq = next_++;
+        header_->held_seq.store(seq);
+        if (slot(seq).state.load() != complete(seq))
+        {
+            // Overwritten (or being overwritten) since write_seq was read
+            header_->held_seq.store(INGEST_NONE);
+            dropped_++;
+            continue;
+        }
+
+        if (isConverted(static_cast<IngestPixelType>(slot(seq).pixel_type)))
+        {
+            frame.timestamp_ns = slot(seq).timestamp_ns;
+            frame.seq = seq;
+            const bool converted = convertFrame(seq, frame.frame);
+            release(0);
+            if (!converted)
+            {
+                dropped_++;
+                continue;
+            }
+            return true;
+        }
+
+        uint8_t *planes[3];
+        if (!layoutFrame(seq, planes))
+        {
+            release(0);
+            dropped_++;
+            continue;
+        }
+        frame.frame = PooledFrame(this, 0, planes, &layout_);
+        frame.timestamp_ns = slot(seq).timestamp_ns;
+        frame.seq = seq;
+        return true;
+    }
+}
+
+void IngestReader::release(uint32_t)
+{
+    header_->read_seq.store(next_);
+    header_->held_seq.store(INGEST_NONE);
+}
+
+bool IngestReader::layoutFrame(uint64_t seq, uint8_t *planes[3])
+{
+    const IngestSlotHeader &slot = this->slot(seq);
+    const IngestPixelType pixel_type = static_cast<IngestPixelType>(slot.pixel_type);
+    const int width = slot.width;
+    const int height = slot.height;
+    if (width <= 0 || height <= 0 || (pixel_type != IngestPixelType::Gray8 && pixel_type != IngestPixelType::I420))
+    {
+        std::cerr << "Unsupported ingest frame: " << width << "x" << height << " pixel type " << slot.pixel_type << std::endl;
+        return false;
+    }
+
+    const int chroma_width = (width + 1) / 2;
+    const int chroma_height = (height + 1) / 2;
+    const int plane_count = pixel_type == IngestPixelType::I420 ? 3 : 1;
+    uint8_t *payload = this->payload(seq);
+    for (int i = 0; i < plane_count; i++)
+    {
+        const int rows = i == 0 ? height : chroma_height;
+        const int row_bytes = i == 0 ? width : chroma_width;
+        if (static_cast<int>(slot.stride[i]) < row_bytes ||
+            slot.offset[i] + static_cast<uint64_t>(slot.stride[i]) * rows > header_->slot_bytes)
+        {
+            std::cerr << "Ingest frame plane " << i << " doesn't fit its slot" << std::endl;
+            return false;
+        }
+        planes[i] = payload + slot.offset[i];
+        layout_.stride[i] = slot.stride[i];
+        layout_.offset[i] = slot.offset[i];
+    }
+
+    if (pixel_type == IngestPixelType::Gray8)
+    {
+        // Every Gray8 frame shares one plane of neutral chroma, read only
+        const size_t chroma_size = static_cast<size_t>(chroma_width) * chroma_height;
+        if (gray_.size() < chroma_size)
+        {
+            gray_.assign(chroma_size, 128);
+        }
+        for (int i = 1; i < 3; i++)
+        {
+            planes[i] = gray_.data();
+            layout_.stride[i] = chroma_width;
+            layout_.offset[i] = 0;
+        }
+    }
+
+    layout_.format = FrameFormat::I420;
+    layout_.width = width;
+    layout_.height = height;
+    layout_.planes = 3;
+    layout_.size = header_->slot_bytes;
+    return true;
+}
+
+bool IngestReader::convertFrame(uint64_t seq, PooledFrame &frame)
+{
+    const IngestSlotHeader &slot = this->slot(seq);
+    const int width = slot.width;
+    const int height = slot.height;
+    if (width <= 0 || height <= 0 || slot.stride[0] < 2 * slot.width || slot.stride[0] % 2 != 0 || slot.offset[0] % 2 != 0 ||
+        slot.offset[0] + static_cast<uint64_t>(slot.stride[0]) * height > header_->slot_bytes)
+    {
+        std::cerr << "Ingest frame " << width << "x" << height << " doesn't fit its slot" << std::endl;
+        return false;
+    }
+
+    if (!converted_ || converted_->layout().width != width || converted_->layout().height != height)
+    {
+        converted_ = &FramePool::shared().slabs(FrameFormat::I420, width, height);
+    }
+    frame = converted_->acquire();
+    if (!frame)
+    {
+        return false;
+    }
+
+    const uint16_t *samples = reinterpret_cast<const uint16_t *>(payload(seq) + slot.offset[0]);
+    switch (static_cast<IngestPixelType>(slot.pixel_type))
+    {
+    case IngestPixelType::BayerRGGB16:
+        converter_->convertBayer16(samples, slot.stride[0], BayerPattern::RGGB, frame);
+        break;
+    case IngestPixelType::BayerBGGR16:
+        converter_->convertBayer16(samples, slot.stride[0], BayerPattern::BGGR, frame);
+        break;
+    case IngestPixelType::BayerGRBG16:
+        converter_->convertBayer16(samples, slot.stride[0], BayerPattern::GRBG, frame);
+        break;
+    case IngestPixelType::BayerGBRG16:
+        converter_->convertBayer16(samples, slot.stride[0], BayerPattern::GBRG, frame);
+        break;
+    default:
+        converter_->convertGray16(samples, slot.stride[0], frame);
+        break;
+    }
+    return true;
+}
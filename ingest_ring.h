@@ -0,0 +1,175 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "frame_pool.h"
+#include "pixel_convert.h"
+
+// Raw frames from an acquisition process, through a ring of slots in POSIX shared memory.
+// The acquisition side (IngestWriter) creates the ring and writes each frame straight into a slot, the server
+// (IngestReader) hands 8 bit frames to the encoders as a PooledFrame without copying them. 16 bit and Bayer frames
+// are converted (see pixel_convert.h) into a pooled frame instead, which lets go of the slot straight away.
+// One writer, one reader.
+//
+// Every slot has a state word: 2 * seq + 1 while frame seq is being written, 2 * seq + 2 once it is complete.
+// The reader announces the frame it holds in held_seq before checking the state, the writer marks a slot as being
+// written before checking held_seq, so one of them always sees the other and a held frame is never overwritten.
+
+const uint32_t INGEST_RING_MAGIC = 0x52514341; // "ACQR"
+const uint32_t INGEST_RING_VERSION = 2;
+
+enum class IngestPixelType : uint32_t
+{
+    Gray8 = 0, // one plane, encoded with neutral chroma
+    I420 = 1,
+    Gray16 = 2, // one plane of 16 bit samples, bit_depth of them used
+    BayerRGGB16 = 3, // 16 bit mosaics, named by the colours of the top left 2x2 quad
+    BayerBGGR16 = 4,
+    BayerGRBG16 = 5,
+    BayerGBRG16 = 6,
+};
+
+// What the reader does when the encoders fall behind the camera
+enum class IngestPolicy : uint32_t
+{
+    DropOldest = 0, // skip ahead to the newest frames, the camera never waits
+    Block = 1,      // the writer waits for a free slot, the camera side has to absorb the stall
+};
+
+struct IngestRingHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t pixel_type; // nominal format, each frame carries its own
+    uint32_t width;
+    uint32_t height;
+    uint32_t bit_depth;      // bits used of each 16 bit sample
+    uint64_t slot_bytes;     // payload room per slot
+    uint64_t payload_offset; // of slot 0's payload from the start of the mapping, slots follow each other
+    std::atomic<uint32_t> policy;
+    std::atomic<uint64_t> write_seq; // frames committed so far
+    std::atomic<uint64_t> read_seq;  // frames the reader is done with (Block waits on this)
+    std::atomic<uint64_t> held_seq;  // frame the reader is using, INGEST_NONE if none
+};
+
+struct IngestSlotHeader
+{
+    std::atomic<uint64_t> state;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixel_type;
+    uint32_t stride[3];
+    uint64_t offset[3]; // of each plane from the start of the slot's payload
+    uint64_t timestamp_ns; // camera clock
+};
+
+const uint64_t INGEST_NONE = ~0ull;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the ring's atomics have to work across processes");
+
+// Describes a frame the writer has put into its slot
+struct IngestFrameInfo
+{
+    uint32_t width;
+    uint32_t height;
+    IngestPixelType pixel_type;
+    uint32_t stride[3];
+    uint64_t offset[3];
+    uint64_t timestamp_ns;
+};
+
+// Mapping of a ring, shared by both sides
+class IngestRing
+{
+public:
+    ~IngestRing();
+
+    IngestRing(const IngestRing &) = delete;
+    IngestRing &operator=(const IngestRing &) = delete;
+
+    IngestRingHeader &header() const { return *header_; }
+    IngestSlotHeader &slot(uint64_t seq) const { return slots_[seq % header_->slot_count]; }
+    uint8_t *payload(uint64_t seq) const { return base_ + header_->payload_offset + (seq % header_->slot_count) * header_->slot_bytes; }
+
+protected:
+    IngestRing(uint8_t *base, size_t size, const std::string &unlink_name);
+
+    uint8_t *base_;
+    size_t size_;
+    std::string unlink_name_; // the creator removes the name again
+    IngestRingHeader *header_;
+    IngestSlotHeader *slots_;
+};
+
+class IngestWriter : public IngestRing
+{
+public:
+    // Creates (or replaces) the ring called name (a shm_open name, "/acquire-ingest"), nullptr on failure.
+    // bit_depth only matters for 16 bit pixel types.
+    static std::unique_ptr<IngestWriter> create(const std::string &name, uint32_t slot_count, size_t slot_bytes,
+                                                IngestPixelType pixel_type, uint32_t width, uint32_t height,
+                                                uint32_t bit_depth = 16);
+
+    // Reserves the next slot and returns where its payload goes (slot_bytes of room). nullptr if it couldn't get
+    // one within timeout: the reader holds that slot, or under Block hasn't finished with it.
+    uint8_t *begin(std::chrono::milliseconds timeout);
+
+    // Publishes the frame written since begin
+    void commit(const IngestFrameInfo &info);
+
+    size_t slotBytes() const { return header_->slot_bytes; }
+
+private:
+    using IngestRing::IngestRing;
+
+    uint64_t seq_ = 0;
+};
+
+// A frame from the ring, plus the camera's timestamp
+struct IngestFrame
+{
+    PooledFrame frame;
+    uint64_t timestamp_ns = 0;
+    uint64_t seq = 0;
+};
+
+class IngestReader : public IngestRing, public FrameLender
+{
+public:
+    // Attaches to an existing ring, nullptr if there is none (yet). max_backlog caps how many frames DropOldest lets
+    // queue up before skipping ahead, 0 for as many as the ring holds. window is how 16 bit frames become 8 bit.
+    static std::unique_ptr<IngestReader> open(const std::string &name, IngestPolicy policy, uint32_t max_backlog,
+                                              const PixelWindowConfig &window = PixelWindowConfig());
+
+    // Waits up to timeout for the next frame, false if none came. The slot stays untouched until frame.frame is
+    // released, which has to happen before the next call: one frame at a time.
+    bool next(IngestFrame &frame, std::chrono::milliseconds timeout);
+
+    // Frames skipped or overwritten before they could be read
+    uint64_t dropped() const { return dropped_; }
+
+    void release(uint32_t index) override;
+
+private:
+    using IngestRing::IngestRing;
+
+    bool layoutFrame(uint64_t seq, uint8_t *planes[3]);
+    // 16 bit and Bayer frames, into a frame from the shared pool
+    bool convertFrame(uint64_t seq, PooledFrame &frame);
+
+    IngestPolicy policy_ = IngestPolicy::DropOldest;
+    uint32_t max_backlog_ = 0;
+    uint64_t next_ = 0;
+    uint64_t dropped_ = 0;
+    FrameLayout layout_{};
+    std::vector<uint8_t> gray_; // neutral chroma for Gray8 frames
+    std::unique_ptr<PixelConverter> converter_;
+    FrameSlabs *converted_ = nullptr; // pool slabs of the size converted last
+};
@@ -0,0 +1,271 @@
+#include "live_webm.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include "frame_diff.h"
+#include "logger.h"
+#include "metrics.h"
+#include "speed_controller.h"
+#include "webm.h"
+#include "xor_texture.h"
+
+namespace
+{
+    const int LIVE_FRAME_RATE = 30; // fps
+
+    // ROI map segment the unchanged blocks go in
+    const int STATIC_SEGMENT = 1;
+
+    // Puts the 8x8 blocks of every macroblock that didn't change into a segment VP9 codes as skipped, copied from the
+    // last frame. A null changes turns the map off again, keyframes can't skip anything.
+    void applyStaticMap(vpx_codec_ctx_t *codec, const DirtyMap *changes, int width, int height, std::vector<uint8_t> &segments)
+    {
+        vpx_roi_map_t roi = {};
+        for (int i = 0; i < 8; i++)
+        {
+            roi.ref_frame[i] = -1;
+        }
+        if (changes)
+        {
+            roi.rows = (height + 7) / 8;
+            roi.cols = (width + 7) / 8;
+            segments.resize(static_cast<size_t>(roi.rows) * roi.cols);
+            for (unsigned int y = 0; y < roi.rows; y++)
+            {
+                for (unsigned int x = 0; x < roi.cols; x++)
+                {
+                    segments[y * roi.cols + x] = changes->at(x / 2, y / 2) ? 0 : STATIC_SEGMENT;
+                }
+            }
+            roi.roi_map = segments.data();
+            roi.skip[STATIC_SEGMENT] = 1;
+            roi.ref_frame[STATIC_SEGMENT] = 1; // LAST_FRAME
+        }
+        if (vpx_codec_control(codec, VP8E_SET_ROI_MAP, &roi) != VPX_CODEC_OK)
+        {
+            logDebug("Failed to set VP9 ROI map: {}", vpx_codec_error(codec));
+        }
+    }
+}
+
+LiveWebmStream::LiveWebmStream(const LiveWebmConfig &config) : config_(config), ring_(config.ring_size) {}
+
+LiveWebmStream::~LiveWebmStream()
+{
+    stop();
+}
+
+void LiveWebmStream::start()
+{
+    if (running_.exchange(true))
+    {
+        return;
+    }
+    // A thread that gave up on its own has cleared running_ but still has to be joined
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+    thread_ = std::thread(&LiveWebmStream::run, this);
+}
+
+void LiveWebmStream::stop()
+{
+    // Joins even when running_ is already false, run() clears it itself when the encoder fails to open
+    if (running_.exchange(false))
+    {
+        cv_.notify_all();
+    }
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+}
+
+std::shared_ptr<const std::vector<uint8_t>> LiveWebmStream::header()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    // The header goes out with the very first frame, which is only a frame interval away unless the encoder is broken
+    cv_.wait_for(lock, std::chrono::seconds(5), [this]
+                 { return header_ || !running_; });
+    return header_;
+}
+
+void LiveWebmStream::run()
+{
+    const int width = config_.width;
+    const int height = config_.height;
+
+    vpx_codec_ctx_t codec;
+    vpx_codec_enc_cfg_t cfg;
+    vpx_codec_enc_config_default(vpx_codec_vp9_cx(), &cfg, 0);
+    cfg.g_w = width;
+    cfg.g_h = height;
+    cfg.g_timebase.num = 1;
+    cfg.g_timebase.den = LIVE_FRAME_RATE;
+    cfg.g_lag_in_frames = 0; // every frame comes out of the encoder as soon as it goes in
+    cfg.kf_max_dist = config_.keyframe_interval;
+    configureVp9Threads(cfg, config_.threads);
+
+    if (vpx_codec_enc_init(&codec, vpx_codec_vp9_cx(), &cfg, 0) != VPX_CODEC_OK)
+    {
+        std::cerr << "Failed to initialize live encoder: " << vpx_codec_error(&codec) << std::endl;
+        ring_.close();
+        running_ = false;
+        cv_.notify_all();
+        return;
+    }
+    applyVp9Threading(&codec, cfg);
+    // Starts on the fastest realtime speed, this has to keep up with the clock. The controller only ever slows it
+    // down (for better quality) when there is time to spare.
+    const int max_cpu_used = 8;
+    vpx_codec_control(&codec, VP8E_SET_CPUUSED, max_cpu_used);
+    std::unique_ptr<SpeedController> speed;
+    if (config_.adaptive_speed)
+    {
+        SpeedControllerConfig speed_config;
+        speed_config.frame_budget = 1.0 / LIVE_FRAME_RATE;
+        speed_config.window = LIVE_FRAME_RATE;
+        speed_config.min_level = std::min(config_.min_cpu_used, max_cpu_used);
+        speed_config.max_level = max_cpu_used;
+        speed_config.start_level = max_cpu_used;
+        speed = std::make_unique<SpeedController>(speed_config, "vp9_live");
+    }
+
+    LiveMkvWriter writer;
+    mkvmuxer::Segment segment;
+    segment.set_mode(mkvmuxer::Segment::kLive);
+    segment.OutputCues(false);
+    mkvmuxer::SegmentInfo *const info = segment.GetSegmentInfo();
+    info->set_writing_app("XorTextureGenerator");
+    info->set_timecode_scale(1e9 / LIVE_FRAME_RATE);
+
+    const uint64_t track = segment.AddVideoTrack(width, height, 0);
+    mkvmuxer::VideoTrack *const video = static_cast<mkvmuxer::VideoTrack *>(segment.GetTrackByNumber(track));
+    if (!track || !video || !segment.Init(&writer))
+    {
+        std::cerr << "Failed to initialize live muxer segment" << std::endl;
+        vpx_codec_destroy(&codec);
+        ring_.close();
+        running_ = false;
+        cv_.notify_all();
+        return;
+    }
+    video->set_default_duration(uint64_t(1e9 / LIVE_FRAME_RATE));
+    video->set_codec_id("V_VP9");
+    video->set_display_width(width);
+    video->set_display_height(height);
+    video->set_pixel_width(width);
+    video->set_pixel_height(height);
+
+    std::vector<uint8_t> before;
+    std::vector<uint8_t> data;
+    std::vector<EncodedFrame> loop_frames; // the first period in loop mode
+    std::unique_ptr<FrameDiff> diff;
+    if (config_.skip_static && !config_.loop)
+    {
+        diff = std::make_unique<FrameDiff>(config_.static_threshold);
+    }
+    std::vector<uint8_t> segments;
+    bool static_map = false; // an ROI map is set on the encoder
+    PipelineMetrics &metrics = pipelineMetrics();
+    const auto start_time = std::chrono::steady_clock::now();
+
+    for (int frame = 0; running_; frame++)
+    {
+        const auto due = start_time + std::chrono::microseconds(int64_t(frame) * 1000000 / LIVE_FRAME_RATE);
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait_until(lock, due, [this]
+                           { return !running_; });
+            if (!running_)
+            {
+                break;
+            }
+        }
+
+        const int phase = config_.loop ? frame % XOR_TEXTURE_PERIOD : frame;
+        if (config_.loop && frame >= XOR_TEXTURE_PERIOD && loop_frames.size() == XOR_TEXTURE_PERIOD)
+        {
+            // Same picture as a frame already encoded, write that one again with the new timestamp
+            const EncodedFrame &cached = loop_frames[phase];
+            if (!segment.AddFrame(cached.data.data(), cached.data.size(), track, frame * 1e9 / LIVE_FRAME_RATE, cached.keyframe))
+            {
+                std::cerr << "Failed to add looped frame to webm" << std::endl;
+                break;
+            }
+        }
+        else
+        {
+            PooledFrame source;
+            {
+                ScopedTimer timer(metrics.frame_synthesis_seconds);
+                source = genXorTexture(width, height, frame);
+            }
+            if (!source)
+            {
+                break;
+            }
+            vpx_image_t img;
+            // mkvmuxer starts a new cluster on every keyframe, forcing them keeps clusters short and evenly spaced
+            const int flags = phase % config_.keyframe_interval == 0 ? VPX_EFLAG_FORCE_KF : 0;
+            const DirtyMap *changes = diff ? &diff->update(source) : nullptr;
+            if (changes)
+            {
+                metrics.webm_static_macroblocks.add(changes->mb_width * changes->mb_height - changes->dirty_count);
+                if (changes->unchanged())
+                {
+                    metrics.webm_static_frames.add(1);
+                    if (flags == 0)
+                    {
+                        // Nothing to encode, the last frame just stays up until the next one's timestamp
+                        continue;
+                    }
+                }
+                const bool partial = flags == 0 && changes->dirty_count < changes->mb_width * changes->mb_height;
+                if (partial || static_map)
+                {
+                    applyStaticMap(&codec, partial ? changes : nullptr, width, height, segments);
+                    static_map = partial;
+                }
+            }
+            std::vector<EncodedFrame> *keep = config_.loop && frame < XOR_TEXTURE_PERIOD ? &loop_frames : nullptr;
+            const auto encode_start = std::chrono::steady_clock::now();
+            {
+                ScopedTimer timer(metrics.vp9_encode_seconds);
+                encode_frame(&codec, wrapVpxImage(source, &img), frame, flags, &writer, segment, track, VPX_DL_REALTIME, keep);
+            }
+            if (speed && speed->record(std::chrono::duration<double>(std::chrono::steady_clock::now() - encode_start).count()))
+            {
+                logInfo("Live VP9 encoder now on cpu-used {}", speed->level());
+                vpx_codec_control(&codec, VP8E_SET_CPUUSED, speed->level());
+            }
+        }
+        metrics.webm_lag_seconds.set(std::chrono::duration<double>(std::chrono::steady_clock::now() - due).count());
+
+        const bool cluster_started = writer.take(before, data);
+        if (!before.empty())
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!header_)
+            {
+                header_ = std::make_shared<std::vector<uint8_t>>(std::move(before));
+                cv_.notify_all();
+            }
+            else
+            {
+                ring_.publish(false, std::move(before)); // whatever closed the previous cluster
+            }
+        }
+        if (!data.empty())
+        {
+            ring_.publish(cluster_started, std::move(data));
+        }
+    }
+
+    vpx_codec_destroy(&codec);
+    ring_.close();
+    cv_.notify_all();
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "broadcast_ring.h"
+
+struct LiveWebmConfig
+{
+    int width = 640;
+    int height = 480;
+    int keyframe_interval = 30; // frames per cluster, a new subscriber starts at most this far behind
+    size_t ring_size = 256;     // frames kept for subscribers that fall behind, more than one cluster
+    int threads = 0;            // encoder threads, 0 for one per core
+    bool loop = false;          // encode the first XOR_TEXTURE_PERIOD frames only and replay them from then on, the source repeats anyway
+    bool adaptive_speed = true; // lower cpu-used (better quality) while the encoder has time to spare, see speed_controller.h
+    int min_cpu_used = 5;       // best quality adaptive_speed goes to, realtime VP9 starts at 5
+    // Diff every frame against the frames before it (see frame_diff.h): frames where nothing changed aren't encoded at
+    // all, the one before stays up longer, and VP9 codes the unchanged blocks of the rest as skips. Not in loop mode,
+    // the replay needs every frame of the period.
+    bool skip_static = true;
+    uint32_t static_threshold = 128; // SAD a macroblock has to exceed to count as changed
+};
+
+// Runs one VP9 encoder in real time on its own thread and writes a live (non-seekable) webm:
+// the stream header once, then one cluster per forced keyframe.
+// Every encoded frame is published into a broadcast ring, so the encode costs the same no matter how many subscribers read it.
+// In loop mode keyframes are counted from the start of each period, so the replayed period starts on one.
+// Cluster keyframes are always encoded, static or not, so a new subscriber can start on any of them.
+class LiveWebmStream
+{
+public:
+    explicit LiveWebmStream(const LiveWebmConfig &config);
+    ~LiveWebmStream();
+
+    void start();
+    void stop();
+
+    // EBML header, segment info and tracks, everything a subscriber needs before its first cluster.
+    // Waits for the encoder to write it, nullptr if it never did.
+    std::shared_ptr<const std::vector<uint8_t>> header();
+
+    const BroadcastRing &ring() const { return ring_; }
+
+    const LiveWebmConfig &config() const { return config_; }
+
+private:
+    void run();
+
+    const LiveWebmConfig config_;
+    BroadcastRing ring_;
+
+    std::thread thread_;
+    std::atomic<bool> running_{false};
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::shared_ptr<const std::vector<uint8_t>> header_;
+};
@@ -0,0 +1,595 @@
+// acquire-driver-load: simulated viewers against a running acquire-driver-web.
+//
+//   acquire-driver-load [--host localhost] [--port 8080] [--viewers 50] [--duration 60] [--ramp 10]
+//                       [--mode hls|webm|mixed] [--playlist /master.m3u8] [--server-pid PID]
+//
+// HLS viewers behave like hls.js on a live stream: pick the first variant of a master playlist, start three segments
+// behind the live edge, reload the media playlist every target duration (half that if it didn't change) and fetch
+// every new segment in order while a playback buffer drains in real time.
+// WebM viewers behave like a <video> element on /webm: an open ended Range request that is dropped after the first bytes,
+// then sequential Range requests for the rest of the file, then a seek back to the start.
+//
+// At the end it prints p50/p95/p99 of time to first byte, segment and range download times, playlist staleness
+// and the server's CPU use (sampled every second from /proc), plus rebuffer and error counts.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <httplib.h>
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    double secondsSince(Clock::time_point start)
+    {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    struct LoadConfig
+    {
+        std::string host = "localhost";
+        int port = 8080;
+        int viewers = 50;
+        int duration = 60; // seconds
+        int ramp = 10;     // seconds over which viewers join
+        std::string mode = "hls";
+        std::string playlist = "/master.m3u8";
+        int server_pid = 0; // 0 looks for acquire-driver-web in /proc
+    };
+
+    // Thread-safe collection of samples, percentiles are computed once at the end
+    class Samples
+    {
+    public:
+        void add(double value)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            values_.push_back(value);
+        }
+
+        void print(const std::string &name, const std::string &unit)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::cout << std::left << std::setw(28) << name << std::right << std::setw(8) << values_.size();
+            if (values_.empty())
+            {
+                std::cout << std::endl;
+                return;
+            }
+            std::sort(values_.begin(), values_.end());
+            for (double p : {0.50, 0.95, 0.99})
+            {
+                const size_t k = std::min(values_.size() - 1, static_cast<size_t>(p * values_.size()));
+                std::cout << std::setw(12) << std::fixed << std::setprecision(1) << values_[k];
+            }
+            std::cout << std::setw(12) << values_.back() << " " << unit << std::endl;
+        }
+
+    private:
+        std::mutex mutex_;
+        std::vector<double> values_;
+    };
+
+    struct LoadStats
+    {
+        Samples ttfb_ms;
+        Samples segment_ms;
+        Samples playlist_ms;
+        Samples staleness_ms; // how much later than its EXTINF promised each playlist update showed up
+        Samples range_ms;
+        Samples server_cpu;   // percent of one core, per second
+        std::atomic<uint64_t> rebuffers{0};
+        std::atomic<uint64_t> errors{0};
+        std::atomic<uint64_t> bytes{0};
+    };
+
+    // A GET that records time to first byte (response headers) and counts the body. Returns false on any failure.
+    // keep_bytes stops reading (and drops the connection) once that many bytes are in, 0 reads everything.
+    bool timedGet(httplib::Client &client, const std::string &path, const httplib::Headers &headers, LoadStats &stats,
+                  std::string *body, int *status = nullptr, std::string *content_range = nullptr, size_t keep_bytes = 0)
+    {
+        const Clock::time_point start = Clock::now();
+        size_t received = 0;
+        auto result = client.Get(path, headers, [&](const httplib::Response &response)
+                                 {
+                                     stats.ttfb_ms.add(secondsSince(start) * 1000);
+                                     if (status)
+                                     {
+                                         *status = response.status;
+                                     }
+                                     if (content_range)
+                                     {
+                                         *content_range = response.get_header_value("Content-Range");
+                                     }
+                                     return response.status == 200 || response.status == 206; },
+                                 [&](const char *data, size_t size)
+                                 {
+                                     received += size;
+                                     if (body)
+                                     {
+                                         body->append(data, size);
+                                     }
+                                     return keep_bytes == 0 || received < keep_bytes; });
+        stats.bytes += received;
+
+        const bool stopped_on_purpose = !result && result.error() == httplib::Error::Canceled && keep_bytes > 0 && received >= keep_bytes;
+        if (!result && !stopped_on_purpose)
+        {
+            stats.errors++;
+            return false;
+        }
+        if (result && result->status != 200 && result->status != 206)
+        {
+            stats.errors++;
+            return false;
+        }
+        return true;
+    }
+
+    struct MediaPlaylist
+    {
+        double target_duration = 0;
+        int64_t media_sequence = 0;
+        std::vector<std::pair<double, std::string>> segments; // EXTINF, URI
+    };
+
+    MediaPlaylist parsePlaylist(const std::string &content)
+    {
+        MediaPlaylist playlist;
+        std::istringstream lines(content);
+        std::string line;
+        double extinf = 0;
+        while (std::getline(lines, line))
+        {
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.pop_back();
+            }
+            if (line.rfind("#EXT-X-TARGETDURATION:", 0) == 0)
+            {
+                playlist.target_duration = std::atof(line.c_str() + 22);
+            }
+            else if (line.rfind("#EXT-X-MEDIA-SEQUENCE:", 0) == 0)
+            {
+                playlist.media_sequence = std::atoll(line.c_str() + 22);
+            }
+            else if (line.rfind("#EXTINF:", 0) == 0)
+            {
+                extinf = std::atof(line.c_str() + 8);
+            }
+            else if (!line.empty() && line[0] != '#')
+            {
+                playlist.segments.emplace_back(extinf, line);
+            }
+        }
+        return playlist;
+    }
+
+    // The first variant of a master playlist, or the playlist itself if it is a media playlist
+    std::string firstVariant(const std::string &content)
+    {
+        std::istringstream lines(content);
+        std::string line;
+        bool variant_next = false;
+        while (std::getline(lines, line))
+        {
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.pop_back();
+            }
+            if (line.rfind("#EXT-X-STREAM-INF", 0) == 0)
+            {
+                variant_next = true;
+            }
+            else if (variant_next && !line.empty() && line[0] != '#')
+            {
+                return line;
+            }
+        }
+        return "";
+    }
+
+    std::string resolve(const std::string &base, const std::string &uri)
+    {
+        if (uri.empty() || uri[0] == '/')
+        {
+            return uri;
+        }
+        return base.substr(0, base.rfind('/') + 1) + uri;
+    }
+
+    // Sleeps until deadline in short steps so a stopping run doesn't wait out a whole target duration
+    void sleepUntil(Clock::time_point deadline, const std::atomic<bool> &running)
+    {
+        while (running && Clock::now() < deadline)
+        {
+            std::this_thread::sleep_for(std::min<Clock::duration>(deadline - Clock::now(), std::chrono::milliseconds(100)));
+        }
+    }
+
+    // The playback side of a player: buffered seconds drain in real time once playing, running dry is a rebuffer
+    class PlaybackBuffer
+    {
+    public:
+        void add(double seconds)
+        {
+            update();
+            buffered_ += seconds;
+            if (!playing_)
+            {
+                playing_ = true; // hls.js starts (and resumes) as soon as a fragment is in
+                last_ = Clock::now();
+            }
+        }
+
+        // Returns true if the buffer ran dry since the last call
+        bool update()
+        {
+            const Clock::time_point now = Clock::now();
+            if (!playing_)
+            {
+                return false;
+            }
+            buffered_ -= std::chrono::duration<double>(now - last_).count();
+            last_ = now;
+            if (buffered_ < 0)
+            {
+                buffered_ = 0;
+                playing_ = false;
+                return true;
+            }
+            return false;
+        }
+
+    private:
+        double buffered_ = 0;
+        bool playing_ = false;
+        Clock::time_point last_ = Clock::now();
+    };
+
+    void hlsViewer(const LoadConfig &config, LoadStats &stats, const std::atomic<bool> &running)
+    {
+        httplib::Client client(config.host, config.port);
+        client.set_keep_alive(true);
+        client.set_read_timeout(30);
+
+        std::string media_path = config.playlist;
+        std::string content;
+        if (!timedGet(client, config.playlist, {}, stats, &content))
+        {
+            return;
+        }
+        const std::string variant = firstVariant(content);
+        if (!variant.empty())
+        {
+            media_path = resolve(config.playlist, variant);
+            content.clear();
+        }
+
+        PlaybackBuffer buffer;
+        int64_t next_segment = -1;
+        int64_t newest_seen = -1;
+        Clock::time_point newest_seen_at;
+        double newest_duration = 0;
+
+        while (running)
+        {
+            if (content.empty())
+            {
+                const Clock::time_point start = Clock::now();
+                if (!timedGet(client, media_path, {}, stats, &content))
+                {
+                    sleepUntil(Clock::now() + std::chrono::seconds(1), running);
+                    continue;
+                }
+                stats.playlist_ms.add(secondsSince(start) * 1000);
+            }
+            const MediaPlaylist playlist = parsePlaylist(content);
+            content.clear();
+            if (playlist.segments.empty())
+            {
+                sleepUntil(Clock::now() + std::chrono::seconds(1), running);
+                continue;
+            }
+
+            // Staleness: a live playlist should gain a segment every EXTINF seconds, anything beyond that is delay
+            const int64_t newest = playlist.media_sequence + playlist.segments.size() - 1;
+            const bool changed = newest > newest_seen;
+            if (changed)
+            {
+                if (newest_seen >= 0)
+                {
+                    const double expected = newest_duration * (newest - newest_seen);
+                    stats.staleness_ms.add(std::max(0.0, secondsSince(newest_seen_at) - expected) * 1000);
+                }
+                newest_seen = newest;
+                newest_seen_at = Clock::now();
+                newest_duration = playlist.segments.back().first;
+            }
+
+            if (next_segment < 0)
+            {
+                next_segment = std::max(playlist.media_sequence, newest - 2); // hls.js liveSyncDurationCount
+            }
+            next_segment = std::max(next_segment, playlist.media_sequence); // fell out of the window
+            for (; running && next_segment <= newest; next_segment++)
+            {
+                const auto &entry = playlist.segments[next_segment - playlist.media_sequence];
+                const Clock::time_point start = Clock::now();
+                if (!timedGet(client, resolve(media_path, entry.second), {}, stats, nullptr))
+                {
+                    break;
+                }
+                stats.segment_ms.add(secondsSince(start) * 1000);
+                if (buffer.update())
+                {
+                    stats.rebuffers++;
+                }
+                buffer.add(entry.first);
+            }
+
+            const double reload = changed ? playlist.target_duration : playlist.target_duration / 2;
+            const Clock::time_point next_reload = Clock::now() + std::chrono::milliseconds(static_cast<int64_t>(reload * 1000));
+            while (running && Clock::now() < next_reload)
+            {
+                if (buffer.update())
+                {
+                    stats.rebuffers++;
+                }
+                sleepUntil(std::min(next_reload, Clock::now() + std::chrono::milliseconds(250)), running);
+            }
+        }
+    }
+
+    void webmViewer(const LoadConfig &config, LoadStats &stats, const std::atomic<bool> &running)
+    {
+        httplib::Client client(config.host, config.port);
+        client.set_keep_alive(true);
+        client.set_read_timeout(30);
+
+        const size_t probe = 64 * 1024;
+        const size_t range = 512 * 1024;
+        while (running)
+        {
+            // What a <video> element asks first, it gives up on the response once it has the headers and the first cluster
+            std::string content_range;
+            const Clock::time_point start = Clock::now();
+            if (!timedGet(client, "/webm", {{"Range", "bytes=0-"}}, stats, nullptr, nullptr, &content_range, probe))
+            {
+                sleepUntil(Clock::now() + std::chrono::seconds(1), running);
+                continue;
+            }
+            stats.range_ms.add(secondsSince(start) * 1000);
+
+            // Content-Range: bytes 0-N/total
+            const size_t slash = content_range.rfind('/');
+            const size_t total = slash == std::string::npos ? 0 : std::strtoull(content_range.c_str() + slash + 1, nullptr, 10);
+            for (size_t offset = probe; running && offset < total; offset += range)
+            {
+                const size_t last = std::min(total, offset + range) - 1;
+                const Clock::time_point range_start = Clock::now();
+                if (!timedGet(client, "/webm", {{"Range", "bytes=" + std::to_string(offset) + "-" + std::to_string(last)}}, stats, nullptr))
+                {
+                    break;
+                }
+                stats.range_ms.add(secondsSince(range_start) * 1000);
+            }
+            // Played to the end, seek back to the start like a looping <video>
+            sleepUntil(Clock::now() + std::chrono::seconds(1), running);
+        }
+    }
+
+    int findServerPid()
+    {
+        DIR *proc = opendir("/proc");
+        if (!proc)
+        {
+            return 0;
+        }
+        const int self = getpid();
+        int found = 0;
+        while (dirent *entry = readdir(proc))
+        {
+            const int pid = std::atoi(entry->d_name);
+            if (pid <= 0 || pid == self)
+            {
+                continue;
+            }
+            // comm is cut at 15 characters, which leaves "acquire-driver-" for this tool and the fake camera as well,
+            // argv[0] has the whole name. It is the first NUL terminated string of cmdline.
+            std::ifstream cmdline(std::string("/proc/") + entry->d_name + "/cmdline");
+            std::string argv0;
+            if (!std::getline(cmdline, argv0, '\0'))
+            {
+                continue;
+            }
+            const size_t slash = argv0.rfind('/');
+            if (argv0.compare(slash == std::string::npos ? 0 : slash + 1, std::string::npos, "acquire-driver-web") == 0)
+            {
+                found = pid;
+                break;
+            }
+        }
+        closedir(proc);
+        return found;
+    }
+
+    // utime + stime of a process in clock ticks, -1 if it is gone
+    long long processTicks(int pid)
+    {
+        std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+        std::string line;
+        if (!std::getline(stat, line))
+        {
+            return -1;
+        }
+        // The command name can contain spaces, fields are counted from the closing parenthesis
+        std::istringstream fields(line.substr(line.rfind(')') + 2));
+        std::string field;
+        long long utime = 0;
+        long long stime = 0;
+        for (int i = 3; fields >> field; i++)
+        {
+            if (i == 14)
+            {
+                utime = std::atoll(field.c_str());
+            }
+            else if (i == 15)
+            {
+                stime = std::atoll(field.c_str());
+                break;
+            }
+        }
+        return utime + stime;
+    }
+
+    void sampleServerCpu(int pid, LoadStats &stats, const std::atomic<bool> &running)
+    {
+        const double ticks_per_second = sysconf(_SC_CLK_TCK);
+        long long previous = processTicks(pid);
+        Clock::time_point previous_at = Clock::now();
+        while (running && previous >= 0)
+        {
+            sleepUntil(previous_at + std::chrono::seconds(1), running);
+            const long long ticks = processTicks(pid);
+            if (ticks < 0)
+            {
+                break;
+            }
+            stats.server_cpu.add(100.0 * (ticks - previous) / ticks_per_second / secondsSince(previous_at));
+            previous = ticks;
+            previous_at = Clock::now();
+        }
+    }
+
+    bool parseArgs(int argc, char *argv[], LoadConfig &config)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            const std::string arg = argv[i];
+            if (i + 1 >= argc)
+            {
+                std::cerr << "Missing value for " << arg << std::endl;
+                return false;
+            }
+            const std::string value = argv[++i];
+            if (arg == "--host")
+            {
+                config.host = value;
+            }
+            else if (arg == "--port")
+            {
+                config.port = std::atoi(value.c_str());
+            }
+            else if (arg == "--viewers")
+            {
+                config.viewers = std::atoi(value.c_str());
+            }
+            else if (arg == "--duration")
+            {
+                config.duration = std::atoi(value.c_str());
+            }
+            else if (arg == "--ramp")
+            {
+                config.ramp = std::atoi(value.c_str());
+            }
+            else if (arg == "--mode" && (value == "hls" || value == "webm" || value == "mixed"))
+            {
+                config.mode = value;
+            }
+            else if (arg == "--playlist")
+            {
+                config.playlist = value;
+            }
+            else if (arg == "--server-pid")
+            {
+                config.server_pid = std::atoi(value.c_str());
+            }
+            else
+            {
+                std::cerr << "Unknown argument: " << arg << " " << value << std::endl;
+                return false;
+            }
+        }
+        return config.viewers > 0 && config.duration > 0;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    LoadConfig config;
+    if (!parseArgs(argc, argv, config))
+    {
+        std::cerr << "Usage: " << argv[0] << " [--host localhost] [--port 8080] [--viewers 50] [--duration 60] [--ramp 10]"
+                  << " [--mode hls|webm|mixed] [--playlist /master.m3u8] [--server-pid PID]" << std::endl;
+        return 1;
+    }
+
+    LoadStats stats;
+    std::atomic<bool> running{true};
+    const Clock::time_point start = Clock::now();
+
+    const int pid = config.server_pid > 0 ? config.server_pid : findServerPid();
+    std::thread cpu_sampler;
+    if (pid > 0)
+    {
+        cpu_sampler = std::thread(sampleServerCpu, pid, std::ref(stats), std::cref(running));
+    }
+    else
+    {
+        std::cerr << "acquire-driver-web not found in /proc, server CPU won't be reported" << std::endl;
+    }
+
+    std::cout << "Starting " << config.viewers << " " << config.mode << " viewers against " << config.host << ":" << config.port
+              << " for " << config.duration << "s" << std::endl;
+    std::vector<std::thread> viewers;
+    for (int i = 0; i < config.viewers && running; i++)
+    {
+        // Viewers join evenly over the ramp, a mixed run alternates between the two kinds
+        sleepUntil(start + std::chrono::milliseconds(int64_t(config.ramp) * 1000 * i / config.viewers), running);
+        const bool hls = config.mode == "hls" || (config.mode == "mixed" && i % 2 == 0);
+        viewers.emplace_back(hls ? hlsViewer : webmViewer, std::cref(config), std::ref(stats), std::cref(running));
+    }
+
+    sleepUntil(start + std::chrono::seconds(config.duration), running);
+    running = false;
+    for (std::thread &viewer : viewers)
+    {
+        viewer.join();
+    }
+    if (cpu_sampler.joinable())
+    {
+        cpu_sampler.join();
+    }
+
+    const double elapsed = secondsSince(start);
+    std::cout << std::endl
+              << std::left << std::setw(28) << "metric" << std::right << std::setw(8) << "count"
+              << std::setw(12) << "p50" << std::setw(12) << "p95" << std::setw(12) << "p99" << std::setw(12) << "max" << std::endl;
+    stats.ttfb_ms.print("time to first byte", "ms");
+    stats.playlist_ms.print("playlist download", "ms");
+    stats.staleness_ms.print("playlist staleness", "ms");
+    stats.segment_ms.print("segment download", "ms");
+    stats.range_ms.print("range download", "ms");
+    stats.server_cpu.print("server cpu", "% of a core");
+    std::cout << std::endl
+              << "rebuffer events: " << stats.rebuffers << std::endl
+              << "errors: " << stats.errors << std::endl
+              << "received: " << std::fixed << std::setprecision(1) << stats.bytes / elapsed / (1024 * 1024) << " MiB/s" << std::endl;
+    return 0;
+}
@@ -0,0 +1,249 @@
+#include "logger.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <ctime>
+
+bool LogRing::push(const LogRecord &record)
+{
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == CAPACITY)
+    {
+        return false;
+    }
+    records_[head % CAPACITY] = record;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+void LogRing::drain(std::vector<LogRecord> &out)
+{
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    const size_t head = head_.load(std::memory_order_acquire);
+    for (; tail != head; tail++)
+    {
+        out.push_back(records_[tail % CAPACITY]);
+    }
+    tail_.store(tail, std::memory_order_release);
+}
+
+namespace
+{
+    // Marks the thread's ring orphaned when the thread exits, the writer drops it once it is empty
+    struct ThreadRing
+    {
+        std::shared_ptr<LogRing> ring;
+
+        ~ThreadRing()
+        {
+            if (ring)
+            {
+                ring->orphaned.store(true, std::memory_order_release);
+            }
+        }
+    };
+
+    const std::chrono::milliseconds WRITE_INTERVAL(20);
+
+    void appendArg(std::string &out, const LogArg &arg)
+    {
+        char buffer[32];
+        switch (arg.type)
+        {
+        case LogArg::Type::Int:
+            snprintf(buffer, sizeof(buffer), "%" PRId64, arg.i);
+            break;
+        case LogArg::Type::Uint:
+            snprintf(buffer, sizeof(buffer), "%" PRIu64, arg.u);
+            break;
+        case LogArg::Type::Double:
+            snprintf(buffer, sizeof(buffer), "%g", arg.d);
+            break;
+        case LogArg::Type::Pointer:
+            snprintf(buffer, sizeof(buffer), "%p", arg.p);
+            break;
+        case LogArg::Type::Literal:
+            out += arg.literal ? arg.literal : "(null)";
+            return;
+        case LogArg::Type::String:
+            out += arg.string;
+            return;
+        }
+        out += buffer;
+    }
+
+    // 2024-01-01T12:00:00.123456Z INFO [3] message
+    void formatRecord(std::string &out, const LogRecord &record)
+    {
+        const time_t seconds = record.time_ns / 1000000000;
+        std::tm utc;
+        gmtime_r(&seconds, &utc);
+        char prefix[64];
+        const size_t n = strftime(prefix, sizeof(prefix), "%Y-%m-%dT%H:%M:%S", &utc);
+        snprintf(prefix + n, sizeof(prefix) - n, ".%06dZ %-5s [%u] ", static_cast<int>(record.time_ns / 1000 % 1000000),
+                 logLevelName(record.level), static_cast<unsigned>(record.thread));
+        out += prefix;
+
+        size_t arg = 0;
+        for (const char *c = record.format; *c; c++)
+        {
+            if (c[0] == '{' && c[1] == '}' && arg < record.arg_count)
+            {
+                appendArg(out, record.args[arg++]);
+                c++;
+            }
+            else
+            {
+                out += *c;
+            }
+        }
+        out += '\n';
+    }
+}
+
+Logger &Logger::shared()
+{
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger() : thread_(&Logger::run, this) {}
+
+Logger::~Logger()
+{
+    running_ = false;
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+    writeOnce();
+}
+
+LogRing &Logger::threadRing()
+{
+    thread_local ThreadRing local;
+    if (!local.ring)
+    {
+        local.ring = std::make_shared<LogRing>();
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        rings_.push_back(local.ring);
+    }
+    return *local.ring;
+}
+
+void Logger::push(LogRecord &record)
+{
+    thread_local const uint16_t thread = next_thread_.fetch_add(1, std::memory_order_relaxed);
+    record.thread = thread;
+    record.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    if (!threadRing().push(record))
+    {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Logger::flush()
+{
+    writeOnce();
+}
+
+void Logger::run()
+{
+    while (running_)
+    {
+        std::this_thread::sleep_for(WRITE_INTERVAL);
+        writeOnce();
+    }
+}
+
+size_t Logger::writeOnce()
+{
+    std::lock_guard<std::mutex> write_lock(write_mutex_);
+
+    std::vector<std::shared_ptr<LogRing>> rings;
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        rings = rings_;
+    }
+    batch_.clear();
+    std::vector<LogRing *> finished;
+    for (const auto &ring : rings)
+    {
+        // Read before draining: once the owner is gone nothing new can arrive after this drain
+        const bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+        ring->drain(batch_);
+        if (orphaned)
+        {
+            finished.push_back(ring.get());
+        }
+    }
+    if (!finished.empty())
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex_);
+        rings_.erase(std::remove_if(rings_.begin(), rings_.end(), [&](const std::shared_ptr<LogRing> &ring)
+                                    { return std::find(finished.begin(), finished.end(), ring.get()) != finished.end(); }),
+                     rings_.end());
+    }
+
+    // Each ring is in order already, interleave the threads by time
+    std::stable_sort(batch_.begin(), batch_.end(), [](const LogRecord &a, const LogRecord &b)
+                     { return a.time_ns < b.time_ns; });
+
+    text_.clear();
+    std::string errors;
+    for (const LogRecord &record : batch_)
+    {
+        formatRecord(record.level >= LogLevel::Warn ? errors : text_, record);
+    }
+    const uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+    if (dropped != reported_dropped_)
+    {
+        errors += std::to_string(dropped - reported_dropped_) + " log records dropped, a log ring was full\n";
+        reported_dropped_ = dropped;
+    }
+
+    if (!text_.empty())
+    {
+        fwrite(text_.data(), 1, text_.size(), stdout);
+        fflush(stdout);
+    }
+    if (!errors.empty())
+    {
+        fwrite(errors.data(), 1, errors.size(), stderr);
+    }
+    return batch_.size();
+}
+
+bool parseLogLevel(const std::string &name, LogLevel &level)
+{
+    for (LogLevel candidate : {LogLevel::Trace, LogLevel::Debug, LogLevel::Info, LogLevel::Warn, LogLevel::Error, LogLevel::Off})
+    {
+        if (name == logLevelName(candidate))
+        {
+            level = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *logLevelName(LogLevel level)
+{
+    switch (level)
+    {
+    case LogLevel::Trace:
+        return "trace";
+    case LogLevel::Debug:
+        return "debug";
+    case LogLevel::Info:
+        return "info";
+    case LogLevel::Warn:
+        return "warn";
+    case LogLevel::Error:
+        return "error";
+    case LogLevel::Off:
+        return "off";
+    }
+    return "?";
+}
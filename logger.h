@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Leveled logging that never blocks the thread that logs.
+// A log call below the current level is one relaxed atomic load. Anything else is copied into a fixed size record
+// in a ring owned by the calling thread (single producer, single consumer). A background thread drains every ring,
+// formats the records and writes them out in batches. A full ring drops the record and counts the drop.
+//
+//   logTrace("Encoding frame {} of segment {}", frame, index);
+//
+// The format must be a string literal, it is kept by pointer and only formatted on the background thread.
+// Arguments are integers, floating point, pointers, string literals (const char *) and std::string,
+// which is copied and cut at LOG_STRING_CAPACITY - 1 characters.
+
+enum class LogLevel
+{
+    Trace, // per frame and per packet
+    Debug, // per segment and per request
+    Info,
+    Warn,
+    Error,
+    Off,
+};
+
+const size_t LOG_MAX_ARGS = 4;
+const size_t LOG_STRING_CAPACITY = 24;
+
+struct LogArg
+{
+    enum class Type : uint8_t
+    {
+        Int,
+        Uint,
+        Double,
+        Pointer,
+        Literal,
+        String,
+    };
+
+    Type type = Type::Int;
+    union
+    {
+        int64_t i;
+        uint64_t u;
+        double d;
+        const void *p;
+        const char *literal;
+        char string[LOG_STRING_CAPACITY];
+    };
+
+    LogArg() : i(0) {}
+};
+
+struct LogRecord
+{
+    int64_t time_ns = 0; // system clock
+    const char *format = nullptr;
+    LogLevel level = LogLevel::Info;
+    uint16_t thread = 0;
+    uint8_t arg_count = 0;
+    LogArg args[LOG_MAX_ARGS];
+};
+
+// One thread's records on their way to the writer
+class LogRing
+{
+public:
+    static constexpr size_t CAPACITY = 1024;
+
+    // Producer side, false if the ring is full
+    bool push(const LogRecord &record);
+
+    // Consumer side, appends everything pushed so far
+    void drain(std::vector<LogRecord> &out);
+
+    bool empty() const { return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire); }
+
+    std::atomic<bool> orphaned{false}; // set when the owning thread exits
+
+private:
+    LogRecord records_[CAPACITY];
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
+
+class Logger
+{
+public:
+    static Logger &shared();
+    ~Logger();
+
+    static bool enabled(LogLevel level) { return static_cast<int>(level) >= level_.load(std::memory_order_relaxed); }
+    static void setLevel(LogLevel level) { level_.store(static_cast<int>(level), std::memory_order_relaxed); }
+    static LogLevel level() { return static_cast<LogLevel>(level_.load(std::memory_order_relaxed)); }
+
+    template <typename... Args>
+    void log(LogLevel level, const char *format, const Args &...args)
+    {
+        static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+        LogRecord record;
+        record.level = level;
+        record.format = format;
+        record.arg_count = sizeof...(Args);
+        size_t i = 0;
+        (void)i;
+        (setArg(record.args[i++], args), ...);
+        push(record);
+    }
+
+    // Writes out everything logged so far, for the end of a command line run
+    void flush();
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    Logger();
+
+    void push(LogRecord &record);
+    LogRing &threadRing();
+    void run();
+    size_t writeOnce();
+
+    template <typename T>
+    static void setArg(LogArg &arg, const T &value)
+    {
+        if constexpr (std::is_same<T, bool>::value)
+        {
+            arg.type = LogArg::Type::Literal;
+            arg.literal = value ? "true" : "false";
+        }
+        else if constexpr (std::is_integral<T>::value && std::is_signed<T>::value)
+        {
+            arg.type = LogArg::Type::Int;
+            arg.i = value;
+        }
+        else if constexpr (std::is_integral<T>::value || std::is_enum<T>::value)
+        {
+            arg.type = LogArg::Type::Uint;
+            arg.u = static_cast<uint64_t>(value);
+        }
+        else if constexpr (std::is_floating_point<T>::value)
+        {
+            arg.type = LogArg::Type::Double;
+            arg.d = value;
+        }
+        else if constexpr (std::is_same<T, std::string>::value)
+        {
+            arg.type = LogArg::Type::String;
+            const size_t n = std::min(value.size(), LOG_STRING_CAPACITY - 1);
+            value.copy(arg.string, n);
+            arg.string[n] = '\0';
+        }
+        else if constexpr (std::is_convertible<T, const char *>::value)
+        {
+            arg.type = LogArg::Type::Literal;
+            arg.literal = value;
+        }
+        else
+        {
+            static_assert(std::is_pointer<T>::value, "unsupported log argument type");
+            arg.type = LogArg::Type::Pointer;
+            arg.p = static_cast<const void *>(value);
+        }
+    }
+
+    static inline std::atomic<int> level_{static_cast<int>(LogLevel::Info)};
+
+    std::mutex rings_mutex_;
+    std::vector<std::shared_ptr<LogRing>> rings_;
+    std::atomic<uint16_t> next_thread_{0};
+
+    std::mutex write_mutex_; // one writer at a time, the background thread or flush()
+    std::vector<LogRecord> batch_;
+    std::string text_;
+
+    std::atomic<bool> running_{true};
+    std::atomic<uint64_t> dropped_{0};
+    uint64_t reported_dropped_ = 0;
+    std::thread thread_;
+};
+
+// "trace", "debug", "info", "warn", "error" or "off". Returns false for anything else.
+bool parseLogLevel(const std::string &name, LogLevel &level);
+const char *logLevelName(LogLevel level);
+
+template <typename... Args>
+void logTrace(const char *format, const Args &...args)
+{
+    if (Logger::enabled(LogLevel::Trace))
+    {
+        Logger::shared().log(LogLevel::Trace, format, args...);
+    }
+}
+
+template <typename... Args>
+void logDebug(const char *format, const Args &...args)
+{
+    if (Logger::enabled(LogLevel::Debug))
+    {
+        Logger::shared().log(LogLevel::Debug, format, args...);
+    }
+}
+
+template <typename... Args>
+void logInfo(const char *format, const Args &...args)
+{
+    if (Logger::enabled(LogLevel::Info))
+    {
+        Logger::shared().log(LogLevel::Info, format, args...);
+    }
+}
+
+template <typename... Args>
+void logWarn(const char *format, const Args &...args)
+{
+    if (Logger::enabled(LogLevel::Warn))
+    {
+        Logger::shared().log(LogLevel::Warn, format, args...);
+    }
+}
+
+template <typename... Args>
+void logError(const char *format, const Args &...args)
+{
+    if (Logger::enabled(LogLevel::Error))
+    {
+        Logger::shared().log(LogLevel::Error, format, args...);
+    }
+}
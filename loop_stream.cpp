@@ -0,0 +1,178 @@
+#include "loop_stream.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "hls.h"
+#include "logger.h"
+#include "webm.h"
+#include "xor_texture.h"
+
+namespace
+{
+    void keepFrame(H264Loop &loop, x264_nal_t *nals, int i_nals, const x264_picture_t &out_pic)
+    {
+        EncodedFrame frame;
+        for (int j = 0; j < i_nals; j++)
+        {
+            frame.data.insert(frame.data.end(), nals[j].p_payload, nals[j].p_payload + nals[j].i_payload);
+        }
+        frame.pts = out_pic.i_pts;
+        frame.dts = out_pic.i_dts;
+        frame.keyframe = out_pic.b_keyframe;
+        loop.frames.push_back(std::move(frame));
+    }
+}
+
+std::shared_ptr<const H264Loop> encodeH264Loop(int width, int height, int period, const LoopFrameSource &source, int bitrate)
+{
+    x264_t *encoder = openHLSEncoder(width, height, bitrate);
+    if (!encoder)
+    {
+        std::cerr << "Failed to open loop encoder" << std::endl;
+        return nullptr;
+    }
+
+    auto loop = std::make_shared<H264Loop>();
+    loop->width = width;
+    loop->height = height;
+    loop->period = period;
+
+    x264_picture_t in_pic;
+    x264_picture_t out_pic;
+    x264_nal_t *nals;
+    int i_nals;
+    bool ok = true;
+    for (int i = 0; i < period && ok; i++)
+    {
+        PooledFrame frame = source(width, height, i);
+        if (!frame)
+        {
+            ok = false;
+            break;
+        }
+        wrapX264Picture(frame, &in_pic);
+        in_pic.i_pts = i;
+        // Only the first frame is an IDR (the encoder's keyint is longer than any period we loop), so each period decodes on its own
+        in_pic.i_type = i == 0 ? X264_TYPE_IDR : X264_TYPE_AUTO;
+
+        int frame_size = x264_encoder_encode(encoder, &nals, &i_nals, &in_pic, &out_pic);
+        if (frame_size < 0)
+        {
+            std::cerr << "Failed to encode loop frame" << std::endl;
+            ok = false;
+        }
+        else if (frame_size > 0)
+        {
+            keepFrame(*loop, nals, i_nals, out_pic);
+        }
+    }
+    while (ok && x264_encoder_delayed_frames(encoder))
+    {
+        int frame_size = x264_encoder_encode(encoder, &nals, &i_nals, NULL, &out_pic);
+        if (frame_size < 0)
+        {
+            std::cerr << "Loop encoder failed while flushing" << std::endl;
+            ok = false;
+        }
+        else if (frame_size > 0)
+        {
+            keepFrame(*loop, nals, i_nals, out_pic);
+        }
+    }
+    x264_encoder_close(encoder);
+
+    if (!ok || loop->frames.empty())
+    {
+        return nullptr;
+    }
+    return loop;
+}
+
+ChunkedBufferPtr muxLoopSegment(const H264Loop &loop, int64_t index)
+{
+    SegmentMuxer muxer(Container::MpegTs, loop.width, loop.height);
+    if (!muxer.ok())
+    {
+        return nullptr;
+    }
+
+    const int64_t shift = index * loop.period;
+    for (const EncodedFrame &frame : loop.frames)
+    {
+        if (!muxer.writeData(frame.data.data(), frame.data.size(), frame.pts + shift, frame.dts + shift, frame.keyframe))
+        {
+            return nullptr;
+        }
+    }
+    return muxer.finish();
+}
+
+LoopHlsStream::LoopHlsStream(const LoopHlsConfig &config, SegmentCache &cache)
+    : config_(config), cache_(cache), start_(std::chrono::steady_clock::now()) {}
+
+std::shared_ptr<const H264Loop> LoopHlsStream::loop()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!loop_)
+    {
+        logInfo("Encoding {} frame loop for {}", XOR_TEXTURE_PERIOD, config_.stream);
+        loop_ = encodeH264Loop(config_.width, config_.height, XOR_TEXTURE_PERIOD, [](int width, int height, int frame)
+                               { return genXorTexture(width, height, frame); }, config_.bitrate);
+    }
+    return loop_;
+}
+
+int64_t LoopHlsStream::liveIndex() const
+{
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_);
+    return elapsed.count() * FRAME_RATE / (int64_t(XOR_TEXTURE_PERIOD) * 1000);
+}
+
+PlaylistSnapshotPtr LoopHlsStream::playlist()
+{
+    PlaylistSnapshotPtr playlist = std::atomic_load(&playlist_);
+    const int64_t newest = liveIndex();
+    if (playlist && playlist->version == newest)
+    {
+        return playlist;
+    }
+    if (!loop())
+    {
+        return nullptr;
+    }
+
+    const double duration = double(XOR_TEXTURE_PERIOD) / FRAME_RATE;
+    const int64_t oldest = std::max<int64_t>(0, newest - config_.window_size + 1);
+
+    std::ostringstream content;
+    content << "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:" << static_cast<int>(std::ceil(duration)) << "\n";
+    content << "#EXT-X-MEDIA-SEQUENCE:" << oldest << "\n";
+    content << std::fixed << std::setprecision(3);
+    for (int64_t index = oldest; index <= newest; index++)
+    {
+        content << "#EXTINF:" << duration << ",\nsegment_" << index << ".ts\n";
+    }
+    // Racing renders of the same segment are identical, and one of an older segment just gets rendered over again
+    playlist = PlaylistSnapshot::make(content.str(), newest);
+    std::atomic_store(&playlist_, playlist);
+    return playlist;
+}
+
+SegmentCache::ValuePtr LoopHlsStream::segment(int64_t index)
+{
+    if (index < 0 || index > liveIndex() + 1)
+    {
+        return nullptr;
+    }
+    std::shared_ptr<const H264Loop> looped = loop();
+    if (!looped)
+    {
+        return nullptr;
+    }
+    return cache_.getOrBuild(SegmentKey{config_.stream, config_.width, config_.height, index}, [&]() -> SegmentCache::ValuePtr
+                             { return muxLoopSegment(*looped, index); });
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "buffer_cache.h"
+#include "encoded_frame.h"
+#include "frame_pool.h"
+#include "playlist_snapshot.h"
+
+// Frame `frame` (0 <= frame < period) of a source that repeats, the XOR texture or a recording played in a loop
+using LoopFrameSource = std::function<PooledFrame(int width, int height, int frame)>;
+
+// One period of a repeating source encoded once, as a single closed GOP that starts on an IDR.
+// Frame n of the endless stream is frame n % period of the loop, so every later period is the same frames with shifted timestamps.
+struct H264Loop
+{
+    int width = 0;
+    int height = 0;
+    int period = 0;                   // frames
+    std::vector<EncodedFrame> frames; // decode order, timestamps within the period
+};
+
+// Returns nullptr if the encoder couldn't be opened or a frame couldn't be made
+std::shared_ptr<const H264Loop> encodeH264Loop(int width, int height, int period, const LoopFrameSource &source, int bitrate = 0);
+
+// Muxes period `index` of the loop into a self contained TS segment, timestamps start at index * period.
+// Nothing is encoded, the muxer only restamps the cached frames and writes fresh PAT/PMT and continuity counters.
+ChunkedBufferPtr muxLoopSegment(const H264Loop &loop, int64_t index);
+
+struct LoopHlsConfig
+{
+    std::string stream = "xor_loop";
+    int width = 1280;
+    int height = 720;
+    int bitrate = 0; // kbit/s, 0 for constant quality
+    int window_size = 6;
+};
+
+// Live HLS of the XOR texture for soak and load tests, one segment per XOR_TEXTURE_PERIOD frames.
+// Nothing runs in the background: the period is encoded on the first request, after that segments are remuxed
+// from the cached frames when asked for (and kept in the segment cache) and the playlist just follows the clock.
+// A stream costs next to no CPU however long it runs.
+class LoopHlsStream
+{
+public:
+    LoopHlsStream(const LoopHlsConfig &config, SegmentCache &cache);
+
+    // Live playlist of the last window_size segments up to the one playing now, nullptr if the loop couldn't be encoded.
+    // Rendered once per segment, every poll in between gets the same one.
+    PlaylistSnapshotPtr playlist();
+
+    // Any segment up to the one after the one playing now, nullptr for later ones or if the loop couldn't be encoded
+    SegmentCache::ValuePtr segment(int64_t index);
+
+    const LoopHlsConfig &config() const { return config_; }
+
+private:
+    std::shared_ptr<const H264Loop> loop();
+    int64_t liveIndex() const;
+
+    const LoopHlsConfig config_;
+    SegmentCache &cache_;
+    const std::chrono::steady_clock::time_point start_;
+
+    std::mutex mutex_; // held while the loop is encoded, so concurrent first requests wait for the one encode
+    std::shared_ptr<const H264Loop> loop_;
+    PlaylistSnapshotPtr playlist_; // version is the newest segment, only accessed through std::atomic_load/atomic_store
+};
@@ -1,6 +1,9 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
 #include <iostream>
 #include <filesystem>
-#include <fstream>
 #include <httplib.h>
 #include <vpx/vpx_image.h>
 #include <vpx/vpx_encoder.h>
@@ -8,345 +11,369 @@
 #include <vp9/common/vp9_common.h>
 #include <mkvmuxer/mkvwriter.h>
 
-#include <x264.h>
-
-extern "C"
-{
-#include <libavformat/avformat.h>
-    // #include "libswscale/swscale.h"
-}
-
-// Modified mkvmuxer::MkvWriter that writes to a memory buffer instead of a file
-class MemoryBufferMkvWriter : public mkvmuxer::IMkvWriter
+#include "buffer_cache.h"
+#include "frame_scale.h"
+#include "hls.h"
+#include "hls_batch.h"
+#include "hls_producer.h"
+#include "http_range.h"
+#include "ingest_ring.h"
+#include "live_webm.h"
+#include "logger.h"
+#include "loop_stream.h"
+#include "mapped_file.h"
+#include "metrics.h"
+#include "pixel_convert.h"
+#include "playlist_snapshot.h"
+#include "segment_store.h"
+#include "webm.h"
+#include "xor_texture.h"
+
+// Segments are shared between every viewer, the producer publishes into this and old segments linger here after leaving the playlist
+const size_t SEGMENT_CACHE_MAX_BYTES = 256 * 1024 * 1024;
+
+// Finished HLS segments on disk for the DVR playlist, under ACQUIRE_SEGMENT_DIR (./segments by default)
+static SegmentStoreConfig segmentStoreConfig()
 {
-public:
-    MemoryBufferMkvWriter(std::vector<uint8_t> &buffer) : buffer_(buffer) {}
-
-    virtual int64_t Position() const override
+    SegmentStoreConfig config;
+    if (const char *directory = std::getenv("ACQUIRE_SEGMENT_DIR"))
     {
-        return position_;
+        config.directory = directory;
     }
+    return config;
+}
+SegmentStore segment_store(segmentStoreConfig());
 
-    virtual int32_t Position(int64_t position) override
+// How 16 bit camera frames are brought down to 8 bits: ACQUIRE_INGEST_LEVELS is "percentile" (the default), "minmax"
+// or a fixed "low-high" window, ACQUIRE_INGEST_GAMMA a gamma to apply on top
+static PixelWindowConfig ingestWindowConfig()
+{
+    PixelWindowConfig config;
+    if (const char *levels = std::getenv("ACQUIRE_INGEST_LEVELS"))
     {
-        if (position < 0 || static_cast<size_t>(position) > buffer_.size())
+        unsigned low = 0;
+        unsigned high = 0;
+        if (std::string(levels) == "minmax")
         {
-            return -1;
+            config.auto_levels = AutoLevels::MinMax;
+        }
+        else if (std::sscanf(levels, "%u-%u", &low, &high) == 2 && low < high && high <= 0xFFFF)
+        {
+            config.auto_levels = AutoLevels::Off;
+            config.low = static_cast<uint16_t>(low);
+            config.high = static_cast<uint16_t>(high);
+        }
+        else if (std::string(levels) != "percentile")
+        {
+            std::cerr << "Unknown ACQUIRE_INGEST_LEVELS " << levels << ", using percentile" << std::endl;
         }
-        position_ = position;
-        return 0;
     }
-
-    virtual bool Seekable() const override
+    if (const char *gamma = std::getenv("ACQUIRE_INGEST_GAMMA"))
     {
-        return true;
+        config.gamma = std::atof(gamma);
     }
+    return config;
+}
 
-    virtual int32_t Write(const void *buf, uint32_t len) override
+// Continuous XOR stream served over HLS, one rendition per rung of the default ladder.
+// With ACQUIRE_INGEST naming a ring (see ingest_ring.h) the frames come from the camera instead, laddered down from
+// its size. ACQUIRE_INGEST_POLICY=block makes the camera wait for the encoders rather than have frames dropped.
+static HlsProducerConfig hlsProducerConfig()
+{
+    HlsProducerConfig config;
+    const char *ingest = std::getenv("ACQUIRE_INGEST");
+    if (!ingest)
     {
-        const size_t new_size = position_ + len;
-        if (new_size > buffer_.size())
-        {
-            buffer_.resize(new_size);
-        }
-        std::memcpy(buffer_.data() + position_, buf, len);
-        position_ += len;
-        return 0;
+        return config;
     }
-
-    virtual void ElementStartNotify(uint64_t element_id, int64_t position) override
+    const char *policy = std::getenv("ACQUIRE_INGEST_POLICY");
+    const IngestPolicy ingest_policy = policy && std::string(policy) == "block" ? IngestPolicy::Block : IngestPolicy::DropOldest;
+    // The ladder depends on the camera's size, so the ring has to be there already
+    std::unique_ptr<IngestReader> ring = IngestReader::open(ingest, ingest_policy, config.ingest_backlog);
+    if (!ring)
+    {
+        std::cerr << "No ingest ring " << ingest << ", streaming the XOR texture instead" << std::endl;
+        return config;
+    }
+    config.ingest = ingest;
+    config.ingest_policy = ingest_policy;
+    config.ingest_window = ingestWindowConfig();
+    // How much a macroblock has to change to be encoded again (see frame_diff.h), "off" encodes everything
+    if (const char *threshold = std::getenv("ACQUIRE_INGEST_STATIC_THRESHOLD"))
     {
-        // No op
-        // Could put some logging in here
+        config.skip_static = std::string(threshold) != "off";
+        config.static_threshold = static_cast<uint32_t>(std::strtoul(threshold, nullptr, 10));
     }
+    config.renditions = ingestLadder(ring->header().width, ring->header().height);
+    return config;
+}
+SegmentCache segment_cache(SEGMENT_CACHE_MAX_BYTES);
+HlsProducer hls_producer(hlsProducerConfig(), segment_cache, &segment_store);
 
-private:
-    std::vector<uint8_t> &buffer_;
-    size_t position_ = 0;
-};
+// Same XOR texture for soak and load tests, only its first period is ever encoded
+LoopHlsStream loop_hls(LoopHlsConfig{}, segment_cache);
 
-// Given a width, height, and time component generate a XOR texture
-vpx_image_t *genXorTexture(int width, int height, int time)
+// One live VP9 encode shared by every /stream subscriber, looped since the XOR source repeats anyway
+static LiveWebmConfig liveWebmConfig()
 {
-    if (width <= 0 || height <= 0)
+    LiveWebmConfig config;
+    config.loop = true;
+    return config;
+}
+LiveWebmStream live_webm(liveWebmConfig());
+
+// Encoded webm files keyed by their encode parameters
+const size_t WEBM_CACHE_MAX_BYTES = 64 * 1024 * 1024;
+WebmCache webm_cache(WEBM_CACHE_MAX_BYTES);
+
+// Route label of a request path for the metrics, by what it serves
+static const char *routeLabel(const std::string &path)
+{
+    auto ends_with = [&path](const std::string &suffix)
+    {
+        return path.size() >= suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    if (path == "/stream" || path == "/webm" || path == "/metrics")
     {
-        std::cerr << "Invalid dimensions provided." << std::endl;
-        return nullptr;
+        return path.c_str() + 1;
     }
-
-    vpx_image_t *img = vpx_img_alloc(nullptr, VPX_IMG_FMT_I420, width, height, 1);
-    if (!img)
+    if (ends_with(".m3u8"))
     {
-        std::cerr << "Failed to allocate image." << std::endl;
-        return nullptr;
+        return "playlist";
     }
+    if (ends_with(".ts"))
+    {
+        return path.find(".part_") != std::string::npos ? "part" : "segment";
+    }
+    if (ends_with(".m4s"))
+    {
+        return "cmaf_segment";
+    }
+    if (ends_with("/init.mp4"))
+    {
+        return "init";
+    }
+    return "static";
+}
 
-    for (int y = 0; y < height; ++y)
+// Response body bytes by route. Bodies set in full are counted by the server logger, streamed ones as they are written.
+static Counter &servedBytes(const std::string &path)
+{
+    static const std::map<std::string, Counter *> counters = []
     {
-        for (int x = 0; x < width; ++x)
+        std::map<std::string, Counter *> counters;
+        for (const char *route : {"stream", "webm", "metrics", "playlist", "part", "segment", "cmaf_segment", "init", "static"})
         {
-            uint8_t value = x ^ y ^ (time & 0xFF);
-            // Set the Y (luminance) component to the XOR value
-            img->planes[VPX_PLANE_Y][y * img->stride[VPX_PLANE_Y] + x] = value;
-
-            // For the I420 format, U and V (chrominance) planes are quarter resolution.
-            // Set them to 128 (neutral value) to get a grayscale image.
-            if (x % 2 == 0 && y % 2 == 0)
-            {
-                img->planes[VPX_PLANE_U][y / 2 * img->stride[VPX_PLANE_U] + x / 2] = 128;
-                img->planes[VPX_PLANE_V][y / 2 * img->stride[VPX_PLANE_V] + x / 2] = 128;
-            }
+            counters[route] = &MetricsRegistry::shared().counter("acquire_http_response_bytes_total", "Response body bytes written, by route", {{"route", route}});
         }
-    }
-
-    return img;
+        return counters;
+    }();
+    return *counters.at(routeLabel(path));
 }
 
-static int encode_frame(vpx_codec_ctx_t *codec, vpx_image_t *img, int frame_index, int flags, mkvmuxer::IMkvWriter *writer, mkvmuxer::Segment &segment, const uint64_t &track)
+static bool writeCounted(httplib::DataSink &sink, Counter &served, const void *data, size_t size)
 {
-    int got_pkts = 0;
-    vpx_codec_iter_t iter = NULL;
-    const vpx_codec_cx_pkt_t *pkt = NULL;
+    served.add(size);
+    return sink.write(static_cast<const char *>(data), size);
+}
 
-    const vpx_codec_err_t res = vpx_codec_encode(codec, img, frame_index, 1, flags, VPX_DL_GOOD_QUALITY);
-    if (res != VPX_CODEC_OK)
+// Writes length bytes of a representation, starting at offset, into the sink
+using ByteSource = std::function<bool(uint64_t offset, uint64_t length, httplib::DataSink &sink)>;
+
+// Answers a GET of a representation of size bytes with whatever http_range.h works out for the request: all of it,
+// one range, several as multipart/byteranges, 304 or 416. Every byte is written straight out of source as httplib
+// asks for it, nothing is copied into the response.
+static void serveRanges(const httplib::Request &req, httplib::Response &res, uint64_t size, const HttpValidators &validators,
+                        const std::string &content_type, Counter &served, ByteSource source)
+{
+    const RangeRequest request{req.get_header_value("Range"), req.get_header_value("If-Range"),
+                               req.get_header_value("If-None-Match"), req.get_header_value("If-Modified-Since")};
+    RangePlan plan = planRangeResponse(request, size, validators);
+    // httplib applies the Range header to content providers itself (without If-Range, and again on top of this),
+    // the plan already answers it
+    const_cast<httplib::Request &>(req).ranges.clear();
+
+    res.set_header("Accept-Ranges", "bytes");
+    if (!validators.etag.empty())
     {
-        std::cerr << "Error during encoding: " << vpx_codec_error(codec);
-        const char *detail = vpx_codec_error_detail(codec);
-        if (detail)
-        {
-            std::cerr << " - " << detail;
-        }
-        std::cerr << std::endl;
-        exit(1);
+        res.set_header("ETag", validators.etag);
     }
-
-    while ((pkt = vpx_codec_get_cx_data(codec, &iter)) != NULL)
+    if (validators.modified != 0)
+    {
+        res.set_header("Last-Modified", formatHttpDate(validators.modified));
+    }
+    res.status = plan.status;
+    if (plan.status == 304)
+    {
+        return;
+    }
+    if (plan.status == 416)
+    {
+        res.set_header("Content-Range", "bytes */" + std::to_string(size));
+        return;
+    }
+    if (plan.status == 200)
     {
-        got_pkts = 1;
+        res.set_content_provider(size, content_type, [source](size_t offset, size_t length, httplib::DataSink &sink)
+                                 { return source(offset, length, sink); });
+        return;
+    }
+    if (plan.ranges.size() == 1)
+    {
+        const ByteRange range = plan.ranges.front();
+        res.set_header("Content-Range", contentRange(range, size));
+        res.set_content_provider(range.length, content_type, [source, range](size_t offset, size_t length, httplib::DataSink &sink)
+                                 { return source(range.offset + offset, length, sink); });
+        return;
+    }
 
-        if (pkt->kind == VPX_CODEC_CX_FRAME_PKT)
+    // The body is each part's header followed by its range, then the closing boundary. httplib asks for it in pieces,
+    // each call writes whatever of the parts overlaps the piece.
+    auto body = std::make_shared<MultipartByteRanges>(multipartByteRanges(plan.ranges, size, content_type));
+    auto ranges = std::make_shared<std::vector<ByteRange>>(std::move(plan.ranges));
+    res.set_content_provider(body->length, body->content_type, [body, ranges, source, &served](size_t offset, size_t length, httplib::DataSink &sink)
+    {
+        const uint64_t end = offset + length;
+        uint64_t position = 0; // of the current part in the body
+        uint64_t from = 0;
+        uint64_t count = 0;
+        auto overlap = [&](uint64_t part_size)
+        {
+            from = std::max<uint64_t>(offset, position) - position;
+            const uint64_t to = std::min<uint64_t>(end, position + part_size);
+            count = to > position + from ? to - position - from : 0;
+            position += part_size;
+            return count > 0;
+        };
+        for (size_t i = 0; i < ranges->size() && position < end; i++)
         {
-            // std::cout << "Frame index: " << frame_index << " - Frame size: " << pkt->data.frame.sz << std::endl;
-            const int keyframe = (pkt->data.frame.flags & VPX_FRAME_IS_KEY) != 0;
-            // std::cout << "Frame PTS: " << pkt->data.frame.pts << std::endl;
-            // TODO: reference the 30 as a frame rate variable
-            int addFrame = segment.AddFrame(static_cast<const uint8_t *>(pkt->data.frame.buf), pkt->data.frame.sz, track, pkt->data.frame.pts * 1e9 / 30, keyframe);
-            // std::cout << "Add frame result: " << addFrame << std::endl;
-            if (!addFrame)
+            const std::string &header = body->part_headers[i];
+            if (overlap(header.size()) && !writeCounted(sink, served, header.data() + from, count))
             {
-                std::cerr << "Failed to add frame to webm" << std::endl;
-                exit(1);
+                return false;
+            }
+            const ByteRange &range = (*ranges)[i];
+            if (overlap(range.length) && !source(range.offset + from, count, sink))
+            {
+                return false;
             }
         }
-    }
-
-    return got_pkts;
+        return !overlap(body->closing.size()) || writeCounted(sink, served, body->closing.data() + from, count);
+    });
 }
 
+// Serves a chunked buffer without flattening or copying it
+static void setChunkedContent(const httplib::Request &req, httplib::Response &res, const ChunkedBufferPtr &buffer, const char *content_type,
+                              Counter &served, const HttpValidators &validators = HttpValidators())
+{
+    serveRanges(req, res, buffer->size(), validators, content_type, served, [buffer, &served](uint64_t offset, uint64_t length, httplib::DataSink &sink)
+                {
+                    return buffer->forEach(offset, length, [&sink, &served](const uint8_t *data, size_t size)
+                                           { return writeCounted(sink, served, data, size); }); });
+}
 
+// Serves a mapped file straight out of the page cache, validated by its size and modification time
+static void setMappedContent(const httplib::Request &req, httplib::Response &res, const MappedFilePtr &file, const char *content_type, Counter &served)
+{
+    const HttpValidators validators{fileEtag(file->size(), file->modified()), file->modified()};
+    serveRanges(req, res, file->size(), validators, content_type, served, [file, &served](uint64_t offset, uint64_t length, httplib::DataSink &sink)
+                { return writeCounted(sink, served, file->data() + offset, length); });
+}
 
-
-const int FRAME_RATE = 30; // fps
-const int SEGMENT_DURATION = 10; // in seconds
-
-void generateXorTexture(x264_picture_t *pic, int width, int height, int time)
+template <typename Cache>
+static void registerCacheMetrics(const char *name, const Cache &cache)
 {
-    std::cout << pic << std::endl;
-    if (x264_picture_alloc(pic, X264_CSP_I420, width, height) < 0)
-    {
-        std::cerr << "Failed to allocate picture" << std::endl;
-    }
+    MetricsRegistry &registry = MetricsRegistry::shared();
+    registry.callback("acquire_cache_hits_total", "Cache lookups served from the cache", true, {{"cache", name}}, [&cache]
+                      { return static_cast<double>(cache.stats().hits); });
+    registry.callback("acquire_cache_misses_total", "Cache lookups that did not find the value and built it or came back empty", true, {{"cache", name}}, [&cache]
+                      { return static_cast<double>(cache.stats().misses); });
+    registry.callback("acquire_cache_coalesced_total", "Cache lookups that waited on another request's build", true, {{"cache", name}}, [&cache]
+                      { return static_cast<double>(cache.stats().coalesced); });
+    registry.callback("acquire_cache_bytes", "Bytes held by the cache", false, {{"cache", name}}, [&cache]
+                      { return static_cast<double>(cache.stats().bytes); });
+}
 
-    for (int y = 0; y < height; y++)
+// ?t= of /webm in nanoseconds, clamped to [0, last_ns] so a time past the end starts at the last cluster.
+// False unless the whole value is a finite number.
+static bool parseStartTime(const std::string &text, uint64_t last_ns, uint64_t &time_ns)
+{
+    char *end = nullptr;
+    const double seconds = std::strtod(text.c_str(), &end);
+    if (text.empty() || end != text.c_str() + text.size() || !std::isfinite(seconds))
     {
-        for (int x = 0; x < width; x++)
-        {
-            uint8_t value = x ^ y ^ (time & 0xFF);
-            pic->img.plane[0][y * width + x] = value; // Y channel (luminance)
-            pic->img.plane[1][y * width / 2 + x / 2] = 128; // U channel (128 for gray)
-            pic->img.plane[2][y * width / 2 + x / 2] = 128; // V channel (128 for gray)
-        }
+        return false;
     }
+    const double ns = std::max(0.0, seconds * 1e9);
+    time_ns = ns >= static_cast<double>(last_ns) ? last_ns : static_cast<uint64_t>(ns);
+    return true;
 }
 
-// TODO: instead of using x264 codec use the avformat codec for the frames
-// Known issue where the stream will start off fine but will get noiser over time, likely due to the fact that the layout of the frames is different, eventually memory management issues
-// All the issues in this function are likely related to this
-std::vector<uint8_t> generateHLSSegment(int width, int height, int64_t pts_offset = 0)
+// Sends a rendered playlist as it is, or 304 if the player already has this version
+static void sendPlaylist(const httplib::Request &req, httplib::Response &res, const PlaylistSnapshotPtr &playlist)
 {
-    std::cout << "Generating HLS segment" << std::endl;
-
-    std::vector<uint8_t> ts_data;
-
-    AVFormatContext *outctx = nullptr;
-    avformat_alloc_output_context2(&outctx, nullptr, "mpegts", nullptr);
-
-    AVStream *stream = avformat_new_stream(outctx, nullptr);
-    stream->time_base.num = 1;
-    stream->time_base.den = FRAME_RATE;
-    // stream->duration = 300; // in time_base units
-
-    stream->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
-    stream->codecpar->codec_id = AV_CODEC_ID_H264;
-    stream->codecpar->width = width;
-    stream->codecpar->height = height;
-
-    avio_open_dyn_buf(&outctx->pb);
-    avformat_write_header(outctx, nullptr);
-
-    // Initialize the encoder
-    x264_param_t param;
-    x264_param_default_preset(&param, "fast", "zerolatency"); // or ultrafast
-    // param.i_threads = 1;
-    param.i_csp = X264_CSP_I420;
-    param.i_width = width;
-    param.i_height = height;
-    param.i_fps_num = FRAME_RATE;
-    param.i_fps_den = 1;
-    param.b_vfr_input = 0;
-    param.b_repeat_headers = 1;
-    param.b_annexb = 1;
-    if (x264_param_apply_profile(&param, "high") < 0)
+    res.set_header("ETag", playlist->etag);
+    if (etagMatches(req.get_header_value("If-None-Match"), playlist->etag))
     {
-        std::cerr << "Failed to apply profile restrictions" << std::endl;
+        res.status = 304;
+        return;
     }
+    res.set_content(playlist->body, "application/vnd.apple.mpegurl");
+}
 
-    x264_t *encoder = x264_encoder_open(&param);
-    if (!encoder)
+// The HLS routes take an optional rendition prefix (/480p/playlist.m3u8), without one they serve the largest rendition.
+// Answers 404 for a rendition that doesn't exist.
+static bool findRendition(const httplib::Request &req, httplib::Response &res, size_t &rendition)
+{
+    rendition = hls_producer.findRendition(req.matches[1]);
+    if (rendition == HlsProducer::NO_RENDITION)
     {
-        std::cerr << "Failed to open encoder" << std::endl;
-        return {};
+        res.status = 404;
+        return false;
     }
+    return true;
+}
 
-    int64_t timestamp = 0;
-    int64_t num_frames = FRAME_RATE * SEGMENT_DURATION; // The number of frames in a segment
-    std::cout << "Encoding " << num_frames << " frames" << std::endl;
-    for (int64_t i = pts_offset; i < pts_offset + num_frames; i++)
+int main(int argc, char *argv[])
+{
+    // ACQUIRE_LOG_LEVEL=trace logs every frame, the level can also be changed while running with POST /log-level?level=...
+    if (const char *level_name = std::getenv("ACQUIRE_LOG_LEVEL"))
     {
-        std::cout << "Encoding frame " << i << std::endl;
-        x264_picture_t in_pic;
-        x264_picture_t out_pic;
-        // Sometimes there is an error thrown around here: malloc: Region cookie corrupted for region 0x150000000 (value is 80808080)[0x150007ffc]
-        generateXorTexture(&in_pic, width, height, i);
-        std::cout << "Made texture" << std::endl;
-
-        in_pic.i_pts = i;
-        std::cout << "Frame " << i << " PTS: " << in_pic.i_pts << std::endl;
-
-        x264_nal_t *nals; // Network abstraction layer, essentially these are groups of packets
-        int i_nals;
-
-        int frame_size = x264_encoder_encode(encoder, &nals, &i_nals, &in_pic, &out_pic); // Encode the frame
-
-        if (frame_size < 0) // Is this actually an error? Doesn't it just mean the frame was buffered?
+        LogLevel level;
+        if (parseLogLevel(level_name, level))
         {
-            std::cerr << "Failed to encode frame" << std::endl;
+            Logger::setLevel(level);
         }
         else
-        { // Mux the encoded frame into the stream
-            for (int j = 0; j < i_nals; j++)
-            {
-                AVPacket pkt;
-                av_init_packet(&pkt);
-
-                // pkt.time_base = (AVRational){1, FRAME_RATE};
-                // std::cout << "pkt time base: " << pkt.time_base.num << "/" << pkt.time_base.den << std::endl;
-
-                pkt.data = nals[j].p_payload;
-                pkt.size = nals[j].i_payload;
-                // pkt.flags |= AV_PKT_FLAG_KEY;
-
-                //  dts <= pts
-                //  TODO: something about this is wrong, the image gets noisier over time so pts may be slightly off?
-                // Could be be bc of dts discontinuities? see ffprobe output
-                pkt.dts = av_rescale_q(in_pic.i_pts, (AVRational){1, FRAME_RATE}, stream->time_base) - i_nals + j;
-                pkt.pts = av_rescale_q(in_pic.i_pts, (AVRational){1, FRAME_RATE}, stream->time_base);
-                std::cout << "pkt dts: " << pkt.dts << std::endl;
-                std::cout << "pkt pts: " << pkt.pts << std::endl;
-
-                // Sometimes there's segfults here?
-                if (av_interleaved_write_frame(outctx, &pkt) != 0)
-                {
-                    std::cerr << "Failed to write frame" << std::endl;
-                }
-                else
-                {
-                    std::cout << "Wrote frame " << i << std::endl;
-                }
-            }
+        {
+            std::cerr << "Unknown log level: " << level_name << std::endl;
         }
-
-        // x264_picture_clean(&in_pic); // this line was breaking things?
-        // std::cout << "Encoded frame " << i << std::endl;
     }
 
-    // Flush the encoder
-    std::cout << "Flushing encoder" << std::endl;
-    while (x264_encoder_delayed_frames(encoder))
+    // acquire-driver-web --vp9-thread-scaling [width height]: print VP9 encode fps per thread count and exit
+    if (argc > 1 && std::string(argv[1]) == "--vp9-thread-scaling")
     {
-        std::cout << "Entered flushing loop" << std::endl;
-        x264_nal_t *nals;
-        int i_nals;
-        x264_picture_t out_pic;
-
-        int frame_size = x264_encoder_encode(encoder, &nals, &i_nals, NULL, &out_pic);
-        if (frame_size < 0)
+        WebmParams params;
+        params.realtime = true;
+        params.cpu_used = 8;
+        if (argc > 3)
         {
-            std::cerr << "Encoder failed while flushing" << std::endl;
-        }
-        else
-        { // Mux the remaining encoded frames into the stream
-            for (int j = 0; j < i_nals; j++)
-            {
-                // std::cout << "in write nal loop" << std::endl;
-                AVPacket pkt;
-                av_init_packet(&pkt);
-                pkt.data = nals[j].p_payload;
-                pkt.size = nals[j].i_payload;
-                // does the pts and dts need to be set here? we almost never need to flush the encoder so we typically never get here
-                av_write_frame(outctx, &pkt);
-            }
+            params.width = std::atoi(argv[2]);
+            params.height = std::atoi(argv[3]);
         }
+        measureWebmThreadScaling(params);
+        return 0;
     }
-    std::cout << "Flushing complete" << std::endl;
-
-    // Still some double free error here?
-    x264_encoder_close(encoder);
-    // x264_picture_clean(&in_pic); // The example has this line?
-    std::cout << "Encoder closed" << std::endl;
 
-    av_write_trailer(outctx);
-
-    uint8_t *buffer;
-    int size = avio_close_dyn_buf(outctx->pb, &buffer);
-    ts_data.insert(ts_data.end(), buffer, buffer + size);
-    av_free(buffer);
-
-    // Cleanup
-    avformat_free_context(outctx);
-    std::cout << "bangarang" << std::endl;
-    return ts_data;
-}
-
-void saveSegmentToFile(const std::vector<uint8_t> &segment, const std::string &filename)
-{
-    std::ofstream outfile(filename, std::ios::out | std::ios::binary);
-    if (!outfile)
+    // acquire-driver-web --hls-batch first count [dir]: encode segments [first, first + count) in parallel and exit
+    if (argc > 3 && std::string(argv[1]) == "--hls-batch")
     {
-        std::cerr << "Could not open file for writing: " << filename << std::endl;
-        return;
+        HlsBatchConfig config;
+        config.first_segment = std::atoll(argv[2]);
+        config.segment_count = std::atoll(argv[3]);
+        return writeHLSBatch(config, argc > 4 ? argv[4] : ".") ? 0 : 1;
     }
 
-    outfile.write((char *)&segment[0], segment.size());
-    outfile.close();
-}
-
-std::vector<std::string> playlist_segments = {"segment_0.ts"}; // Ensure there is one segment to play at first
-int media_sequence = 0;
-
-int main()
-{
     httplib::Server svr;
 
     // std::cout << "Current working directory: " << std::filesystem::current_path() << std::endl;
@@ -359,349 +386,389 @@ int main()
         throw std::runtime_error("Failed to set mount point");
     }
 
-    // Load file into memory
-    std::string filePath = "../public/big-buck-bunny_trailer.webm";
-    std::ifstream file(filePath, std::ifstream::binary | std::ifstream::ate);
-    if (!file)
+    // Mapped once, every request (and every range of it) is written straight out of the page cache
+    const std::string trailer_path = "../public/big-buck-bunny_trailer.webm";
+    const MappedFilePtr trailer = MappedFile::open(trailer_path);
+    if (!trailer)
     {
-        std::cout << "Error opening file: " << filePath << std::endl;
-        return 0;
+        std::cerr << "Error opening file: " << trailer_path << std::endl;
     }
-    std::streamsize fileSize = file.tellg(); // Get the file size
-    file.seekg(0, std::ios::beg);            // Reset the file pointer to the beginning
-
-    // A semi-complete implementation of range requests
-    // https://developer.mozilla.org/en-US/docs/Web/HTTP/Headers/Range
-    // https://datatracker.ietf.org/doc/html/rfc7233
-
-    // Max size of each range request to fulfill in bytes
-    const size_t MAX_RESPONSE_SIZE = 10 * 1024;
-
-    /*
-    tldr: basic video live stream where new video is continuously appended using MSE, many issues and does not work in practice
-    Client code is `/old-stream.html`
-
-    A basic continuous streaming set up where the server responds with unknown length content ranges
-    would work since <video/> should play a continuous stream as long as data keeps coming, but isn't great
-    since a lot of additional complexity would have to be handled, like network changes, skipped frames, smooth playback, video player exceptions, etc.
-    An actual video streaming solution is more optimal, like HLS
-    */
-    
-    /*
+
+    // Range requests (https://datatracker.ietf.org/doc/html/rfc7233) are answered by serveRanges for every route
+    // with a length, see http_range.h
+
+    // Client is old-stream.html
+    // Live webm for MSE: the stream header, then clusters from the latest keyframe on for as long as the client stays connected.
+    // Every subscriber reads the same encode out of the broadcast ring, a subscriber that can't keep up skips ahead.
     svr.Get("/stream", [](const httplib::Request &req, httplib::Response &res)
             {
-                const int width = 640;
-                const int height = 480;
-                const int num_frames = 100; // this is a stream, we're going to append segments of 100 fr
-
-                vpx_codec_ctx_t codec;
-                vpx_codec_enc_cfg_t cfg;
-                vpx_codec_enc_config_default(vpx_codec_vp9_cx(), &cfg, 0);
-                cfg.g_w = width;
-                cfg.g_h = height;
-                cfg.g_timebase.num = 1;
-                cfg.g_timebase.den = 30; // 30 fps
-                // cfg.g_error_resilient = VPX_ERROR_RESILIENT_PARTITIONS;
-
-                if (vpx_codec_enc_init(&codec, vpx_codec_vp9_cx(), &cfg, 0) != VPX_CODEC_OK)
+                std::shared_ptr<const std::vector<uint8_t>> header = live_webm.header();
+                if (!header)
                 {
-                    std::cerr << "Failed to initialize encoder: " << vpx_codec_error(&codec) << std::endl;
+                    res.status = 503;
                     return;
                 }
 
-                std::vector<uint8_t> webmData;
-                MemoryBufferMkvWriter memWriter(webmData);
-                // mkvmuxer::MkvWriter memWriter;
-                // memWriter.Open("test.webm");
+                // The stream has no length and no ranges, answer a Range header with the whole live stream
+                res.status = 200;
+                auto cursor = std::make_shared<uint64_t>(BroadcastRing::NO_SEQUENCE);
+                Counter &served = servedBytes(req.path);
+                res.set_chunked_content_provider("video/webm", [header, cursor, &served](size_t offset, httplib::DataSink &sink)
+                {
+                    if (offset == 0)
+                    {
+                        return writeCounted(sink, served, header->data(), header->size());
+                    }
 
-                mkvmuxer::Segment segment;
-                mkvmuxer::SegmentInfo *const info = segment.GetSegmentInfo();
-                info->set_writing_app("XorTextureGenerator");
-                info->set_timecode_scale(1e9 * (static_cast<double>(cfg.g_timebase.num) / cfg.g_timebase.den));
-                // segment.set_duration(num_frames); // This duration is not actually needed and will be calculated automatically, useful for streaming
-                // std::cout << "Duration: " << segment.duration() << std::endl;
+                    BroadcastPiecePtr piece = live_webm.ring().read(*cursor, std::chrono::seconds(5));
+                    if (!piece)
+                    {
+                        sink.done(); // encoder stopped
+                        return true;
+                    }
+                    return writeCounted(sink, served, piece->data.data(), piece->data.size());
+                }); });
 
-                const uint64_t track = segment.AddVideoTrack(width, height, 0);
-                if (!track)
+    // Looped HLS: costs an encode of one period on the first request and nothing after that, however many viewers there are
+    svr.Get("/loop/playlist.m3u8", [](const httplib::Request &req, httplib::Response &res)
+            {
+                PlaylistSnapshotPtr playlist = loop_hls.playlist();
+                if (!playlist)
                 {
-                    std::cerr << "Failed to add video track" << std::endl;
+                    res.status = 500;
                     return;
                 }
+                sendPlaylist(req, res, playlist); });
+    svr.Get(R"(/loop/segment_(\d+)\.ts)", [](const httplib::Request &req, httplib::Response &res)
+            {
+                SegmentCache::ValuePtr segment = loop_hls.segment(std::stoll(req.matches[1]));
+                if (!segment)
+                {
+                    res.status = 404;
+                    return;
+                }
+                setChunkedContent(req, res, segment, "video/MP2T", servedBytes(req.path)); });
 
-                mkvmuxer::VideoTrack *const video = static_cast<mkvmuxer::VideoTrack *>(
-                    segment.GetTrackByNumber(track));
-                if (!video)
+    // Adaptive bitrate: every rendition of the ladder, each with its own playlists under /<name>/.
+    // The _ll, _cmaf and _dvr variants point at the matching media playlists.
+    svr.Get(R"(/master(_ll|_cmaf|_dvr)?\.m3u8)", [](const httplib::Request &req, httplib::Response &res)
+            {
+                std::string content = hls_producer.masterPlaylist("playlist" + req.matches[1].str() + ".m3u8");
+                res.set_content(content, "application/vnd.apple.mpegurl"); });
+
+    svr.Get(R"((?:/(\w+))?/playlist\.m3u8)", [](const httplib::Request &req, httplib::Response &res)
+            {
+                size_t rendition;
+                if (!findRendition(req, res, rendition))
                 {
-                    printf("\n Could not get video track.\n");
                     return;
                 }
-                video->set_default_duration(uint64_t(1e9 * (static_cast<double>(cfg.g_timebase.num) / cfg.g_timebase.den))); // duration of each frame in nanoseconds
-                video->set_codec_id("V_VP9");
-                video->set_display_width(width);
-                video->set_display_height(height);
-                video->set_pixel_width(width);
-                video->set_pixel_height(height);
-
-                if (!segment.Init(&memWriter))
+
+                sendPlaylist(req, res, hls_producer.playlist(rendition)); });
+
+    // Time-shifted HLS: the same segments as far back as the segment store keeps them
+    svr.Get(R"((?:/(\w+))?/playlist_dvr\.m3u8)", [](const httplib::Request &req, httplib::Response &res)
+            {
+                size_t rendition;
+                if (!findRendition(req, res, rendition))
                 {
-                    std::cerr << "Failed to initialize muxer segment" << std::endl;
                     return;
                 }
 
-                int frame_count = 0;
-                // std::cout << "Starting encoding" << std::endl;
-                while (frame_count < num_frames)
+                std::string content = hls_producer.dvrPlaylist(rendition);
+                if (content.empty())
                 {
-                    vpx_image_t *img = genXorTexture(width, height, frame_count);
-                    encode_frame(&codec, img, frame_count++, 0, &memWriter, segment, track);
-                    vpx_img_free(img);
+                    res.status = 404;
+                    return;
                 }
-                // std::cout << "Encoding complete" << std::endl;
+                res.set_content(content, "application/vnd.apple.mpegurl"); });
 
-                // Signal to encoder that we are done
-                // std::cout << "Starting flushing" << std::endl;
-                while (encode_frame(&codec, nullptr, -1, 0, &memWriter, segment, track))
+    // Low latency HLS, same segments plus partial segments published while each segment is still being encoded
+    svr.Get(R"((?:/(\w+))?/playlist_ll\.m3u8)", [](const httplib::Request &req, httplib::Response &res)
+            {
+                size_t rendition;
+                if (!findRendition(req, res, rendition))
                 {
-                    // Flush any remaining frames
+                    return;
                 }
-                // std::cout << "Flushing complete" << std::endl;
 
-                if (!segment.Finalize())
+                int64_t msn = -1;
+                int part = -1;
+                try
+                {
+                    if (req.has_param("_HLS_msn"))
+                    {
+                        msn = std::stoll(req.get_param_value("_HLS_msn"));
+                    }
+                    if (req.has_param("_HLS_part"))
+                    {
+                        part = std::stoi(req.get_param_value("_HLS_part"));
+                    }
+                }
+                catch (const std::exception &)
                 {
-                    std::cerr << "Error finalizing segment." << std::endl;
-                    exit(1);
+                    res.status = 400;
+                    return;
+                }
+                if (part >= 0 && msn < 0)
+                {
+                    res.status = 400; // _HLS_part without _HLS_msn
+                    return;
                 }
 
-                vpx_codec_destroy(&codec);
+                PlaylistSnapshotPtr playlist;
+                if (!hls_producer.lowLatencyPlaylist(rendition, msn, part, playlist))
+                {
+                    res.status = 400;
+                    return;
+                }
+                res.set_header("Cache-Control", "no-cache");
+                sendPlaylist(req, res, playlist); });
 
-                std::string range = req.get_header_value("Range");
-                size_t start = 0;
-                size_t end = start + MAX_RESPONSE_SIZE - 1; // Respect the MAX_RESPONSE_SIZE constraint
+    svr.Get(R"((?:/(\w+))?/segment_(\d+)\.part_(\d+)\.ts)", [](const httplib::Request &req, httplib::Response &res)
+            {
+                size_t rendition;
+                if (!findRendition(req, res, rendition))
+                {
+                    return;
+                }
+                int64_t segment_index = std::stoll(req.matches[2]);
+                int part_index = std::stoi(req.matches[3]);
 
-                if (!range.empty())
+                ChunkedBufferPtr part = hls_producer.part(rendition, segment_index, part_index);
+                if (!part)
                 {
-                    size_t equalsPos = range.find('=');
-                    size_t dashPos = range.find('-');
-                    start = std::stoull(range.substr(equalsPos + 1, dashPos - equalsPos - 1));
+                    res.status = 404;
+                    return;
                 }
 
-                // Ensure the 'end' doesn't exceed the webmData size
-                end = std::min(end, webmData.size() - 1);
-                std::cout << "Start: " << start << " - End: " << end << std::endl;
+                setChunkedContent(req, res, part, "video/MP2T", servedBytes(req.path)); });
 
-                // Content range with unknown total size
-                std::string contentRange = "bytes " + std::to_string(start) + "-" + std::to_string(end) + "/*";
+    svr.Get(R"((?:/(\w+))?/segment_(\d+)\.ts)", [](const httplib::Request &req, httplib::Response &res)
+            {
+                size_t rendition;
+                if (!findRendition(req, res, rendition))
+                {
+                    return;
+                }
+                int64_t segment_index = std::stoll(req.matches[2]);
+                logDebug("Segment requested: {}", segment_index);
 
-                std::vector<uint8_t> responseData(webmData.begin() + start, webmData.begin() + end + 1);
+                // Segments are encoded ahead of time by the producer, recent ones are still in memory
+                SegmentCache::ValuePtr segment = hls_producer.segment(rendition, segment_index);
+                if (segment)
+                {
+                    setChunkedContent(req, res, segment, "video/MP2T", servedBytes(req.path));
+                    return;
+                }
 
-                res.status = 206; // Partial Content
-                res.set_header("Content-Range", contentRange.c_str());
-                res.set_content(reinterpret_cast<const char *>(responseData.data()), responseData.size(), "video/webm");
-            });
-    */
+                // Older ones are read from the segment store's files, mapped rather than loaded, anything it has deleted doesn't exist
+                MappedFilePtr stored = hls_producer.storedSegment(rendition, segment_index);
+                if (!stored)
+                {
+                    res.status = 404;
+                    return;
+                }
+                setMappedContent(req, res, stored, "video/MP2T", servedBytes(req.path)); });
 
-    svr.Get("/playlist.m3u8", [](const httplib::Request &req, httplib::Response &res)
+    // CMAF: the same encode muxed into fragmented MP4, one moof/mdat fragment per frame
+    svr.Get(R"((?:/(\w+))?/playlist_cmaf\.m3u8)", [](const httplib::Request &req, httplib::Response &res)
             {
-                std::cout << "Playlist requested. " << playlist_segments.size() <<  " segments exist." <<std::endl;
-                std::string content = "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:10\n";
-                
-                if (playlist_segments.size() > 0) {
-                    content += "#EXT-X-MEDIA-SEQUENCE:" + std::to_string(media_sequence) + "\n";
-                    
-                    for (const auto& segment_name : playlist_segments) {
-                        content += "#EXTINF:10.0,\n" + segment_name + "\n";
-                    }
+                size_t rendition;
+                if (!findRendition(req, res, rendition))
+                {
+                    return;
                 }
 
-                res.set_content(content, "application/vnd.apple.mpegurl"); });
+                sendPlaylist(req, res, hls_producer.cmafPlaylist(rendition)); });
 
-    svr.Get(R"(/segment_(\d+)\.ts)", [](const httplib::Request &req, httplib::Response &res)
+    svr.Get(R"((?:/(\w+))?/init\.mp4)", [](const httplib::Request &req, httplib::Response &res)
             {
-                std::cout << "Segment requested" << std::endl;
-                int segment_index = std::stoi(req.matches[1]);
-                std::cout << "Segment index: " << segment_index << std::endl;
-                int64_t offset = segment_index * FRAME_RATE * SEGMENT_DURATION; // The number of pts to offset the segment
-
-                // pass segment index * num_frames_per_segment
-                std::vector<uint8_t> segment = generateHLSSegment(1280, 720, offset);
-                std::string segment_name = "segment_" + std::to_string(segment_index) + ".ts";
-                saveSegmentToFile(segment, segment_name);
+                size_t rendition;
+                if (!findRendition(req, res, rendition))
+                {
+                    return;
+                }
 
-                // every time this segment is requested, add a new one to the playlist
-                playlist_segments.push_back("segment_" + std::to_string(segment_index+1) + ".ts");
+                ChunkedBufferPtr init = hls_producer.cmafInit(rendition);
+                if (!init)
+                {
+                    res.status = 404;
+                    return;
+                }
 
-                res.set_content(std::string(segment.begin(), segment.end()), "video/MP2T"); });
+                setChunkedContent(req, res, init, "video/mp4", servedBytes(req.path)); });
 
-    // Client is basic.html
-    // Generates a XOR texture noise stream and serves w/ range headers
-    svr.Get("/webm", [](const httplib::Request &req, httplib::Response &res)
+    svr.Get(R"((?:/(\w+))?/segment_(\d+)\.m4s)", [](const httplib::Request &req, httplib::Response &res)
             {
-                const int width = 640;
-                const int height = 480;
-                const int num_frames = 300; // example
-
-                vpx_codec_ctx_t codec;
-                vpx_codec_enc_cfg_t cfg;
-                vpx_codec_enc_config_default(vpx_codec_vp9_cx(), &cfg, 0);
-                cfg.g_w = width;
-                cfg.g_h = height;
-                cfg.g_timebase.num = 1;
-                cfg.g_timebase.den = 30; // 30 fps
-                //cfg.g_error_resilient = VPX_ERROR_RESILIENT_PARTITIONS;
-
-                if (vpx_codec_enc_init(&codec, vpx_codec_vp9_cx(), &cfg, 0) != VPX_CODEC_OK) {
-                    std::cerr << "Failed to initialize encoder: " << vpx_codec_error(&codec) << std::endl;
-                    return;
-                }
-                
-                std::vector<uint8_t> webmData;
-                MemoryBufferMkvWriter memWriter(webmData);
-                //mkvmuxer::MkvWriter memWriter; // not actually an in memory writer, variable is just named that for consistency
-                //memWriter.Open("test.webm");
-
-                mkvmuxer::Segment segment;
-                mkvmuxer::SegmentInfo *const info = segment.GetSegmentInfo();
-                info->set_writing_app("XorTextureGenerator");
-                info->set_timecode_scale(1e9 * (static_cast<double>(cfg.g_timebase.num) / cfg.g_timebase.den));
-                //segment.set_duration(num_frames); // This duration is not actually needed and will be calculated automatically
-                //std::cout << "Duration: " << segment.duration() << std::endl;
-
-                // TODO: start adding functionality here
-
-                const uint64_t track = segment.AddVideoTrack(width, height, 0);
-                if (!track) {
-                    std::cerr << "Failed to add video track" << std::endl;
+                size_t rendition;
+                if (!findRendition(req, res, rendition))
+                {
                     return;
                 }
+                int64_t segment_index = std::stoll(req.matches[2]);
 
-                mkvmuxer::VideoTrack* const video = static_cast<mkvmuxer::VideoTrack*>(
-                    segment.GetTrackByNumber(track));
-                if (!video) {
-                    printf("\n Could not get video track.\n");
+                std::shared_ptr<const LiveBuffer> segment = hls_producer.cmafSegment(rendition, segment_index);
+                if (!segment)
+                {
+                    res.status = 404;
                     return;
                 }
-                video->set_default_duration(uint64_t (1e9 * (static_cast<double>(cfg.g_timebase.num) / cfg.g_timebase.den))); // duration of each frame in nanoseconds
-                video->set_codec_id("V_VP9");
-                video->set_display_width(width);
-                video->set_display_height(height);
-                video->set_pixel_width(width);
-                video->set_pixel_height(height);
-
-                if (!segment.Init(&memWriter)) {
-                    std::cerr << "Failed to initialize muxer segment" << std::endl;
+                if (ChunkedBufferPtr whole = segment->whole())
+                {
+                    setChunkedContent(req, res, whole, "video/mp4", servedBytes(req.path));
                     return;
                 }
-                
-                int frame_count = 0;
-                //std::cout << "Starting encoding" << std::endl;
-                while(frame_count < num_frames){
-                    // Add keyframe interval?
-                    //std::cout << "Encoding frame " << frame_count << std::endl;
-                    vpx_image_t *img = genXorTexture(width, height, frame_count);
-                    encode_frame(&codec, img, frame_count++, 0, &memWriter, segment, track);
-                    vpx_img_free(img);
-                }
-                //std::cout << "Encoding complete" << std::endl;
 
-                // Signal to encoder that we are done
-                //std::cout << "Starting flushing" << std::endl;
-                while (encode_frame(&codec, nullptr, -1, 0, &memWriter, segment, track)) {
-                    // Flush any remaining frames
-                }
-                //std::cout << "Flushing complete" << std::endl;
-                
-                if (!segment.Finalize()) {
-                    std::cerr << "Error finalizing segment." << std::endl;
-                    exit(1);
-                }
-
-                //memWriter.Close();
-                //std::cout << "Video written" << std::endl;
-
-                vpx_codec_destroy(&codec);
+                // Still being encoded: send it with chunked transfer encoding, each fragment as soon as the producer flushes it
+                Counter &served = servedBytes(req.path);
+                res.set_chunked_content_provider("video/mp4", [segment, &served](size_t offset, httplib::DataSink &sink)
+                {
+                    size_t piece_offset = 0;
+                    ChunkedBufferPtr piece = segment->next(offset, piece_offset, std::chrono::seconds(SEGMENT_DURATION));
+                    if (!piece)
+                    {
+                        if (!segment->finished())
+                        {
+                            return false; // the producer stalled, drop the connection rather than end on a truncated segment
+                        }
+                        sink.done();
+                        return true;
+                    }
+                    return piece->forEach(piece_offset, piece->size() - piece_offset, [&sink, &served](const uint8_t *data, size_t size)
+                                          { return writeCounted(sink, served, data, size); });
+                }); });
 
+    // Client is basic.html
+    // Generates a XOR texture noise stream and serves w/ range headers.
+    // ?t=seconds starts the file at the keyframe at or before that time instead (still seekable by range), a t that
+    // isn't a number is a 400.
+    svr.Get("/webm", [](const httplib::Request &req, httplib::Response &res)
+            {
+                const WebmParams params; // 640x480, 300 frames
 
+                // Only the first request encodes, concurrent ones wait for it and later ones reuse the buffer
+                WebmCache::ValuePtr webm = webm_cache.getOrBuild(params, [&]
+                                                                 { return encodeXorWebm(params); });
 
-                std::string range = req.get_header_value("Range");
-                size_t start = 0;
-                size_t end = webmData.size() - 1;
+                if (!webm)
+                {
+                    res.status = 500;
+                    return;
+                }
 
-                if (!range.empty()) {
-                    size_t equalsPos = range.find('=');
-                    size_t dashPos = range.find('-');
-                    start = std::stoull(range.substr(equalsPos + 1, dashPos - equalsPos - 1));
-                    if (dashPos != std::string::npos && dashPos != range.size() - 1) {
-                        end = std::stoull(range.substr(dashPos + 1));
+                // Ranges are written straight out of the shared chunks
+                Counter &served = servedBytes(req.path);
+                const WebmCluster *cluster = nullptr;
+                if (req.has_param("t"))
+                {
+                    uint64_t start_ns = 0;
+                    if (!parseStartTime(req.get_param_value("t"), webm->clusters.empty() ? 0 : webm->clusters.back().time_ns, start_ns))
+                    {
+                        res.status = 400;
+                        return;
                     }
+                    cluster = webm->clusterAt(start_ns);
                 }
-
-                if (start > end || end >= webmData.size())
+                if (!cluster)
                 {
-                    res.status = 416; // Range Not Satisfiable
+                    setChunkedContent(req, res, webm->data, "video/webm", served, HttpValidators{webm->etag});
                     return;
                 }
 
-                std::string contentRange = "bytes " + std::to_string(start) + "-" + std::to_string(end) + "/" + std::to_string(webmData.size());
-
-                std::vector<uint8_t> responseData(webmData.begin() + start, webmData.begin() + end + 1);
-
-                res.status = 206; // Partial Content
-                res.set_header("Content-Range", contentRange.c_str());
-                res.set_content(reinterpret_cast<const char *>(responseData.data()), responseData.size(), "video/webm"); });
+                // The header without its seek index, then the clusters from the keyframe on, the cues are left out
+                const size_t header = webm->seek_header.size();
+                const size_t start = cluster->offset;
+                const HttpValidators validators{formatEtag(hashBytes(&start, sizeof(start), hashBytes(webm->etag.data(), webm->etag.size())))};
+                serveRanges(req, res, header + webm->clusters_end - start, validators, "video/webm", served, [webm, header, start, &served](size_t offset, size_t length, httplib::DataSink &sink)
+                {
+                    if (offset < header)
+                    {
+                        const size_t n = std::min(length, header - offset);
+                        if (!writeCounted(sink, served, webm->seek_header.data() + offset, n))
+                        {
+                            return false;
+                        }
+                        offset += n;
+                        length -= n;
+                    }
+                    return webm->data->forEach(start + offset - header, length, [&sink, &served](const uint8_t *data, size_t size)
+                                               { return writeCounted(sink, served, data, size); });
+                }); });
 
-    /*
     // Serve the trailer w/ range requests
     // A client <video/> just has to be pointed at this endpoint
-    svr.Get("/video/big-buck-bunny_trailer.webm", [&](const httplib::Request &req, httplib::Response &res)
+    svr.Get("/video/big-buck-bunny_trailer.webm", [trailer](const httplib::Request &req, httplib::Response &res)
             {
-                std::string range = req.get_header_value("Range");
-                std::string contentRange = "bytes 0-" + std::to_string(fileSize - 1) + "/" + std::to_string(fileSize); // Default range is the entire file
-
-                if (!range.empty())
-                { // If range header present
-                    std::size_t equalsPos = range.find('=');
-                    std::size_t dashPos = range.find('-');
-                    std::streamsize start = std::stoll(range.substr(equalsPos + 1, dashPos - equalsPos - 1)); // Start byte of range
-                    std::streamsize end = (dashPos == std::string::npos || dashPos == range.size() - 1)       // End byte of range
-                                              ? fileSize - 1
-                                              : std::stoll(range.substr(dashPos + 1));
-
-                    // Check if the range is not satisfiable
-                    // TODO: Check if start < 0 ?
-                    if (start > end || end >= fileSize)
-                    {
-                        res.status = 416; // 416 Range Not Satisfiable
-                        return;
-                    }
-
-                    fileSize = end - start + 1;
-                    file.seekg(start);
-                    // Define the requested & validated range
-                    contentRange = "bytes " + std::to_string(start) + "-" + std::to_string(end) + "/" + std::to_string(fileSize);
+                if (!trailer)
+                {
+                    res.status = 404;
+                    return;
                 }
-
-                // Read the file into a buffer
-                char *buffer = new char[fileSize];
-                file.read(buffer, fileSize);
-                std::string content(buffer, fileSize);
-                delete[] buffer;
-
-                // Deliver the desired range
-                res.status = 206; // 206 Partial Content
-                res.set_content(content, "video/webm");
-                res.set_header("Content-Range", contentRange.c_str()); });
-    */
+                setMappedContent(req, res, trailer, "video/webm", servedBytes(req.path)); });
 
     svr.Get("/ping", [](const httplib::Request &, httplib::Response &res)
             { res.set_content("pong", "text/plain"); });
 
+    svr.Get("/log-level", [](const httplib::Request &, httplib::Response &res)
+            { res.set_content(std::string(logLevelName(Logger::level())) + "\n", "text/plain"); });
+    svr.Post("/log-level", [](const httplib::Request &req, httplib::Response &res)
+             {
+                 LogLevel level;
+                 if (!parseLogLevel(req.get_param_value("level"), level))
+                 {
+                     res.status = 400;
+                     res.set_content("level must be one of trace, debug, info, warn, error, off\n", "text/plain");
+                     return;
+                 }
+                 Logger::setLevel(level);
+                 logInfo("Log level set to {}", logLevelName(level));
+                 res.set_content(std::string(logLevelName(level)) + "\n", "text/plain"); });
+
+    // Prometheus scrape target
+    svr.Get("/metrics", [](const httplib::Request &, httplib::Response &res)
+            { res.set_content(MetricsRegistry::shared().render(), "text/plain; version=0.0.4"); });
+
+    // Requests being handled or streamed. Each request runs start to finish on one server thread, the flag keeps
+    // responses that never got routed (malformed requests) from being counted down.
+    static thread_local bool request_counted = false;
+    Gauge &active_requests = MetricsRegistry::shared().gauge("acquire_active_requests", "Requests being handled or streamed");
+    svr.set_pre_routing_handler([&active_requests](const httplib::Request &, httplib::Response &)
+                                {
+                                    active_requests.add(1);
+                                    request_counted = true;
+                                    return httplib::Server::HandlerResponse::Unhandled; });
+    svr.set_logger([&active_requests](const httplib::Request &req, const httplib::Response &res)
+                   {
+                       if (request_counted)
+                       {
+                           active_requests.add(-1);
+                           request_counted = false;
+                       }
+                       servedBytes(req.path).add(res.body.size()); });
+
+    // Cache effectiveness, read from the caches' own statistics at scrape time
+    registerCacheMetrics("segment", segment_cache);
+    registerCacheMetrics("webm", webm_cache);
+
     // Catch-all 404 route
     // svr.Get(".*", [](const httplib::Request &, httplib::Response &res) {
     //     res.status = 404;
     //     res.set_content("404 Not Found", "text/plain");
     // });
 
+    logInfo("XOR texture kernel: {}", xorTextureKernels().front().name);
+    logInfo("Frame scale kernel: {}", frameScaleKernels().front().name);
+    logInfo("Pixel convert kernel: {}", pixelConvertKernels().front().name);
+    segment_store.start();
+    hls_producer.start();
+    live_webm.start();
+
     svr.listen("0.0.0.0", 8080);
 
+    live_webm.stop();
+    hls_producer.stop();
+    segment_store.stop();
+
     return 0;
 }
\ No newline at end of file
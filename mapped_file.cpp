@@ -0,0 +1,56 @@
+#include "mapped_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+
+namespace
+{
+    // Only for the empty file, mmap refuses a length of 0
+    const uint8_t EMPTY = 0;
+}
+
+std::shared_ptr<const MappedFile> MappedFile::open(const std::string &path)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        std::cerr << "Could not stat " << path << std::endl;
+        close(fd);
+        return nullptr;
+    }
+    const size_t size = st.st_size;
+    if (size == 0)
+    {
+        close(fd);
+        return std::shared_ptr<const MappedFile>(new MappedFile(&EMPTY, 0, st.st_mtime));
+    }
+
+    void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps its own reference to the file
+    if (data == MAP_FAILED)
+    {
+        std::cerr << "Could not map " << path << std::endl;
+        return nullptr;
+    }
+    // Served front to back, let the kernel read ahead
+    madvise(data, size, MADV_SEQUENTIAL);
+    return std::shared_ptr<const MappedFile>(new MappedFile(static_cast<const uint8_t *>(data), size, st.st_mtime));
+}
+
+MappedFile::~MappedFile()
+{
+    if (size_ > 0)
+    {
+        munmap(const_cast<uint8_t *>(data_), size_);
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+
+// A whole file mapped read-only. The mapping outlives the file being unlinked, so a response can keep reading a
+// segment that retention has just deleted. Pages come from the page cache, nothing is copied onto the heap.
+class MappedFile
+{
+public:
+    // nullptr if the file can't be opened or mapped
+    static std::shared_ptr<const MappedFile> open(const std::string &path);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const uint8_t *data() const { return data_; }
+    size_t size() const { return size_; }
+    std::time_t modified() const { return modified_; } // the file's modification time (st_mtime) when it was mapped, for Last-Modified
+
+private:
+    MappedFile(const uint8_t *data, size_t size, std::time_t modified) : data_(data), size_(size), modified_(modified) {}
+
+    const uint8_t *data_;
+    size_t size_;
+    std::time_t modified_;
+};
+
+using MappedFilePtr = std::shared_ptr<const MappedFile>;
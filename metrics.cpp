@@ -0,0 +1,283 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+size_t metricShard()
+{
+    static std::atomic<size_t> next{0};
+    thread_local const size_t shard = next.fetch_add(1, std::memory_order_relaxed) % METRIC_SHARDS;
+    return shard;
+}
+
+namespace
+{
+    void atomicAdd(std::atomic<double> &target, double delta)
+    {
+        double current = target.load(std::memory_order_relaxed);
+        while (!target.compare_exchange_weak(current, current + delta, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    std::string renderLabels(const MetricLabels &labels)
+    {
+        if (labels.empty())
+        {
+            return "";
+        }
+        std::string out = "{";
+        for (size_t i = 0; i < labels.size(); i++)
+        {
+            if (i > 0)
+            {
+                out += ",";
+            }
+            out += labels[i].first + "=\"";
+            for (char c : labels[i].second)
+            {
+                if (c == '\n')
+                {
+                    out += "\\n";
+                    continue;
+                }
+                if (c == '\\' || c == '"')
+                {
+                    out += '\\';
+                }
+                out += c;
+            }
+            out += "\"";
+        }
+        return out + "}";
+    }
+
+    // Adds one more label to an already rendered label set
+    std::string withLabel(const std::string &labels, const std::string &label)
+    {
+        if (labels.empty())
+        {
+            return "{" + label + "}";
+        }
+        return labels.substr(0, labels.size() - 1) + "," + label + "}";
+    }
+
+    std::string formatValue(double value)
+    {
+        if (std::isinf(value))
+        {
+            return value > 0 ? "+Inf" : "-Inf";
+        }
+        std::ostringstream out;
+        out.precision(15);
+        out << value;
+        return out.str();
+    }
+}
+
+uint64_t Counter::value() const
+{
+    uint64_t total = 0;
+    for (const Shard &shard : shards_)
+    {
+        total += shard.value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+void Gauge::add(double delta)
+{
+    atomicAdd(value_, delta);
+}
+
+Histogram::Histogram(std::vector<double> bounds) : bounds_(std::move(bounds))
+{
+    for (Shard &shard : shards_)
+    {
+        shard.counts.reset(new std::atomic<uint64_t>[bounds_.size() + 1]);
+        for (size_t i = 0; i <= bounds_.size(); i++)
+        {
+            shard.counts[i].store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+void Histogram::observe(double value)
+{
+    // le buckets: the first bound the value doesn't exceed, +Inf past the last one
+    const size_t bucket = std::lower_bound(bounds_.begin(), bounds_.end(), value) - bounds_.begin();
+    Shard &shard = shards_[metricShard()];
+    shard.counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    atomicAdd(shard.sum, value);
+}
+
+std::vector<uint64_t> Histogram::counts(double &sum) const
+{
+    std::vector<uint64_t> totals(bounds_.size() + 1, 0);
+    sum = 0;
+    for (const Shard &shard : shards_)
+    {
+        for (size_t i = 0; i < totals.size(); i++)
+        {
+            totals[i] += shard.counts[i].load(std::memory_order_relaxed);
+        }
+        sum += shard.sum.load(std::memory_order_relaxed);
+    }
+    return totals;
+}
+
+MetricsRegistry &MetricsRegistry::shared()
+{
+    static MetricsRegistry registry;
+    return registry;
+}
+
+MetricsRegistry::Series *MetricsRegistry::findLocked(const std::string &name, const std::string &help, Type type, const std::string &labels)
+{
+    auto family = std::find_if(families_.begin(), families_.end(), [&](const Family &f)
+                               { return f.name == name; });
+    if (family == families_.end())
+    {
+        families_.push_back(Family{name, help, type, {}});
+        family = families_.end() - 1;
+    }
+    for (Series &series : family->series)
+    {
+        if (series.labels == labels)
+        {
+            return &series;
+        }
+    }
+    Series series;
+    series.labels = labels;
+    family->series.push_back(std::move(series));
+    return &family->series.back();
+}
+
+Counter &MetricsRegistry::counter(const std::string &name, const std::string &help, const MetricLabels &labels)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Series *series = findLocked(name, help, Type::Counter, renderLabels(labels));
+    if (!series->counter)
+    {
+        counters_.emplace_back();
+        series->counter = &counters_.back();
+    }
+    return *series->counter;
+}
+
+Gauge &MetricsRegistry::gauge(const std::string &name, const std::string &help, const MetricLabels &labels)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Series *series = findLocked(name, help, Type::Gauge, renderLabels(labels));
+    if (!series->gauge)
+    {
+        gauges_.emplace_back();
+        series->gauge = &gauges_.back();
+    }
+    return *series->gauge;
+}
+
+Histogram &MetricsRegistry::histogram(const std::string &name, const std::string &help, const std::vector<double> &bounds, const MetricLabels &labels)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    Series *series = findLocked(name, help, Type::Histogram, renderLabels(labels));
+    if (!series->histogram)
+    {
+        histograms_.emplace_back(bounds);
+        series->histogram = &histograms_.back();
+    }
+    return *series->histogram;
+}
+
+void MetricsRegistry::callback(const std::string &name, const std::string &help, bool is_counter, const MetricLabels &labels, std::function<double()> read)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    findLocked(name, help, is_counter ? Type::Counter : Type::Gauge, renderLabels(labels))->read = std::move(read);
+}
+
+std::string MetricsRegistry::render() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::string out;
+    for (const Family &family : families_)
+    {
+        const char *type = family.type == Type::Counter ? "counter" : family.type == Type::Gauge ? "gauge"
+                                                                                                  : "histogram";
+        out += "# HELP " + family.name + " " + family.help + "\n";
+        out += "# TYPE " + family.name + " " + type + "\n";
+        for (const Series &series : family.series)
+        {
+            if (series.histogram)
+            {
+                double sum;
+                const std::vector<uint64_t> counts = series.histogram->counts(sum);
+                const std::vector<double> &bounds = series.histogram->bounds();
+                uint64_t cumulative = 0;
+                for (size_t i = 0; i < counts.size(); i++)
+                {
+                    cumulative += counts[i];
+                    const double le = i < bounds.size() ? bounds[i] : INFINITY;
+                    out += family.name + "_bucket" + withLabel(series.labels, "le=\"" + formatValue(le) + "\"") + " " + std::to_string(cumulative) + "\n";
+                }
+                out += family.name + "_sum" + series.labels + " " + formatValue(sum) + "\n";
+                out += family.name + "_count" + series.labels + " " + std::to_string(cumulative) + "\n";
+                continue;
+            }
+
+            if (series.counter)
+            {
+                out += family.name + series.labels + " " + std::to_string(series.counter->value()) + "\n";
+                continue;
+            }
+            double value = 0;
+            if (series.gauge)
+            {
+                value = series.gauge->value();
+            }
+            else if (series.read)
+            {
+                value = series.read();
+            }
+            out += family.name + series.labels + " " + formatValue(value) + "\n";
+        }
+    }
+    return out;
+}
+
+const std::vector<double> &stageSecondsBuckets()
+{
+    static const std::vector<double> buckets = {0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.033, 0.05, 0.1, 0.25, 0.5, 1};
+    return buckets;
+}
+
+const std::vector<double> &segmentBytesBuckets()
+{
+    static const std::vector<double> buckets = {16e3, 64e3, 256e3, 512e3, 1e6, 2e6, 4e6, 8e6, 16e6};
+    return buckets;
+}
+
+PipelineMetrics &pipelineMetrics()
+{
+    static PipelineMetrics metrics = [] {
+        MetricsRegistry &registry = MetricsRegistry::shared();
+        const std::string encode_help = "Time to encode one frame";
+        const std::string static_frames_help = "Source frames that didn't change since the previous one";
+        const std::string static_macroblocks_help = "Source macroblocks that didn't change since the previous frame and were skipped";
+        return PipelineMetrics{
+            registry.histogram("acquire_frame_synthesis_seconds", "Time to generate one source frame", stageSecondsBuckets()),
+            registry.histogram("acquire_encode_seconds", encode_help, stageSecondsBuckets(), {{"codec", "h264"}}),
+            registry.histogram("acquire_encode_seconds", encode_help, stageSecondsBuckets(), {{"codec", "vp9"}}),
+            registry.histogram("acquire_mux_seconds", "Time to mux one encoded frame into the HLS outputs", stageSecondsBuckets()),
+            registry.histogram("acquire_segment_bytes", "Size of each finished HLS segment", segmentBytesBuckets()),
+            registry.gauge("acquire_producer_lag_seconds", "How far the last encoded frame finished behind its schedule, negative when ahead", {{"stream", "hls"}}),
+            registry.gauge("acquire_producer_lag_seconds", "How far the last encoded frame finished behind its schedule, negative when ahead", {{"stream", "webm"}}),
+            registry.counter("acquire_static_frames_total", static_frames_help, {{"stream", "hls"}}),
+            registry.counter("acquire_static_frames_total", static_frames_help, {{"stream", "webm"}}),
+            registry.counter("acquire_static_macroblocks_total", static_macroblocks_help, {{"stream", "hls"}}),
+            registry.counter("acquire_static_macroblocks_total", static_macroblocks_help, {{"stream", "webm"}}),
+        };
+    }();
+    return metrics;
+}
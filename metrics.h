@@ -0,0 +1,163 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Prometheus metrics for the hot paths.
+// Updates never lock: every metric is split into METRIC_SHARDS cache line sized shards and each thread always
+// updates the same one, so encode threads don't bounce cache lines between each other. Shards are only summed
+// when /metrics is scraped.
+
+const size_t METRIC_SHARDS = 16;
+
+// The shard of the calling thread, threads are handed shards round robin as they first use one
+size_t metricShard();
+
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+class Counter
+{
+public:
+    void add(uint64_t n = 1) { shards_[metricShard()].value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const;
+
+private:
+    struct alignas(64) Shard
+    {
+        std::atomic<uint64_t> value{0};
+    };
+    std::array<Shard, METRIC_SHARDS> shards_;
+};
+
+// A single value, last write wins
+class Gauge
+{
+public:
+    void set(double value) { value_.store(value, std::memory_order_relaxed); }
+    void add(double delta);
+    double value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<double> value_{0};
+};
+
+// Cumulative histogram with fixed upper bounds, an observation is one bucket increment and one add to the sum
+class Histogram
+{
+public:
+    explicit Histogram(std::vector<double> bounds);
+
+    void observe(double value);
+
+    const std::vector<double> &bounds() const { return bounds_; }
+    // Per bucket (not cumulative) counts with +Inf last, and the sum of all observations
+    std::vector<uint64_t> counts(double &sum) const;
+
+private:
+    struct alignas(64) Shard
+    {
+        std::unique_ptr<std::atomic<uint64_t>[]> counts;
+        std::atomic<double> sum{0};
+    };
+
+    const std::vector<double> bounds_;
+    std::array<Shard, METRIC_SHARDS> shards_;
+};
+
+// Observes the seconds between construction and destruction
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(Histogram &histogram) : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() { histogram_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count()); }
+
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+private:
+    Histogram &histogram_;
+    const std::chrono::steady_clock::time_point start_;
+};
+
+// Owns every metric and renders them in the Prometheus text format.
+// Registering the same name and labels twice returns the same metric, so registration can be lazy
+// (a function local static next to the code it measures). Metrics live as long as the registry.
+class MetricsRegistry
+{
+public:
+    static MetricsRegistry &shared();
+
+    Counter &counter(const std::string &name, const std::string &help, const MetricLabels &labels = {});
+    Gauge &gauge(const std::string &name, const std::string &help, const MetricLabels &labels = {});
+    Histogram &histogram(const std::string &name, const std::string &help, const std::vector<double> &bounds, const MetricLabels &labels = {});
+
+    // A counter or gauge read from somewhere else (cache statistics, ...) whenever the metrics are rendered
+    void callback(const std::string &name, const std::string &help, bool is_counter, const MetricLabels &labels, std::function<double()> read);
+
+    std::string render() const;
+
+private:
+    enum class Type
+    {
+        Counter,
+        Gauge,
+        Histogram,
+    };
+
+    struct Series
+    {
+        std::string labels; // rendered, {a="b",c="d"} or empty
+        Counter *counter = nullptr;
+        Gauge *gauge = nullptr;
+        Histogram *histogram = nullptr;
+        std::function<double()> read;
+    };
+
+    struct Family
+    {
+        std::string name;
+        std::string help;
+        Type type;
+        std::vector<Series> series;
+    };
+
+    Series *findLocked(const std::string &name, const std::string &help, Type type, const std::string &labels);
+
+    mutable std::mutex mutex_;
+    std::vector<Family> families_; // in registration order
+    std::deque<Counter> counters_;
+    std::deque<Gauge> gauges_;
+    std::deque<Histogram> histograms_;
+};
+
+// Bucket bounds for per frame stage times, from half a millisecond to a second (a frame is due every 33ms at 30fps)
+const std::vector<double> &stageSecondsBuckets();
+// Bucket bounds for segment sizes, 16KB to 16MB
+const std::vector<double> &segmentBytesBuckets();
+
+// The streaming pipeline's metrics, registered on first use
+struct PipelineMetrics
+{
+    Histogram &frame_synthesis_seconds;
+    Histogram &h264_encode_seconds;
+    Histogram &vp9_encode_seconds;
+    Histogram &mux_seconds;
+    Histogram &segment_bytes;
+    Gauge &hls_lag_seconds;
+    Gauge &webm_lag_seconds;
+    Counter &hls_static_frames;
+    Counter &webm_static_frames;
+    Counter &hls_static_macroblocks;
+    Counter &webm_static_macroblocks;
+};
+PipelineMetrics &pipelineMetrics();
@@ -0,0 +1,420 @@
+#include "pixel_convert.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifdef CPU_DISPATCH_X86
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    // Auto-levels move the window this fraction of the way to where the latest histogram puts it, so a single
+    // odd frame doesn't make the brightness jump
+    const int LEVELS_SMOOTHING = 4;
+
+    // Windowing is 16 bit fixed point, identical in every kernel:
+    //   d = min(max(v - low, 0), range), out = ((d << shift) * scale) >> 16
+    // with shift making range << shift at least 256 and scale = ceil(255 * 65536 / (range << shift)), which fits 16 bits
+    void windowScalar(const uint16_t *src, uint8_t *dst, int width, uint16_t low, uint16_t range, int shift, uint16_t scale)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            const uint32_t d = std::min<uint32_t>(src[x] > low ? src[x] - low : 0, range);
+            dst[x] = static_cast<uint8_t>(((d << shift) * scale) >> 16);
+        }
+    }
+
+    void lookupScalar(uint8_t *row, int width, const uint8_t *table)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            row[x] = table[row[x]];
+        }
+    }
+
+    // Mean of the 2x2 window right of and below every sample, reads one sample past width in both rows
+    void boxScalar(const uint8_t *top, const uint8_t *bottom, uint8_t *dst, int width)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            dst[x] = static_cast<uint8_t>((top[x] + top[x + 1] + bottom[x] + bottom[x + 1] + 2) >> 2);
+        }
+    }
+
+#ifdef CPU_DISPATCH_X86
+    __attribute__((target("sse2"))) void windowSse2(const uint16_t *src, uint8_t *dst, int width, uint16_t low, uint16_t range, int shift, uint16_t scale)
+    {
+        const __m128i vlow = _mm_set1_epi16(static_cast<short>(low));
+        const __m128i vrange = _mm_set1_epi16(static_cast<short>(range));
+        const __m128i vscale = _mm_set1_epi16(static_cast<short>(scale));
+        const __m128i vshift = _mm_cvtsi32_si128(shift);
+        int x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i a = _mm_subs_epu16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x)), vlow);
+            __m128i b = _mm_subs_epu16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x + 8)), vlow);
+            // No unsigned 16 bit min before SSE4.1: d - max(d - range, 0)
+            a = _mm_sub_epi16(a, _mm_subs_epu16(a, vrange));
+            b = _mm_sub_epi16(b, _mm_subs_epu16(b, vrange));
+            a = _mm_mulhi_epu16(_mm_sll_epi16(a, vshift), vscale);
+            b = _mm_mulhi_epu16(_mm_sll_epi16(b, vshift), vscale);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_packus_epi16(a, b));
+        }
+        windowScalar(src + x, dst + x, width - x, low, range, shift, scale);
+    }
+
+    __attribute__((target("avx2"))) void windowAvx2(const uint16_t *src, uint8_t *dst, int width, uint16_t low, uint16_t range, int shift, uint16_t scale)
+    {
+        const __m256i vlow = _mm256_set1_epi16(static_cast<short>(low));
+        const __m256i vrange = _mm256_set1_epi16(static_cast<short>(range));
+        const __m256i vscale = _mm256_set1_epi16(static_cast<short>(scale));
+        const __m128i vshift = _mm_cvtsi32_si128(shift);
+        int x = 0;
+        for (; x + 32 <= width; x += 32)
+        {
+            __m256i a = _mm256_subs_epu16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x)), vlow);
+            __m256i b = _mm256_subs_epu16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x + 16)), vlow);
+            a = _mm256_mulhi_epu16(_mm256_sll_epi16(_mm256_min_epu16(a, vrange), vshift), vscale);
+            b = _mm256_mulhi_epu16(_mm256_sll_epi16(_mm256_min_epu16(b, vrange), vshift), vscale);
+            // packus works within 128 bit lanes, the permute puts the quarters back in order
+            const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x), packed);
+        }
+        windowScalar(src + x, dst + x, width - x, low, range, shift, scale);
+    }
+
+    __attribute__((target("sse2"))) void boxSse2(const uint8_t *top, const uint8_t *bottom, uint8_t *dst, int width)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i two = _mm_set1_epi16(2);
+        int x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(top + x));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(top + x + 1));
+            const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bottom + x));
+            const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bottom + x + 1));
+            __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)),
+                                       _mm_add_epi16(_mm_unpacklo_epi8(c, zero), _mm_unpacklo_epi8(d, zero)));
+            __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)),
+                                       _mm_add_epi16(_mm_unpackhi_epi8(c, zero), _mm_unpackhi_epi8(d, zero)));
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_packus_epi16(lo, hi));
+        }
+        boxScalar(top + x, bottom + x, dst + x, width - x);
+    }
+
+    __attribute__((target("avx2"))) void boxAvx2(const uint8_t *top, const uint8_t *bottom, uint8_t *dst, int width)
+    {
+        const __m256i two = _mm256_set1_epi16(2);
+        int x = 0;
+        for (; x + 16 <= width; x += 16)
+        {
+            const __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(top + x)));
+            const __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(top + x + 1)));
+            const __m256i c = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(bottom + x)));
+            const __m256i d = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(bottom + x + 1)));
+            const __m256i sum = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(_mm256_add_epi16(a, b), _mm256_add_epi16(c, d)), two), 2);
+            const __m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), packed);
+        }
+        boxScalar(top + x, bottom + x, dst + x, width - x);
+    }
+
+    // 256 entry table lookup: pshufb looks up the low nibble in each 16 entry part of the table, every result is
+    // kept where the high nibble picks that part
+    __attribute__((target("avx2"))) void lookupAvx2(uint8_t *row, int width, const uint8_t *table)
+    {
+        const __m256i nibble = _mm256_set1_epi8(0x0F);
+        const __m256i one = _mm256_set1_epi8(1);
+        int x = 0;
+        for (; x + 32 <= width; x += 32)
+        {
+            const __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + x));
+            const __m256i low = _mm256_and_si256(values, nibble);
+            __m256i high = _mm256_and_si256(_mm256_srli_epi16(values, 4), nibble);
+            __m256i result = _mm256_setzero_si256();
+            for (int k = 0; k < 16; k++)
+            {
+                const __m256i part = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(table + 16 * k)));
+                const __m256i hit = _mm256_cmpeq_epi8(high, _mm256_setzero_si256());
+                result = _mm256_or_si256(result, _mm256_and_si256(_mm256_shuffle_epi8(part, low), hit));
+                high = _mm256_sub_epi8(high, one);
+            }
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(row + x), result);
+        }
+        lookupScalar(row + x, width - x, table);
+    }
+#endif
+
+    constexpr PixelConvertKernel KERNELS[] = {
+#ifdef CPU_DISPATCH_X86
+        {CpuFeature::Avx2, "avx2", windowAvx2, lookupAvx2, boxAvx2},
+        {CpuFeature::Sse2, "sse2", windowSse2, lookupScalar, boxSse2},
+#endif
+        {CpuFeature::None, "scalar", windowScalar, lookupScalar, boxScalar},
+    };
+
+    const PixelConvertKernel &activeKernel()
+    {
+        static const PixelConvertKernel &kernel = bestKernel(KERNELS);
+        return kernel;
+    }
+
+    void fillNeutralChroma(const PooledFrame &dst)
+    {
+        const int chroma_width = (dst.width() + 1) / 2;
+        const int chroma_height = (dst.height() + 1) / 2;
+        for (int i = 1; i < 3; i++)
+        {
+            for (int y = 0; y < chroma_height; y++)
+            {
+                std::memset(dst.plane(i) + static_cast<size_t>(y) * dst.stride(i), 128, chroma_width);
+            }
+        }
+    }
+
+    uint8_t clampByte(int value)
+    {
+        return static_cast<uint8_t>(std::clamp(value, 0, 255));
+    }
+
+    const uint16_t *sourceRow(const uint16_t *src, size_t src_stride, int y)
+    {
+        return reinterpret_cast<const uint16_t *>(reinterpret_cast<const uint8_t *>(src) + static_cast<size_t>(y) * src_stride);
+    }
+}
+
+PixelConverter::PixelConverter(const PixelWindowConfig &config, int bit_depth)
+    : config_(config),
+      max_value_(static_cast<uint16_t>((1u << std::clamp(bit_depth, 8, 16)) - 1)),
+      histogram_shift_(std::max(0, std::clamp(bit_depth, 8, 16) - 10)),
+      histogram_(4 * HISTOGRAM_BINS, 0)
+{
+    use_gamma_ = config.gamma > 0 && config.gamma != 1.0;
+    for (int i = 0; i < 256; i++)
+    {
+        gamma_[i] = clampByte(static_cast<int>(std::lround(255.0 * std::pow(i / 255.0, config.gamma))));
+    }
+    // Auto-levels start from the whole range until the first histogram is in
+    if (config.auto_levels == AutoLevels::Off)
+    {
+        setWindow(std::min(config.low, max_value_), config.high > 0 ? std::min(config.high, max_value_) : max_value_);
+    }
+    else
+    {
+        setWindow(0, max_value_);
+    }
+}
+
+void PixelConverter::setWindow(uint16_t low, uint16_t high)
+{
+    if (high <= low)
+    {
+        low = std::min<uint16_t>(low, max_value_ - 1);
+        high = low + 1;
+    }
+    low_ = low;
+    high_ = high;
+    const uint32_t range = high - low;
+    shift_ = 0;
+    while ((range << shift_) < 256)
+    {
+        shift_++;
+    }
+    const uint32_t scaled = range << shift_;
+    scale_ = static_cast<uint16_t>((255u * 65536 + scaled - 1) / scaled);
+}
+
+void PixelConverter::windowRow(const uint16_t *src, uint8_t *dst, int width, bool sample, bool pairs)
+{
+    activeKernel().window(src, dst, width, low_, high_ - low_, shift_, scale_);
+    if (use_gamma_)
+    {
+        activeKernel().lookup(dst, width, gamma_.data());
+    }
+    if (!sample || config_.auto_levels == AutoLevels::Off)
+    {
+        return;
+    }
+    // Four interleaved histograms, so runs of equal samples don't wait on each other's increments
+    uint32_t *h = histogram_.data();
+    const uint32_t last = HISTOGRAM_BINS - 1;
+    int x = 0;
+    if (pairs)
+    {
+        // Two neighbouring samples every 2 * HISTOGRAM_STEP, as many as the single samples but from both columns of
+        // a Bayer quad
+        for (; x + 2 * HISTOGRAM_STEP + 2 <= width; x += 4 * HISTOGRAM_STEP)
+        {
+            h[std::min<uint32_t>(src[x] >> histogram_shift_, last)]++;
+            h[HISTOGRAM_BINS + std::min<uint32_t>(src[x + 1] >> histogram_shift_, last)]++;
+            h[2 * HISTOGRAM_BINS + std::min<uint32_t>(src[x + 2 * HISTOGRAM_STEP] >> histogram_shift_, last)]++;
+            h[3 * HISTOGRAM_BINS + std::min<uint32_t>(src[x + 2 * HISTOGRAM_STEP + 1] >> histogram_shift_, last)]++;
+        }
+        for (; x + 1 < width; x += 2 * HISTOGRAM_STEP)
+        {
+            h[std::min<uint32_t>(src[x] >> histogram_shift_, last)]++;
+            h[HISTOGRAM_BINS + std::min<uint32_t>(src[x + 1] >> histogram_shift_, last)]++;
+        }
+        return;
+    }
+    for (; x + 4 * HISTOGRAM_STEP <= width; x += 4 * HISTOGRAM_STEP)
+    {
+        h[std::min<uint32_t>(src[x] >> histogram_shift_, last)]++;
+        h[HISTOGRAM_BINS + std::min<uint32_t>(src[x + HISTOGRAM_STEP] >> histogram_shift_, last)]++;
+        h[2 * HISTOGRAM_BINS + std::min<uint32_t>(src[x + 2 * HISTOGRAM_STEP] >> histogram_shift_, last)]++;
+        h[3 * HISTOGRAM_BINS + std::min<uint32_t>(src[x + 3 * HISTOGRAM_STEP] >> histogram_shift_, last)]++;
+    }
+    for (; x < width; x += HISTOGRAM_STEP)
+    {
+        h[std::min<uint32_t>(src[x] >> histogram_shift_, last)]++;
+    }
+}
+
+void PixelConverter::finishFrame()
+{
+    if (config_.auto_levels == AutoLevels::Off)
+    {
+        return;
+    }
+    uint64_t total = 0;
+    for (int i = 0; i < HISTOGRAM_BINS; i++)
+    {
+        histogram_[i] += histogram_[i + HISTOGRAM_BINS] + histogram_[i + 2 * HISTOGRAM_BINS] + histogram_[i + 3 * HISTOGRAM_BINS];
+        total += histogram_[i];
+    }
+    if (total == 0)
+    {
+        return;
+    }
+
+    double low_fraction = 0;
+    double high_fraction = 1;
+    if (config_.auto_levels == AutoLevels::Percentile)
+    {
+        low_fraction = std::clamp(config_.low_percentile / 100, 0.0, 1.0);
+        high_fraction = std::clamp(config_.high_percentile / 100, low_fraction, 1.0);
+    }
+    // The first bin with more than low_fraction of the samples below it, and the first one reaching high_fraction
+    const double low_count = low_fraction * total;
+    const double high_count = high_fraction * total;
+    int low_bin = -1;
+    int high_bin = HISTOGRAM_BINS - 1;
+    uint64_t below = 0;
+    for (int i = 0; i < HISTOGRAM_BINS; i++)
+    {
+        below += histogram_[i];
+        if (low_bin < 0 && histogram_[i] > 0 && below > low_count)
+        {
+            low_bin = i;
+        }
+        if (below >= high_count && histogram_[i] > 0)
+        {
+            high_bin = i;
+            break;
+        }
+    }
+    low_bin = std::max(low_bin, 0);
+    std::fill(histogram_.begin(), histogram_.end(), 0);
+
+    int low = low_bin << histogram_shift_;
+    int high = std::min<int>(((high_bin + 1) << histogram_shift_) - 1, max_value_);
+    if (levelled_)
+    {
+        low = low_ + (low - low_) / LEVELS_SMOOTHING;
+        high = high_ + (high - high_) / LEVELS_SMOOTHING;
+    }
+    setWindow(static_cast<uint16_t>(low), static_cast<uint16_t>(high));
+    levelled_ = true;
+}
+
+void PixelConverter::convertGray16(const uint16_t *src, size_t src_stride, const PooledFrame &dst)
+{
+    for (int y = 0; y < dst.height(); y++)
+    {
+        windowRow(sourceRow(src, src_stride, y), dst.plane(0) + static_cast<size_t>(y) * dst.stride(0), dst.width(), y % HISTOGRAM_STEP == 0);
+    }
+    fillNeutralChroma(dst);
+    finishFrame();
+}
+
+void PixelConverter::convertBayer16(const uint16_t *src, size_t src_stride, BayerPattern pattern, const PooledFrame &dst)
+{
+    const int width = dst.width();
+    const int height = dst.height();
+    // One spare byte repeating the last sample, so the 2x2 windows need no edge case on the right
+    for (std::vector<uint8_t> &row : rows_)
+    {
+        row.resize(width + 1);
+    }
+
+    // Where red and blue sit in a quad, numbered 0 1 / 2 3; green has the other two
+    int red = 0;
+    int blue = 3;
+    switch (pattern)
+    {
+    case BayerPattern::RGGB:
+        red = 0, blue = 3;
+        break;
+    case BayerPattern::BGGR:
+        red = 3, blue = 0;
+        break;
+    case BayerPattern::GRBG:
+        red = 1, blue = 2;
+        break;
+    case BayerPattern::GBRG:
+        red = 2, blue = 1;
+        break;
+    }
+
+    // Every single sample on a sampled row and column would be the same site of the pattern, so auto-levels would
+    // only ever see one colour. The histogram takes whole quads instead: both rows of every 2 * HISTOGRAM_STEP-th
+    // quad row, in pairs of columns.
+    auto window = [&](int y)
+    {
+        uint8_t *row = rows_[y & 1].data();
+        windowRow(sourceRow(src, src_stride, y), row, width, y % (2 * HISTOGRAM_STEP) < 2, true);
+        row[width] = row[width - 1];
+    };
+
+    window(0);
+    for (int y = 0; y < height; y++)
+    {
+        if (y + 1 < height)
+        {
+            window(y + 1);
+        }
+        const uint8_t *top = rows_[y & 1].data();
+        const uint8_t *bottom = y + 1 < height ? rows_[(y + 1) & 1].data() : top;
+
+        activeKernel().box(top, bottom, dst.plane(0) + static_cast<size_t>(y) * dst.stride(0), width);
+
+        if (y % 2 != 0)
+        {
+            continue;
+        }
+        // BT.601 full range chroma of each quad, matching the full range luma
+        const uint8_t *red_row = (red < 2 ? top : bottom) + (red & 1);
+        const uint8_t *blue_row = (blue < 2 ? top : bottom) + (blue & 1);
+        uint8_t *u = dst.plane(1) + static_cast<size_t>(y / 2) * dst.stride(1);
+        uint8_t *v = dst.plane(2) + static_cast<size_t>(y / 2) * dst.stride(2);
+        for (int x = 0; x < width; x += 2)
+        {
+            const int r = red_row[x];
+            const int b = blue_row[x];
+            const int g = (top[x] + top[x + 1] + bottom[x] + bottom[x + 1] - r - b + 1) >> 1;
+            u[x / 2] = clampByte(128 + ((-43 * r - 85 * g + 128 * b + 128) >> 8));
+            v[x / 2] = clampByte(128 + ((128 * r - 107 * g - 21 * b + 128) >> 8));
+        }
+    }
+    finishFrame();
+}
+
+std::vector<PixelConvertKernel> pixelConvertKernels()
+{
+    return supportedKernels(KERNELS);
+}
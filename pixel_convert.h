@@ -0,0 +1,101 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "cpu_dispatch.h"
+#include "frame_pool.h"
+
+// Camera pixels into the 8 bit I420 the encoders take. 16 bit samples are windowed down to 8 bits, through a gamma
+// curve if one is set, and Bayer mosaics get a cheap demosaic on the way.
+// The window is fixed or follows auto-levels: every frame's histogram (of every HISTOGRAM_STEP-th sample of every
+// HISTOGRAM_STEP-th row, or as many whole 2x2 quads of a Bayer mosaic so every colour counts, taken while converting
+// it) sets the window for the next frame, so there is never a second pass over the pixels.
+// Windowing, gamma and the demosaic's luma use the best kernels the CPU supports (AVX2, SSE2 or plain C++).
+
+enum class AutoLevels
+{
+    Off,        // fixed window, PixelWindowConfig::low and high
+    MinMax,     // darkest to brightest sample
+    Percentile, // low_percentile to high_percentile of the samples, ignores hot and dead pixels
+};
+
+// Colours of the top left 2x2 quad, row by row
+enum class BayerPattern
+{
+    RGGB,
+    BGGR,
+    GRBG,
+    GBRG,
+};
+
+struct PixelWindowConfig
+{
+    AutoLevels auto_levels = AutoLevels::Percentile;
+    double low_percentile = 0.5;
+    double high_percentile = 99.5;
+    uint16_t low = 0;  // window with AutoLevels::Off
+    uint16_t high = 0; // 0 for the top of the bit depth
+    double gamma = 1.0; // on the windowed value, below 1 brightens the shadows
+};
+
+class PixelConverter
+{
+public:
+    static constexpr int HISTOGRAM_BINS = 1024;
+    static constexpr int HISTOGRAM_STEP = 4;
+
+    // bit_depth is how many bits of each 16 bit sample are used (12 for a 12 bit camera)
+    PixelConverter(const PixelWindowConfig &config, int bit_depth);
+
+    // Monochrome into dst's luma, with neutral chroma. dst has the size of the source, src_stride is in bytes.
+    void convertGray16(const uint16_t *src, size_t src_stride, const PooledFrame &dst);
+
+    // Bayer mosaic. Luma is the mean of each 2x2 window, which always covers one red, two green and one blue site,
+    // so it keeps full resolution. Chroma comes from each 2x2 quad of the pattern, exactly I420's chroma resolution.
+    void convertBayer16(const uint16_t *src, size_t src_stride, BayerPattern pattern, const PooledFrame &dst);
+
+    // Window the last frame was converted with
+    uint16_t low() const { return low_; }
+    uint16_t high() const { return high_; }
+
+private:
+    // One source row windowed into dst (and counted into the histogram if sample, in pairs of neighbouring samples
+    // if pairs)
+    void windowRow(const uint16_t *src, uint8_t *dst, int width, bool sample, bool pairs = false);
+    void setWindow(uint16_t low, uint16_t high);
+    // Window for the next frame from this frame's histogram
+    void finishFrame();
+
+    const PixelWindowConfig config_;
+    const uint16_t max_value_;
+    const int histogram_shift_;
+    bool use_gamma_ = false;
+    std::array<uint8_t, 256> gamma_{};
+
+    uint16_t low_ = 0;
+    uint16_t high_ = 0;
+    int shift_ = 0;      // the window's samples are scaled by scale_ after shifting left by this many bits
+    uint16_t scale_ = 0;
+    bool levelled_ = false; // a histogram has set the window at least once
+
+    std::vector<uint32_t> histogram_;
+    std::vector<uint8_t> rows_[2]; // windowed rows for the Bayer path
+};
+
+struct PixelConvertKernel
+{
+    CpuFeature feature;
+    const char *name;
+    // dst[x] = ((min(max(src[x] - low, 0), range) << shift) * scale) >> 16, the window from low onto 0..255
+    void (*window)(const uint16_t *src, uint8_t *dst, int width, uint16_t low, uint16_t range, int shift, uint16_t scale);
+    // dst[x] = table[dst[x]], in place
+    void (*lookup)(uint8_t *dst, int width, const uint8_t *table);
+    // dst[x] = mean of top[x], top[x + 1], bottom[x] and bottom[x + 1], reads one sample past width in both rows
+    void (*box)(const uint8_t *top, const uint8_t *bottom, uint8_t *dst, int width);
+};
+
+// The kernels this CPU can run, best first: PixelConverter uses the first, the last is plain C++
+std::vector<PixelConvertKernel> pixelConvertKernels();
@@ -0,0 +1,12 @@
+#include "playlist_snapshot.h"
+
+#include "http_range.h"
+
+std::shared_ptr<const PlaylistSnapshot> PlaylistSnapshot::make(std::string body, int64_t version)
+{
+    auto snapshot = std::make_shared<PlaylistSnapshot>();
+    snapshot->etag = formatEtag(hashBytes(body.data(), body.size()));
+    snapshot->body = std::move(body);
+    snapshot->version = version;
+    return snapshot;
+}
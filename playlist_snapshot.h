@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// A rendered playlist, immutable once it is published. Producers render a new one whenever what it lists changes and
+// swap it in with std::atomic_store, a poll is then one std::atomic_load and the body goes out as it is.
+struct PlaylistSnapshot
+{
+    std::string body;
+    std::string etag;    // quoted strong validator, a hash of the body
+    int64_t version = 0; // whatever the producer rendered it from, to tell whether it is stale
+
+    static std::shared_ptr<const PlaylistSnapshot> make(std::string body, int64_t version = 0);
+};
+
+using PlaylistSnapshotPtr = std::shared_ptr<const PlaylistSnapshot>;
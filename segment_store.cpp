@@ -0,0 +1,393 @@
+#include "segment_store.h"
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <filesystem>
+#include <iostream>
+#include <iterator>
+
+#ifdef ACQUIRE_DRIVER_IO_URING
+#include <liburing.h>
+#endif
+
+#include "logger.h"
+#include "metrics.h"
+
+namespace
+{
+    struct FileWrite
+    {
+        std::string path;
+        const ChunkedBuffer *data;
+    };
+
+    // iovecs for the chunks of data from offset on, at most IOV_MAX of them
+    void gatherChunks(const ChunkedBuffer &data, size_t offset, std::vector<iovec> &iov)
+    {
+        iov.clear();
+        data.forEach(offset, data.size() - offset, [&iov](const uint8_t *bytes, size_t size)
+                     {
+                         iov.push_back({const_cast<uint8_t *>(bytes), size});
+                         return iov.size() < IOV_MAX; });
+    }
+
+    // Writes data from offset on, one pwritev per IOV_MAX chunks (a single one for any realistic segment)
+    bool pwriteAll(int fd, const ChunkedBuffer &data, size_t offset)
+    {
+        std::vector<iovec> iov;
+        while (offset < data.size())
+        {
+            gatherChunks(data, offset, iov);
+            const ssize_t written = pwritev(fd, iov.data(), iov.size(), offset);
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (written <= 0)
+            {
+                return false;
+            }
+            offset += written;
+        }
+        return true;
+    }
+
+    // Writes a batch of files. With io_uring every file is a writev on a ring kept for the writer thread's lifetime,
+    // all submitted at once. Whatever those leave unwritten, or everything without io_uring, goes out with pwritev.
+    class BatchWriter
+    {
+    public:
+        explicit BatchWriter(unsigned entries)
+        {
+#ifdef ACQUIRE_DRIVER_IO_URING
+            ring_ok_ = io_uring_queue_init(entries, &ring_, 0) == 0;
+            if (!ring_ok_)
+            {
+                logWarn("io_uring unavailable, segment store falls back to pwritev");
+            }
+#else
+            (void)entries;
+#endif
+        }
+
+        ~BatchWriter()
+        {
+#ifdef ACQUIRE_DRIVER_IO_URING
+            if (ring_ok_)
+            {
+                io_uring_queue_exit(&ring_);
+            }
+#endif
+        }
+
+        BatchWriter(const BatchWriter &) = delete;
+        BatchWriter &operator=(const BatchWriter &) = delete;
+
+        // Each file is written as path.tmp and renamed over path once complete
+        std::vector<bool> write(const std::vector<FileWrite> &files)
+        {
+            std::vector<int> fds(files.size(), -1);
+            for (size_t i = 0; i < files.size(); i++)
+            {
+                const std::string temporary = files[i].path + ".tmp";
+                fds[i] = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (fds[i] < 0)
+                {
+                    std::cerr << "Could not open file for writing: " << temporary << std::endl;
+                }
+            }
+
+            std::vector<size_t> done(files.size(), 0);
+#ifdef ACQUIRE_DRIVER_IO_URING
+            if (ring_ok_)
+            {
+                submit(files, fds, done);
+            }
+#endif
+
+            std::vector<bool> ok(files.size(), false);
+            for (size_t i = 0; i < files.size(); i++)
+            {
+                if (fds[i] < 0)
+                {
+                    continue;
+                }
+                const std::string temporary = files[i].path + ".tmp";
+                ok[i] = pwriteAll(fds[i], *files[i].data, done[i]);
+                ok[i] = close(fds[i]) == 0 && ok[i];
+                ok[i] = ok[i] && rename(temporary.c_str(), files[i].path.c_str()) == 0;
+                if (!ok[i])
+                {
+                    std::cerr << "Could not write " << files[i].path << std::endl;
+                    unlink(temporary.c_str());
+                }
+            }
+            return ok;
+        }
+
+    private:
+#ifdef ACQUIRE_DRIVER_IO_URING
+        // Sets done[i] to how much of file i its writev managed
+        void submit(const std::vector<FileWrite> &files, const std::vector<int> &fds, std::vector<size_t> &done)
+        {
+            std::vector<std::vector<iovec>> iovs(files.size()); // must stay put until the completions are in
+            unsigned submitted = 0;
+            for (size_t i = 0; i < files.size(); i++)
+            {
+                if (fds[i] < 0 || files[i].data->empty())
+                {
+                    continue;
+                }
+                io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+                if (!sqe)
+                {
+                    break; // ring full, the rest go through pwritev
+                }
+                gatherChunks(*files[i].data, 0, iovs[i]);
+                io_uring_prep_writev(sqe, fds[i], iovs[i].data(), iovs[i].size(), 0);
+                io_uring_sqe_set_data(sqe, reinterpret_cast<void *>(i));
+                submitted++;
+            }
+            if (submitted == 0)
+            {
+                return;
+            }
+            io_uring_submit(&ring_);
+
+            for (unsigned completed = 0; completed < submitted;)
+            {
+                io_uring_cqe *cqe;
+                const int result = io_uring_wait_cqe(&ring_, &cqe);
+                if (result == -EINTR)
+                {
+                    continue;
+                }
+                if (result < 0)
+                {
+                    // Can't tell what became of the rest, start those files over with pwritev
+                    std::fill(done.begin(), done.end(), 0);
+                    return;
+                }
+                const size_t i = reinterpret_cast<size_t>(io_uring_cqe_get_data(cqe));
+                if (cqe->res > 0)
+                {
+                    done[i] = cqe->res;
+                }
+                io_uring_cqe_seen(&ring_, cqe);
+                completed++;
+            }
+        }
+
+        io_uring ring_;
+        bool ring_ok_ = false;
+#endif
+    };
+
+    struct StoreMetrics
+    {
+        Counter &written_bytes = MetricsRegistry::shared().counter("acquire_segment_store_written_bytes_total", "Segment bytes written to disk");
+        Counter &dropped = MetricsRegistry::shared().counter("acquire_segment_store_dropped_total", "Segments dropped because the writer fell behind or the write failed");
+        Counter &evicted = MetricsRegistry::shared().counter("acquire_segment_store_evicted_total", "Segments deleted by retention");
+    };
+
+    StoreMetrics &storeMetrics()
+    {
+        static StoreMetrics metrics;
+        return metrics;
+    }
+}
+
+SegmentStore::SegmentStore(const SegmentStoreConfig &config) : config_(config) {}
+
+SegmentStore::~SegmentStore()
+{
+    stop();
+}
+
+void SegmentStore::start()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_)
+    {
+        return;
+    }
+    running_ = true;
+    stopping_ = false;
+    thread_ = std::thread(&SegmentStore::run, this);
+}
+
+void SegmentStore::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!running_)
+        {
+            return;
+        }
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+}
+
+void SegmentStore::store(const std::string &stream, int64_t index, ChunkedBufferPtr data)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (queue_.size() < config_.max_queued)
+        {
+            auto inserted = streams_.emplace(stream, Stream());
+            inserted.first->second.segments.push_back(Stored{index, data->size(), false});
+            queue_.push_back(Job{stream, index, std::move(data), inserted.second});
+            cv_.notify_all();
+            return;
+        }
+    }
+    storeMetrics().dropped.add(1);
+    logWarn("Segment store is behind, dropped {} segment {}", stream, index);
+}
+
+std::vector<int64_t> SegmentStore::indices(const std::string &stream) const
+{
+    std::vector<int64_t> result;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = streams_.find(stream);
+    if (found != streams_.end())
+    {
+        for (const Stored &stored : found->second.segments)
+        {
+            result.push_back(stored.index);
+        }
+    }
+    return result;
+}
+
+bool SegmentStore::evicted(const std::string &stream) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto found = streams_.find(stream);
+    return found != streams_.end() && found->second.evicted;
+}
+
+MappedFilePtr SegmentStore::map(const std::string &stream, int64_t index) const
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = streams_.find(stream);
+        if (found == streams_.end())
+        {
+            return nullptr;
+        }
+        const std::deque<Stored> &segments = found->second.segments;
+        auto stored = std::find_if(segments.begin(), segments.end(), [index](const Stored &s)
+                                   { return s.index == index; });
+        if (stored == segments.end() || !stored->written)
+        {
+            return nullptr;
+        }
+    }
+    // Retention may delete it in between, the open fails then just as if it had been asked for a moment later
+    return MappedFile::open(path(stream, index));
+}
+
+std::string SegmentStore::directory(const std::string &stream) const
+{
+    return config_.directory + "/" + stream;
+}
+
+std::string SegmentStore::path(const std::string &stream, int64_t index) const
+{
+    return directory(stream) + "/segment_" + std::to_string(index) + ".ts";
+}
+
+void SegmentStore::run()
+{
+    BatchWriter writer(config_.max_queued);
+    std::vector<Job> batch;
+    std::vector<FileWrite> files;
+    std::vector<std::string> doomed;
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this]
+                     { return !queue_.empty() || stopping_; });
+            if (queue_.empty())
+            {
+                break; // stopping, and everything queued has been written
+            }
+            batch.assign(std::make_move_iterator(queue_.begin()), std::make_move_iterator(queue_.end()));
+            queue_.clear();
+        }
+
+        files.clear();
+        for (const Job &job : batch)
+        {
+            const std::string dir = directory(job.stream);
+            std::error_code error;
+            if (job.first)
+            {
+                // Segment numbers start over with every run, whatever an earlier one left is of no use
+                std::filesystem::remove_all(dir, error);
+            }
+            std::filesystem::create_directories(dir, error);
+            files.push_back(FileWrite{path(job.stream, job.index), job.data.get()});
+        }
+        const std::vector<bool> ok = writer.write(files);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (size_t i = 0; i < batch.size(); i++)
+            {
+                finishLocked(batch[i], ok[i], doomed);
+            }
+        }
+        for (const std::string &file : doomed)
+        {
+            unlink(file.c_str());
+        }
+        storeMetrics().evicted.add(doomed.size());
+        doomed.clear();
+        batch.clear();
+    }
+}
+
+void SegmentStore::finishLocked(const Job &job, bool ok, std::vector<std::string> &doomed)
+{
+    Stream &stream = streams_[job.stream];
+    auto stored = std::find_if(stream.segments.begin(), stream.segments.end(), [&job](const Stored &s)
+                               { return s.index == job.index; });
+    if (stored == stream.segments.end())
+    {
+        return;
+    }
+    if (!ok)
+    {
+        stream.segments.erase(stored);
+        storeMetrics().dropped.add(1);
+        return;
+    }
+    stored->written = true;
+    stream.bytes += stored->size;
+    storeMetrics().written_bytes.add(stored->size);
+
+    // Oldest first, never one that is still waiting to be written
+    while (!stream.segments.empty() && stream.segments.front().written &&
+           ((config_.max_segments > 0 && stream.segments.size() > config_.max_segments) ||
+            (config_.max_bytes > 0 && stream.bytes > config_.max_bytes)))
+    {
+        const Stored &oldest = stream.segments.front();
+        doomed.push_back(path(job.stream, oldest.index));
+        stream.bytes -= oldest.size;
+        stream.segments.pop_front();
+        stream.evicted = true;
+    }
+}
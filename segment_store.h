@@ -0,0 +1,95 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "chunked_buffer.h"
+#include "mapped_file.h"
+
+struct SegmentStoreConfig
+{
+    std::string directory = "segments"; // every stream gets a subdirectory of its own
+    size_t max_segments = 360;          // per stream, an hour of 10 second segments. 0 for no limit.
+    uint64_t max_bytes = 1ull << 30;    // per stream, 0 for no limit
+    size_t max_queued = 64;             // segments waiting for the writer, any more are dropped instead of piling up in memory
+};
+
+// Keeps finished segments on disk for time-shifted playback, outside of the encode and request paths.
+// store() only queues the segment, a background writer batches whatever has queued up and writes it with io_uring
+// (when built with ACQUIRE_DRIVER_IO_URING) or one pwritev per segment. Segments are written under a temporary
+// name and renamed into place, so a mapped segment is always complete.
+// Each stream keeps its newest max_segments / max_bytes on disk, older ones are deleted as new ones land.
+class SegmentStore
+{
+public:
+    explicit SegmentStore(const SegmentStoreConfig &config);
+    ~SegmentStore();
+
+    SegmentStore(const SegmentStore &) = delete;
+    SegmentStore &operator=(const SegmentStore &) = delete;
+
+    void start();
+    // Writes out whatever is still queued, then stops the writer
+    void stop();
+
+    // Queues a segment for writing, the store keeps a reference to data until it is on disk.
+    // The first segment of a stream clears out whatever a previous run left in its directory.
+    void store(const std::string &stream, int64_t index, ChunkedBufferPtr data);
+
+    // Indices of the stream's stored segments, oldest first, including those still queued
+    std::vector<int64_t> indices(const std::string &stream) const;
+
+    // Whether retention has deleted any of the stream's segments yet
+    bool evicted(const std::string &stream) const;
+
+    // A segment that is on disk, mapped. nullptr if it is still queued, was never stored or has been deleted.
+    MappedFilePtr map(const std::string &stream, int64_t index) const;
+
+    const SegmentStoreConfig &config() const { return config_; }
+
+private:
+    struct Stored
+    {
+        int64_t index;
+        size_t size;
+        bool written;
+    };
+
+    struct Stream
+    {
+        std::deque<Stored> segments; // oldest first
+        uint64_t bytes = 0;          // of the written ones
+        bool evicted = false;
+    };
+
+    struct Job
+    {
+        std::string stream;
+        int64_t index;
+        ChunkedBufferPtr data;
+        bool first; // of its stream, clear the directory before writing it
+    };
+
+    void run();
+    // Marks a job done and returns the paths retention wants deleted
+    void finishLocked(const Job &job, bool ok, std::vector<std::string> &doomed);
+    std::string directory(const std::string &stream) const;
+    std::string path(const std::string &stream, int64_t index) const;
+
+    const SegmentStoreConfig config_;
+
+    std::thread thread_;
+    bool running_ = false;
+    bool stopping_ = false;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Job> queue_;
+    std::map<std::string, Stream> streams_;
+};
@@ -0,0 +1,87 @@
+#include "speed_controller.h"
+
+#include <algorithm>
+
+#include "logger.h"
+
+namespace
+{
+    // A window that is this far over budget by a quarter of the way in is decided early, a stall shouldn't last a second
+    const double OVERLOAD_LOAD = 1.5;
+
+    // Longest wait between tries of a slower level, in windows
+    const int MAX_RELAX_WINDOWS = 64;
+}
+
+SpeedController::SpeedController(const SpeedControllerConfig &config, const std::string &encoder)
+    : config_(config),
+      level_(std::clamp(config.start_level, config.min_level, config.max_level)),
+      calm_needed_(std::max(config.relax_windows, 1)),
+      faster_(MetricsRegistry::shared().counter("acquire_encoder_speed_changes_total", "Speed level changes made to keep an encoder in real time",
+                                                {{"encoder", encoder}, {"direction", "faster"}})),
+      slower_(MetricsRegistry::shared().counter("acquire_encoder_speed_changes_total", "Speed level changes made to keep an encoder in real time",
+                                                {{"encoder", encoder}, {"direction", "slower"}})),
+      level_gauge_(MetricsRegistry::shared().gauge("acquire_encoder_speed_level", "Current speed level of an encoder, higher is faster",
+                                                   {{"encoder", encoder}})),
+      load_gauge_(MetricsRegistry::shared().gauge("acquire_encoder_load", "Average encode time over the last window as a share of the frame budget",
+                                                  {{"encoder", encoder}}))
+{
+    level_gauge_.set(level_);
+}
+
+bool SpeedController::record(double seconds)
+{
+    frames_++;
+    total_ += seconds;
+    const double budget = config_.frame_budget * frames_;
+    const bool overloaded = frames_ >= std::max(config_.window / 4, 1) && total_ > OVERLOAD_LOAD * budget;
+    if (frames_ < config_.window && !overloaded)
+    {
+        return false;
+    }
+
+    const double load = total_ / budget;
+    load_gauge_.set(load);
+    frames_ = 0;
+    total_ = 0;
+
+    const int before = level_;
+    if (load > config_.target_load)
+    {
+        calm_ = 0;
+        if (probing_)
+        {
+            // The slower level was too much, wait longer before the next try
+            calm_needed_ = std::min(calm_needed_ * 2, MAX_RELAX_WINDOWS);
+            probing_ = false;
+        }
+        if (level_ < config_.max_level)
+        {
+            change(level_ + 1);
+        }
+    }
+    else
+    {
+        if (probing_)
+        {
+            calm_needed_ = std::max(config_.relax_windows, 1);
+            probing_ = false;
+        }
+        calm_ = load < config_.relax_load ? calm_ + 1 : 0;
+        if (calm_ >= calm_needed_ && level_ > config_.min_level)
+        {
+            calm_ = 0;
+            probing_ = true;
+            change(level_ - 1);
+        }
+    }
+    return level_ != before;
+}
+
+void SpeedController::change(int level)
+{
+    (level > level_ ? faster_ : slower_).add(1);
+    logDebug("Encoder speed level {} -> {}", level_, level);
+    level_ = level;
+    level_gauge_.set(level_);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+
+#include "metrics.h"
+
+// Keeps a realtime encoder at the best quality it can sustain. Every frame's encode time is measured against the
+// frame budget; once a window of frames averages above target_load of the budget the encoder is stepped to the next
+// faster speed level, and after relax_windows windows below relax_load it tries the next slower one again.
+// A slower level that doesn't hold up doubles how long the next try waits, so a box that is just at its limit
+// doesn't flip back and forth every second.
+struct SpeedControllerConfig
+{
+    double frame_budget = 1.0 / 30; // seconds
+    double target_load = 0.85;
+    double relax_load = 0.55;
+    int window = 30;        // frames per decision, a frame rate's worth decides once a second
+    int relax_windows = 3;
+    // Speed levels, higher is faster: an x264 preset index or a VP9 cpu-used
+    int min_level = 0;
+    int max_level = 0;
+    int start_level = 0;
+};
+
+class SpeedController
+{
+public:
+    // encoder labels the metrics, e.g. "h264_720p"
+    SpeedController(const SpeedControllerConfig &config, const std::string &encoder);
+
+    // Adds one frame's encode time, true if the level changed and the encoder needs reconfiguring
+    bool record(double seconds);
+
+    int level() const { return level_; }
+
+private:
+    void change(int level);
+
+    const SpeedControllerConfig config_;
+    int level_;
+    int frames_ = 0;
+    double total_ = 0;
+    int calm_ = 0;         // windows in a row below relax_load
+    int calm_needed_;      // windows below relax_load before trying a slower level
+    bool probing_ = false; // the last change was to a slower level and hasn't proven itself yet
+
+    Counter &faster_;
+    Counter &slower_;
+    Gauge &level_gauge_;
+    Gauge &load_gauge_;
+};
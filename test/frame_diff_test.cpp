@@ -0,0 +1,76 @@
+// Checks every SAD kernel of the frame diff this CPU can run against the scalar one: identical block sums for 16 wide
+// luma and 8 wide chroma blocks, at odd widths, unaligned starts, and on top of sums already in the blocks.
+// Exits non-zero if any of them is off.
+
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "frame_diff.h"
+
+namespace
+{
+    const int WIDTHS[] = {1, 2, 7, 8, 9, 15, 16, 17, 31, 32, 33, 47, 63, 64, 65, 95, 127, 129, 319, 641, 960, 1279, 1920, 3841};
+    const int SHIFTS[] = {4, 3}; // luma and chroma blocks
+
+    bool checkKernel(const FrameDiffKernel &kernel, const FrameDiffKernel &scalar)
+    {
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<int> byte(0, 255);
+        std::vector<uint8_t> a;
+        std::vector<uint8_t> b;
+        for (int width : WIDTHS)
+        {
+            a.resize(width + 64);
+            b.resize(width + 64);
+            for (int shift : SHIFTS)
+            {
+                const int blocks = (width >> shift) + 2; // one past the last block must stay untouched
+                for (int offset = 0; offset < 64; offset += 13)
+                {
+                    // Random samples, then the extremes so a block's sum gets as large as it can
+                    for (int pattern = 0; pattern < 2; pattern++)
+                    {
+                        for (size_t i = 0; i < a.size(); i++)
+                        {
+                            a[i] = static_cast<uint8_t>(pattern == 0 ? byte(rng) : (i & 1) * 255);
+                            b[i] = static_cast<uint8_t>(pattern == 0 ? byte(rng) : 255 - a[i]);
+                        }
+                        std::vector<uint32_t> expected(blocks);
+                        for (uint32_t &sum : expected)
+                        {
+                            sum = static_cast<uint32_t>(byte(rng));
+                        }
+                        std::vector<uint32_t> sums = expected;
+                        scalar.sad_row(a.data() + offset, b.data() + offset, width, shift, expected.data());
+                        kernel.sad_row(a.data() + offset, b.data() + offset, width, shift, sums.data());
+                        for (int i = 0; i < blocks; i++)
+                        {
+                            if (sums[i] != expected[i])
+                            {
+                                std::cerr << kernel.name << ": width " << width << " shift " << shift << " offset " << offset
+                                          << ": block " << i << " is " << sums[i] << ", expected " << expected[i] << std::endl;
+                                return false;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        return true;
+    }
+}
+
+int main()
+{
+    const std::vector<FrameDiffKernel> kernels = frameDiffKernels();
+    bool ok = true;
+    for (const FrameDiffKernel &kernel : kernels)
+    {
+        const bool passed = checkKernel(kernel, kernels.back());
+        std::cout << kernel.name << ": " << (passed ? "ok" : "FAILED") << std::endl;
+        ok = ok && passed;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,252 @@
+// Checks the downscaler: every blend and halve kernel this CPU can run against the scalar one, scalePlane against a
+// plain reference of the halve-then-bilinear scale for the ladder's sizes and odd ones, and that a one pixel
+// checkerboard scaled down 3:1, 4.5:1 and 5:1 comes out flat gray instead of aliasing into a coarser pattern.
+// Exits non-zero if any of them is off.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "frame_scale.h"
+
+namespace
+{
+    const int GUARD = 64;      // bytes on each side of a row that must stay untouched
+    const uint8_t FILL = 0xA5; // what the guards and padding start out as
+
+    bool guardsIntact(const std::vector<uint8_t> &buffer, size_t begin, size_t end)
+    {
+        for (size_t i = 0; i < buffer.size(); i++)
+        {
+            if ((i < begin || i >= end) && buffer[i] != FILL)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool checkKernel(const FrameScaleKernel &kernel, const FrameScaleKernel &scalar)
+    {
+        std::mt19937 rng(42);
+        std::vector<uint8_t> a;
+        std::vector<uint8_t> b;
+        std::vector<uint8_t> expected;
+        std::vector<uint8_t> buffer;
+        std::uniform_int_distribution<int> wide(129, 4200);
+        for (int i = 0; i < 400; i++)
+        {
+            // Every width up to two AVX2 halving blocks, so each tail length comes up, then random ones
+            const int width = i < 128 ? i + 1 : wide(rng);
+            const int offset = static_cast<int>(rng() % 32);
+            a.resize(width + 32);
+            b.resize(width + 32);
+            const bool extremes = i % 5 == 0; // all 255 is the largest sum the 16 bit lanes see
+            for (size_t j = 0; j < a.size(); j++)
+            {
+                a[j] = static_cast<uint8_t>(extremes ? 255 : rng());
+                b[j] = static_cast<uint8_t>(extremes ? 255 - (j & 1) : rng());
+            }
+
+            const int f = static_cast<int>(rng() % 256);
+            expected.assign(width, 0);
+            scalar.blend(expected.data(), a.data() + offset, b.data() + offset, width, f);
+            buffer.assign(GUARD + width + GUARD, FILL);
+            kernel.blend(buffer.data() + GUARD, a.data() + offset, b.data() + offset, width, f);
+            if (!std::equal(expected.begin(), expected.end(), buffer.begin() + GUARD) || !guardsIntact(buffer, GUARD, GUARD + width))
+            {
+                std::cerr << kernel.name << " blend: width " << width << " f " << f << " differs from " << scalar.name << std::endl;
+                return false;
+            }
+
+            const int halved = (width + 1) / 2;
+            expected.assign(halved, 0);
+            scalar.halve(expected.data(), a.data() + offset, b.data() + offset, width);
+            buffer.assign(GUARD + halved + GUARD, FILL);
+            kernel.halve(buffer.data() + GUARD, a.data() + offset, b.data() + offset, width);
+            if (!std::equal(expected.begin(), expected.end(), buffer.begin() + GUARD) || !guardsIntact(buffer, GUARD, GUARD + halved))
+            {
+                std::cerr << kernel.name << " halve: width " << width << " differs from " << scalar.name << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    struct Plane
+    {
+        int width;
+        int height;
+        std::vector<uint8_t> pixels; // packed, stride is width
+
+        uint8_t at(int x, int y) const
+        {
+            return pixels[static_cast<size_t>(y) * width + x];
+        }
+    };
+
+    // The whole scale one sample at a time: 2x2 box halving while more than 2:1 larger, then a vertical and a
+    // horizontal bilinear blend, rounding where scalePlane does
+    Plane referenceScale(Plane src, int dst_width, int dst_height)
+    {
+        while (src.width > 2 * dst_width || src.height > 2 * dst_height)
+        {
+            const bool halve_x = src.width > 2 * dst_width;
+            const bool halve_y = src.height > 2 * dst_height;
+            Plane half{halve_x ? (src.width + 1) / 2 : src.width, halve_y ? (src.height + 1) / 2 : src.height, {}};
+            half.pixels.resize(static_cast<size_t>(half.width) * half.height);
+            for (int y = 0; y < half.height; y++)
+            {
+                const int y0 = halve_y ? 2 * y : y;
+                const int y1 = halve_y ? std::min(y0 + 1, src.height - 1) : y0;
+                for (int x = 0; x < half.width; x++)
+                {
+                    const int x0 = halve_x ? 2 * x : x;
+                    const int x1 = halve_x ? std::min(x0 + 1, src.width - 1) : x0;
+                    const int sum = src.at(x0, y0) + src.at(x1, y0) + src.at(x0, y1) + src.at(x1, y1);
+                    half.pixels[static_cast<size_t>(y) * half.width + x] = static_cast<uint8_t>((sum + 2) >> 2);
+                }
+            }
+            src = std::move(half);
+        }
+
+        // Source position of output i's centre in 1/256ths, less half a sample, clamped to the plane
+        auto position = [](int i, int src_size, int dst_size, int &index, int &weight)
+        {
+            const int64_t p = ((2 * static_cast<int64_t>(i) + 1) * src_size * 256) / (2 * dst_size) - 128;
+            index = p <= 0 ? 0 : std::min(static_cast<int>(p >> 8), src_size - 1);
+            weight = p <= 0 || index == src_size - 1 ? 0 : static_cast<int>(p & 0xFF);
+        };
+
+        Plane dst{dst_width, dst_height, std::vector<uint8_t>(static_cast<size_t>(dst_width) * dst_height)};
+        for (int y = 0; y < dst_height; y++)
+        {
+            int sy;
+            int fy;
+            position(y, src.height, dst_height, sy, fy);
+            auto column = [&](int x)
+            {
+                const int below = fy == 0 ? src.at(x, sy) : src.at(x, sy + 1);
+                return (src.at(x, sy) * (256 - fy) + below * fy + 128) >> 8;
+            };
+            for (int x = 0; x < dst_width; x++)
+            {
+                int sx;
+                int fx;
+                position(x, src.width, dst_width, sx, fx);
+                const int right = column(std::min(sx + 1, src.width - 1));
+                dst.pixels[static_cast<size_t>(y) * dst_width + x] = static_cast<uint8_t>((column(sx) * (256 - fx) + right * fx + 128) >> 8);
+            }
+        }
+        return dst;
+    }
+
+    // scalePlane from a padded source into a padded destination, padding must stay untouched
+    bool scale(const Plane &src, Plane &dst)
+    {
+        const int src_stride = src.width + 13;
+        const int dst_stride = dst.width + 7;
+        std::vector<uint8_t> padded(static_cast<size_t>(src_stride) * src.height, FILL);
+        for (int y = 0; y < src.height; y++)
+        {
+            std::copy_n(src.pixels.begin() + static_cast<size_t>(y) * src.width, src.width, padded.begin() + static_cast<size_t>(y) * src_stride);
+        }
+        std::vector<uint8_t> out(static_cast<size_t>(dst_stride) * dst.height, FILL);
+        scalePlane(padded.data(), src_stride, src.width, src.height, out.data(), dst_stride, dst.width, dst.height);
+
+        dst.pixels.resize(static_cast<size_t>(dst.width) * dst.height);
+        for (int y = 0; y < dst.height; y++)
+        {
+            const auto row = out.begin() + static_cast<size_t>(y) * dst_stride;
+            std::copy_n(row, dst.width, dst.pixels.begin() + static_cast<size_t>(y) * dst.width);
+            if (std::any_of(row + dst.width, row + dst_stride, [](uint8_t v)
+                            { return v != FILL; }))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool checkScalePlane()
+    {
+        const int sizes[][4] = {{1920, 1080, 1280, 720}, {1920, 1080, 854, 480}, {1920, 1080, 640, 360}, {1920, 1080, 426, 240},
+                                {960, 540, 320, 180}, {1921, 1081, 213, 121}, {333, 777, 100, 101}, {777, 333, 101, 100},
+                                {64, 48, 63, 47}, {17, 9, 17, 9}, {9, 17, 1, 1}, {5, 3, 2, 1}};
+        std::mt19937 rng(7);
+        for (const auto &size : sizes)
+        {
+            Plane src{size[0], size[1], std::vector<uint8_t>(static_cast<size_t>(size[0]) * size[1])};
+            for (uint8_t &v : src.pixels)
+            {
+                v = static_cast<uint8_t>(rng());
+            }
+            Plane dst{size[2], size[3], {}};
+            if (!scale(src, dst))
+            {
+                std::cerr << "scalePlane: " << src.width << "x" << src.height << " to " << dst.width << "x" << dst.height
+                          << " wrote into the padding" << std::endl;
+                return false;
+            }
+            const Plane expected = referenceScale(src, dst.width, dst.height);
+            for (size_t i = 0; i < dst.pixels.size(); i++)
+            {
+                if (dst.pixels[i] != expected.pixels[i])
+                {
+                    std::cerr << "scalePlane: " << src.width << "x" << src.height << " to " << dst.width << "x" << dst.height << ": "
+                              << i % dst.width << "," << i / dst.width << " is " << int(dst.pixels[i]) << ", expected "
+                              << int(expected.pixels[i]) << std::endl;
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Plain bilinear samples a pixel checkerboard at whatever phase each output lands on, black, white or between
+    bool checkAliasing()
+    {
+        Plane src{1920, 1080, std::vector<uint8_t>(1920 * 1080)};
+        for (int y = 0; y < src.height; y++)
+        {
+            for (int x = 0; x < src.width; x++)
+            {
+                src.pixels[static_cast<size_t>(y) * src.width + x] = (x + y) & 1 ? 255 : 0;
+            }
+        }
+        for (const auto &size : {std::make_pair(640, 360), std::make_pair(426, 240), std::make_pair(384, 216)})
+        {
+            Plane dst{size.first, size.second, {}};
+            scale(src, dst);
+            const auto range = std::minmax_element(dst.pixels.begin(), dst.pixels.end());
+            if (std::abs(*range.first - 128) > 2 || std::abs(*range.second - 128) > 2)
+            {
+                std::cerr << "checkerboard scaled to " << dst.width << "x" << dst.height << " is " << int(*range.first) << ".."
+                          << int(*range.second) << ", expected flat gray" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+int main()
+{
+    const std::vector<FrameScaleKernel> kernels = frameScaleKernels();
+    bool ok = true;
+    for (const FrameScaleKernel &kernel : kernels)
+    {
+        const bool passed = checkKernel(kernel, kernels.back());
+        std::cout << kernel.name << ": " << (passed ? "ok" : "FAILED") << std::endl;
+        ok = ok && passed;
+    }
+    const bool planes = checkScalePlane();
+    std::cout << "scalePlane (" << kernels.front().name << "): " << (planes ? "ok" : "FAILED") << std::endl;
+    const bool aliasing = checkAliasing();
+    std::cout << "checkerboard: " << (aliasing ? "ok" : "FAILED") << std::endl;
+    return ok && planes && aliasing ? 0 : 1;
+}
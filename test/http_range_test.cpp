@@ -0,0 +1,281 @@
+// Checks the range and conditional request planning: which status and which bytes a GET gets for Range headers of
+// every form, malformed ones, overlapping and too many ranges, If-Range with tags and dates, and If-None-Match over
+// If-Modified-Since, and that a multipart/byteranges body is as long as it says.
+// Exits non-zero if any of them is off.
+
+#include <cstdint>
+#include <ctime>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "http_range.h"
+
+namespace
+{
+    const uint64_t SIZE = 10000;
+    const std::time_t MODIFIED = 784111777; // Sun, 06 Nov 1994 08:49:37 GMT
+
+    HttpValidators validators()
+    {
+        HttpValidators v;
+        v.etag = "\"abc123\"";
+        v.modified = MODIFIED;
+        return v;
+    }
+
+    std::string describe(const RangePlan &plan)
+    {
+        std::string text = std::to_string(plan.status);
+        for (const ByteRange &range : plan.ranges)
+        {
+            text += " " + std::to_string(range.offset) + "+" + std::to_string(range.length);
+        }
+        return text;
+    }
+
+    // Plans request against SIZE bytes with validators() and compares status and ranges
+    bool expect(const RangeRequest &request, int status, const std::vector<ByteRange> &ranges = {})
+    {
+        const RangePlan plan = planRangeResponse(request, SIZE, validators());
+        bool same = plan.status == status && plan.ranges.size() == ranges.size();
+        for (size_t i = 0; same && i < ranges.size(); i++)
+        {
+            same = plan.ranges[i].offset == ranges[i].offset && plan.ranges[i].length == ranges[i].length;
+        }
+        if (!same)
+        {
+            RangePlan expected;
+            expected.status = status;
+            expected.ranges = ranges;
+            std::cerr << "Range \"" << request.range << "\" If-Range \"" << request.if_range << "\" If-None-Match \""
+                      << request.if_none_match << "\" If-Modified-Since \"" << request.if_modified_since << "\": got "
+                      << describe(plan) << ", expected " << describe(expected) << std::endl;
+        }
+        return same;
+    }
+
+    bool expectRange(const std::string &range, int status, const std::vector<ByteRange> &ranges = {})
+    {
+        RangeRequest request;
+        request.range = range;
+        return expect(request, status, ranges);
+    }
+
+    bool checkRanges()
+    {
+        bool ok = true;
+        ok = expectRange("", 200) && ok;
+        ok = expectRange("bytes=0-99", 206, {{0, 100}}) && ok;
+        ok = expectRange("bytes=9999-9999", 206, {{9999, 1}}) && ok;
+        ok = expectRange("BYTES=5-5", 206, {{5, 1}}) && ok;
+        // Suffix ranges, longer than the representation is all of it
+        ok = expectRange("bytes=-500", 206, {{9500, 500}}) && ok;
+        ok = expectRange("bytes=-20000", 206, {{0, SIZE}}) && ok;
+        // Open ended
+        ok = expectRange("bytes=9000-", 206, {{9000, 1000}}) && ok;
+        ok = expectRange("bytes=0-", 206, {{0, SIZE}}) && ok;
+        // Clipped to the end, and past the end of uint64_t
+        ok = expectRange("bytes=9990-20000", 206, {{9990, 10}}) && ok;
+        ok = expectRange("bytes=100-99999999999999999999999", 206, {{100, 9900}}) && ok;
+        // Several, in the order asked for when they don't overlap, with whitespace and empty list elements
+        ok = expectRange("bytes=500-599, 0-9,,-10", 206, {{500, 100}, {0, 10}, {9990, 10}}) && ok;
+        // Unsatisfiable ones are left out, a 416 only if nothing is left
+        ok = expectRange("bytes=20000-30000,0-0", 206, {{0, 1}}) && ok;
+        ok = expectRange("bytes=10000-", 416) && ok;
+        ok = expectRange("bytes=10000-10001,20000-", 416) && ok;
+        ok = expectRange("bytes=-0", 416) && ok;
+        ok = expectRange("bytes=-0,-0", 416) && ok;
+        return ok;
+    }
+
+    bool checkMalformed()
+    {
+        bool ok = true;
+        for (const char *range : {"bytes", "bytes=", "bytes=,", "bytes=abc", "bytes=5", "bytes=5-3", "bytes=1-2-3", "bytes=-",
+                                  "bytes=0-99,x-y", "bytes=+1-2", "bytes=0x10-", "items=0-99", "bytes 0-99", "bytes0=0-99"})
+        {
+            ok = expectRange(range, 200) && ok;
+        }
+        std::vector<ByteRange> ranges = {{1, 2}};
+        if (parseByteRanges("bytes=5-3", SIZE, ranges) || !ranges.empty())
+        {
+            std::cerr << "parseByteRanges accepted \"bytes=5-3\" or left ranges behind" << std::endl;
+            ok = false;
+        }
+        return ok;
+    }
+
+    bool checkOverlap()
+    {
+        bool ok = true;
+        // Overlapping and adjacent ranges merge, sorted by offset
+        ok = expectRange("bytes=50-149,0-99", 206, {{0, 150}}) && ok;
+        ok = expectRange("bytes=0-9,10-19", 206, {{0, 10}, {10, 10}}) && ok; // adjacent alone isn't an overlap
+        ok = expectRange("bytes=200-299,0-99,50-149", 206, {{0, 150}, {200, 100}}) && ok;
+        ok = expectRange("bytes=0-99,100-199,150-159", 206, {{0, 200}}) && ok;
+        ok = expectRange("bytes=0-,-100", 206, {{0, SIZE}}) && ok;
+        ok = expectRange("bytes=5-5,5-5", 206, {{5, 1}}) && ok;
+        return ok;
+    }
+
+    bool checkRangeLimit()
+    {
+        std::string header = "bytes=";
+        for (size_t i = 0; i < MAX_BYTE_RANGES; i++)
+        {
+            header += (i > 0 ? "," : "") + std::to_string(i * 10) + "-" + std::to_string(i * 10 + 4);
+        }
+        RangeRequest request;
+        request.range = header;
+        const RangePlan plan = planRangeResponse(request, SIZE, validators());
+        bool ok = plan.status == 206 && plan.ranges.size() == MAX_BYTE_RANGES;
+        if (!ok)
+        {
+            std::cerr << MAX_BYTE_RANGES << " ranges: got " << plan.status << " with " << plan.ranges.size() << " ranges" << std::endl;
+        }
+        ok = expectRange(header + ",1000-1004", 200) && ok;
+        return ok;
+    }
+
+    bool checkIfRange()
+    {
+        RangeRequest request;
+        request.range = "bytes=0-99";
+        bool ok = true;
+        // A matching strong tag or the exact Last-Modified let the range through, anything else gets the whole thing
+        request.if_range = "\"abc123\"";
+        ok = expect(request, 206, {{0, 100}}) && ok;
+        request.if_range = "\"other\"";
+        ok = expect(request, 200) && ok;
+        request.if_range = "W/\"abc123\""; // weak tags never match
+        ok = expect(request, 200) && ok;
+        request.if_range = formatHttpDate(MODIFIED);
+        ok = expect(request, 206, {{0, 100}}) && ok;
+        request.if_range = formatHttpDate(MODIFIED + 1);
+        ok = expect(request, 200) && ok;
+        request.if_range = formatHttpDate(MODIFIED - 1);
+        ok = expect(request, 200) && ok;
+        request.if_range = "yesterday";
+        ok = expect(request, 200) && ok;
+
+        // Without the validator If-Range compares against, it never matches
+        HttpValidators none;
+        request.if_range = "\"abc123\"";
+        ok = planRangeResponse(request, SIZE, none).status == 200 && ok;
+        request.if_range = formatHttpDate(MODIFIED);
+        ok = planRangeResponse(request, SIZE, none).status == 200 && ok;
+        if (!ok)
+        {
+            std::cerr << "If-Range is off" << std::endl;
+        }
+        return ok;
+    }
+
+    bool checkConditional()
+    {
+        bool ok = true;
+        RangeRequest request;
+        request.if_none_match = "\"abc123\"";
+        ok = expect(request, 304) && ok;
+        request.if_none_match = "\"x\", W/\"abc123\""; // weak comparison
+        ok = expect(request, 304) && ok;
+        request.if_none_match = "*";
+        ok = expect(request, 304) && ok;
+        request.if_none_match = "\"x\"";
+        ok = expect(request, 200) && ok;
+
+        // If-None-Match decides whenever it is there, If-Modified-Since only counts without it
+        request.if_none_match = "\"x\"";
+        request.if_modified_since = formatHttpDate(MODIFIED);
+        ok = expect(request, 200) && ok;
+        request.if_none_match = "\"abc123\"";
+        request.if_modified_since = formatHttpDate(MODIFIED - 3600);
+        ok = expect(request, 304) && ok;
+        request.if_none_match.clear();
+        ok = expect(request, 200) && ok;
+        request.if_modified_since = formatHttpDate(MODIFIED);
+        ok = expect(request, 304) && ok;
+        request.if_modified_since = formatHttpDate(MODIFIED + 3600);
+        ok = expect(request, 304) && ok;
+        request.if_modified_since = "not a date";
+        ok = expect(request, 200) && ok;
+
+        // A 304 wins over the range, a failed condition still serves it
+        request.range = "bytes=0-99";
+        request.if_modified_since = formatHttpDate(MODIFIED);
+        ok = expect(request, 304) && ok;
+        request.if_none_match = "\"x\"";
+        ok = expect(request, 206, {{0, 100}}) && ok;
+        return ok;
+    }
+
+    bool checkMultipart()
+    {
+        // The representation's bytes are their offset mod 251, so every part can be checked
+        std::string representation(SIZE, '\0');
+        for (uint64_t i = 0; i < SIZE; i++)
+        {
+            representation[i] = static_cast<char>(i % 251);
+        }
+        const std::vector<std::vector<ByteRange>> cases = {{{0, 1}, {9999, 1}}, {{500, 100}, {0, 10}, {9990, 10}}, {{0, SIZE}, {0, SIZE}}};
+        for (const std::vector<ByteRange> &ranges : cases)
+        {
+            const MultipartByteRanges body = multipartByteRanges(ranges, SIZE, "video/webm");
+            const std::string prefix = "multipart/byteranges; boundary=";
+            if (body.content_type.compare(0, prefix.size(), prefix) != 0 || body.part_headers.size() != ranges.size())
+            {
+                std::cerr << "multipartByteRanges: bad content type or part count" << std::endl;
+                return false;
+            }
+            const std::string boundary = body.content_type.substr(prefix.size());
+
+            // Put together the way the server sends it
+            std::string produced;
+            for (size_t i = 0; i < ranges.size(); i++)
+            {
+                const std::string &header = body.part_headers[i];
+                if (header.find("--" + boundary + "\r\n") == std::string::npos ||
+                    header.find("Content-Range: " + contentRange(ranges[i], SIZE) + "\r\n") == std::string::npos ||
+                    header.find("Content-Type: video/webm\r\n") == std::string::npos)
+                {
+                    std::cerr << "multipartByteRanges: part " << i << " header is off: " << header << std::endl;
+                    return false;
+                }
+                produced += header;
+                produced += representation.substr(ranges[i].offset, ranges[i].length);
+            }
+            produced += body.closing;
+            if (body.closing != "\r\n--" + boundary + "--\r\n" || produced.size() != body.length)
+            {
+                std::cerr << "multipartByteRanges: length " << body.length << ", produced " << produced.size() << " bytes" << std::endl;
+                return false;
+            }
+        }
+        if (contentRange({9990, 10}, SIZE) != "bytes 9990-9999/10000")
+        {
+            std::cerr << "contentRange: " << contentRange({9990, 10}, SIZE) << std::endl;
+            return false;
+        }
+        return true;
+    }
+}
+
+int main()
+{
+    const struct
+    {
+        const char *name;
+        bool (*check)();
+    } checks[] = {{"ranges", checkRanges}, {"malformed", checkMalformed}, {"overlap", checkOverlap},
+                  {"range limit", checkRangeLimit}, {"If-Range", checkIfRange}, {"conditional", checkConditional},
+                  {"multipart", checkMultipart}};
+    bool ok = true;
+    for (const auto &check : checks)
+    {
+        const bool passed = check.check();
+        std::cout << check.name << ": " << (passed ? "ok" : "FAILED") << std::endl;
+        ok = ok && passed;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,226 @@
+// Checks every pixel convert kernel set this CPU can run against the scalar one: windowing, the gamma lookup and the
+// demosaic's box filter must give identical rows for random samples, windows and tables, at random widths with every
+// tail length, at unaligned starts, without writing outside the row.
+// Exits non-zero if any of them is off.
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "pixel_convert.h"
+
+namespace
+{
+    const int GUARD = 64;      // bytes on each side of a row that must stay untouched
+    const uint8_t FILL = 0xA5; // what the guards start out as
+    const int RANDOM_WIDTHS = 200;
+
+    // Every width up to two AVX2 blocks, so each tail length comes up, then random ones up to past 4K
+    std::vector<int> widths(std::mt19937 &rng)
+    {
+        std::vector<int> result;
+        for (int width = 1; width <= 64; width++)
+        {
+            result.push_back(width);
+        }
+        std::uniform_int_distribution<int> width(65, 4200);
+        for (int i = 0; i < RANDOM_WIDTHS; i++)
+        {
+            result.push_back(width(rng));
+        }
+        return result;
+    }
+
+    // The window parameters PixelConverter::setWindow derives
+    struct Window
+    {
+        uint16_t low;
+        uint16_t range;
+        int shift;
+        uint16_t scale;
+    };
+
+    Window window(uint16_t low, uint16_t high)
+    {
+        Window w{low, static_cast<uint16_t>(high - low), 0, 0};
+        while ((static_cast<uint32_t>(w.range) << w.shift) < 256)
+        {
+            w.shift++;
+        }
+        const uint32_t scaled = static_cast<uint32_t>(w.range) << w.shift;
+        w.scale = static_cast<uint16_t>((255u * 65536 + scaled - 1) / scaled);
+        return w;
+    }
+
+    bool guardsIntact(const std::vector<uint8_t> &buffer, size_t begin, size_t end)
+    {
+        for (size_t i = 0; i < buffer.size(); i++)
+        {
+            if ((i < begin || i >= end) && buffer[i] != FILL)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool checkWindow(const PixelConvertKernel &kernel, const PixelConvertKernel &scalar, const std::vector<int> &widths, std::mt19937 &rng)
+    {
+        std::vector<Window> windows = {window(0, 65535), window(0, 4095), window(0, 1023), window(0, 255), window(0, 1),
+                                       window(100, 101), window(1000, 1200), window(4000, 60000), window(65534, 65535)};
+        std::uniform_int_distribution<int> sample(0, 65535);
+        for (int i = 0; i < 16; i++)
+        {
+            const uint16_t a = static_cast<uint16_t>(sample(rng));
+            const uint16_t b = static_cast<uint16_t>(sample(rng));
+            if (a != b)
+            {
+                windows.push_back(window(std::min(a, b), std::max(a, b)));
+            }
+        }
+
+        std::vector<uint16_t> src;
+        std::vector<uint8_t> expected;
+        std::vector<uint8_t> buffer;
+        for (int width : widths)
+        {
+            const Window &w = windows[rng() % windows.size()];
+            const int offset = static_cast<int>(rng() % 32);
+            src.resize(width + 32);
+            // Mostly around the window so clipping at both ends and the ramp between are all covered
+            std::uniform_int_distribution<int> near(std::max(0, w.low - 64), std::min(65535, w.low + w.range + 64));
+            for (uint16_t &s : src)
+            {
+                s = static_cast<uint16_t>(rng() % 8 == 0 ? sample(rng) : near(rng));
+            }
+            expected.assign(width, 0);
+            scalar.window(src.data() + offset, expected.data(), width, w.low, w.range, w.shift, w.scale);
+
+            buffer.assign(GUARD + width + GUARD, FILL);
+            uint8_t *dst = buffer.data() + GUARD;
+            kernel.window(src.data() + offset, dst, width, w.low, w.range, w.shift, w.scale);
+            for (int x = 0; x < width; x++)
+            {
+                if (dst[x] != expected[x])
+                {
+                    std::cerr << kernel.name << " window: width " << width << " low " << w.low << " range " << w.range << ": x " << x
+                              << " (" << src[offset + x] << ") is " << int(dst[x]) << ", expected " << int(expected[x]) << std::endl;
+                    return false;
+                }
+            }
+            if (!guardsIntact(buffer, GUARD, GUARD + width))
+            {
+                std::cerr << kernel.name << " window: width " << width << " wrote outside the row" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool checkLookup(const PixelConvertKernel &kernel, const PixelConvertKernel &scalar, const std::vector<int> &widths, std::mt19937 &rng)
+    {
+        std::vector<uint8_t> table(256);
+        std::vector<uint8_t> row;
+        std::vector<uint8_t> expected;
+        std::vector<uint8_t> buffer;
+        for (int width : widths)
+        {
+            // A random table catches any mixed up entry, the identity and a reversal any mixed up nibble
+            const int kind = static_cast<int>(rng() % 3);
+            for (int i = 0; i < 256; i++)
+            {
+                table[i] = static_cast<uint8_t>(kind == 0 ? rng() : kind == 1 ? i : 255 - i);
+            }
+            row.resize(width);
+            for (uint8_t &v : row)
+            {
+                v = static_cast<uint8_t>(rng());
+            }
+            expected = row;
+            scalar.lookup(expected.data(), width, table.data());
+
+            const int offset = static_cast<int>(rng() % 32);
+            buffer.assign(GUARD + offset + width + GUARD, FILL);
+            uint8_t *dst = buffer.data() + GUARD + offset;
+            std::copy(row.begin(), row.end(), dst);
+            kernel.lookup(dst, width, table.data());
+            for (int x = 0; x < width; x++)
+            {
+                if (dst[x] != expected[x])
+                {
+                    std::cerr << kernel.name << " lookup: width " << width << ": x " << x << " (" << int(row[x]) << ") is "
+                              << int(dst[x]) << ", expected " << int(expected[x]) << std::endl;
+                    return false;
+                }
+            }
+            if (!guardsIntact(buffer, GUARD + offset, GUARD + offset + width))
+            {
+                std::cerr << kernel.name << " lookup: width " << width << " wrote outside the row" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool checkBox(const PixelConvertKernel &kernel, const PixelConvertKernel &scalar, const std::vector<int> &widths, std::mt19937 &rng)
+    {
+        std::vector<uint8_t> top;
+        std::vector<uint8_t> bottom;
+        std::vector<uint8_t> expected;
+        std::vector<uint8_t> buffer;
+        for (int width : widths)
+        {
+            // The kernels read one sample past width in both rows
+            top.resize(width + 32 + 1);
+            bottom.resize(width + 32 + 1);
+            const bool extremes = rng() % 4 == 0; // all 255 is the largest sum the 16 bit lanes see
+            for (size_t i = 0; i < top.size(); i++)
+            {
+                top[i] = static_cast<uint8_t>(extremes ? 255 : rng());
+                bottom[i] = static_cast<uint8_t>(extremes ? 255 - (i & 1) : rng());
+            }
+            const int offset = static_cast<int>(rng() % 32);
+            expected.assign(width, 0);
+            scalar.box(top.data() + offset, bottom.data() + offset, expected.data(), width);
+
+            buffer.assign(GUARD + width + GUARD, FILL);
+            uint8_t *dst = buffer.data() + GUARD;
+            kernel.box(top.data() + offset, bottom.data() + offset, dst, width);
+            for (int x = 0; x < width; x++)
+            {
+                if (dst[x] != expected[x])
+                {
+                    std::cerr << kernel.name << " box: width " << width << ": x " << x << " is " << int(dst[x]) << ", expected "
+                              << int(expected[x]) << std::endl;
+                    return false;
+                }
+            }
+            if (!guardsIntact(buffer, GUARD, GUARD + width))
+            {
+                std::cerr << kernel.name << " box: width " << width << " wrote outside the row" << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+int main()
+{
+    std::mt19937 rng(42);
+    const std::vector<int> row_widths = widths(rng);
+    const std::vector<PixelConvertKernel> kernels = pixelConvertKernels();
+    bool ok = true;
+    for (const PixelConvertKernel &kernel : kernels)
+    {
+        const bool window = checkWindow(kernel, kernels.back(), row_widths, rng);
+        const bool lookup = checkLookup(kernel, kernels.back(), row_widths, rng);
+        const bool box = checkBox(kernel, kernels.back(), row_widths, rng);
+        std::cout << kernel.name << ": window " << (window ? "ok" : "FAILED") << ", lookup " << (lookup ? "ok" : "FAILED")
+                  << ", box " << (box ? "ok" : "FAILED") << std::endl;
+        ok = ok && window && lookup && box;
+    }
+    return ok ? 0 : 1;
+}
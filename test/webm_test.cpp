@@ -0,0 +1,157 @@
+// Checks the cluster index and the seek header of a finished webm: the header that goes in front of clusters cut
+// out of the middle of the file (/webm?t=) must not carry the seek head, whose absolute positions would point into
+// the wrong bytes, and every indexed cluster must start where the index says.
+// Exits non-zero if anything is off.
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "webm.h"
+
+namespace
+{
+    const uint64_t EBML_ID = 0x1A45DFA3;
+    const uint64_t SEGMENT_ID = 0x18538067;
+    const uint64_t SEEK_HEAD_ID = 0x114D9B74;
+    const uint8_t CLUSTER_ID[] = {0x1F, 0x43, 0xB6, 0x75};
+
+    // An EBML element header at position: the id with its length marker and the size without, false if it doesn't
+    // parse. unknown is set for the all ones size.
+    bool readHeader(const std::vector<uint8_t> &bytes, size_t position, uint64_t &id, uint64_t &size, size_t &header, bool &unknown)
+    {
+        if (position >= bytes.size())
+        {
+            return false;
+        }
+        size_t id_length = 1;
+        while (id_length <= 4 && !(bytes[position] & (0x100 >> id_length)))
+        {
+            id_length++;
+        }
+        if (id_length > 4 || position + id_length >= bytes.size())
+        {
+            return false;
+        }
+        id = 0;
+        for (size_t i = 0; i < id_length; i++)
+        {
+            id = id << 8 | bytes[position + i];
+        }
+
+        const uint8_t first = bytes[position + id_length];
+        size_t size_length = 1;
+        while (size_length <= 8 && !(first & (0x100 >> size_length)))
+        {
+            size_length++;
+        }
+        if (size_length > 8 || position + id_length + size_length > bytes.size())
+        {
+            return false;
+        }
+        size = first & (0xFF >> size_length);
+        unknown = size == (0xFFu >> size_length);
+        for (size_t i = 1; i < size_length; i++)
+        {
+            size = size << 8 | bytes[position + id_length + i];
+            unknown = unknown && bytes[position + id_length + i] == 0xFF;
+        }
+        header = id_length + size_length;
+        return true;
+    }
+
+    bool checkSeekHeader(const WebmFile &file)
+    {
+        const std::vector<uint8_t> &bytes = file.seek_header;
+        uint64_t id;
+        uint64_t size;
+        size_t header;
+        bool unknown;
+        if (!readHeader(bytes, 0, id, size, header, unknown) || id != EBML_ID)
+        {
+            std::cerr << "seek header doesn't start with an EBML header" << std::endl;
+            return false;
+        }
+        size_t position = header + size;
+        if (!readHeader(bytes, position, id, size, header, unknown) || id != SEGMENT_ID || !unknown)
+        {
+            std::cerr << "no segment of unknown size after the EBML header" << std::endl;
+            return false;
+        }
+
+        // Every child of the segment up to the first cluster
+        position += header;
+        while (position < bytes.size())
+        {
+            if (!readHeader(bytes, position, id, size, header, unknown) || unknown || size > bytes.size() - position - header)
+            {
+                std::cerr << "broken element at " << position << " of the seek header" << std::endl;
+                return false;
+            }
+            if (id == SEEK_HEAD_ID)
+            {
+                std::cerr << "seek header still has a SeekHead at " << position << std::endl;
+                return false;
+            }
+            position += header + size;
+        }
+        return true;
+    }
+
+    bool checkClusters(const WebmFile &file)
+    {
+        if (file.clusters.empty())
+        {
+            std::cerr << "no clusters indexed" << std::endl;
+            return false;
+        }
+        for (size_t i = 0; i < file.clusters.size(); i++)
+        {
+            const WebmCluster &cluster = file.clusters[i];
+            if (i > 0 && (cluster.offset <= file.clusters[i - 1].offset || cluster.time_ns < file.clusters[i - 1].time_ns))
+            {
+                std::cerr << "cluster " << i << " is out of order" << std::endl;
+                return false;
+            }
+            std::vector<uint8_t> id;
+            file.data->forEach(cluster.offset, sizeof(CLUSTER_ID), [&id](const uint8_t *data, size_t size)
+                               {
+                                   id.insert(id.end(), data, data + size);
+                                   return true; });
+            if (id != std::vector<uint8_t>(CLUSTER_ID, CLUSTER_ID + sizeof(CLUSTER_ID)))
+            {
+                std::cerr << "cluster " << i << " at " << cluster.offset << " doesn't start with a Cluster id" << std::endl;
+                return false;
+            }
+        }
+        if (file.seek_header.size() != file.clusters.front().offset || file.clusters_end > file.size())
+        {
+            std::cerr << "seek header or cluster range doesn't line up with the clusters" << std::endl;
+            return false;
+        }
+        return true;
+    }
+}
+
+int main()
+{
+    // Small and fast, but past the encoder's default keyframe interval so there is more than one cluster
+    WebmParams params;
+    params.width = 160;
+    params.height = 120;
+    params.num_frames = 150;
+    params.realtime = true;
+    params.cpu_used = 8;
+    const std::shared_ptr<const WebmFile> file = encodeXorWebm(params);
+    if (!file)
+    {
+        std::cerr << "encodeXorWebm failed" << std::endl;
+        return 1;
+    }
+
+    const bool header = checkSeekHeader(*file);
+    std::cout << "seek header: " << (header ? "ok" : "FAILED") << std::endl;
+    const bool clusters = checkClusters(*file);
+    std::cout << "clusters (" << file->clusters.size() << "): " << (clusters ? "ok" : "FAILED") << std::endl;
+    return header && clusters ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+// Checks every XOR texture kernel this CPU can run against the per-pixel loop the kernels replaced: bit-identical
+// rows at odd widths and unaligned starts, and whole frames at padded strides, for several time values.
+// Exits non-zero if any of them is off.
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "xor_texture.h"
+
+namespace
+{
+    const int WIDTHS[] = {1, 2, 3, 15, 16, 17, 31, 33, 63, 64, 65, 127, 129, 255, 256, 257, 319, 511, 640, 1023, 1279, 1919, 3841};
+    const int TIMES[] = {0, 1, 77, 127, 128, 255, 256, 1001, 65535};
+    const int GUARD = 64;     // bytes on each side of a row that must stay untouched
+    const uint8_t FILL = 0xA5; // what the guards and padding start out as
+
+    // The original luma loop
+    uint8_t reference(int x, int y, int time)
+    {
+        return static_cast<uint8_t>(x ^ y ^ (time & 0xFF));
+    }
+
+    bool checkRows(const XorTextureKernel &kernel)
+    {
+        std::vector<uint8_t> buffer;
+        for (int width : WIDTHS)
+        {
+            buffer.assign(GUARD + width + GUARD + 64, FILL);
+            for (int time : TIMES)
+            {
+                for (int y : {0, 1, 200, 255, 1079})
+                {
+                    // Start offsets across a cache line, the kernels only align their loads from the ramp
+                    for (int offset = 0; offset < 64; offset += 7)
+                    {
+                        std::fill(buffer.begin(), buffer.end(), FILL);
+                        uint8_t *dst = buffer.data() + GUARD + offset;
+                        kernel.row(dst, width, static_cast<uint8_t>(y ^ (time & 0xFF)));
+                        for (int x = 0; x < width; x++)
+                        {
+                            if (dst[x] != reference(x, y, time))
+                            {
+                                std::cerr << kernel.name << ": width " << width << " y " << y << " time " << time << " offset " << offset
+                                          << ": x " << x << " is " << int(dst[x]) << ", expected " << int(reference(x, y, time)) << std::endl;
+                                return false;
+                            }
+                        }
+                        for (size_t i = 0; i < buffer.size(); i++)
+                        {
+                            const bool inside = i >= static_cast<size_t>(GUARD + offset) && i < static_cast<size_t>(GUARD + offset + width);
+                            if (!inside && buffer[i] != FILL)
+                            {
+                                std::cerr << kernel.name << ": width " << width << " offset " << offset << " wrote outside the row at byte "
+                                          << i << std::endl;
+                                return false;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    // fillXorPlanes with the active kernel: luma, neutral chroma, and padding left alone
+    bool checkPlanes()
+    {
+        const int sizes[][2] = {{1, 1}, {3, 5}, {17, 9}, {64, 48}, {319, 181}, {640, 480}, {1281, 721}};
+        for (const auto &size : sizes)
+        {
+            const int width = size[0];
+            const int height = size[1];
+            const int chroma_width = (width + 1) / 2;
+            const int chroma_height = (height + 1) / 2;
+            for (int pad : {0, 1, 13, 64})
+            {
+                const int y_stride = width + pad;
+                const int c_stride = chroma_width + pad;
+                for (int time : TIMES)
+                {
+                    std::vector<uint8_t> y_plane(static_cast<size_t>(y_stride) * height, FILL);
+                    std::vector<uint8_t> u_plane(static_cast<size_t>(c_stride) * chroma_height, FILL);
+                    std::vector<uint8_t> v_plane(static_cast<size_t>(c_stride) * chroma_height, FILL);
+                    fillXorPlanes(y_plane.data(), y_stride, u_plane.data(), c_stride, v_plane.data(), c_stride, width, height, time);
+
+                    for (int y = 0; y < height; y++)
+                    {
+                        for (int x = 0; x < y_stride; x++)
+                        {
+                            const uint8_t expected = x < width ? reference(x, y, time) : FILL;
+                            if (y_plane[static_cast<size_t>(y) * y_stride + x] != expected)
+                            {
+                                std::cerr << "fillXorPlanes (" << xorTextureKernels().front().name << "): " << width << "x" << height << " stride "
+                                          << y_stride << " time " << time << ": luma mismatch at " << x << "," << y << std::endl;
+                                return false;
+                            }
+                        }
+                    }
+                    for (int y = 0; y < chroma_height; y++)
+                    {
+                        for (int x = 0; x < c_stride; x++)
+                        {
+                            const uint8_t expected = x < chroma_width ? 128 : FILL;
+                            const size_t i = static_cast<size_t>(y) * c_stride + x;
+                            if (u_plane[i] != expected || v_plane[i] != expected)
+                            {
+                                std::cerr << "fillXorPlanes: " << width << "x" << height << " stride " << c_stride
+                                          << ": chroma mismatch at " << x << "," << y << std::endl;
+                                return false;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        return true;
+    }
+}
+
+int main()
+{
+    const std::vector<XorTextureKernel> kernels = xorTextureKernels();
+    bool ok = true;
+    for (const XorTextureKernel &kernel : kernels)
+    {
+        const bool passed = checkRows(kernel);
+        std::cout << kernel.name << ": " << (passed ? "ok" : "FAILED") << std::endl;
+        ok = ok && passed;
+    }
+    const bool planes = checkPlanes();
+    std::cout << "fillXorPlanes (" << xorTextureKernels().front().name << "): " << (planes ? "ok" : "FAILED") << std::endl;
+    return ok && planes ? 0 : 1;
+}
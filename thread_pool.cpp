@@ -0,0 +1,58 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t threads)
+{
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; i++)
+    {
+        workers_.emplace_back(&ThreadPool::work, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (std::thread &worker : workers_)
+    {
+        worker.join();
+    }
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> task)
+{
+    std::packaged_task<void()> packaged(std::move(task));
+    std::future<void> result = packaged.get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(packaged));
+    }
+    cv_.notify_one();
+    return result;
+}
+
+void ThreadPool::work()
+{
+    for (;;)
+    {
+        std::packaged_task<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this]
+                     { return stopping_ || !tasks_.empty(); });
+            // Queued tasks still run on shutdown, someone may be waiting on their futures
+            if (tasks_.empty())
+            {
+                return;
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        task();
+    }
+}
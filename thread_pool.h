@@ -0,0 +1,35 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running submitted tasks in submission order
+class ThreadPool
+{
+public:
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // The future becomes ready once the task has run (and rethrows whatever it threw)
+    std::future<void> submit(std::function<void()> task);
+
+    size_t size() const { return workers_.size(); }
+
+private:
+    void work();
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::packaged_task<void()>> tasks_;
+    bool stopping_ = false;
+};
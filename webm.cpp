@@ -0,0 +1,556 @@
+#include "webm.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "http_range.h"
+#include "xor_texture.h"
+
+namespace
+{
+    // Synthesises frames on its own thread so generating frame N+1 overlaps encoding frame N.
+    // At most depth frames are waiting at any time, which keeps the frame pool usage bounded.
+    class FramePipeline
+    {
+    public:
+        FramePipeline(int width, int height, int num_frames, size_t depth)
+            : width_(width), height_(height), num_frames_(num_frames), depth_(depth)
+        {
+            thread_ = std::thread(&FramePipeline::run, this);
+        }
+
+        ~FramePipeline()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stopping_ = true;
+            }
+            cv_.notify_all();
+            thread_.join();
+        }
+
+        FramePipeline(const FramePipeline &) = delete;
+        FramePipeline &operator=(const FramePipeline &) = delete;
+
+        // Next frame in order, an empty frame once there are no more (or generating one failed)
+        PooledFrame next()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this]
+                     { return !queue_.empty() || done_; });
+            if (queue_.empty())
+            {
+                return PooledFrame();
+            }
+            PooledFrame frame = std::move(queue_.front());
+            queue_.pop_front();
+            cv_.notify_all();
+            return frame;
+        }
+
+    private:
+        void run()
+        {
+            for (int i = 0; i < num_frames_; i++)
+            {
+                PooledFrame frame = genXorTexture(width_, height_, i);
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (!frame)
+                {
+                    break;
+                }
+                cv_.wait(lock, [this]
+                         { return queue_.size() < depth_ || stopping_; });
+                if (stopping_)
+                {
+                    break;
+                }
+                queue_.push_back(std::move(frame));
+                cv_.notify_all();
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_ = true;
+            cv_.notify_all();
+        }
+
+        const int width_;
+        const int height_;
+        const int num_frames_;
+        const size_t depth_;
+
+        std::thread thread_;
+        std::mutex mutex_;
+        std::condition_variable cv_;
+        std::deque<PooledFrame> queue_;
+        bool done_ = false;
+        bool stopping_ = false;
+    };
+}
+
+const WebmCluster *WebmFile::clusterAt(uint64_t time_ns) const
+{
+    if (clusters.empty())
+    {
+        return nullptr;
+    }
+    auto after = std::upper_bound(clusters.begin(), clusters.end(), time_ns, [](uint64_t time, const WebmCluster &cluster)
+                                  { return time < cluster.time_ns; });
+    return after == clusters.begin() ? &clusters.front() : &*(after - 1);
+}
+
+int32_t ChunkedMkvWriter::Write(const void *buf, uint32_t len)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(buf);
+    while (len > 0)
+    {
+        const size_t index = position_ / BufferChunk::CAPACITY;
+        const size_t offset = position_ % BufferChunk::CAPACITY;
+        if (index == chunks_.size())
+        {
+            chunks_.push_back(pool_->acquire());
+        }
+        BufferChunk &chunk = *chunks_[index];
+        const size_t n = std::min<size_t>(len, BufferChunk::CAPACITY - offset);
+        std::memcpy(chunk.data + offset, bytes, n);
+        chunk.size = std::max(chunk.size, offset + n);
+        position_ += n;
+        bytes += n;
+        len -= n;
+    }
+    size_ = std::max(size_, position_);
+    return 0;
+}
+
+void ChunkedMkvWriter::ElementStartNotify(uint64_t element_id, int64_t position)
+{
+    // Finalize goes back to rewrite elements that are already indexed, only the ones appended at the end are new
+    if (static_cast<size_t>(position) != size_)
+    {
+        return;
+    }
+    switch (element_id)
+    {
+    case libwebm::kMkvSegment:
+    case libwebm::kMkvInfo:
+    case libwebm::kMkvTracks:
+    case libwebm::kMkvCluster:
+    case libwebm::kMkvCues:
+        elements_.push_back({element_id, size_});
+        break;
+    case libwebm::kMkvTimecode: // only clusters have one
+        timecodes_.push_back(size_);
+        break;
+    default:
+        break;
+    }
+}
+
+uint64_t ChunkedMkvWriter::readVint(size_t position, size_t &length) const
+{
+    length = 0;
+    if (position >= size_)
+    {
+        return 0;
+    }
+    const uint8_t first = byteAt(position);
+    size_t n = 1;
+    while (n <= 8 && !(first & (0x100 >> n)))
+    {
+        n++;
+    }
+    if (n > 8 || position + n > size_)
+    {
+        return 0;
+    }
+    uint64_t value = first & (0xFF >> n);
+    for (size_t i = 1; i < n; i++)
+    {
+        value = value << 8 | byteAt(position + i);
+    }
+    length = n;
+    return value;
+}
+
+uint64_t ChunkedMkvWriter::readId(size_t position, size_t &length) const
+{
+    length = 0;
+    if (position >= size_)
+    {
+        return 0;
+    }
+    const uint8_t first = byteAt(position);
+    size_t n = 1;
+    while (n <= 4 && !(first & (0x100 >> n)))
+    {
+        n++;
+    }
+    if (n > 4 || position + n > size_)
+    {
+        return 0;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        value = value << 8 | byteAt(position + i);
+    }
+    length = n;
+    return value;
+}
+
+WebmFile ChunkedMkvWriter::take(uint64_t timecode_scale)
+{
+    const size_t npos = static_cast<size_t>(-1);
+    WebmFile file;
+    size_t segment = npos;
+    size_t first_cluster = size_;
+    file.clusters_end = size_;
+
+    for (size_t i = 0; i < elements_.size(); i++)
+    {
+        const uint64_t id = elements_[i].first;
+        const size_t position = elements_[i].second;
+        const size_t next = i + 1 < elements_.size() ? elements_[i + 1].second : size_;
+        if (id == libwebm::kMkvSegment)
+        {
+            segment = position;
+        }
+        else if (id == libwebm::kMkvCluster)
+        {
+            first_cluster = std::min(first_cluster, position);
+            // The timecode is the cluster's first child: one byte of id, the size, then the value
+            auto timecode = std::lower_bound(timecodes_.begin(), timecodes_.end(), position);
+            if (timecode == timecodes_.end() || *timecode >= next)
+            {
+                continue;
+            }
+            size_t length;
+            const uint64_t value_size = readVint(*timecode + 1, length);
+            if (!length || value_size > 8 || *timecode + 1 + length + value_size > next)
+            {
+                continue;
+            }
+            uint64_t value = 0;
+            for (size_t b = 0; b < value_size; b++)
+            {
+                value = value << 8 | byteAt(*timecode + 1 + length + b);
+            }
+            file.clusters.push_back({value * timecode_scale, position});
+            file.clusters_end = next;
+        }
+        else if (id == libwebm::kMkvCues && !file.clusters.empty())
+        {
+            file.clusters_end = std::min(file.clusters_end, position);
+        }
+    }
+
+    file.seek_header.reserve(first_cluster);
+    for (size_t i = 0; i < first_cluster; i++)
+    {
+        file.seek_header.push_back(byteAt(i));
+    }
+    if (segment != npos && segment + 4 < first_cluster)
+    {
+        // All ones is the unknown size, same as the live header: the segment ends wherever the response does
+        size_t length;
+        readVint(segment + 4, length);
+        for (size_t b = 0; b < length; b++)
+        {
+            file.seek_header[segment + 4 + b] = b == 0 ? 0xFF >> (length - 1) : 0xFF;
+        }
+
+        // The seek head points at the clusters and cues by absolute position, which are wrong once clusters are left
+        // out, so it becomes a Void element of the same size. mkvmuxer reserves it as a Void in Init and only writes
+        // it over that in Finalize, which is never announced as a new element: it is found by walking the segment's
+        // children up to the first cluster.
+        size_t child = segment + 4 + length;
+        while (length && child < first_cluster)
+        {
+            size_t id_length;
+            const uint64_t id = readId(child, id_length);
+            size_t size_length = 0;
+            const uint64_t size = id_length ? readVint(child + id_length, size_length) : 0;
+            if (!size_length || size > first_cluster - child - id_length - size_length)
+            {
+                break;
+            }
+            const size_t end = child + id_length + size_length + size;
+            if (id == libwebm::kMkvSeekHead && end - child >= 9)
+            {
+                const uint64_t void_size = end - child - 9;
+                file.seek_header[child] = 0xEC;
+                file.seek_header[child + 1] = 0x01;
+                for (size_t b = 0; b < 7; b++)
+                {
+                    file.seek_header[child + 2 + b] = static_cast<uint8_t>(void_size >> (8 * (6 - b)));
+                }
+            }
+            child = end;
+        }
+    }
+
+    auto data = std::make_shared<ChunkedBuffer>(*pool_);
+    for (ChunkPtr &chunk : chunks_)
+    {
+        data->appendChunk(std::move(chunk));
+    }
+    file.data = std::move(data);
+
+    chunks_.clear();
+    elements_.clear();
+    timecodes_.clear();
+    position_ = 0;
+    size_ = 0;
+    return file;
+}
+
+vpx_image_t *wrapVpxImage(const PooledFrame &frame, vpx_image_t *img)
+{
+    if (!vpx_img_wrap(img, VPX_IMG_FMT_I420, frame.width(), frame.height(), 1, frame.plane(0)))
+    {
+        return nullptr;
+    }
+    // The pool pads every plane to its own aligned stride, which vpx_img_wrap doesn't know about
+    for (int i = 0; i < 3; i++)
+    {
+        img->planes[i] = frame.plane(i);
+        img->stride[i] = frame.stride(i);
+    }
+    return img;
+}
+
+// Given a width, height, and time component generate a XOR texture
+PooledFrame genXorTexture(int width, int height, int time)
+{
+    if (width <= 0 || height <= 0)
+    {
+        std::cerr << "Invalid dimensions provided." << std::endl;
+        return PooledFrame();
+    }
+
+    PooledFrame frame = FramePool::shared().acquire(FrameFormat::I420, width, height);
+    if (!frame)
+    {
+        std::cerr << "Failed to allocate image." << std::endl;
+        return frame;
+    }
+
+    fillXorPlanes(frame.plane(0), frame.stride(0),
+                  frame.plane(1), frame.stride(1),
+                  frame.plane(2), frame.stride(2),
+                  width, height, time);
+
+    return frame;
+}
+
+void configureVp9Threads(vpx_codec_enc_cfg_t &cfg, int threads)
+{
+    if (threads <= 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    cfg.g_threads = threads;
+}
+
+void applyVp9Threading(vpx_codec_ctx_t *codec, const vpx_codec_enc_cfg_t &cfg)
+{
+    // Tile columns are given as log2, one per thread as far as the 256 pixel minimum tile width allows
+    int max_log2 = 0;
+    while (max_log2 < 6 && (static_cast<int>(cfg.g_w) >> (max_log2 + 1)) >= 256)
+    {
+        max_log2++;
+    }
+    int wanted_log2 = 0;
+    while (wanted_log2 < max_log2 && (1u << wanted_log2) < cfg.g_threads)
+    {
+        wanted_log2++;
+    }
+    vpx_codec_control(codec, VP9E_SET_TILE_COLUMNS, wanted_log2);
+    // Row based multithreading keeps more threads busy than there are tile columns
+    vpx_codec_control(codec, VP9E_SET_ROW_MT, cfg.g_threads > 1 ? 1 : 0);
+}
+
+int encode_frame(vpx_codec_ctx_t *codec, vpx_image_t *img, int frame_index, int flags, mkvmuxer::IMkvWriter *writer, mkvmuxer::Segment &segment, const uint64_t &track,
+                 unsigned long deadline, std::vector<EncodedFrame> *encoded)
+{
+    int got_pkts = 0;
+    vpx_codec_iter_t iter = NULL;
+    const vpx_codec_cx_pkt_t *pkt = NULL;
+
+    const vpx_codec_err_t res = vpx_codec_encode(codec, img, frame_index, 1, flags, deadline);
+    if (res != VPX_CODEC_OK)
+    {
+        std::cerr << "Error during encoding: " << vpx_codec_error(codec);
+        const char *detail = vpx_codec_error_detail(codec);
+        if (detail)
+        {
+            std::cerr << " - " << detail;
+        }
+        std::cerr << std::endl;
+        exit(1);
+    }
+
+    while ((pkt = vpx_codec_get_cx_data(codec, &iter)) != NULL)
+    {
+        got_pkts = 1;
+
+        if (pkt->kind == VPX_CODEC_CX_FRAME_PKT)
+        {
+            // std::cout << "Frame index: " << frame_index << " - Frame size: " << pkt->data.frame.sz << std::endl;
+            const int keyframe = (pkt->data.frame.flags & VPX_FRAME_IS_KEY) != 0;
+            // std::cout << "Frame PTS: " << pkt->data.frame.pts << std::endl;
+            // TODO: reference the 30 as a frame rate variable
+            int addFrame = segment.AddFrame(static_cast<const uint8_t *>(pkt->data.frame.buf), pkt->data.frame.sz, track, pkt->data.frame.pts * 1e9 / 30, keyframe);
+            // std::cout << "Add frame result: " << addFrame << std::endl;
+            if (!addFrame)
+            {
+                std::cerr << "Failed to add frame to webm" << std::endl;
+                exit(1);
+            }
+            if (encoded)
+            {
+                const uint8_t *data = static_cast<const uint8_t *>(pkt->data.frame.buf);
+                encoded->push_back({std::vector<uint8_t>(data, data + pkt->data.frame.sz), pkt->data.frame.pts, pkt->data.frame.pts, keyframe != 0});
+            }
+        }
+    }
+
+    return got_pkts;
+}
+
+std::shared_ptr<const WebmFile> encodeXorWebm(const WebmParams &params)
+{
+    const int width = params.width;
+    const int height = params.height;
+    const int num_frames = params.num_frames;
+
+    vpx_codec_ctx_t codec;
+    vpx_codec_enc_cfg_t cfg;
+    vpx_codec_enc_config_default(vpx_codec_vp9_cx(), &cfg, 0);
+    cfg.g_w = width;
+    cfg.g_h = height;
+    cfg.g_timebase.num = 1;
+    cfg.g_timebase.den = 30; // 30 fps
+    //cfg.g_error_resilient = VPX_ERROR_RESILIENT_PARTITIONS;
+    configureVp9Threads(cfg, params.threads);
+
+    if (vpx_codec_enc_init(&codec, vpx_codec_vp9_cx(), &cfg, 0) != VPX_CODEC_OK) {
+        std::cerr << "Failed to initialize encoder: " << vpx_codec_error(&codec) << std::endl;
+        return nullptr;
+    }
+    applyVp9Threading(&codec, cfg);
+    vpx_codec_control(&codec, VP8E_SET_CPUUSED, params.cpu_used);
+    const unsigned long deadline = params.realtime ? VPX_DL_REALTIME : VPX_DL_GOOD_QUALITY;
+    
+    ChunkedMkvWriter memWriter;
+    //mkvmuxer::MkvWriter memWriter; // not actually an in memory writer, variable is just named that for consistency
+    //memWriter.Open("test.webm");
+
+    mkvmuxer::Segment segment;
+    mkvmuxer::SegmentInfo *const info = segment.GetSegmentInfo();
+    info->set_writing_app("XorTextureGenerator");
+    info->set_timecode_scale(1e9 * (static_cast<double>(cfg.g_timebase.num) / cfg.g_timebase.den));
+    //segment.set_duration(num_frames); // This duration is not actually needed and will be calculated automatically
+    //std::cout << "Duration: " << segment.duration() << std::endl;
+
+    // TODO: start adding functionality here
+
+    const uint64_t track = segment.AddVideoTrack(width, height, 0);
+    if (!track) {
+        std::cerr << "Failed to add video track" << std::endl;
+        vpx_codec_destroy(&codec);
+        return {};
+    }
+
+    mkvmuxer::VideoTrack* const video = static_cast<mkvmuxer::VideoTrack*>(
+        segment.GetTrackByNumber(track));
+    if (!video) {
+        printf("\n Could not get video track.\n");
+        vpx_codec_destroy(&codec);
+        return {};
+    }
+    video->set_default_duration(uint64_t (1e9 * (static_cast<double>(cfg.g_timebase.num) / cfg.g_timebase.den))); // duration of each frame in nanoseconds
+    video->set_codec_id("V_VP9");
+    video->set_display_width(width);
+    video->set_display_height(height);
+    video->set_pixel_width(width);
+    video->set_pixel_height(height);
+
+    if (!segment.Init(&memWriter)) {
+        std::cerr << "Failed to initialize muxer segment" << std::endl;
+        vpx_codec_destroy(&codec);
+        return {};
+    }
+    
+    int frame_count = 0;
+    FramePipeline frames(width, height, num_frames, 2);
+    //std::cout << "Starting encoding" << std::endl;
+    while(frame_count < num_frames){
+        // Add keyframe interval?
+        //std::cout << "Encoding frame " << frame_count << std::endl;
+        PooledFrame frame = frames.next();
+        if (!frame) {
+            break;
+        }
+        vpx_image_t img;
+        encode_frame(&codec, wrapVpxImage(frame, &img), frame_count++, 0, &memWriter, segment, track, deadline);
+    }
+    //std::cout << "Encoding complete" << std::endl;
+
+    // Signal to encoder that we are done
+    //std::cout << "Starting flushing" << std::endl;
+    while (encode_frame(&codec, nullptr, -1, 0, &memWriter, segment, track, deadline)) {
+        // Flush any remaining frames
+    }
+    //std::cout << "Flushing complete" << std::endl;
+    
+    if (!segment.Finalize()) {
+        std::cerr << "Error finalizing segment." << std::endl;
+        exit(1);
+    }
+
+    //memWriter.Close();
+    //std::cout << "Video written" << std::endl;
+
+    vpx_codec_destroy(&codec);
+
+    auto webm = std::make_shared<WebmFile>(memWriter.take(info->timecode_scale()));
+    if (!webm->size())
+    {
+        return nullptr;
+    }
+    // Hashed once here, every request for it is validated against the tag
+    uint64_t hash = HASH_BYTES_SEED;
+    webm->data->forEach(0, webm->size(), [&hash](const uint8_t *data, size_t size)
+                        {
+                            hash = hashBytes(data, size, hash);
+                            return true; });
+    webm->etag = formatEtag(hash);
+    return webm;
+}
+
+void measureWebmThreadScaling(const WebmParams &params)
+{
+    std::cout << "VP9 " << params.width << "x" << params.height << ", " << params.num_frames << " frames, "
+              << (params.realtime ? "realtime" : "good quality") << ", cpu-used " << params.cpu_used << std::endl;
+    for (int threads : {1, 2, 4, 8, 16})
+    {
+        WebmParams run = params;
+        run.threads = threads;
+
+        const auto start = std::chrono::steady_clock::now();
+        const std::shared_ptr<const WebmFile> webm = encodeXorWebm(run);
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        if (!webm)
+        {
+            std::cerr << "Encode failed at " << threads << " threads" << std::endl;
+            continue;
+        }
+        std::cout << threads << " threads: " << params.num_frames / elapsed.count() << " fps" << std::endl;
+    }
+}
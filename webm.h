@@ -0,0 +1,264 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <vpx/vpx_image.h>
+#include <vpx/vpx_encoder.h>
+#include <vpx/vp8cx.h>
+#include <mkvmuxer/mkvwriter.h>
+#include <common/webmids.h>
+
+#include "buffer_cache.h"
+#include "chunked_buffer.h"
+#include "encoded_frame.h"
+#include "frame_pool.h"
+
+// Modified mkvmuxer::MkvWriter that writes to a memory buffer instead of a file
+class MemoryBufferMkvWriter : public mkvmuxer::IMkvWriter
+{
+public:
+    MemoryBufferMkvWriter(std::vector<uint8_t> &buffer) : buffer_(buffer) {}
+
+    virtual int64_t Position() const override
+    {
+        return position_;
+    }
+
+    virtual int32_t Position(int64_t position) override
+    {
+        if (position < 0 || static_cast<size_t>(position) > buffer_.size())
+        {
+            return -1;
+        }
+        position_ = position;
+        return 0;
+    }
+
+    virtual bool Seekable() const override
+    {
+        return true;
+    }
+
+    virtual int32_t Write(const void *buf, uint32_t len) override
+    {
+        const size_t new_size = position_ + len;
+        if (new_size > buffer_.size())
+        {
+            buffer_.resize(new_size);
+        }
+        std::memcpy(buffer_.data() + position_, buf, len);
+        position_ += len;
+        return 0;
+    }
+
+    virtual void ElementStartNotify(uint64_t element_id, int64_t position) override
+    {
+        // No op
+        // Could put some logging in here
+    }
+
+private:
+    std::vector<uint8_t> &buffer_;
+    size_t position_ = 0;
+};
+
+// Non-seekable variant for live webm: mkvmuxer writes clusters with unknown sizes and never goes back to patch anything.
+// Bytes collect here until take() hands them out, cluster starts are remembered so the stream can be cut on them.
+class LiveMkvWriter : public mkvmuxer::IMkvWriter
+{
+public:
+    virtual int64_t Position() const override
+    {
+        return position_;
+    }
+
+    virtual int32_t Position(int64_t position) override
+    {
+        return -1;
+    }
+
+    virtual bool Seekable() const override
+    {
+        return false;
+    }
+
+    virtual int32_t Write(const void *buf, uint32_t len) override
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(buf);
+        pending_.insert(pending_.end(), bytes, bytes + len);
+        position_ += len;
+        return 0;
+    }
+
+    virtual void ElementStartNotify(uint64_t element_id, int64_t position) override
+    {
+        if (element_id == libwebm::kMkvCluster && cluster_start_ < 0)
+        {
+            cluster_start_ = position - (position_ - pending_.size());
+        }
+    }
+
+    // Hands out everything written since the last take. If a cluster started in it, the bytes before the cluster
+    // go to before (the stream header, the first time) and data starts with the cluster, true is returned then.
+    bool take(std::vector<uint8_t> &before, std::vector<uint8_t> &data)
+    {
+        before.clear();
+        const bool cluster_started = cluster_start_ >= 0;
+        if (cluster_started)
+        {
+            before.assign(pending_.begin(), pending_.begin() + cluster_start_);
+            pending_.erase(pending_.begin(), pending_.begin() + cluster_start_);
+        }
+        data.swap(pending_);
+        pending_.clear();
+        cluster_start_ = -1;
+        return cluster_started;
+    }
+
+private:
+    std::vector<uint8_t> pending_;
+    int64_t position_ = 0;
+    int64_t cluster_start_ = -1; // offset into pending_
+};
+
+// A cluster of a finished webm: where it starts and the time of its first frame.
+// mkvmuxer starts a cluster on every keyframe, so playback can begin at any of them.
+struct WebmCluster
+{
+    uint64_t time_ns;
+    size_t offset;
+};
+
+// A finished webm kept as the pooled chunks it was muxed into, with an index of its clusters
+struct WebmFile
+{
+    ChunkedBufferPtr data;
+    std::vector<WebmCluster> clusters; // in file order
+    size_t clusters_end = 0;           // end of the last cluster, the cues (if any) follow
+    // Everything before the first cluster, with the seek head voided and the segment size unknown like the live
+    // stream's header, so it can be followed by clusters from anywhere in the file
+    std::vector<uint8_t> seek_header;
+    std::string etag; // strong validator, a hash of the whole file
+
+    size_t size() const { return data ? data->size() : 0; }
+
+    // The cluster playback from time_ns starts with: the last one starting at or before it, nullptr if there are none
+    const WebmCluster *clusterAt(uint64_t time_ns) const;
+};
+
+// Seekable writer into pooled chunks. Output grows one chunk at a time instead of reallocating and zero-filling a
+// vector, and the finished file is handed over by reference. Seeking back (Finalize patches the element sizes, the
+// seek head and the cues) overwrites in place. The positions of new top-level elements and cluster timecodes are
+// noted as mkvmuxer announces them, take() turns them into the cluster index.
+class ChunkedMkvWriter : public mkvmuxer::IMkvWriter
+{
+public:
+    explicit ChunkedMkvWriter(ChunkPool &pool = ChunkPool::shared()) : pool_(&pool) {}
+
+    virtual int64_t Position() const override
+    {
+        return position_;
+    }
+
+    virtual int32_t Position(int64_t position) override
+    {
+        if (position < 0 || static_cast<size_t>(position) > size_)
+        {
+            return -1;
+        }
+        position_ = position;
+        return 0;
+    }
+
+    virtual bool Seekable() const override
+    {
+        return true;
+    }
+
+    virtual int32_t Write(const void *buf, uint32_t len) override;
+
+    virtual void ElementStartNotify(uint64_t element_id, int64_t position) override;
+
+    // The finished file and its index, call after Segment::Finalize. timecode_scale is the segment's, in ns per tick.
+    // The writer is empty afterwards.
+    WebmFile take(uint64_t timecode_scale);
+
+private:
+    uint8_t byteAt(size_t position) const
+    {
+        return chunks_[position / BufferChunk::CAPACITY]->data[position % BufferChunk::CAPACITY];
+    }
+
+    // EBML variable length integer at position without its length marker, length is 0 if it isn't valid
+    uint64_t readVint(size_t position, size_t &length) const;
+    // EBML element id at position with its length marker, as libwebm's ids have it, length is 0 if it isn't valid
+    uint64_t readId(size_t position, size_t &length) const;
+
+    ChunkPool *pool_;
+    std::vector<ChunkPtr> chunks_; // all full but the last, so a position maps straight to its chunk
+    size_t position_ = 0;
+    size_t size_ = 0;
+    std::vector<std::pair<uint64_t, size_t>> elements_; // top-level element ids and positions, in file order
+    std::vector<size_t> timecodes_;                     // positions of the cluster Timecode elements
+};
+
+// Point a vpx image at the planes of a pooled frame, libvpx copies the input during encode so the frame can go back afterwards
+vpx_image_t *wrapVpxImage(const PooledFrame &frame, vpx_image_t *img);
+
+// Given a width, height, and time component generate a XOR texture in a frame from the shared pool
+PooledFrame genXorTexture(int width, int height, int time);
+
+// Encodes img (nullptr flushes) and adds whatever comes out to the segment, encoded also gets a copy of every frame if set
+int encode_frame(vpx_codec_ctx_t *codec, vpx_image_t *img, int frame_index, int flags, mkvmuxer::IMkvWriter *writer, mkvmuxer::Segment &segment, const uint64_t &track,
+                 unsigned long deadline = VPX_DL_GOOD_QUALITY, std::vector<EncodedFrame> *encoded = nullptr);
+
+// Sets g_threads for a VP9 encode, threads 0 means one per core
+void configureVp9Threads(vpx_codec_enc_cfg_t &cfg, int threads);
+
+// Tile columns and row based multithreading for an initialised VP9 encoder, sized to the frame width and cfg.g_threads.
+// VP9 tiles are at least 256 pixels wide, so small frames get fewer tiles than threads.
+void applyVp9Threading(vpx_codec_ctx_t *codec, const vpx_codec_enc_cfg_t &cfg);
+
+// Everything that changes the bytes of an encoded XOR webm
+struct WebmParams
+{
+    int width = 640;
+    int height = 480;
+    int num_frames = 300;
+    int threads = 0;       // encoder threads, 0 for one per core
+    bool realtime = false; // VPX_DL_REALTIME instead of VPX_DL_GOOD_QUALITY
+    int cpu_used = 0;      // VP9 speed, higher is faster (up to 5 for good quality, 9 for realtime)
+
+    bool operator==(const WebmParams &other) const
+    {
+        return width == other.width && height == other.height && num_frames == other.num_frames &&
+               threads == other.threads && realtime == other.realtime && cpu_used == other.cpu_used;
+    }
+};
+
+struct WebmParamsHash
+{
+    size_t operator()(const WebmParams &params) const
+    {
+        size_t h = std::hash<int>()(params.width);
+        h = h * 31 + std::hash<int>()(params.height);
+        h = h * 31 + std::hash<int>()(params.num_frames);
+        h = h * 31 + std::hash<int>()(params.threads);
+        h = h * 31 + std::hash<bool>()(params.realtime);
+        h = h * 31 + std::hash<int>()(params.cpu_used);
+        return h;
+    }
+};
+
+// Finished webm files are immutable, every request (and every range of it) shares the same chunks
+using WebmCache = BufferCache<WebmParams, WebmFile, WebmParamsHash>;
+
+// Encodes a complete VP9 webm of a XOR texture, returns nullptr on failure.
+// Frames are synthesised on a separate thread, one frame ahead of the encoder.
+std::shared_ptr<const WebmFile> encodeXorWebm(const WebmParams &params);
+
+// Encodes params at 1, 2, 4, 8 and 16 threads and prints the frame rate of each, for sizing encode boxes
+void measureWebmThreadScaling(const WebmParams &params);
@@ -0,0 +1,121 @@
+#include "work_stealing_pool.h"
+
+#include <algorithm>
+
+namespace
+{
+    thread_local const WorkStealingPool *current_pool = nullptr;
+    thread_local size_t current_worker = 0;
+}
+
+WorkStealingPool::WorkStealingPool(size_t threads)
+{
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; i++)
+    {
+        workers_.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < threads; i++)
+    {
+        threads_.emplace_back(&WorkStealingPool::work, this, i);
+    }
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    wait();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    work_cv_.notify_all();
+    for (std::thread &thread : threads_)
+    {
+        thread.join();
+    }
+}
+
+void WorkStealingPool::submit(Task task)
+{
+    size_t index;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        index = current_pool == this ? current_worker : next_worker_++ % workers_.size();
+        pending_++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(workers_[index]->mutex);
+        workers_[index]->tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queued_++;
+    }
+    work_cv_.notify_one();
+}
+
+void WorkStealingPool::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_cv_.wait(lock, [this]
+                  { return pending_ == 0; });
+}
+
+bool WorkStealingPool::take(size_t index, Task &task)
+{
+    {
+        Worker &own = *workers_[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers_.size(); i++)
+    {
+        Worker &victim = *workers_[(index + i) % workers_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::work(size_t index)
+{
+    current_pool = this;
+    current_worker = index;
+
+    for (;;)
+    {
+        Task task;
+        if (take(index, task))
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                queued_--;
+            }
+            task(index);
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--pending_ == 0)
+            {
+                idle_cv_.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_cv_.wait(lock, [this]
+                      { return queued_ > 0 || stopping_; });
+        if (stopping_ && queued_ <= 0)
+        {
+            return;
+        }
+    }
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Thread pool where every worker has its own task deque. A worker runs its newest task first and, once it runs out,
+// steals the oldest task of another worker, so uneven tasks spread themselves over the pool without one shared queue.
+// Tasks get the index of the worker running them, for per-worker state such as an encoder.
+class WorkStealingPool
+{
+public:
+    using Task = std::function<void(size_t worker)>;
+
+    explicit WorkStealingPool(size_t threads);
+    ~WorkStealingPool(); // runs whatever is still queued first
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    // From one of the pool's own workers the task goes on that worker's deque, otherwise they take turns
+    void submit(Task task);
+
+    // Blocks until every task submitted so far has run
+    void wait();
+
+    size_t size() const { return workers_.size(); }
+
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void work(size_t index);
+    bool take(size_t index, Task &task);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+    size_t next_worker_ = 0;
+
+    // Only for sleeping and for wait(), tasks themselves never go through here
+    std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable idle_cv_;
+    int64_t queued_ = 0;  // tasks sitting in a deque
+    int64_t pending_ = 0; // tasks queued or running
+    bool stopping_ = false;
+};
@@ -0,0 +1,131 @@
+#include "xor_texture.h"
+
+#include <cstring>
+
+#ifdef CPU_DISPATCH_X86
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    // x only matters through its low byte, so every row is this ramp repeated and XORed with (y ^ time)
+    struct alignas(64) Ramp
+    {
+        uint8_t values[256];
+        constexpr Ramp() : values{}
+        {
+            for (int i = 0; i < 256; i++)
+            {
+                values[i] = static_cast<uint8_t>(i);
+            }
+        }
+    };
+    constexpr Ramp ramp;
+
+    void rowScalar(uint8_t *dst, int width, uint8_t c)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            dst[x] = static_cast<uint8_t>(x) ^ c;
+        }
+    }
+
+#ifdef CPU_DISPATCH_X86
+    // Each chunk starts at a multiple of its own width, so it never wraps inside the 256 byte ramp
+
+    __attribute__((target("sse2"))) void rowSse2(uint8_t *dst, int width, uint8_t c)
+    {
+        const __m128i key = _mm_set1_epi8(static_cast<char>(c));
+        int x = 0;
+        for (; x + 32 <= width; x += 32)
+        {
+            const __m128i *src = reinterpret_cast<const __m128i *>(ramp.values + (x & 0xFF));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_xor_si128(_mm_load_si128(src), key));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x + 16), _mm_xor_si128(_mm_load_si128(src + 1), key));
+        }
+        rowScalar(dst + x, width - x, c ^ static_cast<uint8_t>(x));
+    }
+
+    __attribute__((target("avx2"))) void rowAvx2(uint8_t *dst, int width, uint8_t c)
+    {
+        const __m256i key = _mm256_set1_epi8(static_cast<char>(c));
+        int x = 0;
+        for (; x + 64 <= width; x += 64)
+        {
+            const __m256i *src = reinterpret_cast<const __m256i *>(ramp.values + (x & 0xFF));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x), _mm256_xor_si256(_mm256_load_si256(src), key));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x + 32), _mm256_xor_si256(_mm256_load_si256(src + 1), key));
+        }
+        rowScalar(dst + x, width - x, c ^ static_cast<uint8_t>(x));
+    }
+
+    __attribute__((target("avx512f,avx512bw"))) void rowAvx512(uint8_t *dst, int width, uint8_t c)
+    {
+        const __m512i key = _mm512_set1_epi8(static_cast<char>(c));
+        int x = 0;
+        for (; x + 64 <= width; x += 64)
+        {
+            const __m512i src = _mm512_load_si512(ramp.values + (x & 0xFF));
+            _mm512_storeu_si512(dst + x, _mm512_xor_si512(src, key));
+        }
+        rowScalar(dst + x, width - x, c ^ static_cast<uint8_t>(x));
+    }
+#endif
+
+    constexpr XorTextureKernel KERNELS[] = {
+#ifdef CPU_DISPATCH_X86
+        {CpuFeature::Avx512bw, "avx512", rowAvx512},
+        {CpuFeature::Avx2, "avx2", rowAvx2},
+        {CpuFeature::Sse2, "sse2", rowSse2},
+#endif
+        {CpuFeature::None, "scalar", rowScalar},
+    };
+
+    const XorTextureKernel &activeKernel()
+    {
+        static const XorTextureKernel &kernel = bestKernel(KERNELS);
+        return kernel;
+    }
+
+    void fillConstant(uint8_t *plane, int stride, int width, int height, uint8_t value)
+    {
+        if (stride == width)
+        {
+            std::memset(plane, value, static_cast<size_t>(width) * height);
+            return;
+        }
+        for (int y = 0; y < height; y++)
+        {
+            std::memset(plane + static_cast<size_t>(y) * stride, value, width);
+        }
+    }
+}
+
+// The (x ^ y) low byte is what gets stored, so the row is ramp[x & 0xFF] ^ ((y ^ time) & 0xFF)
+void xorTextureRow(uint8_t *dst, int width, int y, int time)
+{
+    activeKernel().row(dst, width, static_cast<uint8_t>(y ^ (time & 0xFF)));
+}
+
+void fillXorPlanes(uint8_t *y_plane, int y_stride,
+                   uint8_t *u_plane, int u_stride,
+                   uint8_t *v_plane, int v_stride,
+                   int width, int height, int time)
+{
+    for (int y = 0; y < height; y++)
+    {
+        xorTextureRow(y_plane + static_cast<size_t>(y) * y_stride, width, y, time);
+    }
+
+    // For the I420 format, U and V (chrominance) planes are quarter resolution.
+    // Set them to 128 (neutral value) to get a grayscale image.
+    const int chroma_width = (width + 1) / 2;
+    const int chroma_height = (height + 1) / 2;
+    fillConstant(u_plane, u_stride, chroma_width, chroma_height, 128);
+    fillConstant(v_plane, v_stride, chroma_width, chroma_height, 128);
+}
+
+std::vector<XorTextureKernel> xorTextureKernels()
+{
+    return supportedKernels(KERNELS);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "cpu_dispatch.h"
+
+// Row oriented kernels behind genXorTexture and generateXorTexture.
+// The best kernel the CPU supports (AVX-512, AVX2, SSE2 or plain C++) is picked once at startup.
+
+// The texture only depends on time through its low byte, so it repeats every this many frames
+const int XOR_TEXTURE_PERIOD = 256;
+
+// Writes one row of the luma plane: dst[x] = x ^ y ^ (time & 0xFF)
+void xorTextureRow(uint8_t *dst, int width, int y, int time);
+
+// Fills a whole I420 frame: XOR texture in Y, gray (128) in U and V
+void fillXorPlanes(uint8_t *y_plane, int y_stride,
+                   uint8_t *u_plane, int u_stride,
+                   uint8_t *v_plane, int v_stride,
+                   int width, int height, int time);
+
+struct XorTextureKernel
+{
+    CpuFeature feature;
+    const char *name;
+    void (*row)(uint8_t *dst, int width, uint8_t c); // dst[x] = (x & 0xFF) ^ c
+};
+
+// Every kernel this CPU can run, best first. The first one is the one xorTextureRow uses, the last one is the scalar
+// reference the others are tested against.
+std::vector<XorTextureKernel> xorTextureKernels();